@@ -0,0 +1,152 @@
+/*
+ * Cost of the hot control responses: ACK, PONG and LAGRP.
+ *
+ * A session that sends into a no-op sendto answers over and over, once
+ * through the per-session template buffer and once through the generic
+ * iax_send() path the responses used to take (rebuilt here from the same
+ * calls, including the IE assembly PONG used to do).  The library is
+ * compiled in to reach its internals.  The best of many batches is taken,
+ * in cycles on x86 and in nanoseconds everywhere.  The retransmission
+ * copies of PONG and LAGRP are dropped after every batch.
+ *
+ * usage: ackbench [-r batches]
+ */
+#include "iax.c"
+
+#include "bench.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() 0ULL
+#endif
+
+#define BATCH 8
+
+enum { ACK, PONG, LAGRP };
+static const char *responses[] = { "ACK", "PONG", "LAGRP" };
+
+static int null_sendto(int fd, const void *buf, size_t len, int flags,
+		const struct sockaddr *to, socklen_t tolen)
+{
+	return (int)len;
+}
+
+/* the responses as they were sent before the template buffer */
+static int generic_pong(struct iax_session *session, unsigned int ts)
+{
+	struct iax_ie_data ied;
+	jb_info stats;
+
+	memset(&ied, 0, sizeof(ied));
+	jb_getinfo(session->jb, &stats);
+	iax_ie_append_int(&ied, IAX_IE_RR_JITTER, stats.jitter);
+	if (stats.frames_in == 0)
+		stats.frames_in = 1;
+	iax_ie_append_int(&ied, IAX_IE_RR_LOSS,
+			((0xff & (stats.losspct / 1000)) << 24 | (stats.frames_lost & 0x00ffffff)));
+	iax_ie_append_int(&ied, IAX_IE_RR_PKTS, stats.frames_in);
+	iax_ie_append_short(&ied, IAX_IE_RR_DELAY, (unsigned short)(stats.current - stats.min));
+	iax_ie_append_int(&ied, IAX_IE_RR_DROPPED, stats.frames_dropped);
+	iax_ie_append_int(&ied, IAX_IE_RR_OOO, stats.frames_ooo);
+	return send_command(session, AST_FRAME_IAX, IAX_COMMAND_PONG, ts, ied.buf, ied.pos, -1);
+}
+
+static void respond(struct iax_session *session, int response, int generic, unsigned int ts)
+{
+	switch (response) {
+	case ACK:
+		if (generic)
+			__send_command(session, AST_FRAME_IAX, IAX_COMMAND_ACK, ts, NULL, 0, session->iseqno, 1, 0, 0, 0, 0);
+		else
+			iax_ack(session, ts, session->iseqno, 1);
+		break;
+	case PONG:
+		if (generic)
+			generic_pong(session, ts);
+		else
+			iax_send_pong(session, ts);
+		break;
+	case LAGRP:
+		if (generic)
+			send_command(session, AST_FRAME_IAX, IAX_COMMAND_LAGRP, ts, NULL, 0, -1);
+		else
+			iax_send_lagrp(session, ts);
+		break;
+	}
+}
+
+/* forget the queued retransmissions, nobody will ever acknowledge them */
+static void drop_queue(struct iax_context *ctx)
+{
+	struct iax_sched *cur;
+
+	while ((cur = ctx->schedq)) {
+		ctx->schedq = cur->next;
+		if (cur->frame) {
+			free(cur->frame->data);
+			free(cur->frame);
+		}
+		free(cur);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct iax_context *ctx;
+	struct iax_session *session;
+	unsigned long long best_cycles;
+	unsigned long long best_ns;
+	unsigned long long cycles;
+	unsigned long long ns;
+	int batches = 20000;
+	int response;
+	int generic;
+	int c;
+	int i;
+	int r;
+
+	while ((c = getopt(argc, argv, "r:")) != -1) {
+		switch (c) {
+		case 'r':
+			batches = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: ackbench [-r batches]");
+		}
+	}
+	if (batches < 1)
+		bench_fail("usage: ackbench [-r batches]");
+
+	ctx = iax_context_new();
+	if (!ctx || !(session = iax_context_session_new(ctx)))
+		bench_fail("no session");
+	iax_set_sendto(session, (iax_sendto_t)null_sendto);
+	session->peercallno = 7;
+	drop_queue(ctx);
+
+	for (response = ACK; response <= LAGRP; response++) {
+		for (generic = 1; generic >= 0; generic--) {
+			best_cycles = ~0ULL;
+			best_ns = ~0ULL;
+			for (r = 0; r < batches; r++) {
+				ns = bench_now_ns();
+				cycles = CYCLES();
+				for (i = 0; i < BATCH; i++)
+					respond(session, response, generic, 1000 + i);
+				cycles = CYCLES() - cycles;
+				ns = bench_now_ns() - ns;
+				drop_queue(ctx);
+				if (cycles < best_cycles)
+					best_cycles = cycles;
+				if (ns < best_ns)
+					best_ns = ns;
+			}
+			printf("%-5s %-8s %6llu cycles %6.1f ns\n", responses[response],
+					generic ? "generic" : "template", best_cycles / BATCH, (double)best_ns / BATCH);
+		}
+	}
+	iax_context_free(ctx);
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Per-frame cost of the call encryption.
+ *
+ * Frames of the sizes an encrypted call carries, padded the way libiax2
+ * pads them, are encrypted and decrypted in place over and over, with
+ * AES-NI where the processor has it and with the constant-time software
+ * cipher.  Both have to produce the same ciphertext.  The cipher is
+ * compiled in here, so that the benchmark can pick the path.
+ *
+ * usage: aesbench [-n frames]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "aes.c"
+
+struct size {
+	const char *what;
+	int bytes;	/* encrypted behind the clear call number */
+};
+
+static const struct size sizes[] = {
+	{ "ack", 8 },		/* full frame header without call numbers */
+	{ "ulaw 20 ms", 162 },	/* mini frame timestamp and payload */
+	{ "slin 20 ms", 322 },
+	{ "slin 60 ms", 962 },
+};
+
+/* as libiax2 pads: 16 to 31 bytes, up to whole blocks */
+static int padded(int bytes)
+{
+	return bytes + 16 + ((16 - bytes % 16) & 0x0f);
+}
+
+static unsigned long long measure(const struct aes_key *key, unsigned char *buf, int len, int frames, int decrypt)
+{
+	unsigned long long start;
+	int i;
+
+	start = bench_thread_ns();
+	for (i = 0; i < frames; i++) {
+		if (decrypt)
+			aes_cbc_decrypt(key, buf, len);
+		else
+			aes_cbc_encrypt(key, buf, len);
+	}
+	return bench_thread_ns() - start;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char secret[16];
+	unsigned char plain[1024];
+	unsigned char soft[1024];
+	unsigned char buf[1024];
+	struct aes_key key;
+	int available = aes_hardware();
+	int frames = 20000;
+	int path;
+	int len;
+	int c;
+	int i;
+	int s;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			frames = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: aesbench [-n frames]");
+		}
+	}
+	if (frames < 1)
+		bench_fail("usage: aesbench [-n frames]");
+
+	for (i = 0; i < (int)sizeof(secret); i++)
+		secret[i] = (unsigned char)(i * 37 + 11);
+	for (i = 0; i < (int)sizeof(plain); i++)
+		plain[i] = (unsigned char)(i * 13 + 5);
+
+	printf("AES-NI %s\n", available ? "available" : "not available");
+	for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+		len = padded(sizes[s].bytes);
+
+		/* the software cipher is the reference the hardware has to agree with */
+		hardware = 0;
+		aes_set_key(&key, secret);
+		memcpy(soft, plain, len);
+		aes_cbc_encrypt(&key, soft, len);
+		for (path = available; path >= 0; path--) {
+			hardware = path;
+			aes_set_key(&key, secret);
+			memcpy(buf, plain, len);
+			aes_cbc_encrypt(&key, buf, len);
+			if (memcmp(buf, soft, len))
+				bench_fail("AES-NI and software cipher disagree");
+			aes_cbc_decrypt(&key, buf, len);
+			if (memcmp(buf, plain, len))
+				bench_fail("decryption doesn't restore the frame");
+
+			/* the software cipher is slow, a tenth of the frames does */
+			i = path ? frames : frames / 10 ? frames / 10 : 1;
+			printf("%-8s %-11s %4d bytes  encrypt %9.0f ns  decrypt %9.0f ns\n",
+					path ? "aes-ni" : "software", sizes[s].what, len,
+					(double)measure(&key, buf, len, i, 0) / i,
+					(double)measure(&key, buf, len, i, 1) / i);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Helpers shared by the benchmarks
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+#include "frame.h"
+
+unsigned long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long bench_thread_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long bench_process_ns(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (unsigned long long)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+		(unsigned long long)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+void bench_fail(const char *what)
+{
+	fprintf(stderr, "%s\n", what);
+	exit(1);
+}
+
+void bench_run(struct iax_context **ctxs, int count, int ms)
+{
+	struct iax_event *e;
+	unsigned long long end = bench_now_ns() + ms * 1000000ULL;
+	int i;
+
+	while (bench_now_ns() < end) {
+		for (i = 0; i < count; i++)
+			while ((e = iax_context_get_event(ctxs[i], 0)))
+				iax_event_free(e);
+		usleep(1000);
+	}
+}
+
+int bench_calls(struct iax_context *caller, struct iax_context *callee, int port,
+		struct iax_session **calls, int count)
+{
+	struct iax_event *e;
+	char dial[64];
+	int accepted = 0;
+	int answered = 0;
+	int i;
+
+	snprintf(dial, sizeof(dial), "bench@127.0.0.1:%d/100", port);
+	for (i = 0; i < count; i++) {
+		calls[i] = iax_context_session_new(caller);
+		if (!calls[i] || iax_call(calls[i], "1", "bench", dial, NULL, 0,
+				AST_FORMAT_SLINEAR, AST_FORMAT_SLINEAR) < 0)
+			return -1;
+	}
+	for (i = 0; i < 5000 && (accepted < count || answered < count); i++) {
+		while ((e = iax_context_get_event(callee, 0))) {
+			if (e->etype == IAX_EVENT_CONNECT) {
+				iax_accept(e->session, AST_FORMAT_SLINEAR);
+				iax_answer(e->session);
+				answered++;
+			}
+			iax_event_free(e);
+		}
+		while ((e = iax_context_get_event(caller, 0))) {
+			if (e->etype == IAX_EVENT_ACCEPT)
+				accepted++;
+			iax_event_free(e);
+		}
+		usleep(1000);
+	}
+	return accepted < count || answered < count ? -1 : 0;
+}
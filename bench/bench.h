@@ -0,0 +1,29 @@
+/*
+ * Helpers shared by the benchmarks.  They run on Linux against the libiax2
+ * sources, build them with make -C bench and run them with make -C bench run.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <sys/socket.h>
+
+#include "iax-client.h"
+
+/* monotonic wall clock, cpu time of the calling thread and of the process
+   (every thread, kernel threads serving io_uring included) */
+unsigned long long bench_now_ns(void);
+unsigned long long bench_thread_ns(void);
+unsigned long long bench_process_ns(void);
+
+/* run contexts on the calling thread for ms milliseconds, events are freed */
+void bench_run(struct iax_context **ctxs, int count, int ms);
+
+/* place count calls from caller to the callee context listening on port
+   and answer them, -1 if they aren't all up within a few seconds */
+int bench_calls(struct iax_context *caller, struct iax_context *callee, int port,
+		struct iax_session **calls, int count);
+
+/* print a failure and exit */
+void bench_fail(const char *what);
+
+#endif /* !BENCH_H */
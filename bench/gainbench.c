@@ -0,0 +1,153 @@
+/*
+ * Cost of the gain stage per 20 ms frame.
+ *
+ * A few seconds of speech-like signal with loud bursts, at a volume and
+ * agc target that drive it into the limiter, go through ProcessGain frame
+ * by frame.  The stage relies on the compiler to vectorize its loops (MSVC
+ * does at /O2), so it's built twice here: as the pager builds it and with
+ * vectorization turned off.  Both have to produce the same samples, none of
+ * them above the limiter ceiling.  The best of many batches is taken, in
+ * cycles on x86 and in nanoseconds everywhere.
+ *
+ * usage: gainbench [-r batches]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <winsock2.h>
+#include <windows.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "gain.h"
+#include "realtime.h"
+#include "bench.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() 0ULL
+#endif
+
+#define FRAME   160
+#define FRAMES  150
+#define BATCH   FRAMES
+#define CEILING 1
+
+/* the same gain stage built without vectorization */
+extern LPGAIN ScalarCreateGain(LPSETTINGS);
+extern VOID ScalarProcessGain(LPGAIN, SHORT *, DWORD);
+extern VOID ScalarFreeGain(LPGAIN);
+
+struct build {
+	const char *what;
+	LPGAIN (*create)(LPSETTINGS);
+	VOID (*process)(LPGAIN, SHORT *, DWORD);
+	VOID (*release)(LPGAIN);
+};
+
+static const struct build builds[] = {
+	{ "vectorized", CreateGain, ProcessGain, FreeGain },
+	{ "scalar", ScalarCreateGain, ScalarProcessGain, ScalarFreeGain },
+};
+
+/* nothing is locked or written by the benchmark */
+VOID LockRealtimeMemory(LPSETTINGS settings, LPVOID buffer, SIZE_T size)
+{
+}
+
+VOID PrintMetrics(LPMETRICS metrics, LPCSTR format, ...)
+{
+}
+
+/* syllables of two tones at a talking level, every second a shout three times as loud */
+static void speech(SHORT *samples, int count)
+{
+	double envelope;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		envelope = 0.5 + 0.5 * sin(2 * M_PI * 4 * i / 8000.0);
+		if (i % 8000 >= 6000 && i % 8000 < 6800)
+			envelope = 3.0;
+		samples[i] = (SHORT)(envelope * (5000 * sin(2 * M_PI * 220 * i / 8000.0) + 3000 * sin(2 * M_PI * 1250 * i / 8000.0)) / 3.0);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static SHORT input[FRAMES * FRAME];
+	static SHORT output[2][FRAMES * FRAME];
+	static SHORT frames[FRAMES * FRAME];
+	unsigned long long best_cycles;
+	unsigned long long best_ns;
+	unsigned long long cycles;
+	unsigned long long ns;
+	SETTINGS settings;
+	LPGAIN gain;
+	SHORT ceiling = (SHORT)(32767 * pow(10.0, -CEILING / 20.0));
+	int batches = 200;
+	size_t b;
+	int c;
+	int f;
+	int r;
+	int i;
+
+	while ((c = getopt(argc, argv, "r:")) != -1) {
+		switch (c) {
+		case 'r':
+			batches = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: gainbench [-r batches]");
+		}
+	}
+	if (batches < 1)
+		bench_fail("usage: gainbench [-r batches]");
+
+	memset(&settings, 0, sizeof(settings));
+	settings.Volume = 0xFFFF;
+	settings.AgcTarget = 12;
+	settings.LimiterCeiling = CEILING;
+	speech(input, FRAMES * FRAME);
+
+	for (b = 0; b < sizeof(builds) / sizeof(builds[0]); b++) {
+		/* the whole signal once, the way a call plays it */
+		gain = builds[b].create(&settings);
+		memcpy(output[b], input, sizeof(input));
+		for (f = 0; f < FRAMES; f++)
+			builds[b].process(gain, output[b] + f * FRAME, FRAME);
+		for (i = 0; i < FRAMES * FRAME; i++)
+			if (output[b][i] > ceiling + 1 || output[b][i] < -ceiling - 1)
+				bench_fail("a sample got past the limiter");
+		if (memcmp(output[b], output[0], sizeof(output[0])))
+			bench_fail("vectorized and scalar gain stage disagree");
+
+		/* and again and again, agc and limiter carry on from where they were */
+		best_cycles = ~0ULL;
+		best_ns = ~0ULL;
+		for (r = 0; r < batches; r++) {
+			memcpy(frames, input, sizeof(input));
+			ns = bench_now_ns();
+			cycles = CYCLES();
+			for (f = 0; f < BATCH; f++)
+				builds[b].process(gain, frames + f * FRAME, FRAME);
+			cycles = CYCLES() - cycles;
+			ns = bench_now_ns() - ns;
+			if (cycles < best_cycles)
+				best_cycles = cycles;
+			if (ns < best_ns)
+				best_ns = ns;
+		}
+		printf("%-10s %3d samples  %6llu cycles %7.0f ns per frame  %5.3f%% of real time\n", builds[b].what, FRAME,
+				best_cycles / BATCH, (double)best_ns / BATCH, (double)best_ns / BATCH / 20e6 * 100);
+		builds[b].release(gain);
+	}
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Latency of the handoff from the network to the playout thread.
+ *
+ * A producer thread pushes items into the handoff queue, one every
+ * millisecond and in bursts of 20 like a jitter buffer releasing a backlog.
+ * The consumer waits on the eventfd the queue signals, resets it and drains
+ * the queue, the way the playout thread does.  Each item carries its number,
+ * which indexes the time it was pushed.  The distribution of push to pop
+ * latencies is reported, and so is how often the producer had to signal.
+ *
+ * usage: handoffbench [-n items]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include <winsock2.h>
+#include <windows.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "handoff.h"
+#include "realtime.h"
+#include "bench.h"
+
+#define PERIOD_NS 1000000
+
+struct run {
+	LPHANDOFF handoff;
+	int count;
+	int burst;
+	unsigned long long *pushed;
+	unsigned long long *latency;
+};
+
+/* nothing is locked by the benchmark */
+VOID LockRealtimeMemory(LPSETTINGS settings, LPVOID buffer, SIZE_T size)
+{
+}
+
+static int compare(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* push the items in bursts every period, retrying while the queue is full */
+static void *producer(void *arg)
+{
+	struct run *run = (struct run *)arg;
+	struct timespec next;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < run->count; i++) {
+		if (i % run->burst == 0) {
+			next.tv_nsec += PERIOD_NS;
+			if (next.tv_nsec >= 1000000000) {
+				next.tv_nsec -= 1000000000;
+				next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+		run->pushed[i] = bench_now_ns();
+		while (!PushHandoff(run->handoff, HANDOFF_VOICE, (struct iax_event *)(DWORD_PTR)(i + 1)))
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void measure(const char *what, int count, int burst)
+{
+	struct run run;
+	struct pollfd pfd;
+	SETTINGS settings;
+	HANDOFFITEM item;
+	pthread_t thread;
+	eventfd_t value;
+	unsigned long long wakeups = 0;
+	unsigned long long signals = 0;
+	int popped = 0;
+	int i;
+
+	memset(&settings, 0, sizeof(settings));
+	pfd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0)
+		bench_fail("no eventfd");
+	run.handoff = CreateHandoff(&settings, (WSAEVENT)(DWORD_PTR)pfd.fd);
+	run.count = count;
+	run.burst = burst;
+	run.pushed = (unsigned long long *)calloc(count, sizeof(*run.pushed));
+	run.latency = (unsigned long long *)calloc(count, sizeof(*run.latency));
+	if (pthread_create(&thread, NULL, producer, &run))
+		bench_fail("no producer thread");
+
+	while (popped < count) {
+		if (poll(&pfd, 1, 1000) != 1)
+			bench_fail("the handoff never signalled");
+		wakeups++;
+
+		/* reset before draining, so that no item gets missed */
+		if (eventfd_read(pfd.fd, &value) == 0)
+			signals += value;
+		while (PopHandoff(run.handoff, &item)) {
+			i = (int)(DWORD_PTR)item.Event - 1;
+			if (i != popped)
+				bench_fail("items out of order");
+			run.latency[popped++] = bench_now_ns() - run.pushed[i];
+		}
+	}
+	pthread_join(thread, NULL);
+
+	qsort(run.latency, count, sizeof(*run.latency), compare);
+	printf("%-8s %6d items  p50 %6.1f us  p99 %6.1f us  p99.9 %6.1f us  max %7.1f us  %llu signals %llu wakeups\n",
+			what, count, run.latency[count / 2] / 1e3, run.latency[count * 99 / 100] / 1e3,
+			run.latency[count * 999 / 1000] / 1e3, run.latency[count - 1] / 1e3, signals, wakeups);
+	FreeHandoff(run.handoff);
+	free(run.pushed);
+	free(run.latency);
+	close(pfd.fd);
+}
+
+int main(int argc, char **argv)
+{
+	int count = 5000;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: handoffbench [-n items]");
+		}
+	}
+	if (count < 1)
+		bench_fail("usage: handoffbench [-n items]");
+
+	measure("single", count, 1);
+	measure("burst 20", count, 20);
+	return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Lookup cost of the compiled host table.
+ *
+ * 10000 random prefixes, four in five IPv4, are spread over the allowed,
+ * forbidden and call token lists and compiled.  Addresses, half of them
+ * inside a listed prefix, are then looked up in the table and by walking
+ * every prefix the way the lists used to be checked.  Both have to agree.
+ *
+ * usage: hostbench [-p prefixes] [-l lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+
+#include <winsock2.h>
+#include <windows.h>
+#include <tchar.h>
+#include "host.h"
+#include "bench.h"
+
+struct prefix {
+	int family;
+	int length;
+	int list;
+	BYTE address[16];
+};
+
+static unsigned int seed = 2463534242u;
+
+static unsigned int next(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static void random_prefix(struct prefix *p)
+{
+	int i;
+
+	p->family = next() % 5 ? AF_INET : AF_INET6;
+	/* mostly the lengths people list: /24 and /32, /48 and /64 */
+	if (p->family == AF_INET)
+		p->length = next() % 3 ? (next() % 2 ? 24 : 32) : 8 + next() % 25;
+	else
+		p->length = next() % 3 ? (next() % 2 ? 48 : 64) : 16 + next() % 49;
+	for (i = 0; i < 16; i++)
+		p->address[i] = (BYTE)next();
+	for (i = 0; i < 16; i++)
+		p->address[i] &= p->length >= (i + 1) * 8 ? 0xFF :
+			p->length > i * 8 ? (BYTE)(0xFF << ((i + 1) * 8 - p->length)) : 0x00;
+}
+
+static void format_prefix(const struct prefix *p, char *text, int len)
+{
+	const BYTE *a = p->address;
+
+	if (p->family == AF_INET)
+		snprintf(text, len, "%d.%d.%d.%d/%d", a[0], a[1], a[2], a[3], p->length);
+	else
+		snprintf(text, len, "%x:%x:%x:%x:%x:%x:%x:%x/%d",
+				a[0] << 8 | a[1], a[2] << 8 | a[3], a[4] << 8 | a[5], a[6] << 8 | a[7],
+				a[8] << 8 | a[9], a[10] << 8 | a[11], a[12] << 8 | a[13], a[14] << 8 | a[15],
+				p->length);
+}
+
+static int covers(const struct prefix *p, int family, const BYTE *address)
+{
+	int bits = p->length;
+	int i;
+
+	if (p->family != family)
+		return 0;
+	for (i = 0; bits >= 8; i++, bits -= 8)
+		if (address[i] != p->address[i])
+			return 0;
+	return !bits || !((address[i] ^ p->address[i]) & (BYTE)(0xFF << (8 - bits)));
+}
+
+/* the lists checked one prefix after the other */
+static DWORD linear(const struct prefix *prefixes, int count, int family, const BYTE *address)
+{
+	int allowed = 0;
+	int restricted = 0;
+	int token = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		restricted |= prefixes[i].list == 0;
+		if (!covers(&prefixes[i], family, address))
+			continue;
+		if (prefixes[i].list == 1)
+			return HOST_FORBIDDEN;
+		if (prefixes[i].list == 0)
+			allowed = 1;
+		else
+			token = 1;
+	}
+	if (restricted && !allowed)
+		return HOST_NOT_ALLOWED;
+	return token ? HOST_TOKEN : HOST_ACCEPTED;
+}
+
+/* in a sockaddr_in6 rather than a sockaddr_storage, whose size would make
+   the lookups wait for the addresses rather than for the table */
+static void random_address(const struct prefix *prefixes, int count, struct sockaddr_in6 *ss)
+{
+	const struct prefix *p = &prefixes[next() % count];
+	BYTE address[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		address[i] = (BYTE)next();
+	/* half of them inside a listed prefix */
+	if (next() % 2) {
+		for (i = 0; i < p->length; i++) {
+			if (p->address[i / 8] & (0x80 >> (i % 8)))
+				address[i / 8] |= 0x80 >> (i % 8);
+			else
+				address[i / 8] &= ~(0x80 >> (i % 8));
+		}
+	}
+	memset(ss, 0, sizeof(*ss));
+	ss->sin6_family = p->family;
+	if (p->family == AF_INET)
+		memcpy(&((struct sockaddr_in *)ss)->sin_addr, address, 4);
+	else
+		memcpy(&ss->sin6_addr, address, 16);
+}
+
+static const BYTE *address_bytes(const struct sockaddr_in6 *ss)
+{
+	if (ss->sin6_family == AF_INET)
+		return (const BYTE *)&((const struct sockaddr_in *)ss)->sin_addr;
+	return (const BYTE *)&ss->sin6_addr;
+}
+
+/* large blocks are mapped, they count as well */
+static size_t heap_used(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+int main(int argc, char **argv)
+{
+	struct prefix *prefixes;
+	struct sockaddr_in6 *addresses;
+	LPHOST lists[3] = { NULL, NULL, NULL };
+	LPHOSTTABLE table;
+	volatile DWORD sink = 0;
+	unsigned long long start;
+	unsigned long long table_ns;
+	unsigned long long linear_ns;
+	size_t heap;
+	char text[64];
+	int count = 10000;
+	int lookups = 1000000;
+	int checked;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "p:l:")) != -1) {
+		switch (c) {
+		case 'p':
+			count = atoi(optarg);
+			break;
+		case 'l':
+			lookups = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: hostbench [-p prefixes] [-l lookups]");
+		}
+	}
+	if (count < 1 || lookups < 1)
+		bench_fail("usage: hostbench [-p prefixes] [-l lookups]");
+
+	prefixes = (struct prefix *)calloc(count, sizeof(*prefixes));
+	addresses = (struct sockaddr_in6 *)calloc(lookups, sizeof(*addresses));
+	/* six in ten allowed, three forbidden, one needs a call token */
+	for (i = 0; i < count; i++) {
+		random_prefix(&prefixes[i]);
+		prefixes[i].list = i % 10 < 6 ? 0 : i % 10 < 9 ? 1 : 2;
+		format_prefix(&prefixes[i], text, sizeof(text));
+		if (!AppendHost(text, &lists[prefixes[i].list]))
+			bench_fail(text);
+	}
+	for (i = 0; i < lookups; i++)
+		random_address(prefixes, count, &addresses[i]);
+
+	heap = heap_used();
+	start = bench_now_ns();
+	table = CompileHosts(lists[0], lists[1], lists[2]);
+	start = bench_now_ns() - start;
+	heap = heap_used() - heap;
+	printf("%d prefixes compiled in %.1f ms into %.1f MB\n", count, start / 1e6, heap / 1048576.0);
+
+	start = bench_now_ns();
+	for (i = 0; i < lookups; i++)
+		sink += LookupHost(table, (SOCKADDR *)&addresses[i]);
+	table_ns = bench_now_ns() - start;
+
+	/* the walk is slow, a slice of the addresses does */
+	checked = lookups < 20000 ? lookups : 20000;
+	start = bench_now_ns();
+	for (i = 0; i < checked; i++)
+		sink += linear(prefixes, count, addresses[i].sin6_family, address_bytes(&addresses[i]));
+	linear_ns = bench_now_ns() - start;
+	for (i = 0; i < checked; i++)
+		if (LookupHost(table, (SOCKADDR *)&addresses[i]) !=
+		    linear(prefixes, count, addresses[i].sin6_family, address_bytes(&addresses[i])))
+			bench_fail("table and lists disagree");
+
+	printf("table  %8.1f ns/lookup over %d addresses\n", (double)table_ns / lookups, lookups);
+	printf("lists  %8.1f ns/lookup over %d addresses\n", (double)linear_ns / checked, checked);
+
+	FreeHostTable(table);
+	for (i = 0; i < 3; i++)
+		RemoveAllHosts(&lists[i]);
+	free(addresses);
+	free(prefixes);
+	return 0;
+}
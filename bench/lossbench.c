@@ -0,0 +1,178 @@
+/*
+ * Call setup latency under packet loss.
+ *
+ * A caller and a callee context on loopback drop a share of everything
+ * they send, picked by a seeded generator, so a run can be repeated.  One
+ * call after the other is placed, accepted and answered as soon as the
+ * callee sees it, and the time from iax_call() until the caller gets the
+ * ANSWER is recorded.  Without loss that is the jitterbuffer holding the
+ * NEW and the ANSWER for its initial delay; every lost NEW, ACCEPT, ANSWER
+ * or ACK adds a retransmission timeout on top.
+ *
+ * usage: lossbench [-n calls per loss rate] [-s seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "bench.h"
+#include "frame.h"
+
+/* after this long a call setup counts as failed */
+#define SETUP_LIMIT_MS 20000
+
+static unsigned int loss;
+static unsigned int seed = 2463534242u;
+
+static unsigned int next(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static int lossy_sendto(int fd, const void *buf, size_t len, int flags,
+		const struct sockaddr *to, socklen_t tolen)
+{
+	if (next() % 100 < loss)
+		return (int)len;
+	return (int)sendto(fd, buf, len, flags, to, tolen);
+}
+
+static int compare(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* wait for either context, no longer than their timers allow */
+static void wait_for(struct iax_context **ctx)
+{
+	struct pollfd fds[2];
+	int timeout = 20;
+	int t;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		fds[i].fd = iax_context_get_fd(ctx[i]);
+		fds[i].events = POLLIN;
+		t = iax_context_time_to_next_event(ctx[i]);
+		if (t >= 0 && t < timeout)
+			timeout = t;
+	}
+	poll(fds, 2, timeout);
+}
+
+/* milliseconds until the caller has the answer, negative if it never came */
+static double setup(struct iax_context **ctx, const char *dial)
+{
+	struct iax_session *session;
+	struct iax_event *e;
+	unsigned long long start;
+	double ms = -1;
+	int done = 0;
+
+	session = iax_context_session_new(ctx[0]);
+	if (!session)
+		bench_fail("no session");
+	start = bench_now_ns();
+	if (iax_call(session, "1", "bench", dial, NULL, 0, AST_FORMAT_SLINEAR, AST_FORMAT_SLINEAR) < 0)
+		bench_fail("call failed");
+	while (!done && bench_now_ns() - start < SETUP_LIMIT_MS * 1000000ULL) {
+		wait_for(ctx);
+		while ((e = iax_context_get_event(ctx[0], 0))) {
+			if (e->etype == IAX_EVENT_ANSWER) {
+				ms = (bench_now_ns() - start) / 1e6;
+				done = 1;
+			} else if (e->etype == IAX_EVENT_TIMEOUT || e->etype == IAX_EVENT_REJECT) {
+				done = -1;
+			}
+			iax_event_free(e);
+		}
+		while ((e = iax_context_get_event(ctx[1], 0))) {
+			if (e->etype == IAX_EVENT_CONNECT) {
+				iax_accept(e->session, AST_FORMAT_SLINEAR);
+				iax_answer(e->session);
+			}
+			iax_event_free(e);
+		}
+	}
+	/* a timed out session is gone already */
+	if (done >= 0)
+		iax_hangup(session, "done");
+	/* let the hangup and its retransmissions settle before the next call */
+	bench_run(ctx, 2, 300);
+	return ms;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int rates[] = { 0, 5, 10, 20, 30 };
+	struct iax_context *ctx[2];
+	double *samples;
+	double sum;
+	char dial[64];
+	int calls = 20;
+	int failed;
+	int port = -1;
+	int ok;
+	int c;
+	int i;
+	int r;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			calls = atoi(optarg);
+			break;
+		case 's':
+			seed = (unsigned int)strtoul(optarg, NULL, 0);
+			break;
+		default:
+			bench_fail("usage: lossbench [-n calls per loss rate] [-s seed]");
+		}
+	}
+	if (calls < 1 || !seed)
+		bench_fail("usage: lossbench [-n calls per loss rate] [-s seed]");
+
+	ctx[0] = iax_context_new();
+	ctx[1] = iax_context_new();
+	if (iax_context_init(ctx[0], -1) < 0 || (port = iax_context_init(ctx[1], -1)) < 0)
+		bench_fail("init failed");
+	iax_context_set_networking(ctx[0], (iax_sendto_t)lossy_sendto, (iax_recvfrom_t)recvfrom);
+	iax_context_set_networking(ctx[1], (iax_sendto_t)lossy_sendto, (iax_recvfrom_t)recvfrom);
+	snprintf(dial, sizeof(dial), "bench@127.0.0.1:%d/100", port);
+	samples = (double *)calloc(calls, sizeof(*samples));
+
+	for (r = 0; r < (int)(sizeof(rates) / sizeof(rates[0])); r++) {
+		loss = rates[r];
+		ok = 0;
+		failed = 0;
+		sum = 0;
+		for (i = 0; i < calls; i++) {
+			samples[ok] = setup(ctx, dial);
+			if (samples[ok] < 0) {
+				failed++;
+				continue;
+			}
+			sum += samples[ok++];
+		}
+		if (!ok) {
+			printf("loss %2u%%  all %d call setups failed\n", loss, failed);
+			continue;
+		}
+		qsort(samples, ok, sizeof(*samples), compare);
+		printf("loss %2u%%  %3d set up %2d failed  mean %6.0f ms  median %6.0f  p90 %6.0f  max %6.0f\n",
+				loss, ok, failed, sum / ok, samples[ok / 2], samples[ok * 9 / 10], samples[ok - 1]);
+	}
+
+	free(samples);
+	iax_context_free(ctx[0]);
+	iax_context_free(ctx[1]);
+	return 0;
+}
@@ -0,0 +1,286 @@
+/*
+ * Loopback cost of the libiax2 network paths.
+ *
+ * receive: a blaster thread pumps mini frames at a context over loopback,
+ * which reads them the way iax_get_event does with
+ *   recvfrom   select() and recvfrom() per datagram, the path custom
+ *              networking and non-Linux systems take
+ *   recvmmsg   the batched reads of the internal socket
+ *   io_uring   the multishot receive of iax_set_io_uring
+ * respond: the blaster sends POKEs instead, each answered with a PONG
+ * through sendto() after the batched reads, through the ring with the
+ * PONGs of a run of datagrams submitted together, or through the ring
+ * and its submission thread.
+ * send: voice frames go out on an answered call through sendto() or the
+ * io_uring submission thread.
+ *
+ * usage: netbench [-n datagrams] [-s bytes]
+ *
+ * Datagrams longer than IAX_MAX_DATAGRAM are dropped by libiax2, so that
+ * is the largest size.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "frame.h"
+#include "iax2.h"
+
+#define BURST 32
+/* bytes in flight at most, well below what the socket buffer holds */
+#define WINDOW (64 * 1024)
+
+struct blaster {
+	int port;
+	int count;
+	int size;
+	int poke;
+	volatile int received;
+	volatile int done;
+	unsigned long long cpu;
+};
+
+static void *blast(void *arg)
+{
+	struct blaster *b = (struct blaster *)arg;
+	struct mmsghdr msg[BURST];
+	struct iovec iov;
+	struct sockaddr_in to;
+	unsigned char *buf;
+	unsigned long long start = bench_thread_ns();
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int window = WINDOW / (b->size + 64);
+	int sent = 0;
+	int n;
+	int i;
+
+	buf = (unsigned char *)calloc(1, b->size);
+	if (b->poke) {
+		/* a full frame POKE from a call of its own, answered without a session */
+		buf[0] = 0x80;
+		buf[1] = 0x01;
+		buf[10] = AST_FRAME_IAX;
+		buf[11] = IAX_COMMAND_POKE;
+	} else {
+		/* a mini frame of a call nobody has, it is looked up and dropped */
+		buf[0] = 0x12;
+		buf[1] = 0x34;
+	}
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_port = htons(b->port);
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	iov.iov_base = buf;
+	iov.iov_len = b->size;
+	memset(msg, 0, sizeof(msg));
+	for (i = 0; i < BURST; i++) {
+		msg[i].msg_hdr.msg_name = &to;
+		msg[i].msg_hdr.msg_namelen = sizeof(to);
+		msg[i].msg_hdr.msg_iov = &iov;
+		msg[i].msg_hdr.msg_iovlen = 1;
+	}
+	while (sent < b->count) {
+		n = window + b->received - sent;
+		if (n > b->count - sent)
+			n = b->count - sent;
+		if (n > BURST)
+			n = BURST;
+		if (n < 1) {
+			sched_yield();
+			continue;
+		}
+		n = sendmmsg(fd, msg, n, 0);
+		if (n > 0)
+			sent += n;
+	}
+	b->cpu = bench_thread_ns() - start;
+	/* whatever loopback dropped is made up until the reader has them all */
+	while (!b->done) {
+		sendmmsg(fd, msg, 1, 0);
+		usleep(1000);
+	}
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static void report(const char *path, const char *what, int count, unsigned long long wall,
+		unsigned long long thread, long long other)
+{
+	/* the clocks tick at different granularities */
+	if (other < 0)
+		other = 0;
+	printf("%-8s %-9s %9.0f pkt/s  %6.0f ns/pkt on the thread  %6.0f ns/pkt elsewhere\n",
+			what, path, count * 1e9 / wall, (double)thread / count, (double)other / count);
+}
+
+/* receive over path, or with poke set have every datagram answered */
+static void receive(const char *path, int io_uring, int count, int size, int poke)
+{
+	struct blaster b;
+	struct iax_context *ctx = NULL;
+	struct iax_event *e;
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	unsigned char *buf = NULL;
+	unsigned long long wall;
+	unsigned long long thread;
+	unsigned long long process;
+	pthread_t tid;
+	fd_set fds;
+	int fd = -1;
+	int res;
+
+	memset(&b, 0, sizeof(b));
+	b.count = count;
+	b.size = poke ? 12 : size;
+	b.poke = poke;
+	if (!strcmp(path, "recvfrom")) {
+		struct sockaddr_in sin;
+		socklen_t len = sizeof(sin);
+		int bufsize = 256 * 1024;
+
+		/* libiax2 gets its frames handed in, like custom networking does */
+		ctx = iax_context_new();
+		iax_context_set_networking(ctx, (iax_sendto_t)sendto, (iax_recvfrom_t)NULL);
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+		    getsockname(fd, (struct sockaddr *)&sin, &len) < 0)
+			bench_fail("bind failed");
+		b.port = ntohs(sin.sin_port);
+		buf = (unsigned char *)malloc(65536);
+	} else {
+		ctx = iax_context_new();
+		iax_context_set_io_uring(ctx, io_uring);
+		b.port = iax_context_init(ctx, -1);
+		if (b.port < 0)
+			bench_fail(iax_context_error(ctx));
+		if ((iax_context_io_uring(ctx) & io_uring) != io_uring) {
+			printf("%-8s %-9s unavailable on this kernel\n", poke ? "respond" : "receive", path);
+			iax_context_free(ctx);
+			return;
+		}
+	}
+
+	wall = bench_now_ns();
+	thread = bench_thread_ns();
+	process = bench_process_ns();
+	pthread_create(&tid, NULL, blast, &b);
+	while (b.received < count) {
+		if (fd < 0) {
+			e = iax_context_get_event(ctx, 1);
+			if (!e)
+				continue;
+			iax_event_free(e);
+		} else {
+			FD_ZERO(&fds);
+			FD_SET(fd, &fds);
+			select(fd + 1, &fds, NULL, NULL, NULL);
+			fromlen = sizeof(from);
+			res = (int)recvfrom(fd, buf, 65536, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+			if (res < 0)
+				continue;
+			e = iax_context_net_process(ctx, buf, res, (struct sockaddr *)&from);
+			if (e)
+				iax_event_free(e);
+		}
+		__atomic_store_n(&b.received, b.received + 1, __ATOMIC_RELEASE);
+	}
+	wall = bench_now_ns() - wall;
+	thread = bench_thread_ns() - thread;
+	process = bench_process_ns() - process;
+	b.done = 1;
+	pthread_join(tid, NULL);
+	report(path, poke ? "respond" : "receive", count, wall, thread, (long long)(process - thread - b.cpu));
+
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	iax_context_free(ctx);
+}
+
+static void send_voice(const char *path, int count)
+{
+	struct iax_context *ctx[2];
+	struct iax_session *s;
+	unsigned char pcm[320];
+	unsigned long long wall;
+	unsigned long long thread;
+	unsigned long long process;
+	int port = -1;
+	int i;
+
+	ctx[0] = iax_context_new();
+	ctx[1] = iax_context_new();
+	if (!strcmp(path, "io_uring"))
+		iax_context_set_io_uring(ctx[0], IAX_IO_URING_RECV | IAX_IO_URING_SQPOLL);
+	if (iax_context_init(ctx[0], -1) < 0 || (port = iax_context_init(ctx[1], -1)) < 0)
+		bench_fail("init failed");
+	if (!strcmp(path, "io_uring") && !(iax_context_io_uring(ctx[0]) & IAX_IO_URING_SQPOLL)) {
+		printf("send     %-9s unavailable on this kernel\n", path);
+		iax_context_free(ctx[0]);
+		iax_context_free(ctx[1]);
+		return;
+	}
+	if (bench_calls(ctx[0], ctx[1], port, &s, 1) < 0)
+		bench_fail("call failed");
+	memset(pcm, 0, sizeof(pcm));
+
+	/* the callee doesn't read, its socket buffer overflows into the void */
+	wall = bench_now_ns();
+	thread = bench_thread_ns();
+	process = bench_process_ns();
+	for (i = 0; i < count; i++)
+		iax_send_voice(s, AST_FORMAT_SLINEAR, pcm, sizeof(pcm), 160);
+	wall = bench_now_ns() - wall;
+	thread = bench_thread_ns() - thread;
+	/* give the submission thread time to catch up before charging it */
+	usleep(100000);
+	process = bench_process_ns() - process;
+	report(path, "send", count, wall, thread, (long long)(process - thread));
+
+	iax_context_free(ctx[0]);
+	iax_context_free(ctx[1]);
+}
+
+int main(int argc, char **argv)
+{
+	int count = 200000;
+	int size = 164;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: netbench [-n datagrams] [-s bytes]");
+		}
+	}
+	if (count < 1 || size < 4 || size > IAX_MAX_DATAGRAM)
+		bench_fail("usage: netbench [-n datagrams] [-s bytes]");
+
+	receive("recvfrom", 0, count, size, 0);
+	receive("recvmmsg", 0, count, size, 0);
+	receive("io_uring", IAX_IO_URING_RECV, count, size, 0);
+	receive("recvmmsg", 0, count, size, 1);
+	receive("io_uring", IAX_IO_URING_RECV | IAX_IO_URING_SEND, count, size, 1);
+	receive("sqpoll", IAX_IO_URING_RECV | IAX_IO_URING_SQPOLL, count, size, 1);
+	send_voice("sendto", count);
+	send_voice("io_uring", count);
+	return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Cost of the comfort noise generator per sample.
+ *
+ * Blocks of the size the playout writes ahead (15 ms) and of a 20 ms frame
+ * are filled over and over at a quiet and a loud level, the best of many
+ * batches is taken, in cycles on x86 and in nanoseconds everywhere.  The
+ * noise has to come out at the level it was asked for.
+ *
+ * usage: noisebench [-r batches]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#include <winsock2.h>
+#include <windows.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "wave.h"
+#include "noise.h"
+#include "bench.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES() __rdtsc()
+#else
+#define CYCLES() 0ULL
+#endif
+
+#define BATCH 64
+
+/* the rms level of a block in dB below full scale, the way SetNoiseLevel takes it */
+static double level_of(const SHORT *samples, int count)
+{
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		sum += (double)samples[i] * samples[i];
+	return 20.0 * log10(sqrt(sum / count) / 32767.0);
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { WAVE_NOISE_SAMPLES, 160 };
+	static const BYTE levels[] = { 70, 30 };
+	static SHORT block[48000];
+	unsigned long long best_cycles;
+	unsigned long long best_ns;
+	unsigned long long cycles;
+	unsigned long long ns;
+	LPNOISE noise;
+	double level;
+	int batches = 20000;
+	int samples;
+	size_t s;
+	size_t l;
+	int c;
+	int r;
+	int i;
+
+	while ((c = getopt(argc, argv, "r:")) != -1) {
+		switch (c) {
+		case 'r':
+			batches = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: noisebench [-r batches]");
+		}
+	}
+	if (batches < 1)
+		bench_fail("usage: noisebench [-r batches]");
+
+	noise = CreateNoise(12345);
+	for (l = 0; l < sizeof(levels) / sizeof(levels[0]); l++) {
+		/* a few seconds of noise must be at the signalled level */
+		SetNoiseLevel(noise, levels[l]);
+		GenerateNoise(noise, block, sizeof(block) / sizeof(block[0]));
+		level = level_of(block, sizeof(block) / sizeof(block[0]));
+		if (fabs(level + levels[l]) > 0.5)
+			bench_fail("noise isn't at the signalled level");
+
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			samples = sizes[s];
+			best_cycles = ~0ULL;
+			best_ns = ~0ULL;
+			for (r = 0; r < batches; r++) {
+				ns = bench_now_ns();
+				cycles = CYCLES();
+				for (i = 0; i < BATCH; i++)
+					GenerateNoise(noise, block, samples);
+				cycles = CYCLES() - cycles;
+				ns = bench_now_ns() - ns;
+				if (cycles < best_cycles)
+					best_cycles = cycles;
+				if (ns < best_ns)
+					best_ns = ns;
+			}
+			printf("-%2u dBov %3d samples  %5.2f cycles %5.2f ns per sample  %6.0f ns per block\n", levels[l], samples,
+					(double)best_cycles / BATCH / samples, (double)best_ns / BATCH / samples, (double)best_ns / BATCH);
+		}
+	}
+	FreeNoise(noise);
+	return 0;
+}
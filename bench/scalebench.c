@@ -0,0 +1,150 @@
+/*
+ * Scaling of independent libiax2 contexts over threads.
+ *
+ * The calls are spread evenly over 1, 2, 4, 8 and 16 threads.  Every thread
+ * owns a caller and a callee context on ports of their own, places its
+ * share of the calls between them and then, round after round, sends one
+ * voice frame per call and runs both contexts until they are idle.  Call
+ * setup isn't timed.  No lock is taken anywhere, so the frame rate should
+ * grow with the threads until the cores run out.
+ *
+ * usage: scalebench [-c calls] [-r rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "frame.h"
+
+#define MAX_THREADS 16
+
+struct worker {
+	int calls;
+	int rounds;
+	int failed;
+	unsigned long long start;
+	unsigned long long end;
+	pthread_barrier_t *ready;
+};
+
+static int run(struct iax_context *ctx)
+{
+	struct iax_event *e;
+	int events = 0;
+
+	while ((e = iax_context_get_event(ctx, 0))) {
+		iax_event_free(e);
+		events++;
+	}
+	return events;
+}
+
+static void *work(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	struct iax_context *ctx[2];
+	struct iax_session **calls;
+	unsigned char pcm[320];
+	int port = -1;
+	int busy;
+	int i;
+	int r;
+
+	calls = (struct iax_session **)calloc(w->calls, sizeof(*calls));
+	ctx[0] = iax_context_new();
+	ctx[1] = iax_context_new();
+	if (!calls || !ctx[0] || !ctx[1] || iax_context_init(ctx[0], -1) < 0 ||
+	    (port = iax_context_init(ctx[1], -1)) < 0)
+		w->failed = 1;
+	if (!w->failed && bench_calls(ctx[0], ctx[1], port, calls, w->calls) < 0)
+		w->failed = 1;
+	bench_run(ctx, 2, 50);
+	memset(pcm, 0, sizeof(pcm));
+
+	/* every worker clocks itself, the main thread may not even run in between */
+	pthread_barrier_wait(w->ready);
+	w->start = bench_now_ns();
+	for (r = 0; r < w->rounds && !w->failed; r++) {
+		for (i = 0; i < w->calls; i++)
+			iax_send_voice(calls[i], AST_FORMAT_SLINEAR, pcm, sizeof(pcm), 160);
+		do {
+			busy = run(ctx[1]);
+			busy += run(ctx[0]);
+		} while (busy);
+	}
+	w->end = bench_now_ns();
+
+	for (i = 0; i < w->calls; i++)
+		if (calls[i])
+			iax_hangup(calls[i], "done");
+	bench_run(ctx, 2, 50);
+	iax_context_free(ctx[0]);
+	iax_context_free(ctx[1]);
+	free(calls);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct worker w[MAX_THREADS];
+	pthread_t tid[MAX_THREADS];
+	pthread_barrier_t ready;
+	unsigned long long start;
+	unsigned long long end;
+	double base = 0;
+	double rate;
+	int calls = 256;
+	int rounds = 200;
+	int threads;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "c:r:")) != -1) {
+		switch (c) {
+		case 'c':
+			calls = atoi(optarg);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: scalebench [-c calls] [-r rounds]");
+		}
+	}
+	if (calls < MAX_THREADS || rounds < 1)
+		bench_fail("usage: scalebench [-c calls] [-r rounds]");
+
+	printf("%ld cpus online, %d calls, %d frames per call\n",
+			sysconf(_SC_NPROCESSORS_ONLN), calls, rounds);
+	for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		pthread_barrier_init(&ready, NULL, threads);
+		for (i = 0; i < threads; i++) {
+			memset(&w[i], 0, sizeof(w[i]));
+			w[i].calls = calls / threads + (i < calls % threads);
+			w[i].rounds = rounds;
+			w[i].ready = &ready;
+			pthread_create(&tid[i], NULL, work, &w[i]);
+		}
+		start = ~0ULL;
+		end = 0;
+		for (i = 0; i < threads; i++) {
+			pthread_join(tid[i], NULL);
+			if (w[i].failed)
+				bench_fail("call setup failed");
+			if (w[i].start < start)
+				start = w[i].start;
+			if (w[i].end > end)
+				end = w[i].end;
+		}
+		pthread_barrier_destroy(&ready);
+
+		rate = (double)calls * rounds * 1e9 / (end - start);
+		if (threads == 1)
+			base = rate;
+		printf("%2d threads %9.0f frames/s  %5.2fx\n", threads, rate, rate / base);
+	}
+	return 0;
+}
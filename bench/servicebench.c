@@ -0,0 +1,192 @@
+/*
+ * The service event loop the pager waits in on Linux.
+ *
+ * WaitForServiceEvents is given the sub-millisecond deadlines libiax2's
+ * scheduler asks for and the lateness of every wakeup behind its deadline is
+ * taken; no wakeup may come early.  The events have to come out lowest first
+ * and stay set until reset, SIGUSR1 and SIGTERM have to turn into the metrics
+ * and shutdown events, and a pending event must not leave the timer armed.
+ * Last, datagrams are sent to a libiax2 context whose descriptor (the
+ * io_uring one where the kernel has it) the loop watches, and the time from
+ * the send until the network event is reported.
+ *
+ * usage: servicebench [-n waits]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <winsock2.h>
+#include <windows.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "service.h"
+#include "bench.h"
+
+static int compare(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void reset(LPSERVICE service, int event)
+{
+	eventfd_t value;
+
+	eventfd_read((int)(DWORD_PTR)GetServiceEvent(service, event), &value);
+}
+
+static void expect(LPSERVICE service, LONGLONG timeout, DWORD result, const char *what)
+{
+	if (WaitForServiceEvents(service, timeout) != result)
+		bench_fail(what);
+}
+
+static void print(const char *what, int count, unsigned long long *ns)
+{
+	qsort(ns, count, sizeof(*ns), compare);
+	printf("%-18s %5d waits  p50 %6.1f us  p99 %6.1f us  max %7.1f us\n", what, count,
+			ns[count / 2] / 1e3, ns[count * 99 / 100] / 1e3, ns[count - 1] / 1e3);
+}
+
+/* how late the timeouts come behind their deadlines */
+static void deadlines(LPSERVICE service, int count)
+{
+	static const LONGLONG timeouts[] = { 100, 250, 500, 1000, 5000 };
+	unsigned long long *late = (unsigned long long *)calloc(count, sizeof(*late));
+	unsigned long long due;
+	unsigned long long now;
+	char what[32];
+	size_t t;
+	int i;
+
+	for (t = 0; t < sizeof(timeouts) / sizeof(timeouts[0]); t++) {
+		for (i = 0; i < count; i++) {
+			due = bench_now_ns() + timeouts[t] * 1000;
+			expect(service, timeouts[t], WSA_WAIT_TIMEOUT, "the timer didn't time out");
+			if ((now = bench_now_ns()) < due)
+				bench_fail("woke up before the deadline");
+			late[i] = now - due;
+		}
+		snprintf(what, sizeof(what), "timeout %lld us", timeouts[t]);
+		print(what, count, late);
+	}
+	free(late);
+}
+
+/* events come lowest first and stay set, signals set their events, the timer is disarmed */
+static void events(LPSERVICE service)
+{
+	WSASetEvent(GetServiceEvent(service, SERVICE_EVENT_RESOLVER));
+	WSASetEvent(GetServiceEvent(service, SERVICE_EVENT_WAVEFORM));
+	expect(service, 1000000, WSA_WAIT_EVENT_0 + SERVICE_EVENT_WAVEFORM, "the waveform event doesn't come first");
+	expect(service, 0, WSA_WAIT_EVENT_0 + SERVICE_EVENT_WAVEFORM, "the waveform event didn't stay set");
+	reset(service, SERVICE_EVENT_WAVEFORM);
+	expect(service, -1, WSA_WAIT_EVENT_0 + SERVICE_EVENT_RESOLVER, "the resolver event got lost");
+	reset(service, SERVICE_EVENT_RESOLVER);
+
+	/* the timer armed for the waits above must not fire into the next one */
+	usleep(2000);
+	expect(service, 0, WSA_WAIT_TIMEOUT, "a disarmed timer fired");
+
+	kill(getpid(), SIGUSR1);
+	expect(service, -1, WSA_WAIT_EVENT_0 + SERVICE_EVENT_METRICS, "SIGUSR1 doesn't request metrics");
+	reset(service, SERVICE_EVENT_METRICS);
+	kill(getpid(), SIGTERM);
+	expect(service, -1, WSA_WAIT_EVENT_0 + SERVICE_EVENT_SHUTDOWN, "SIGTERM doesn't shut down");
+	expect(service, 0, WSA_WAIT_EVENT_0 + SERVICE_EVENT_SHUTDOWN, "the shutdown event didn't stay set");
+	reset(service, SERVICE_EVENT_SHUTDOWN);
+	expect(service, 0, WSA_WAIT_TIMEOUT, "an event is left set");
+	printf("events             lowest first, kept until reset, signals and timer right\n");
+}
+
+/* the time from sending a datagram until the network event, with a deadline pending */
+static void network(const char *path, int io_uring, int count)
+{
+	unsigned long long *wake = (unsigned long long *)calloc(count, sizeof(*wake));
+	unsigned char frame[16];
+	struct iax_context *ctx;
+	struct iax_event *e;
+	struct sockaddr_in to;
+	unsigned long long sent;
+	LPSERVICE service;
+	int fd;
+	int i;
+
+	if ((service = InitializeService()) == NULL)
+		bench_fail("no service");
+	ctx = iax_context_new();
+	iax_context_set_io_uring(ctx, io_uring);
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if ((i = iax_context_init(ctx, -1)) < 0)
+		bench_fail(iax_context_error(ctx));
+	to.sin_port = htons(i);
+	if ((iax_context_io_uring(ctx) & io_uring) != io_uring) {
+		printf("%-18s unavailable on this kernel\n", path);
+		iax_context_free(ctx);
+		FreeService(service, 0);
+		free(wake);
+		return;
+	}
+	if (!WatchServiceNetwork(service, iax_context_get_fd(ctx)))
+		bench_fail("can't watch the network");
+
+	/* a mini frame of a call nobody has, it is looked up and dropped */
+	memset(frame, 0, sizeof(frame));
+	frame[0] = 0x12;
+	frame[1] = 0x34;
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	for (i = 0; i < count; i++) {
+		sent = bench_now_ns();
+		sendto(fd, frame, sizeof(frame), 0, (struct sockaddr *)&to, sizeof(to));
+		expect(service, 1000000, WSA_WAIT_EVENT_0 + SERVICE_EVENT_NETWORK, "no network event");
+		wake[i] = bench_now_ns() - sent;
+		reset(service, SERVICE_EVENT_NETWORK);
+		while ((e = iax_context_get_event(ctx, 0)))
+			iax_event_free(e);
+		expect(service, 0, WSA_WAIT_TIMEOUT, "the network event stayed after draining");
+	}
+	print(path, count, wake);
+	close(fd);
+	iax_context_free(ctx);
+	FreeService(service, 0);
+	free(wake);
+}
+
+int main(int argc, char **argv)
+{
+	LPSERVICE service;
+	int count = 500;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: servicebench [-n waits]");
+		}
+	}
+	if (count < 1)
+		bench_fail("usage: servicebench [-n waits]");
+
+	if ((service = InitializeService()) == NULL)
+		bench_fail("no service");
+	deadlines(service, count);
+	events(service);
+	FreeService(service, 0);
+	network("socket", 0, count);
+	network("io_uring", IAX_IO_URING_RECV, count);
+	return 0;
+}
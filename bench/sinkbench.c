@@ -0,0 +1,178 @@
+/*
+ * The POSIX sink the pager runs headless with on Linux.
+ *
+ * 20 ms slin frames are written to the sink with a few of them queued, the
+ * way the playout keeps it fed, and the done ones are collected whenever
+ * the eventfd signals.  For the null output, which plays in real-time, the
+ * lateness of every completion behind the frame's deadline is taken; the
+ * discard output and the wave file report the cost of a frame's round trip
+ * through the sink thread.  The wave file has to come out with the right
+ * sizes in its header.
+ *
+ * usage: sinkbench [-n frames]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include <winsock2.h>
+#include <windows.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "wave.h"
+#include "sink.h"
+#include "bench.h"
+
+#define FRAME_BYTES 320
+#define QUEUED 3
+
+static int compare(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* play count frames through the output, the completion times go to done */
+static void play(int output, const char *file, int count, unsigned long long *done)
+{
+	WAVEFORMATEX slin = { WAVE_FORMAT_PCM, 1, 8000, 16000, 2, 16, 0 };
+	static char data[QUEUED][FRAME_BYTES];
+	WAVEHDR headers[QUEUED];
+	SETTINGS settings;
+	LPSINK sink;
+	struct pollfd pfd;
+	eventfd_t value;
+	int written = 0;
+	int retired = 0;
+	int i;
+
+	memset(&settings, 0, sizeof(settings));
+	settings.Output = output;
+	settings.OutputFile = (LPTSTR)file;
+	pfd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0 || OpenSink(&settings, &slin, (WSAEVENT)(DWORD_PTR)pfd.fd, &sink) != MMSYSERR_NOERROR)
+		bench_fail("no sink");
+
+	memset(headers, 0, sizeof(headers));
+	for (i = 0; i < QUEUED; i++) {
+		headers[i].lpData = data[i];
+		headers[i].dwBufferLength = FRAME_BYTES;
+		PrepareSinkHeader(sink, &headers[i]);
+		headers[i].dwFlags |= WHDR_DONE;
+	}
+	while (retired < count) {
+		/* refill every done header, then wait for the sink to retire one */
+		for (i = 0; i < QUEUED; i++) {
+			if (!(__atomic_load_n(&headers[i].dwFlags, __ATOMIC_ACQUIRE) & WHDR_DONE))
+				continue;
+			if (headers[i].dwUser) {
+				headers[i].dwUser = 0;
+				done[retired++] = bench_now_ns();
+			}
+			if (written < count) {
+				memset(data[i], written, FRAME_BYTES);
+				headers[i].dwUser = 1;
+				if (WriteSink(sink, &headers[i]) != MMSYSERR_NOERROR)
+					bench_fail("write failed");
+				written++;
+			}
+		}
+		if (retired < count && poll(&pfd, 1, 1000) != 1)
+			bench_fail("the sink never signalled");
+		eventfd_read(pfd.fd, &value);
+		if (PollSink(sink) != MMSYSERR_NOERROR)
+			bench_fail("the sink failed");
+	}
+	for (i = 0; i < QUEUED; i++)
+		UnprepareSinkHeader(sink, &headers[i]);
+	if (CloseSink(sink) != MMSYSERR_NOERROR)
+		bench_fail("closing the sink failed");
+	close(pfd.fd);
+}
+
+/* the lateness of the real-time completions behind their deadlines */
+static void null_output(int count)
+{
+	unsigned long long *done = (unsigned long long *)calloc(count, sizeof(*done));
+	unsigned long long start = bench_now_ns();
+	unsigned long long frame = 1000000000ULL * FRAME_BYTES / 16000;
+	int i;
+
+	play(OUTPUT_NULL, NULL, count, done);
+	for (i = 0; i < count; i++) {
+		/* the clock started with the first write, just before it returned */
+		done[i] = done[i] > start + (i + 1) * frame ? done[i] - start - (i + 1) * frame : 0;
+	}
+	qsort(done, count, sizeof(*done), compare);
+	printf("null     %6d frames  late p50 %6.0f us  p99 %6.0f us  max %6.0f us\n", count,
+			done[count / 2] / 1e3, done[count * 99 / 100] / 1e3, done[count - 1] / 1e3);
+	free(done);
+}
+
+/* the round trip of a frame through the sink thread */
+static void fast_output(const char *what, int output, const char *file, int count)
+{
+	unsigned long long *done = (unsigned long long *)calloc(count, sizeof(*done));
+	unsigned long long start = bench_now_ns();
+
+	play(output, file, count, done);
+	printf("%-8s %6d frames  %6.1f us per frame\n", what, count, (done[count - 1] - start) / 1e3 / count);
+	free(done);
+}
+
+/* the wave file holds every frame and says so in its header */
+static void check_file(const char *file, int count)
+{
+	unsigned char header[44];
+	struct stat st;
+	FILE *f;
+
+	if (stat(file, &st) != 0 || st.st_size != 44 + (off_t)count * FRAME_BYTES)
+		bench_fail("wave file has the wrong size");
+	if (!(f = fopen(file, "rb")) || fread(header, 1, sizeof(header), f) != sizeof(header))
+		bench_fail("wave file can't be read");
+	fclose(f);
+	if (memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVEfmt ", 8) || memcmp(header + 36, "data", 4) ||
+			*(DWORD *)(header + 4) != 36 + (DWORD)count * FRAME_BYTES || *(DWORD *)(header + 40) != (DWORD)count * FRAME_BYTES)
+		bench_fail("wave file header is wrong");
+}
+
+int main(int argc, char **argv)
+{
+	char file[] = "/tmp/sinkbench-XXXXXX";
+	int count = 250;
+	int fd;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1) {
+		switch (c) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: sinkbench [-n frames]");
+		}
+	}
+	if (count < 1)
+		bench_fail("usage: sinkbench [-n frames]");
+
+	null_output(count);
+	fast_output("discard", OUTPUT_DISCARD, NULL, count * 40);
+	if ((fd = mkstemp(file)) < 0)
+		bench_fail("no temporary file");
+	close(fd);
+	fast_output("file", OUTPUT_FILE, file, count * 40);
+	check_file(file, count * 40);
+	unlink(file);
+	return 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * Cost of call token admission under a spoofed flood.
+ *
+ * A context without a socket is fed full frames with dcallno 0 from random
+ * IPv4 sources, the way a flood of spoofed datagrams would arrive, and its
+ * answers are thrown away.  Every flood reports the cost per frame, what
+ * the heap grew by and the admission counters.  All sources need a call
+ * token; for contrast NEWs and PINGs are then flooded with the hook
+ * accepting them, which opens a session for each.
+ *
+ * usage: tokenbench [-f frames]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "frame.h"
+#include "iax2.h"
+#include "iax2-parser.h"
+
+enum { NO_TOKEN, EMPTY_TOKEN, FORGED_TOKEN };
+
+static int admit_result = IAX_ADMIT_TOKEN;
+
+/* the last call token handed out */
+static char token[64];
+
+static unsigned int seed = 2463534242u;
+
+static unsigned int next(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static int admit(struct iax_context *ctx, const struct sockaddr *from, int subclass, const char **cause, void *data)
+{
+	return admit_result;
+}
+
+/* answers go nowhere, a CALLTOKEN is kept for the next NEW */
+static int capture_sendto(int fd, const void *buf, size_t len, int flags,
+		const struct sockaddr *to, socklen_t tolen)
+{
+	const struct ast_iax2_full_hdr *fh = (const struct ast_iax2_full_hdr *)buf;
+	const unsigned char *ie = fh->iedata;
+
+	if (len >= sizeof(*fh) + 2 && fh->type == AST_FRAME_IAX && fh->csub == IAX_COMMAND_CALLTOKEN &&
+	    ie[0] == IAX_IE_CALLTOKEN && ie[1] < sizeof(token) && sizeof(*fh) + 2 + ie[1] <= len) {
+		memcpy(token, ie + 2, ie[1]);
+		token[ie[1]] = '\0';
+	}
+	return (int)len;
+}
+
+/* large blocks are mapped, they count as well */
+static size_t heap_used(void)
+{
+	struct mallinfo2 mi = mallinfo2();
+
+	return mi.uordblks + mi.hblkhd;
+}
+
+static void random_source(struct sockaddr_in *sin)
+{
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_addr.s_addr = htonl(0x0A000000 | (next() & 0xFFFFFF));
+	sin->sin_port = htons(1024 + next() % 64512);
+}
+
+/* a full IAX frame opening a call, tok NULL leaves the token IE out */
+static int build(unsigned char *buf, int subclass, const char *tok)
+{
+	struct ast_iax2_full_hdr *fh = (struct ast_iax2_full_hdr *)buf;
+	struct iax_ie_data ied;
+
+	memset(&ied, 0, sizeof(ied));
+	if (subclass == IAX_COMMAND_NEW) {
+		iax_ie_append_short(&ied, IAX_IE_VERSION, IAX_PROTO_VERSION);
+		iax_ie_append_str(&ied, IAX_IE_CALLED_NUMBER, "100");
+		iax_ie_append_str(&ied, IAX_IE_USERNAME, "bench");
+		iax_ie_append_int(&ied, IAX_IE_FORMAT, AST_FORMAT_SLINEAR);
+		iax_ie_append_int(&ied, IAX_IE_CAPABILITY, AST_FORMAT_SLINEAR);
+	} else if (subclass == IAX_COMMAND_REGREQ) {
+		iax_ie_append_str(&ied, IAX_IE_USERNAME, "bench");
+	}
+	if (tok)
+		iax_ie_append_str(&ied, IAX_IE_CALLTOKEN, tok);
+	fh->scallno = htons(IAX_FLAG_FULL | (1 + next() % 32767));
+	fh->dcallno = 0;
+	fh->ts = htonl(next() % 100000);
+	fh->oseqno = 0;
+	fh->iseqno = 0;
+	fh->type = AST_FRAME_IAX;
+	fh->csub = (unsigned char)subclass;
+	memcpy(fh->iedata, ied.buf, ied.pos);
+	return (int)sizeof(*fh) + ied.pos;
+}
+
+static struct iax_context *context(void)
+{
+	struct iax_context *ctx = iax_context_new();
+
+	if (!ctx)
+		bench_fail("no context");
+	iax_context_set_networking(ctx, (iax_sendto_t)capture_sendto, NULL);
+	iax_context_set_admission(ctx, admit, NULL);
+	return ctx;
+}
+
+/* the counters since before, what the heap grew by and the cost per frame */
+static void report(const char *what, struct iax_context *ctx, const struct iax_admission_stats *before,
+		int frames, unsigned long long spent, size_t heap)
+{
+	struct iax_admission_stats st;
+
+	iax_context_get_admission_stats(ctx, &st);
+	printf("%-18s %9.0f ns/frame %9.1f KB  acc %lu rej %lu chal %lu inv %lu poke %lu\n",
+			what, (double)spent / frames, heap / 1024.0,
+			st.accepted - before->accepted, st.rejected - before->rejected,
+			st.challenged - before->challenged, st.invalid - before->invalid,
+			st.poked - before->poked);
+}
+
+/* frames of one kind from as many sources, nothing is kept between them */
+static void flood(const char *what, int subclass, int mode, int frames)
+{
+	struct iax_context *ctx = context();
+	struct iax_admission_stats before;
+	struct sockaddr_in sin;
+	struct iax_event *e;
+	unsigned char buf[512];
+	unsigned long long spent = 0;
+	unsigned long long start;
+	const char *tok = NULL;
+	char *mac;
+	size_t heap;
+	int len;
+	int i;
+
+	/* key the tokens first, that isn't part of the flood */
+	token[0] = '\0';
+	random_source(&sin);
+	len = build(buf, IAX_COMMAND_NEW, "");
+	if ((e = iax_context_net_process(ctx, buf, len, (struct sockaddr *)&sin)))
+		iax_event_free(e);
+	if (mode == EMPTY_TOKEN) {
+		tok = "";
+	} else if (mode == FORGED_TOKEN) {
+		/* a genuine token with another MAC is current, so the MAC gets checked */
+		if (!(mac = strchr(token, '?')))
+			bench_fail("no call token handed out");
+		memset(mac + 1, 'f', strlen(mac + 1));
+		tok = token;
+	}
+	iax_context_get_admission_stats(ctx, &before);
+	heap = heap_used();
+	for (i = 0; i < frames; i++) {
+		random_source(&sin);
+		len = build(buf, subclass, tok);
+		start = bench_thread_ns();
+		e = iax_context_net_process(ctx, buf, len, (struct sockaddr *)&sin);
+		spent += bench_thread_ns() - start;
+		if (e)
+			iax_event_free(e);
+	}
+	report(what, ctx, &before, frames, spent, heap_used() - heap);
+	iax_context_free(ctx);
+}
+
+/* the full exchange: every source asks for a token and calls with it */
+static void proven(int calls)
+{
+	struct iax_context *ctx = context();
+	struct iax_admission_stats before;
+	struct sockaddr_in sin;
+	struct iax_event *e;
+	unsigned char buf[512];
+	unsigned long long spent = 0;
+	unsigned long long start;
+	size_t heap;
+	int len;
+	int i;
+
+	iax_context_get_admission_stats(ctx, &before);
+	heap = heap_used();
+	for (i = 0; i < calls; i++) {
+		random_source(&sin);
+		token[0] = '\0';
+		len = build(buf, IAX_COMMAND_NEW, "");
+		start = bench_thread_ns();
+		if ((e = iax_context_net_process(ctx, buf, len, (struct sockaddr *)&sin)))
+			iax_event_free(e);
+		spent += bench_thread_ns() - start;
+		if (!token[0])
+			bench_fail("no call token handed out");
+		len = build(buf, IAX_COMMAND_NEW, token);
+		start = bench_thread_ns();
+		e = iax_context_net_process(ctx, buf, len, (struct sockaddr *)&sin);
+		spent += bench_thread_ns() - start;
+		if (e)
+			iax_event_free(e);
+	}
+	report("new, valid token", ctx, &before, calls, spent, heap_used() - heap);
+	iax_context_free(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	int frames = 100000;
+	int sessions;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:")) != -1) {
+		switch (c) {
+		case 'f':
+			frames = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: tokenbench [-f frames]");
+		}
+	}
+	if (frames < 1)
+		bench_fail("usage: tokenbench [-f frames]");
+
+	printf("%d spoofed frames per flood, every source needs a call token\n", frames);
+	flood("new, no token", IAX_COMMAND_NEW, NO_TOKEN, frames);
+	flood("new, empty token", IAX_COMMAND_NEW, EMPTY_TOKEN, frames);
+	flood("new, forged token", IAX_COMMAND_NEW, FORGED_TOKEN, frames);
+	flood("regreq, no token", IAX_COMMAND_REGREQ, NO_TOKEN, frames);
+	flood("ping", IAX_COMMAND_PING, NO_TOKEN, frames);
+	flood("lagrq", IAX_COMMAND_LAGRQ, NO_TOKEN, frames);
+	flood("poke", IAX_COMMAND_POKE, NO_TOKEN, frames);
+	/* every one of these is a session, a tenth of them is plenty */
+	sessions = frames / 10 ? frames / 10 : 1;
+	proven(sessions);
+
+	admit_result = IAX_ADMIT_ACCEPT;
+	printf("without call tokens\n");
+	flood("new", IAX_COMMAND_NEW, NO_TOKEN, sessions);
+	flood("ping", IAX_COMMAND_PING, NO_TOKEN, sessions);
+	return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * Receive cost of trunked against untrunked voice.
+ *
+ * A caller context places the calls and sends one full voice frame on each,
+ * then gives up its socket.  A plain socket bound to the caller's port
+ * takes over and, round after round, sends one 20 ms frame per call to the
+ * callee context: as one mini frame per call, as a single trunk frame with
+ * a shared timestamp, or as a single trunk frame of mini frames.  Only the
+ * callee's thread time running its context is counted.
+ *
+ * usage: trunkbench [-r rounds] [-b payload bytes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "frame.h"
+#include "iax2.h"
+
+#define MAX_CALLS 64
+
+enum { UNTRUNKED, TRUNK, TRUNK_MINI };
+static const char *modes[] = { "untrunked", "trunk", "trunk-ts" };
+
+/* the call number of the last NEW the caller sent */
+static unsigned short last_callno;
+
+static int record_sendto(int fd, const void *buf, size_t len, int flags,
+		const struct sockaddr *to, socklen_t tolen)
+{
+	const struct ast_iax2_full_hdr *fh = (const struct ast_iax2_full_hdr *)buf;
+
+	if (len >= sizeof(*fh) && (ntohs(fh->scallno) & IAX_FLAG_FULL))
+		last_callno = ntohs(fh->scallno) & ~IAX_FLAG_FULL;
+	return (int)sendto(fd, buf, len, flags, to, tolen);
+}
+
+/* one round of datagrams for every call in msgs, returns how many */
+static int build(int mode, unsigned short *callnos, int calls, int payload, unsigned int ts,
+		unsigned char *buf, struct mmsghdr *msgs, struct iovec *iov)
+{
+	struct ast_iax2_meta_hdr *meta = (struct ast_iax2_meta_hdr *)buf;
+	struct ast_iax2_meta_trunk_hdr *mth = (struct ast_iax2_meta_trunk_hdr *)meta->data;
+	unsigned char *ptr = mth->data;
+	int i;
+
+	if (mode == UNTRUNKED) {
+		for (i = 0; i < calls; i++) {
+			struct ast_iax2_mini_hdr *mh = (struct ast_iax2_mini_hdr *)(buf + i * (payload + 4));
+
+			mh->callno = htons(callnos[i]);
+			mh->ts = htons((unsigned short)ts);
+			memset(mh->data, 0, payload);
+			iov[i].iov_base = mh;
+			iov[i].iov_len = sizeof(*mh) + payload;
+		}
+		return calls;
+	}
+	meta->zeros = 0;
+	meta->metacmd = IAX_META_TRUNK;
+	meta->cmddata = mode == TRUNK_MINI ? IAX_META_TRUNK_MINI : IAX_META_TRUNK_SUPERMINI;
+	mth->ts = htonl(ts);
+	for (i = 0; i < calls; i++) {
+		if (mode == TRUNK_MINI) {
+			struct ast_iax2_meta_trunk_mini *mtm = (struct ast_iax2_meta_trunk_mini *)ptr;
+
+			mtm->len = htons(payload);
+			mtm->mini.callno = htons(callnos[i]);
+			mtm->mini.ts = htons((unsigned short)ts);
+			ptr += sizeof(*mtm);
+		} else {
+			struct ast_iax2_meta_trunk_entry *mte = (struct ast_iax2_meta_trunk_entry *)ptr;
+
+			mte->callno = htons(callnos[i]);
+			mte->len = htons(payload);
+			ptr += sizeof(*mte);
+		}
+		memset(ptr, 0, payload);
+		ptr += payload;
+	}
+	iov[0].iov_base = buf;
+	iov[0].iov_len = ptr - buf;
+	return 1;
+}
+
+static void measure(int mode, int calls, int rounds, int payload)
+{
+	struct iax_context *ctx[2];
+	struct iax_session *sessions[MAX_CALLS];
+	unsigned short callnos[MAX_CALLS];
+	struct mmsghdr msgs[MAX_CALLS];
+	struct iovec iov[MAX_CALLS];
+	struct sockaddr_in sin;
+	struct iax_event *e;
+	unsigned char *buf;
+	unsigned char pcm[320];
+	unsigned long long spent = 0;
+	unsigned long long start;
+	char dial[64];
+	int answered = 0;
+	int accepted = 0;
+	int caller_port;
+	int port = -1;
+	int fd;
+	int n;
+	int i;
+	int r;
+
+	ctx[0] = iax_context_new();
+	ctx[1] = iax_context_new();
+	if ((caller_port = iax_context_init(ctx[0], -1)) < 0 || (port = iax_context_init(ctx[1], -1)) < 0)
+		bench_fail("init failed");
+	snprintf(dial, sizeof(dial), "bench@127.0.0.1:%d/100", port);
+	for (i = 0; i < calls; i++) {
+		sessions[i] = iax_context_session_new(ctx[0]);
+		iax_set_sendto(sessions[i], (iax_sendto_t)record_sendto);
+		if (iax_call(sessions[i], "1", "bench", dial, NULL, 0, AST_FORMAT_SLINEAR, AST_FORMAT_SLINEAR) < 0)
+			bench_fail("call failed");
+		callnos[i] = last_callno;
+	}
+	for (i = 0; i < 5000 && (answered < calls || accepted < calls); i++) {
+		while ((e = iax_context_get_event(ctx[1], 0))) {
+			if (e->etype == IAX_EVENT_CONNECT) {
+				iax_accept(e->session, AST_FORMAT_SLINEAR);
+				iax_answer(e->session);
+				answered++;
+			}
+			iax_event_free(e);
+		}
+		while ((e = iax_context_get_event(ctx[0], 0))) {
+			if (e->etype == IAX_EVENT_ACCEPT)
+				accepted++;
+			iax_event_free(e);
+		}
+		usleep(1000);
+	}
+	if (answered < calls || accepted < calls)
+		bench_fail("calls didn't come up");
+	/* the full frame that tells the callee the format, then the port changes hands */
+	memset(pcm, 0, sizeof(pcm));
+	for (i = 0; i < calls; i++)
+		iax_send_voice(sessions[i], AST_FORMAT_SLINEAR, pcm, sizeof(pcm), 160);
+	bench_run(ctx, 2, 50);
+	iax_context_shutdown(ctx[0]);
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(caller_port);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+		bench_fail("can't take over the caller's port");
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < MAX_CALLS; i++) {
+		msgs[i].msg_hdr.msg_name = &sin;
+		msgs[i].msg_hdr.msg_namelen = sizeof(sin);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	buf = (unsigned char *)malloc(MAX_CALLS * (payload + 8) + 64);
+
+	for (r = 0; r < rounds; r++) {
+		n = build(mode, callnos, calls, payload, 1000 + r * 20, buf, msgs, iov);
+		if (sendmmsg(fd, msgs, n, 0) != n)
+			bench_fail("send failed");
+		start = bench_thread_ns();
+		/* the jitterbuffer releases voice in real time, only its intake counts */
+		while ((e = iax_context_get_event(ctx[1], 0)))
+			iax_event_free(e);
+		spent += bench_thread_ns() - start;
+	}
+	printf("%-9s %2d calls %9.0f voice frames/s of cpu  %6.0f ns/frame\n",
+			modes[mode], calls, (double)calls * rounds * 1e9 / spent,
+			(double)spent / calls / rounds);
+
+	free(buf);
+	close(fd);
+	iax_context_free(ctx[0]);
+	iax_context_free(ctx[1]);
+}
+
+int main(int argc, char **argv)
+{
+	static const int sizes[] = { 1, 8, 32, MAX_CALLS };
+	int rounds = 5000;
+	int payload = 20;
+	int mode;
+	int c;
+	int i;
+
+	while ((c = getopt(argc, argv, "r:b:")) != -1) {
+		switch (c) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'b':
+			payload = atoi(optarg);
+			break;
+		default:
+			bench_fail("usage: trunkbench [-r rounds] [-b payload bytes]");
+		}
+	}
+	/* a trunk frame of MAX_CALLS entries has to fit a datagram */
+	if (rounds < 1 || payload < 1 || payload > 1000)
+		bench_fail("usage: trunkbench [-r rounds] [-b payload bytes]");
+
+	for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+		for (mode = UNTRUNKED; mode <= TRUNK_MINI; mode++)
+			measure(mode, sizes[i], rounds, payload);
+	return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * ANSI TCHAR mappings for the benchmarks
+ */
+#ifndef BENCH_TCHAR_H
+#define BENCH_TCHAR_H
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+/* TCHAR and LPTSTR come with windows.h */
+#include "windows.h"
+
+#define _T(x) x
+#define _tcschr strchr
+#define _tcslen strlen
+#define _stscanf sscanf
+#define _istxdigit isxdigit
+#define _istdigit isdigit
+#define _istspace isspace
+#define _totlower tolower
+#define _tfopen fopen
+#define _fgetts fgets
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * Just enough of the Win32 API on POSIX to build the pager's portable
+ * modules into the benchmarks
+ */
+#ifndef BENCH_WINDOWS_H
+#define BENCH_WINDOWS_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+typedef int BOOL;
+typedef int INT;
+typedef unsigned int UINT;
+typedef short SHORT;
+typedef int LONG;
+typedef unsigned int ULONG;
+typedef long long LONGLONG;
+typedef unsigned long long ULONGLONG;
+typedef unsigned char BYTE, *LPBYTE;
+typedef unsigned short WORD, USHORT;
+typedef unsigned int DWORD, *LPDWORD;
+typedef uintptr_t DWORD_PTR;
+typedef size_t SIZE_T;
+typedef char CHAR, *LPSTR, TCHAR, *LPTSTR;
+typedef const char *LPCSTR, *LPCTSTR;
+typedef void VOID, *LPVOID;
+typedef const void *LPCVOID;
+typedef void *HANDLE;
+typedef unsigned short ADDRESS_FAMILY;
+typedef struct sockaddr SOCKADDR;
+typedef struct sockaddr_in SOCKADDR_IN;
+typedef struct sockaddr_in6 SOCKADDR_IN6;
+
+#define CONST const
+#define TRUE 1
+#define FALSE 0
+#define CALLBACK
+#define WINAPI
+
+#define HIBYTE(w) ((BYTE)(((WORD)(w)) >> 8))
+#define LOBYTE(w) ((BYTE)(w))
+#define ZeroMemory(d, n) memset((d), 0, (n))
+#define CopyMemory(d, s, n) memcpy((d), (s), (n))
+#define FillMemory(d, n, v) memset((d), (v), (n))
+
+#define ERROR_SUCCESS 0
+#define E_INVALIDARG EINVAL
+#define E_UNEXPECTED EFAULT
+#define SetLastError(e) (errno = (e))
+#define GetLastError() errno
+
+/* the process heap, failures raise like HEAP_GENERATE_EXCEPTIONS does */
+#define HEAP_GENERATE_EXCEPTIONS 0x4
+#define HEAP_ZERO_MEMORY 0x8
+#define GetProcessHeap() ((HANDLE)0)
+
+static inline void *HeapCheck(void *p)
+{
+	if (!p) {
+		fputs("out of memory\n", stderr);
+		abort();
+	}
+	return p;
+}
+
+#define HeapAlloc(heap, flags, size) HeapCheck(((flags) & HEAP_ZERO_MEMORY) ? calloc(1, (size)) : malloc(size))
+#define HeapReAlloc(heap, flags, p, size) HeapCheck(realloc((p), (size)))
+static inline BOOL HeapFree(HANDLE heap, DWORD flags, void *p)
+{
+	free(p);
+	return TRUE;
+}
+
+/* events are eventfds here, signalled by adding one */
+typedef HANDLE WSAEVENT;
+
+static inline BOOL WSASetEvent(WSAEVENT event)
+{
+	uint64_t one = 1;
+
+	return write((int)(uintptr_t)event, &one, sizeof(one)) == sizeof(one);
+}
+
+#define MemoryBarrier() __sync_synchronize()
+
+#define WSA_INVALID_EVENT ((WSAEVENT)0)
+#define WSA_WAIT_EVENT_0 0
+#define WSA_WAIT_TIMEOUT 258
+#define WSA_WAIT_FAILED 0xFFFFFFFF
+
+/* the service status, kept without an SCM to report it to */
+typedef struct _SERVICE_STATUS
+{
+	DWORD dwServiceType;
+	DWORD dwCurrentState;
+	DWORD dwControlsAccepted;
+	DWORD dwWin32ExitCode;
+	DWORD dwServiceSpecificExitCode;
+	DWORD dwCheckPoint;
+	DWORD dwWaitHint;
+} SERVICE_STATUS;
+
+#define SERVICE_STOPPED 1
+#define SERVICE_START_PENDING 2
+#define SERVICE_STOP_PENDING 3
+#define SERVICE_RUNNING 4
+#define SERVICE_CONTINUE_PENDING 5
+#define SERVICE_PAUSE_PENDING 6
+#define SERVICE_PAUSED 7
+
+/* waveform audio as the sink sees it */
+
+#define WAVE_FORMAT_PCM 1
+#define WHDR_DONE 0x01
+#define WHDR_PREPARED 0x02
+#define WHDR_INQUEUE 0x10
+#define MMSYSERR_NOERROR 0
+#define MMSYSERR_NODRIVER 6
+#define MMSYSERR_NOMEM 7
+#define MMSYSERR_NOTSUPPORTED 8
+#define MMSYSERR_INVALPARAM 11
+
+typedef struct __attribute__((packed)) tWAVEFORMATEX
+{
+	WORD wFormatTag;
+	WORD nChannels;
+	DWORD nSamplesPerSec;
+	DWORD nAvgBytesPerSec;
+	WORD nBlockAlign;
+	WORD wBitsPerSample;
+	WORD cbSize;
+} WAVEFORMATEX, *LPWAVEFORMATEX;
+
+typedef struct pcmwaveformat_tag
+{
+	WORD wFormatTag;
+	WORD nChannels;
+	DWORD nSamplesPerSec;
+	DWORD nAvgBytesPerSec;
+	WORD nBlockAlign;
+	WORD wBitsPerSample;
+} PCMWAVEFORMAT;
+
+typedef struct wavehdr_tag
+{
+	LPSTR lpData;
+	DWORD dwBufferLength;
+	DWORD dwBytesRecorded;
+	DWORD_PTR dwUser;
+	DWORD dwFlags;
+	DWORD dwLoops;
+	struct wavehdr_tag *lpNext;
+	DWORD_PTR reserved;
+} WAVEHDR, *LPWAVEHDR;
+
+#endif
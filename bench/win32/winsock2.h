@@ -0,0 +1,2 @@
+/* sockets come with windows.h here */
+#include "windows.h"
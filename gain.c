@@ -0,0 +1,202 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <math.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "gain.h"
+#include "realtime.h"
+
+/* the limiter looks 2ms ahead (the window widening below is written for
+   exactly 16 samples), samples are processed in chunks */
+#define LOOKAHEAD 16
+#define CHUNK     256
+
+/* the agc boosts by at most 20dB, ignores chunks below -55dBFS and
+   follows louder chunks faster than quieter ones */
+#define AGC_MAX_GAIN 10.0
+#define AGC_GATE     0.0018
+#define AGC_ATTACK   0.5
+#define AGC_RELEASE  0.05
+
+/* limiter gain is 1.15 fixed point and recovers within 50ms */
+#define UNITY   32768
+#define RELEASE (UNITY / 400)
+
+struct tagGAIN
+{
+	double Volume;
+	double AgcTarget;
+	double AgcGain;
+	LONG Ceiling;
+	LONG Envelope;
+	DWORD Samples;
+	DWORD LimitedSamples;
+	LONG Delay[LOOKAHEAD];
+	LONG Buffer[LOOKAHEAD + CHUNK];
+	LONG Peaks[LOOKAHEAD + CHUNK];
+};
+
+/* convert decibels below full scale to a linear factor */
+static double FromDecibels(INT decibels)
+{
+	return pow(10.0, -decibels / 20.0);
+}
+
+/* create a gain stage configured by the volume, agc and limiter settings */
+LPGAIN CreateGain(LPSETTINGS settings)
+{
+	LPGAIN gain;
+
+	ALLOC(gain);
+	gain->Volume = settings->Volume > -1 ? settings->Volume / 65535.0 : 1.0;
+	gain->AgcTarget = settings->AgcTarget > 0 ? FromDecibels(settings->AgcTarget) : 0.0;
+	gain->Ceiling = (LONG)(32767 * FromDecibels(settings->LimiterCeiling));
+	ResetGain(gain);
+	LockRealtimeMemory(settings, gain, sizeof(*gain));
+	return gain;
+}
+
+/* forget the agc level and limiter state of the last call */
+VOID ResetGain(LPGAIN gain)
+{
+	gain->AgcGain = 1.0;
+	gain->Envelope = UNITY;
+	gain->Samples = 0;
+	gain->LimitedSamples = 0;
+	ZERO(&gain->Delay);
+}
+
+/* adapt the agc to the level of a chunk */
+static VOID AdaptAgc(LPGAIN gain, SHORT *samples, DWORD count)
+{
+	LONGLONG sum = 0;
+	double level;
+	double desired;
+	DWORD i;
+
+	for (i = 0; i < count; i++)
+		sum += (LONG)samples[i] * samples[i];
+	level = sqrt((double)sum / count) / 32768.0 * gain->Volume;
+
+	/* leave pauses and background noise alone */
+	if (level < AGC_GATE)
+		return;
+	desired = gain->AgcTarget / level;
+	if (desired > AGC_MAX_GAIN)
+		desired = AGC_MAX_GAIN;
+	gain->AgcGain += (desired - gain->AgcGain) * (desired < gain->AgcGain ? AGC_ATTACK : AGC_RELEASE);
+}
+
+/* widen windows of peaks to twice the step, reading only ahead of the writes */
+static VOID WidenPeaks(LONG *peaks, DWORD count, DWORD step)
+{
+	DWORD i;
+
+	for (i = 0; i < count; i++)
+		peaks[i] = peaks[i + step] > peaks[i] ? peaks[i + step] : peaks[i];
+}
+
+/* amplify and limit at most one chunk of samples; everything but the envelope
+   is a plain loop over the whole chunk, left to the compiler to vectorize */
+static VOID ProcessChunk(LPGAIN gain, SHORT *samples, DWORD count)
+{
+	LONG *buffer = gain->Buffer;
+	LONG *peaks = gain->Peaks;
+	LONG factor;
+	LONG envelope = gain->Envelope;
+	LONG required;
+	LONG sample;
+	DWORD i;
+
+	/* adjust the agc and determine the 22.10 fixed point gain */
+	if (gain->AgcTarget > 0)
+		AdaptAgc(gain, samples, count);
+	factor = (LONG)(gain->Volume * gain->AgcGain * 1024.0);
+
+	/* amplify behind the samples still in the look-ahead */
+	memcpy(buffer, gain->Delay, sizeof(gain->Delay));
+	for (i = 0; i < count; i++)
+		buffer[LOOKAHEAD + i] = ((LONG)samples[i] * factor) >> 10;
+
+	/* the peak of each look-ahead window, doubling the window in four passes */
+	for (i = 0; i < count + LOOKAHEAD; i++)
+		peaks[i] = buffer[i] < 0 ? -buffer[i] : buffer[i];
+	WidenPeaks(peaks, count + LOOKAHEAD - 1, 1);
+	WidenPeaks(peaks, count + LOOKAHEAD - 3, 2);
+	WidenPeaks(peaks, count + LOOKAHEAD - 7, 4);
+	WidenPeaks(peaks, count + LOOKAHEAD - 15, 8);
+
+	/* reduce the gain before a peak enters the output and release it slowly */
+	for (i = 0; i < count; i++)
+	{
+		required = peaks[i] > gain->Ceiling ? (LONG)(((LONGLONG)gain->Ceiling << 15) / peaks[i]) : UNITY;
+		envelope += RELEASE;
+		if (envelope > required)
+			envelope = required;
+		if (envelope < UNITY)
+			gain->LimitedSamples++;
+
+		/* write the result and clip rounding errors */
+		sample = (LONG)(((LONGLONG)buffer[i] * envelope) >> 15);
+		samples[i] = (SHORT)(sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample);
+	}
+
+	/* keep the tail for the next chunk */
+	memcpy(gain->Delay, buffer + count, sizeof(gain->Delay));
+	gain->Envelope = envelope;
+	gain->Samples += count;
+}
+
+/* amplify, level and limit slin samples in place */
+VOID ProcessGain(LPGAIN gain, SHORT *samples, DWORD count)
+{
+	DWORD chunk;
+
+	while (count > 0)
+	{
+		chunk = count < CHUNK ? count : CHUNK;
+		ProcessChunk(gain, samples, chunk);
+		samples += chunk;
+		count -= chunk;
+	}
+}
+
+/* scale generated slin samples in place by the volume alone, leaving the agc
+   and limiter state to the call's audio */
+VOID ApplyVolume(LPGAIN gain, SHORT *samples, DWORD count)
+{
+	LONG factor = (LONG)(gain->Volume * 1024.0);
+	DWORD i;
+
+	/* the volume never amplifies, so nothing can clip */
+	for (i = 0; i < count; i++)
+		samples[i] = (SHORT)(((LONG)samples[i] * factor) >> 10);
+}
+
+/* write the gain statistics */
+VOID DumpGain(LPGAIN gain, LPMETRICS metrics)
+{
+	PrintMetrics(metrics, "gain: volume=%.1fdB agc=%.1fdB limited=%lu/%lu\n", 20.0 * log10(gain->Volume > 0 ? gain->Volume : 1e-5), 20.0 * log10(gain->AgcGain), gain->LimitedSamples, gain->Samples);
+}
+
+/* release the gain stage */
+VOID FreeGain(LPGAIN gain)
+{
+	FREE(gain);
+}
@@ -0,0 +1,38 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _GAIN_H
+#define _GAIN_H
+
+/* transparent gain stage structure */
+typedef struct tagGAIN GAIN, *LPGAIN;
+
+/* create a gain stage configured by the volume, agc and limiter settings */
+extern LPGAIN CreateGain(LPSETTINGS);
+
+/* forget the agc level and limiter state of the last call */
+extern VOID ResetGain(LPGAIN);
+
+/* amplify, level and limit slin samples in place */
+extern VOID ProcessGain(LPGAIN, SHORT *, DWORD);
+
+/* scale generated slin samples in place by the volume alone, leaving the agc
+   and limiter state to the call's audio */
+extern VOID ApplyVolume(LPGAIN, SHORT *, DWORD);
+
+/* write the gain statistics */
+extern VOID DumpGain(LPGAIN, LPMETRICS);
+
+/* release the gain stage */
+extern VOID FreeGain(LPGAIN);
+
+#endif
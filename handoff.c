@@ -0,0 +1,92 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "handoff.h"
+#include "realtime.h"
+
+/* about 5s of 20ms voice frames */
+#define ITEMS 256
+
+struct tagHANDOFF
+{
+	WSAEVENT Event;
+
+	/* the head is only written by the producer, the tail only by the consumer */
+	volatile LONG Head;
+	volatile LONG Tail;
+	HANDOFFITEM Items[ITEMS];
+};
+
+/* create an empty handoff queue that signals the event when it stops being empty */
+LPHANDOFF CreateHandoff(LPSETTINGS settings, WSAEVENT event)
+{
+	LPHANDOFF handoff;
+
+	ALLOC(handoff);
+	handoff->Event = event;
+	LockRealtimeMemory(settings, handoff, sizeof(*handoff));
+	return handoff;
+}
+
+/* append an item (producer only), fails if the queue is full */
+BOOL PushHandoff(LPHANDOFF handoff, INT kind, struct iax_event *event)
+{
+	LONG head = handoff->Head;
+	LONG next = (head + 1) % ITEMS;
+
+	if (next == handoff->Tail)
+		return FALSE;
+
+	/* fill the item and publish it */
+	handoff->Items[head].Kind = kind;
+	handoff->Items[head].Event = event;
+	handoff->Items[head].Pushed = iax_monotonic_us();
+	MemoryBarrier();
+	handoff->Head = next;
+
+	/* only wake the consumer if it may have seen an empty queue, the barrier
+	   orders the head store before the tail load (the consumer does the opposite) */
+	MemoryBarrier();
+	if (handoff->Tail == head)
+		WSASetEvent(handoff->Event);
+	return TRUE;
+}
+
+/* remove the oldest item (consumer only, reset the event before draining), fails if the queue is empty */
+BOOL PopHandoff(LPHANDOFF handoff, LPHANDOFFITEM item)
+{
+	LONG tail = handoff->Tail;
+
+	/* order the last tail store before the head load */
+	MemoryBarrier();
+	if (tail == handoff->Head)
+		return FALSE;
+
+	/* read the item after the head and hand the slot back */
+	MemoryBarrier();
+	*item = handoff->Items[tail];
+	MemoryBarrier();
+	handoff->Tail = (tail + 1) % ITEMS;
+	return TRUE;
+}
+
+/* release the queue, remaining items must have been popped */
+VOID FreeHandoff(LPHANDOFF handoff)
+{
+	FREE(handoff);
+}
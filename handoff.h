@@ -0,0 +1,46 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+/* kinds of items handed from the network to the playout thread */
+#define HANDOFF_START   0 /* a call was answered */
+#define HANDOFF_STOP    1 /* the call ended */
+#define HANDOFF_VOICE   2 /* voice event in host byte order */
+#define HANDOFF_CNG     3 /* comfort noise event */
+#define HANDOFF_METRICS 4 /* the metrics were requested */
+
+/* a single handed over item, the event (if any) belongs to the receiver */
+typedef struct tagHANDOFFITEM
+{
+	INT Kind;
+	struct iax_event *Event;
+	ULONGLONG Pushed;
+} HANDOFFITEM, *LPHANDOFFITEM;
+
+/* transparent handoff structure */
+typedef struct tagHANDOFF HANDOFF, *LPHANDOFF;
+
+/* create an empty handoff queue that signals the event when it stops being empty */
+extern LPHANDOFF CreateHandoff(LPSETTINGS, WSAEVENT);
+
+/* append an item (producer only), fails if the queue is full */
+extern BOOL PushHandoff(LPHANDOFF, INT, struct iax_event *);
+
+/* remove the oldest item (consumer only, reset the event before draining), fails if the queue is empty */
+extern BOOL PopHandoff(LPHANDOFF, LPHANDOFFITEM);
+
+/* release the queue, remaining items must have been popped */
+extern VOID FreeHandoff(LPHANDOFF);
+
+#endif
@@ -10,51 +10,483 @@
  * at the top of the source tree.
  */
 
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <tchar.h>
 #include "common.h"
 #include "host.h"
 
-/* structure for storing allowed/forbidden hosts */
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#define HOST_POPCNT
+#define HOST_POPCNT_TARGET
+#define HardwareCountBits(bits) ((DWORD)__popcnt64(bits))
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#define HOST_POPCNT
+#define HOST_POPCNT_TARGET __attribute__((target("popcnt")))
+#define HardwareCountBits(bits) ((DWORD)__builtin_popcountll(bits))
+#endif
+
+/* structure for storing allowed/forbidden hosts (address in network byte order) */
 struct tagHOST
 {
-	ULONG Address;
-	ULONG Network;
+	ADDRESS_FAMILY Family;
+	INT Length;
+	BYTE Address[16];
 	LPHOST Next;
 };
 
-/* checks if a given address is within a host list */
-BOOL ContainsHost(ULONG address, LPHOST hosts)
+/* flags of a table entry */
+#define ENTRY_ALLOWED   0x1
+#define ENTRY_FORBIDDEN 0x2
+#define ENTRY_TOKEN     0x4
+
+/* root nodes of both address families */
+#define ROOT_INET  0
+#define ROOT_INET6 1
+
+/* a quarter of a table node, 64 entries: a bit in Children means the entry
+   continues in a child node, a bit in Leaves starts a run of entries with
+   equal flags; the children and the run flags are stored consecutively, the
+   quarter's first ones at Child and Leaf, so a lookup finds them by counting
+   bits and touches a single cache line */
+typedef struct tagHOSTQUARTER
+{
+	ULONGLONG Children;
+	ULONGLONG Leaves;
+	DWORD Child;
+	DWORD Leaf;
+}
+HOSTQUARTER;
+
+/* node of a multibit trie with one address byte per level */
+typedef struct tagHOSTNODE
+{
+	HOSTQUARTER Quarters[4];
+}
+HOSTNODE, *LPHOSTNODE;
+
+/* prefixes are pushed down to the leaves, which are then run-length encoded */
+struct tagHOSTTABLE
+{
+	LPHOSTNODE Nodes;
+	DWORD NodeCount;
+	DWORD NodeCapacity;
+	LPBYTE Leaves;
+	DWORD LeafCount;
+	DWORD LeafCapacity;
+	BOOL Restricted;
+	BOOL Popcount;
+};
+
+/* a prefix and the list it came from, while the table is built */
+typedef struct tagHOSTPREFIX
+{
+	LPHOST Host;
+	BYTE Flag;
+}
+HOSTPREFIX, *LPHOSTPREFIX;
+
+/* parses the textual form of an IPv6 address (without embedded IPv4 part) */
+static BOOL ParseAddress6(LPCTSTR text, LPBYTE address)
 {
-	while (hosts != NULL)
+	WORD groups[8];
+	INT count = 0, gap = -1, digits, slot, i;
+	DWORD value;
+
+	if (text[0] == _T(':') && text[1] == _T(':'))
 	{
-		if ((address & hosts->Network) == hosts->Address)
-			return TRUE;
-		hosts = hosts->Next;
+		gap = 0;
+		text += 2;
 	}
-	return FALSE;
+	while (*text != _T('\0'))
+	{
+		for (value = 0, digits = 0; _istxdigit(*text) && digits <= 4; text++, digits++)
+			value = (value << 4) | (_istdigit(*text) ? *text - _T('0') : _totlower(*text) - _T('a') + 10);
+		if (digits == 0 || digits > 4 || count == 8)
+			return FALSE;
+		groups[count++] = (WORD)value;
+		if (*text == _T('\0'))
+			break;
+		if (*text++ != _T(':'))
+			return FALSE;
+		if (*text == _T(':'))
+		{
+			/* only one zero compression is allowed */
+			if (gap >= 0)
+				return FALSE;
+			gap = count;
+			text++;
+		}
+		else if (*text == _T('\0'))
+			return FALSE;
+	}
+	if (gap < 0 ? count != 8 : count > 7)
+		return FALSE;
+
+	/* expand the groups around the compressed zeros */
+	ZeroMemory(address, 16);
+	for (i = 0; i < count; i++)
+	{
+		slot = gap < 0 || i < gap ? i : 8 - count + i;
+		address[slot * 2] = HIBYTE(groups[i]);
+		address[slot * 2 + 1] = LOBYTE(groups[i]);
+	}
+	return TRUE;
 }
 
 /* function to parse an allowed/forbidden host */
 BOOL AppendHost(LPTSTR subnet, LPHOST *hosts)
 {
-	INT b1, b2, b3, b4, net;
+	INT b1, b2, b3, b4, net, max, i;
+	BYTE address[16];
+	LPTSTR slash;
+	BOOL valid;
 	LPHOST host;
 
-	if (_stscanf(subnet, _T("%d.%d.%d.%d/%d"), &b1, &b2, &b3, &b4, &net) != 5 || b1 < 0 || b1 > 0xFF || b2 < 0 || b2 > 0xFF || b3 < 0 || b3 > 0xFF || b4 < 0 || b4 > 0xFF || net < 0 || net > 32)
+	if (_tcschr(subnet, _T(':')) != NULL)
 	{
-		SetLastError(E_INVALIDARG);
-		return FALSE;
+		/* IPv6 prefix, split at the slash for the address parser */
+		slash = _tcschr(subnet, _T('/'));
+		if (slash == NULL || _stscanf(slash + 1, _T("%d"), &net) != 1 || net < 0 || net > 128)
+		{
+			SetLastError(E_INVALIDARG);
+			return FALSE;
+		}
+		*slash = _T('\0');
+		valid = ParseAddress6(subnet, address);
+		*slash = _T('/');
+		if (!valid)
+		{
+			SetLastError(E_INVALIDARG);
+			return FALSE;
+		}
+		max = 128;
+	}
+	else
+	{
+		if (_stscanf(subnet, _T("%d.%d.%d.%d/%d"), &b1, &b2, &b3, &b4, &net) != 5 || b1 < 0 || b1 > 0xFF || b2 < 0 || b2 > 0xFF || b3 < 0 || b3 > 0xFF || b4 < 0 || b4 > 0xFF || net < 0 || net > 32)
+		{
+			SetLastError(E_INVALIDARG);
+			return FALSE;
+		}
+		ZeroMemory(address, sizeof(address));
+		address[0] = (BYTE)b1;
+		address[1] = (BYTE)b2;
+		address[2] = (BYTE)b3;
+		address[3] = (BYTE)b4;
+		max = 32;
 	}
+
+	/* clear the host bits, this also covers a zero-length prefix */
+	for (i = 0; i < 16; i++)
+		address[i] &= net >= (i + 1) * 8 ? 0xFF : net > i * 8 ? (BYTE)(0xFF << ((i + 1) * 8 - net)) : 0x00;
+
 	ALLOC(host);
-	host->Address = htonl((b1 << 24) | (b2 << 16) | (b3 << 8) | b4);
-	host->Network = htonl(0xFFFFFFFF << (32 - net));
+	host->Family = max == 128 ? AF_INET6 : AF_INET;
+	host->Length = net;
+	CopyMemory(host->Address, address, 16);
 	host->Next = *hosts;
 	*hosts = host;
 	return TRUE;
 }
 
+/* parses every line of a file as allowed/forbidden host, skipping blank lines and comments */
+BOOL AppendHostFile(LPTSTR fileName, LPHOST *hosts)
+{
+	TCHAR line[128];
+	LPTSTR start, end;
+	FILE *file;
+	BOOL result = TRUE;
+
+	if ((file = _tfopen(fileName, _T("r"))) == NULL)
+		return FALSE;
+	while (result && _fgetts(line, sizeof(line) / sizeof(TCHAR), file) != NULL)
+	{
+		/* cut off comments and the surrounding white space */
+		if ((end = _tcschr(line, _T('#'))) != NULL)
+			*end = _T('\0');
+		for (start = line; _istspace(*start); start++);
+		for (end = start + _tcslen(start); end > start && _istspace(end[-1]); end--);
+		*end = _T('\0');
+		if (*start != _T('\0'))
+			result = AppendHost(start, hosts);
+	}
+	fclose(file);
+	return result;
+}
+
+/* counts the set bits where the processor has no instruction for it */
+static DWORD CountBits(ULONGLONG bits)
+{
+	bits -= (bits >> 1) & 0x5555555555555555ULL;
+	bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+	bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (DWORD)((bits * 0x0101010101010101ULL) >> 56);
+}
+
+/* tells whether the processor counts bits in a single instruction */
+static BOOL HasPopcount()
+{
+#if defined(HOST_POPCNT) && defined(_MSC_VER) && defined(_M_X64)
+	INT info[4];
+
+	__cpuid(info, 1);
+	return (info[2] >> 23) & 1;
+#elif defined(HOST_POPCNT)
+	UINT a, b, c, d;
+
+	return __get_cpuid(1, &a, &b, &c, &d) ? (c >> 23) & 1 : FALSE;
+#else
+	return FALSE;
+#endif
+}
+
+/* orders prefixes by family and address, so those below an entry are adjacent */
+static int ComparePrefixes(CONST VOID *a, CONST VOID *b)
+{
+	LPHOST x = ((CONST HOSTPREFIX *)a)->Host;
+	LPHOST y = ((CONST HOSTPREFIX *)b)->Host;
+
+	if (x->Family != y->Family)
+		return x->Family < y->Family ? -1 : 1;
+	return memcmp(x->Address, y->Address, sizeof(x->Address));
+}
+
+/* reserves consecutive nodes */
+static DWORD NewNodes(LPHOSTTABLE table, DWORD count)
+{
+	while (table->NodeCount + count > table->NodeCapacity)
+	{
+		table->NodeCapacity *= 2;
+		table->Nodes = HeapReAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, table->Nodes, table->NodeCapacity * sizeof(*table->Nodes));
+	}
+	table->NodeCount += count;
+	return table->NodeCount - count;
+}
+
+/* appends the flags of a run */
+static VOID NewLeaf(LPHOSTTABLE table, BYTE flags)
+{
+	if (table->LeafCount == table->LeafCapacity)
+	{
+		table->LeafCapacity *= 2;
+		table->Leaves = HeapReAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, table->Leaves, table->LeafCapacity);
+	}
+	table->Leaves[table->LeafCount++] = flags;
+}
+
+/* builds a node from the sorted prefixes that reach below depth bytes, flags are inherited from above */
+static VOID BuildNode(LPHOSTTABLE table, DWORD node, LPHOSTPREFIX prefixes, INT count, INT depth, BYTE flags)
+{
+	BYTE entries[256];
+	HOSTNODE result;
+	LPHOST host;
+	DWORD child;
+	INT index, span, first, last, i;
+
+	/* expand the prefixes ending at this level into whole entries */
+	FillMemory(entries, sizeof(entries), flags);
+	for (i = 0; i < count; i++)
+	{
+		host = prefixes[i].Host;
+		if (host->Length <= depth * 8 || host->Length > (depth + 1) * 8)
+			continue;
+		span = 1 << ((depth + 1) * 8 - host->Length);
+		for (index = host->Address[depth]; span > 0; index++, span--)
+			entries[index] |= prefixes[i].Flag;
+	}
+
+	/* an entry needs a child only if a longer prefix adds a flag to it */
+	ZERO(&result);
+	for (i = 0; i < count; i++)
+	{
+		host = prefixes[i].Host;
+		index = host->Address[depth];
+		if (host->Length > (depth + 1) * 8 && (prefixes[i].Flag & ~entries[index]) != 0)
+			result.Quarters[index >> 6].Children |= (ULONGLONG)1 << (index & 63);
+	}
+
+	/* run-length encode the other entries and place the children */
+	child = NewNodes(table, CountBits(result.Quarters[0].Children) + CountBits(result.Quarters[1].Children) + CountBits(result.Quarters[2].Children) + CountBits(result.Quarters[3].Children));
+	for (index = 0, last = -1; index < 256; index++)
+	{
+		if ((index & 63) == 0)
+		{
+			result.Quarters[index >> 6].Child = child;
+			result.Quarters[index >> 6].Leaf = table->LeafCount;
+		}
+		if (result.Quarters[index >> 6].Children & ((ULONGLONG)1 << (index & 63)))
+			child++;
+		else if (entries[index] != last)
+		{
+			result.Quarters[index >> 6].Leaves |= (ULONGLONG)1 << (index & 63);
+			NewLeaf(table, entries[index]);
+			last = entries[index];
+		}
+	}
+	table->Nodes[node] = result;
+
+	/* build the children from the prefixes below their entries */
+	child = result.Quarters[0].Child;
+	for (first = 0; first < count; first = last)
+	{
+		index = prefixes[first].Host->Address[depth];
+		for (last = first + 1; last < count && prefixes[last].Host->Address[depth] == index; last++);
+		if (result.Quarters[index >> 6].Children & ((ULONGLONG)1 << (index & 63)))
+			BuildNode(table, child++, prefixes + first, last - first, depth + 1, entries[index]);
+	}
+}
+
+/* builds the root node of a family */
+static VOID BuildRoot(LPHOSTTABLE table, DWORD node, LPHOSTPREFIX prefixes, INT count)
+{
+	BYTE flags = 0;
+	INT i;
+
+	/* zero-length prefixes cover the whole family */
+	for (i = 0; i < count; i++)
+		if (prefixes[i].Host->Length == 0)
+			flags |= prefixes[i].Flag;
+	BuildNode(table, node, prefixes, count, 0, flags);
+}
+
+/* collects the prefixes of a list */
+static VOID CollectHosts(LPHOSTPREFIX prefixes, INT *count, LPHOST host, BYTE flag)
+{
+	for (; host != NULL; host = host->Next)
+	{
+		prefixes[*count].Host = host;
+		prefixes[(*count)++].Flag = flag;
+	}
+}
+
+/* counts the prefixes of a list */
+static INT CountHosts(LPHOST host)
+{
+	INT count;
+
+	for (count = 0; host != NULL; host = host->Next)
+		count++;
+	return count;
+}
+
+/* builds the lookup table from the allowed, forbidden and call token hosts */
+LPHOSTTABLE CompileHosts(LPHOST allowed, LPHOST forbidden, LPHOST token)
+{
+	LPHOSTTABLE table;
+	LPHOSTPREFIX prefixes;
+	INT count = 0, inet;
+
+	if (allowed == NULL && forbidden == NULL && token == NULL)
+		return NULL;
+	prefixes = HeapAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, (CountHosts(allowed) + CountHosts(forbidden) + CountHosts(token)) * sizeof(*prefixes));
+	CollectHosts(prefixes, &count, allowed, ENTRY_ALLOWED);
+	CollectHosts(prefixes, &count, forbidden, ENTRY_FORBIDDEN);
+	CollectHosts(prefixes, &count, token, ENTRY_TOKEN);
+	qsort(prefixes, count, sizeof(*prefixes), ComparePrefixes);
+	for (inet = 0; inet < count && prefixes[inet].Host->Family == AF_INET; inet++);
+
+	ALLOC(table);
+	table->NodeCapacity = 16;
+	table->Nodes = HeapAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, table->NodeCapacity * sizeof(*table->Nodes));
+	table->LeafCapacity = 64;
+	table->Leaves = HeapAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, table->LeafCapacity);
+	table->Restricted = allowed != NULL;
+	table->Popcount = HasPopcount();
+	NewNodes(table, 2);
+	BuildRoot(table, ROOT_INET, prefixes, inet);
+	BuildRoot(table, ROOT_INET6, prefixes + inet, count - inet);
+	FREE(prefixes);
+
+	/* give back what the doubling left over */
+	table->Nodes = HeapReAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, table->Nodes, table->NodeCount * sizeof(*table->Nodes));
+	table->Leaves = HeapReAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, table->Leaves, table->LeafCount);
+	return table;
+}
+
+/* walks down to the flags of the entry an address falls into */
+static BYTE WalkTable(LPHOSTTABLE table, DWORD node, CONST BYTE *bytes)
+{
+	CONST HOSTQUARTER *quarter;
+	ULONGLONG bit;
+
+	for (;;)
+	{
+		quarter = &table->Nodes[node].Quarters[*bytes >> 6];
+		bit = (ULONGLONG)1 << (*bytes++ & 63);
+		if (!(quarter->Children & bit))
+			return table->Leaves[quarter->Leaf + CountBits(quarter->Leaves & (bit | (bit - 1))) - 1];
+		node = quarter->Child + CountBits(quarter->Children & (bit - 1));
+	}
+}
+
+#ifdef HOST_POPCNT
+/* the same walk counting bits with the processor's instruction */
+static HOST_POPCNT_TARGET BYTE WalkTablePopcount(LPHOSTTABLE table, DWORD node, CONST BYTE *bytes)
+{
+	CONST HOSTQUARTER *quarter;
+	ULONGLONG bit;
+
+	for (;;)
+	{
+		quarter = &table->Nodes[node].Quarters[*bytes >> 6];
+		bit = (ULONGLONG)1 << (*bytes++ & 63);
+		if (!(quarter->Children & bit))
+			return table->Leaves[quarter->Leaf + HardwareCountBits(quarter->Leaves & (bit | (bit - 1))) - 1];
+		node = quarter->Child + HardwareCountBits(quarter->Children & (bit - 1));
+	}
+}
+#endif
+
+/* checks an address against all host lists in a single walk */
+DWORD LookupHost(LPHOSTTABLE table, CONST SOCKADDR *address)
+{
+	CONST BYTE *bytes;
+	DWORD node;
+	BYTE entry;
+
+	if (table == NULL)
+		return HOST_ACCEPTED;
+	if (address->sa_family == AF_INET6)
+	{
+		bytes = (CONST BYTE *)&((CONST SOCKADDR_IN6 *)address)->sin6_addr;
+		node = ROOT_INET6;
+	}
+	else
+	{
+		bytes = (CONST BYTE *)&((CONST SOCKADDR_IN *)address)->sin_addr;
+		node = ROOT_INET;
+	}
+#ifdef HOST_POPCNT
+	if (table->Popcount)
+		entry = WalkTablePopcount(table, node, bytes);
+	else
+#endif
+		entry = WalkTable(table, node, bytes);
+	if (entry & ENTRY_FORBIDDEN)
+		return HOST_FORBIDDEN;
+	if (table->Restricted && !(entry & ENTRY_ALLOWED))
+		return HOST_NOT_ALLOWED;
+	if (entry & ENTRY_TOKEN)
+		return HOST_TOKEN;
+	return HOST_ACCEPTED;
+}
+
+/* release the lookup table */
+VOID FreeHostTable(LPHOSTTABLE table)
+{
+	if (table == NULL)
+		return;
+	FREE(table->Nodes);
+	FREE(table->Leaves);
+	FREE(table);
+}
+
 /* release all host memory */
 VOID RemoveAllHosts(LPHOST *hosts)
 {
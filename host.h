@@ -13,15 +13,31 @@
 #ifndef _HOST_H
 #define _HOST_H
 
-/* transparent host structure */
+/* transparent host list and lookup table structures */
 typedef struct tagHOST HOST, *LPHOST;
+typedef struct tagHOSTTABLE HOSTTABLE, *LPHOSTTABLE;
 
-/* checks if a given address is within a host list */
-extern BOOL ContainsHost(ULONG, LPHOST);
+/* results of a host lookup */
+#define HOST_ACCEPTED    0
+#define HOST_FORBIDDEN   1
+#define HOST_NOT_ALLOWED 2
+#define HOST_TOKEN       3 /* accepted, but only after a call token exchange */
 
 /* function to parse an allowed/forbidden host */
 extern BOOL AppendHost(LPTSTR, LPHOST *);
 
+/* parses every line of a file as allowed/forbidden host, skipping blank lines and comments */
+extern BOOL AppendHostFile(LPTSTR, LPHOST *);
+
+/* builds the lookup table from the allowed, forbidden and call token hosts (NULL if all are empty) */
+extern LPHOSTTABLE CompileHosts(LPHOST, LPHOST, LPHOST);
+
+/* checks an address against all host lists in a single walk */
+extern DWORD LookupHost(LPHOSTTABLE, CONST SOCKADDR *);
+
+/* release the lookup table */
+extern VOID FreeHostTable(LPHOSTTABLE);
+
 /* release all host memory */
 extern VOID RemoveAllHosts(LPHOST *);
 
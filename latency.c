@@ -0,0 +1,172 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "latency.h"
+
+/* samples below 16us are exact, above that each power of two is split into
+   eight buckets (about 12% precision) up to 2^34us */
+#define LINEAR_BUCKETS 16
+#define SUB_BUCKETS    8
+#define HIGHEST_BIT    33
+#define BUCKETS        ((HIGHEST_BIT - 1) * SUB_BUCKETS)
+
+/* a single HDR-style histogram */
+typedef struct tagHISTOGRAM
+{
+	volatile LONG Buckets[BUCKETS];
+	volatile LONG Count;
+	volatile LONGLONG Sum;
+	volatile LONGLONG Max;
+} HISTOGRAM, *LPHISTOGRAM;
+
+struct tagLATENCY
+{
+	HISTOGRAM Stages[LATENCY_MAX];
+};
+
+/* names used when dumping the stages */
+static CONST LPCSTR StageNames[LATENCY_MAX] = {"jitter", "schedule", "output", "total", "handoff", "wakeup"};
+
+/* find the bucket of a sample */
+static INT BucketOf(ULONGLONG micros)
+{
+	INT bit;
+
+	if (micros < LINEAR_BUCKETS)
+		return (INT)micros;
+	if ((micros >> (HIGHEST_BIT + 1)) != 0)
+		return BUCKETS - 1;
+	for (bit = HIGHEST_BIT; (micros >> bit) == 0; bit--);
+	return (bit - 2) * SUB_BUCKETS + (INT)((micros >> (bit - 3)) & (SUB_BUCKETS - 1));
+}
+
+/* return the highest sample that falls into a bucket */
+static ULONGLONG BucketLimit(INT bucket)
+{
+	INT bit;
+
+	if (bucket < LINEAR_BUCKETS)
+		return bucket;
+	bit = bucket / SUB_BUCKETS + 2;
+	return ((ULONGLONG)(SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << (bit - 3)) - 1;
+}
+
+/* return the sample below which the given permille of all samples lie */
+static ULONGLONG Percentile(LPHISTOGRAM histogram, LONG count, INT permille)
+{
+	LONG seen = 0;
+	LONG rank;
+	INT i;
+
+	rank = (LONG)(((LONGLONG)count * permille + 999) / 1000);
+	for (i = 0; i < BUCKETS; i++)
+	{
+		seen += histogram->Buckets[i];
+		if (seen >= rank)
+			return BucketLimit(i);
+	}
+	return BucketLimit(BUCKETS - 1);
+}
+
+/* create an empty set of latency histograms */
+LPLATENCY CreateLatency()
+{
+	LPLATENCY latency;
+
+	ALLOC(latency);
+	return latency;
+}
+
+/* add a sample in microseconds to a stage, safe to call from any thread */
+VOID RecordLatency(LPLATENCY latency, INT stage, ULONGLONG micros)
+{
+	LPHISTOGRAM histogram = &latency->Stages[stage];
+	LONGLONG max;
+
+	InterlockedIncrement(&histogram->Buckets[BucketOf(micros)]);
+	InterlockedIncrement(&histogram->Count);
+	InterlockedExchangeAdd64(&histogram->Sum, (LONGLONG)micros);
+	while ((LONGLONG)micros > (max = histogram->Max) && InterlockedCompareExchange64(&histogram->Max, (LONGLONG)micros, max) != max);
+}
+
+/* record all stages of a completed voice frame from its timestamps */
+VOID RecordFrameLatency(LPLATENCY latency, ULONGLONG received, ULONGLONG released, ULONGLONG submitted, ULONGLONG completed)
+{
+#define RECORD(stage, from, to) { if ((from) != 0 && (to) >= (from)) RecordLatency(latency, (stage), (to) - (from)); }
+	RECORD(LATENCY_JITTER, received, released);
+	RECORD(LATENCY_SCHEDULE, released, submitted);
+	RECORD(LATENCY_OUTPUT, submitted, completed);
+	RECORD(LATENCY_TOTAL, received, completed);
+#undef RECORD
+}
+
+/* clear all histograms, samples may be recorded concurrently */
+VOID ResetLatency(LPLATENCY latency)
+{
+	LPHISTOGRAM histogram;
+	INT i, j;
+
+	for (i = 0; i < LATENCY_MAX; i++)
+	{
+		histogram = &latency->Stages[i];
+		/* samples bump their bucket before the count, so a sample caught in between
+		   can't make the count exceed the buckets and skew the percentiles upwards */
+		for (j = 0; j < BUCKETS; j++)
+			InterlockedExchange(&histogram->Buckets[j], 0);
+		InterlockedExchange(&histogram->Count, 0);
+		InterlockedExchange64(&histogram->Sum, 0);
+		InterlockedExchange64(&histogram->Max, 0);
+	}
+}
+
+/* write the percentiles of all stages */
+VOID DumpLatency(LPLATENCY latency, LPMETRICS metrics)
+{
+	LPHISTOGRAM histogram;
+	LONG count;
+	INT i;
+
+	PrintMetrics(metrics, "%-10s %10s %10s %10s %10s %10s %10s %10s\n", "stage[us]", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < LATENCY_MAX; i++)
+	{
+		histogram = &latency->Stages[i];
+		if ((count = histogram->Count) == 0)
+		{
+			PrintMetrics(metrics, "%-10s %10d\n", StageNames[i], 0);
+			continue;
+		}
+		PrintMetrics
+		(
+			metrics, "%-10s %10ld %10lu %10lu %10lu %10lu %10lu %10lu\n", StageNames[i], count,
+			(ULONG)(histogram->Sum / count),
+			(ULONG)Percentile(histogram, count, 500),
+			(ULONG)Percentile(histogram, count, 900),
+			(ULONG)Percentile(histogram, count, 990),
+			(ULONG)Percentile(histogram, count, 999),
+			(ULONG)histogram->Max
+		);
+	}
+}
+
+/* release the histograms */
+VOID FreeLatency(LPLATENCY latency)
+{
+	FREE(latency);
+}
@@ -0,0 +1,46 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+/* measured stages of a voice frame */
+#define LATENCY_JITTER   0 /* datagram arrival to jitterbuffer release */
+#define LATENCY_SCHEDULE 1 /* jitterbuffer release to output submission */
+#define LATENCY_OUTPUT   2 /* output submission to playback completion */
+#define LATENCY_TOTAL    3 /* datagram arrival to playback completion */
+#define LATENCY_HANDOFF  4 /* network thread to playout thread (threaded mode) */
+#define LATENCY_WAKEUP   5 /* scheduled to actual wakeup of the service loop */
+#define LATENCY_MAX      6
+
+/* transparent latency structure */
+typedef struct tagLATENCY LATENCY, *LPLATENCY;
+
+/* create an empty set of latency histograms */
+extern LPLATENCY CreateLatency();
+
+/* add a sample in microseconds to a stage, safe to call from any thread */
+extern VOID RecordLatency(LPLATENCY, INT, ULONGLONG);
+
+/* record all stages of a completed voice frame from its timestamps */
+extern VOID RecordFrameLatency(LPLATENCY, ULONGLONG, ULONGLONG, ULONGLONG, ULONGLONG);
+
+/* clear all histograms, safe while other threads record samples */
+extern VOID ResetLatency(LPLATENCY);
+
+/* write the percentiles of all stages */
+extern VOID DumpLatency(LPLATENCY, LPMETRICS);
+
+/* release the histograms */
+extern VOID FreeLatency(LPLATENCY);
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * AES-128 (FIPS-197) in CBC mode for IAX2 encryption.
+ *
+ * Processors with AES-NI do a round in a single instruction.  Elsewhere the
+ * S-box is computed instead of looked up: the GF(2^8) inverse as x^254 with
+ * eight bytes packed into a 64 bit word, so neither the timing nor the cache
+ * footprint depends on the key or the data.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU Lesser (Library) General Public License
+ */
+
+#include <string.h>
+
+#include "aes.h"
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#include <wmmintrin.h>
+#define AES_NI
+#define AES_NI_TARGET
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#include <wmmintrin.h>
+#define AES_NI
+#define AES_NI_TARGET __attribute__((target("aes,sse2")))
+#endif
+
+typedef unsigned long long u64;
+
+/* the same byte in every lane */
+#define LANES(b) (0x0101010101010101ULL * (b))
+
+static const unsigned char rcon[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+
+/* -1 until the processor was asked */
+static int hardware = -1;
+
+int aes_hardware(void)
+{
+#ifdef AES_NI
+	if (hardware < 0) {
+#ifdef _MSC_VER
+		int info[4];
+
+		__cpuid(info, 1);
+		hardware = (info[2] >> 25) & 1;
+#else
+		unsigned int a, b, c, d;
+
+		hardware = __get_cpuid(1, &a, &b, &c, &d) ? (c >> 25) & 1 : 0;
+#endif
+	}
+	return hardware;
+#else
+	return 0;
+#endif
+}
+
+/* GF(2^8) product of each pair of lanes */
+static u64 gf_mul(u64 a, u64 b)
+{
+	u64 r = 0;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		r ^= a & (((b >> i) & LANES(1)) * 0xff);
+		a = ((a & LANES(0x7f)) << 1) ^ (((a >> 7) & LANES(1)) * 0x1b);
+	}
+	return r;
+}
+
+/* GF(2^8) inverse of each lane as x^254, 0 stays 0 */
+static u64 gf_inv(u64 x)
+{
+	u64 x2, x3, x12, x15, x240;
+
+	x2 = gf_mul(x, x);
+	x3 = gf_mul(x2, x);
+	x12 = gf_mul(x3, x3);
+	x12 = gf_mul(x12, x12);
+	x15 = gf_mul(x12, x3);
+	x240 = gf_mul(x15, x15);
+	x240 = gf_mul(x240, x240);
+	x240 = gf_mul(x240, x240);
+	x240 = gf_mul(x240, x240);
+	return gf_mul(gf_mul(x240, x12), x2);
+}
+
+/* rotate each lane left */
+static u64 rotb(u64 x, int k)
+{
+	u64 high = LANES((0xff << k) & 0xff);
+
+	return ((x << k) & high) | ((x >> (8 - k)) & ~high);
+}
+
+static u64 sub_lanes(u64 x)
+{
+	x = gf_inv(x);
+	return x ^ rotb(x, 1) ^ rotb(x, 2) ^ rotb(x, 3) ^ rotb(x, 4) ^ LANES(0x63);
+}
+
+static u64 inv_sub_lanes(u64 x)
+{
+	return gf_inv(rotb(x, 1) ^ rotb(x, 3) ^ rotb(x, 6) ^ LANES(0x05));
+}
+
+static void sub_bytes(unsigned char *s, int inverse)
+{
+	u64 lanes[2];
+
+	memcpy(lanes, s, 16);
+	lanes[0] = inverse ? inv_sub_lanes(lanes[0]) : sub_lanes(lanes[0]);
+	lanes[1] = inverse ? inv_sub_lanes(lanes[1]) : sub_lanes(lanes[1]);
+	memcpy(s, lanes, 16);
+}
+
+/* the state is column major, row r is shifted left by r (right when inverse) */
+static void shift_rows(unsigned char *s, int inverse)
+{
+	unsigned char t[16];
+	int r, c;
+
+	for (c = 0; c < 4; c++)
+		for (r = 0; r < 4; r++)
+			t[r + 4 * c] = s[r + 4 * ((c + (inverse ? 4 - r : r)) & 3)];
+	memcpy(s, t, 16);
+}
+
+static unsigned char xtime(unsigned char x)
+{
+	return (unsigned char)((x << 1) ^ (((x >> 7) & 1) * 0x1b));
+}
+
+static void mix_columns(unsigned char *s)
+{
+	unsigned char a0, a1, a2, a3, all;
+	int c;
+
+	for (c = 0; c < 16; c += 4) {
+		a0 = s[c]; a1 = s[c + 1]; a2 = s[c + 2]; a3 = s[c + 3];
+		all = a0 ^ a1 ^ a2 ^ a3;
+		s[c] ^= all ^ xtime(a0 ^ a1);
+		s[c + 1] ^= all ^ xtime(a1 ^ a2);
+		s[c + 2] ^= all ^ xtime(a2 ^ a3);
+		s[c + 3] ^= all ^ xtime(a3 ^ a0);
+	}
+}
+
+/* InvMixColumns is MixColumns after multiplying with 4x^2+5 */
+static void inv_mix_columns(unsigned char *s)
+{
+	unsigned char u, v;
+	int c;
+
+	for (c = 0; c < 16; c += 4) {
+		u = xtime(xtime(s[c] ^ s[c + 2]));
+		v = xtime(xtime(s[c + 1] ^ s[c + 3]));
+		s[c] ^= u; s[c + 1] ^= v; s[c + 2] ^= u; s[c + 3] ^= v;
+	}
+	mix_columns(s);
+}
+
+static void add_round_key(unsigned char *s, const unsigned char *k)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		s[i] ^= k[i];
+}
+
+static void soft_set_key(struct aes_key *key, const unsigned char *secret)
+{
+	unsigned char *w = key->ek[0];
+	u64 word;
+	int i;
+
+	memcpy(w, secret, 16);
+	for (i = 16; i < 176; i += 4) {
+		word = w[i - 4] | (w[i - 3] << 8) | (w[i - 2] << 16) | ((u64)w[i - 1] << 24);
+		if (i % 16 == 0) {
+			/* RotWord, SubWord and the round constant */
+			word = sub_lanes((word >> 8) | ((word & 0xff) << 24));
+			word ^= rcon[i / 16 - 1];
+		}
+		w[i] = w[i - 16] ^ (unsigned char)word;
+		w[i + 1] = w[i - 15] ^ (unsigned char)(word >> 8);
+		w[i + 2] = w[i - 14] ^ (unsigned char)(word >> 16);
+		w[i + 3] = w[i - 13] ^ (unsigned char)(word >> 24);
+	}
+}
+
+static void soft_encrypt(const struct aes_key *key, unsigned char *s)
+{
+	int round;
+
+	add_round_key(s, key->ek[0]);
+	for (round = 1; round < 10; round++) {
+		sub_bytes(s, 0);
+		shift_rows(s, 0);
+		mix_columns(s);
+		add_round_key(s, key->ek[round]);
+	}
+	sub_bytes(s, 0);
+	shift_rows(s, 0);
+	add_round_key(s, key->ek[10]);
+}
+
+static void soft_decrypt(const struct aes_key *key, unsigned char *s)
+{
+	int round;
+
+	add_round_key(s, key->ek[10]);
+	for (round = 9; round > 0; round--) {
+		shift_rows(s, 1);
+		sub_bytes(s, 1);
+		add_round_key(s, key->ek[round]);
+		inv_mix_columns(s);
+	}
+	shift_rows(s, 1);
+	sub_bytes(s, 1);
+	add_round_key(s, key->ek[0]);
+}
+
+#ifdef AES_NI
+static AES_NI_TARGET __m128i ni_expand(__m128i k, __m128i assist)
+{
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, assist);
+}
+
+/* the round constant has to be an immediate */
+#define NI_ROUND(k, i, c) k[i] = ni_expand(k[i - 1], _mm_aeskeygenassist_si128(k[i - 1], c))
+
+static AES_NI_TARGET void ni_set_key(struct aes_key *key, const unsigned char *secret)
+{
+	__m128i k[11];
+	int i;
+
+	k[0] = _mm_loadu_si128((const __m128i *)secret);
+	NI_ROUND(k, 1, 0x01);
+	NI_ROUND(k, 2, 0x02);
+	NI_ROUND(k, 3, 0x04);
+	NI_ROUND(k, 4, 0x08);
+	NI_ROUND(k, 5, 0x10);
+	NI_ROUND(k, 6, 0x20);
+	NI_ROUND(k, 7, 0x40);
+	NI_ROUND(k, 8, 0x80);
+	NI_ROUND(k, 9, 0x1b);
+	NI_ROUND(k, 10, 0x36);
+	for (i = 0; i < 11; i++)
+		_mm_storeu_si128((__m128i *)key->ek[i], k[i]);
+	_mm_storeu_si128((__m128i *)key->dk[0], k[10]);
+	for (i = 1; i < 10; i++)
+		_mm_storeu_si128((__m128i *)key->dk[i], _mm_aesimc_si128(k[10 - i]));
+	_mm_storeu_si128((__m128i *)key->dk[10], k[0]);
+}
+
+static AES_NI_TARGET void ni_cbc_encrypt(const struct aes_key *key, unsigned char *buf, int len)
+{
+	__m128i k[11], b = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i < 11; i++)
+		k[i] = _mm_loadu_si128((const __m128i *)key->ek[i]);
+	for (; len >= 16; len -= 16, buf += 16) {
+		b = _mm_xor_si128(_mm_xor_si128(b, _mm_loadu_si128((const __m128i *)buf)), k[0]);
+		for (i = 1; i < 10; i++)
+			b = _mm_aesenc_si128(b, k[i]);
+		b = _mm_aesenclast_si128(b, k[10]);
+		_mm_storeu_si128((__m128i *)buf, b);
+	}
+}
+
+static AES_NI_TARGET void ni_cbc_decrypt(const struct aes_key *key, unsigned char *buf, int len)
+{
+	__m128i k[11], b, c, last = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i < 11; i++)
+		k[i] = _mm_loadu_si128((const __m128i *)key->dk[i]);
+	for (; len >= 16; len -= 16, buf += 16) {
+		c = _mm_loadu_si128((const __m128i *)buf);
+		b = _mm_xor_si128(c, k[0]);
+		for (i = 1; i < 10; i++)
+			b = _mm_aesdec_si128(b, k[i]);
+		b = _mm_aesdeclast_si128(b, k[10]);
+		_mm_storeu_si128((__m128i *)buf, _mm_xor_si128(b, last));
+		last = c;
+	}
+}
+#endif
+
+void aes_set_key(struct aes_key *key, const unsigned char secret[16])
+{
+	memset(key, 0, sizeof(*key));
+#ifdef AES_NI
+	if (aes_hardware()) {
+		ni_set_key(key, secret);
+		return;
+	}
+#endif
+	soft_set_key(key, secret);
+}
+
+void aes_cbc_encrypt(const struct aes_key *key, unsigned char *buf, int len)
+{
+	unsigned char *last;
+	int i;
+
+#ifdef AES_NI
+	if (aes_hardware()) {
+		ni_cbc_encrypt(key, buf, len);
+		return;
+	}
+#endif
+	for (last = NULL; len >= 16; last = buf, len -= 16, buf += 16) {
+		if (last)
+			for (i = 0; i < 16; i++)
+				buf[i] ^= last[i];
+		soft_encrypt(key, buf);
+	}
+}
+
+void aes_cbc_decrypt(const struct aes_key *key, unsigned char *buf, int len)
+{
+	unsigned char last[16], cipher[16];
+	int i;
+
+#ifdef AES_NI
+	if (aes_hardware()) {
+		ni_cbc_decrypt(key, buf, len);
+		return;
+	}
+#endif
+	memset(last, 0, sizeof(last));
+	for (; len >= 16; len -= 16, buf += 16) {
+		memcpy(cipher, buf, 16);
+		soft_decrypt(key, buf);
+		for (i = 0; i < 16; i++)
+			buf[i] ^= last[i];
+		memcpy(last, cipher, 16);
+	}
+}
@@ -0,0 +1,24 @@
+/*
+ * AES-128 for IAX2 encryption: AES-NI where the processor has it, otherwise
+ * a software cipher without any secret dependent table lookups or branches
+ */
+#ifndef AES_H
+#define AES_H
+
+struct aes_key {
+	/* round keys of the cipher and of the equivalent inverse cipher (AES-NI only) */
+	unsigned char ek[11][16];
+	unsigned char dk[11][16];
+};
+
+/* nonzero if the AES-NI instructions are used */
+int aes_hardware(void);
+
+/* expand a 128 bit key */
+void aes_set_key(struct aes_key *key, const unsigned char secret[16]);
+
+/* CBC with a zero IV in place, the length must be a multiple of 16 */
+void aes_cbc_encrypt(const struct aes_key *key, unsigned char *buf, int len);
+void aes_cbc_decrypt(const struct aes_key *key, unsigned char *buf, int len);
+
+#endif /* !AES_H */
@@ -35,6 +35,7 @@
 extern char iax_errstr[];
 
 struct iax_session;
+struct iax_context;
 
 
 #define IAX_EVENT_CONNECT       0      /* Connect a new call */
@@ -124,6 +125,9 @@ struct iax_event {
 	struct iax_session *session; /* Applicable session */
 	int datalen;                 /* Length of raw data */
 	struct iax_ies ies;          /* IE's for IAX2 frames */
+	unsigned long long rxstamp;  /* Monotonic usecs the datagram arrived (voice) */
+	unsigned long long jbstamp;  /* Monotonic usecs the jitterbuffer released it (voice) */
+	struct iax_context *ctx;     /* Stack the event belongs to */
 	unsigned char data[0];       /* Raw data if applicable */
 };
 
@@ -135,32 +139,109 @@ extern "C"
 /* All functions return 0 on success and -1 on failure unless otherwise
    specified */
 
+/* Every stack (socket, sessions, scheduler) lives in a context.  Threads
+   that never select one share a default context whose errors go to
+   iax_errstr.  A thread that selects its own context can run a second
+   stack next to the others without any locking, as long as all calls for
+   that stack's sessions happen on that thread.  The iax_context_ calls
+   below name the context explicitly, the plain calls use the selected
+   one.  Session calls always work on the session's own context.  Every
+   context binds a port of its own, peers pick the stack by the port they
+   send to. */
+
+/* Allocate an empty context, NULL if out of memory */
+extern struct iax_context *iax_context_new(void);
+
+/* Close the socket, destroy all sessions and release the context */
+extern void iax_context_free(struct iax_context *ctx);
+
+/* Run the calling thread on ctx (NULL for the default context) and return
+   the previous one */
+extern struct iax_context *iax_use_context(struct iax_context *ctx);
+
+/* Serve the next iax_init socket through io_uring on Linux.  With
+   IAX_IO_URING_RECV datagrams are received into kernel-selected buffers
+   without a system call per read.  IAX_IO_URING_SEND queues the sends
+   made while iax_get_event works on the ring, they are submitted together
+   once no datagram is left to read or before it blocks (sends of the
+   application itself go out at once); a send that fails after it was
+   queued shows up in iax_context_error.  IAX_IO_URING_SQPOLL adds a
+   kernel thread that takes all sends off the caller (and keeps a core
+   busy for it).  Datagrams longer than IAX_MAX_DATAGRAM are dropped on
+   the way in, so peers must not trunk beyond it.  The socket is used
+   directly if the kernel refuses, -1 where io_uring isn't supported at
+   all. */
+#define IAX_IO_URING_RECV	(1 << 0)
+#define IAX_IO_URING_SEND	(1 << 1)
+#define IAX_IO_URING_SQPOLL	(1 << 2)
+#define IAX_MAX_DATAGRAM	2048
+extern int iax_set_io_uring(int flags);
+extern int iax_context_set_io_uring(struct iax_context *ctx, int flags);
+
+/* What io_uring does for an initialized context, 0 if it is not used */
+extern int iax_context_io_uring(struct iax_context *ctx);
+
+/* Last error of a context, iax_errstr for the default one */
+extern const char *iax_context_error(struct iax_context *ctx);
+
 /* Shutdown the IAX port */
 extern int iax_shutdown();
+extern int iax_context_shutdown(struct iax_context *ctx);
 
 /* Called to initialize IAX structures and sockets.  Returns actual
    portnumber (which it will try preferred portno first, but if not
    take what it can get */
 extern int iax_init(int preferredportno);
+extern int iax_context_init(struct iax_context *ctx, int preferredportno);
 
 /* Get filedescriptor for IAX to use with select or gtk_input_add */
 extern int iax_get_fd(void);
+extern int iax_context_get_fd(struct iax_context *ctx);
 
 /* Find out how many milliseconds until the next scheduled event */
 extern int iax_time_to_next_event(void);
+extern int iax_context_time_to_next_event(struct iax_context *ctx);
+
+/* Find out how many microseconds until the next scheduled event or jitterbuffer
+   release, -1 if there is nothing to wait for */
+extern long long iax_time_to_next_event_us(void);
+extern long long iax_context_time_to_next_event_us(struct iax_context *ctx);
+
+/* Monotonic clock in microseconds, the base of the event timestamps */
+extern unsigned long long iax_monotonic_us(void);
 
 /* Generate a new IAX session */
 extern struct iax_session *iax_session_new(void);
+extern struct iax_session *iax_context_session_new(struct iax_context *ctx);
 
 /* Return exactly one iax event (if there is one pending).  If blocking is
    non-zero, IAX will block until some event is received */
 extern struct iax_event *iax_get_event(int blocking);
+extern struct iax_event *iax_context_get_event(struct iax_context *ctx, int blocking);
 
 
 extern int iax_auth_reply(struct iax_session *session, char *password,
 		char *challenge, int methods);
 
+/* Offer encryption (IAX_ENCRYPT_*) on an outgoing call, before iax_call.  It
+   starts with the AUTHREP if the callee asks for MD5 and encryption as well. */
+extern void iax_set_encryption(struct iax_session *session, int encmethods);
+
+/* Ask the caller of an IAX_EVENT_CONNECT to authenticate against the secret,
+   encrypting the call with the given methods as far as the caller offered them
+   and MD5 is among the authentication methods; the reply is an IAX_EVENT_AUTHRP */
+extern int iax_auth_request(struct iax_session *session, int methods,
+		int encmethods, const char *secret);
+
+/* Nonzero if the MD5 reply of an IAX_EVENT_AUTHRP matches our challenge */
+extern int iax_auth_verify(struct iax_session *session, struct iax_event *e);
+
+/* Nonzero once the session's frames are encrypted */
+extern int iax_session_encrypted(struct iax_session *session);
+
 /* Free an event */
+/* Events must be freed on the thread that runs iax_get_event, except for
+   voice and comfort noise events, whose release only frees memory. */
 extern void iax_event_free(struct iax_event *event);
 
 struct sockaddr_in;
@@ -186,6 +267,7 @@ extern int iax_send_unlink(struct iax_session *session);
 extern int iax_send_link_reject(struct iax_session *session);
 extern int iax_ring_announce(struct iax_session *session);
 extern struct sockaddr_in iax_get_peer_addr(struct iax_session *session);
+extern struct sockaddr_storage iax_get_peer_sockaddr(struct iax_session *session);
 extern int iax_register(struct iax_session *session, const char *hostname, const char *peer, const char *secret, int refresh);
 extern int iax_lag_request(struct iax_session *session);
 extern int iax_dial(struct iax_session *session, char *number); /* Dial on a TBD call */
@@ -231,15 +313,21 @@ extern void iax_set_sendto(struct iax_session *s, iax_sendto_t sendto);
 /* to use application networking instead of internal, set call this instead of iax_init,
  * and pass in sendto and recvfrom replacements.  blocking reads may not be implemented */
 extern void iax_set_networking(iax_sendto_t st, iax_recvfrom_t rf);
+extern void iax_context_set_networking(struct iax_context *ctx, iax_sendto_t st, iax_recvfrom_t rf);
 
 /* destroy an iax session */
 extern void iax_session_destroy(struct iax_session **session);
 
+/* forget the peer's call number, sequence numbers and all unacknowledged frames,
+ * so that the session can start a new transaction like a REGREQ from scratch */
+extern void iax_session_reset(struct iax_session *session);
+
 /* To control use of jitter buffer for video event */
 int iax_video_bypass_jitter(struct iax_session*, int );
 
 /* Handle externally received frames */
-struct iax_event *iax_net_process(unsigned char *buf, int len, struct sockaddr_in *sin);
+struct iax_event *iax_net_process(unsigned char *buf, int len, struct sockaddr *from);
+struct iax_event *iax_context_net_process(struct iax_context *ctx, unsigned char *buf, int len, struct sockaddr *from);
 extern unsigned int iax_session_get_capability(struct iax_session *s);
 extern char iax_pref_codec_add(struct iax_session *session, unsigned int format);
 extern void iax_pref_codec_del(struct iax_session *session, unsigned int format);
@@ -247,6 +335,64 @@ extern int iax_pref_codec_get(struct iax_session *session, unsigned int *array,
 
 /* Fine tune jitterbuffer */
 extern void iax_set_jb_target_extra( long value );
+extern void iax_context_set_jb_target_extra(struct iax_context *ctx, long value);
+
+/* Admission of full frames that would open a new session.  The hook runs
+   before anything is allocated for the peer and gets the IAX subclass of
+   the frame (-1 for other frame types).  IAX_ADMIT_REJECT answers a NEW
+   with a stateless REJECT carrying *cause (if set), a REGREQ with a REGREJ
+   and anything else with INVAL, IAX_ADMIT_DROP discards the frame
+   silently.  IAX_ADMIT_TOKEN opens a session only for a NEW or REGREQ with
+   a valid call token: peers announcing support get a stateless CALLTOKEN,
+   others a REJECT or REGREJ, any other frame an INVAL.  An admitted POKE
+   gets a stateless PONG and opens no session either.  Stray ACK and INVAL
+   frames never reach the hook and never open a session, NEWs and REGREQs
+   with a bad or expired token neither. */
+#define IAX_ADMIT_ACCEPT	0
+#define IAX_ADMIT_REJECT	1
+#define IAX_ADMIT_DROP		2
+#define IAX_ADMIT_TOKEN		3
+
+typedef int (*iax_admit_t)(struct iax_context *ctx, const struct sockaddr *from, int subclass, const char **cause, void *data);
+
+extern void iax_set_admission(iax_admit_t admit, void *data);
+extern void iax_context_set_admission(struct iax_context *ctx, iax_admit_t admit, void *data);
+
+/* Allow each source rate frames per second that open a new session, with
+   bursts of up to burst frames (0 for rate).  Excess frames are dropped
+   before the hook runs, a rate of 0 turns the limit off. */
+extern void iax_set_admission_rate(unsigned int rate, unsigned int burst);
+extern void iax_context_set_admission_rate(struct iax_context *ctx, unsigned int rate, unsigned int burst);
+
+struct iax_admission_stats {
+	unsigned long accepted;		/* frames that opened a session */
+	unsigned long rejected;		/* answered with REJECT or INVAL */
+	unsigned long limited;		/* dropped by the rate limit */
+	unsigned long dropped;		/* stray ACK/INVAL or dropped by the hook */
+	unsigned long challenged;	/* answered with a CALLTOKEN */
+	unsigned long invalid;		/* NEWs and REGREQs with a bad or expired call token */
+	unsigned long poked;		/* POKEs answered with a stateless PONG */
+};
+
+extern void iax_get_admission_stats(struct iax_admission_stats *stats);
+extern void iax_context_get_admission_stats(struct iax_context *ctx, struct iax_admission_stats *stats);
+
+/* Hold the ACK of a received full frame back for up to ms milliseconds (at
+   most 50), so that a frame of ours sent meanwhile carries the
+   acknowledgement instead and several frames share one ACK.  Hangups and
+   rejects are acknowledged at once; 0, the default, acknowledges everything
+   at once. */
+extern void iax_set_ack_delay(int ms);
+extern void iax_context_set_ack_delay(struct iax_context *ctx, int ms);
+
+struct iax_ack_stats {
+	unsigned long sent;		/* ACK frames sent */
+	unsigned long delayed;		/* ACKs held back by the delay */
+	unsigned long suppressed;	/* carried by another frame or merged into one ACK */
+};
+
+extern void iax_get_ack_stats(struct iax_ack_stats *stats);
+extern void iax_context_get_ack_stats(struct iax_context *ctx, struct iax_ack_stats *stats);
 
 #if defined(__cplusplus)
 }
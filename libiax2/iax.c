@@ -14,6 +14,11 @@
 #include "config.h"
 #endif
 
+/* recvmmsg is a gnu extension */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #if defined(WIN32)  ||  defined(_WIN32_WCE)
 #undef __STRICT_ANSI__ //for strdup with ms
 
@@ -26,8 +31,10 @@
 #include <errno.h>
 #endif
 #include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
-#include <winsock.h>
+#include <wincrypt.h>
 #include <time.h>
 #include <stdlib.h>
 #include <malloc.h>
@@ -84,6 +91,10 @@ void gettimeofday(struct timeval* tv, void* tz)
 #include <arpa/inet.h>
 #include <time.h>
 
+#ifdef __linux__
+#include "uring.h"
+#endif
+
 #ifndef MACOSX
 #include <malloc.h>
 #ifndef SOLARIS
@@ -96,6 +107,7 @@ void gettimeofday(struct timeval* tv, void* tz)
 #include "jitterbuf.h"
 #include "iax-client.h"
 #include "md5.h"
+#include "aes.h"
 
 /* Define socket options for IAX2 sockets, based on platform
  * availability of flags */
@@ -126,6 +138,12 @@ void gettimeofday(struct timeval* tv, void* tz)
 
 #define MIN_RETRY_TIME 10
 #define MAX_RETRY_TIME 4000
+/* longest ACK delay, well below the 100ms chan_iax2 retransmits after at the earliest */
+#define MAX_ACK_DELAY 50
+/* room for the IEs of an ACK, PONG or LAGRP sent from the session's control buffer */
+#define CONTROL_IES_MAX 64
+/* clock granularity of the retransmission timer in microseconds (RFC 6298) */
+#define RTO_GRANULARITY 1000
 #define MEMORY_SIZE 1000
 
 #define TRANSFER_NONE  0
@@ -133,25 +151,28 @@ void gettimeofday(struct timeval* tv, void* tz)
 #define TRANSFER_READY 2
 #define TRANSFER_REL   3
 
-/* Video frames bypass jitterbuffer */
-static int video_bypass_jitterbuffer = 0;
-
-/* UDP Socket (file descriptor) */
-static int netfd = -1;
-
 /* Max timeouts */
 static const int maxretries = 10;
 
-/* configurable jitterbuffer options */
-static long jb_target_extra = -1;
-
-/* external global networking replacements */
-static iax_sendto_t   iax_sendto = (iax_sendto_t) sendto;
-static iax_recvfrom_t iax_recvfrom = (iax_recvfrom_t) recvfrom;
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+/* Batched reads: when the internal socket is used, fetch up to
+ * IAX_NET_BATCH datagrams with a single recvmmsg() call and hand
+ * them out one by one on the following reads.  A slot takes the
+ * largest datagram IAX sends, anything longer is dropped. */
+#define IAX_NET_BATCH 16
+#define IAX_NET_SLOT IAX_MAX_DATAGRAM
+struct iax_net_batch {
+	unsigned char buf[IAX_NET_BATCH][IAX_NET_SLOT];
+	struct sockaddr_storage sin[IAX_NET_BATCH];
+	struct mmsghdr msg[IAX_NET_BATCH];
+	struct iovec iov[IAX_NET_BATCH];
+	int count;
+	int next;
+};
+#endif
 
-/* ping interval (seconds) */
-static int ping_time = 10;
-static void send_ping(void *session);
+struct iax_context;
+static void send_ping(struct iax_context *ctx, void *session);
 
 struct iax_session {
 	/* Private data */
@@ -186,8 +207,13 @@ struct iax_session {
 #endif
 	/* Our last measured ping time */
 	unsigned int pingtime;
-	/* Address of peer */
-	struct sockaddr_in peeraddr;
+	/* Smoothed round trip time and its variation (us, 0 before the first
+	   sample) and the retransmission timeout derived from them (ms) */
+	long long srtt;
+	long long rttvar;
+	int rto;
+	/* Address of peer, a sockaddr_in or sockaddr_in6 */
+	struct sockaddr_storage peeraddr;
 	/* Our call number */
 	int callno;
 	/* Peer's call number */
@@ -206,6 +232,8 @@ struct iax_session {
 	struct timeval offset;
 	/* Time value we base our delivery on */
 	struct timeval rxcore;
+	/* Time the peer's trunk timestamps count from */
+	struct timeval rxtrunk;
 	/* Current link state */
 	int state;
 	/* Expected Username */
@@ -218,8 +246,30 @@ struct iax_session {
 	/* ping scheduler id */
 	int pingid;
 
+	/* IEs of the NEW or REGREQ to resend if the peer hands out a call token */
+	unsigned char *calltoken_ies;
+	int calltoken_ieslen;
+	int calltoken_cmd;
+
+	/* Encryption offered by the peer (or by us on outgoing calls) until the
+	   AUTHREQ settles it, the challenge we sent, and once keyed the cipher
+	   and the bytes the next padding is taken from */
+	int encmethods;
+	char challenge[16];
+	int encrypted;
+	struct aes_key key;
+	unsigned char semirand[32];
+
+	/* A delayed ACK is scheduled, with the timestamp and sequence number it echoes */
+	int ack_pending;
+	unsigned int ack_ts;
+	int ack_seqno;
+
+	/* ACK, PONG and LAGRP are laid out and sent from here */
+	unsigned char control[sizeof(struct ast_iax2_full_hdr) + CONTROL_IES_MAX];
+
 	/* Transfer stuff */
-	struct sockaddr_in transfer;
+	struct sockaddr_storage transfer;
 	int transferring;
 	int transfercallno;
 	int transferid;
@@ -232,12 +282,13 @@ struct iax_session {
 
 	/* For linking if there are multiple connections */
 	struct iax_session *next;
+	/* The stack this session belongs to */
+	struct iax_context *ctx;
 };
 
-char iax_errstr[256];
-
+#define IAX_ERRSTRLEN 256
 
-#define IAXERROR snprintf(iax_errstr, sizeof(iax_errstr),
+char iax_errstr[IAX_ERRSTRLEN];
 
 #ifdef DEBUG_SUPPORT
 
@@ -317,7 +368,7 @@ static int __debug(char *file, int lineno, char *func, char *fmt, ...)
 #define G
 #endif
 
-typedef void (*sched_func)(void *);
+typedef void (*sched_func)(struct iax_context *, void *);
 
 struct iax_sched {
 	/* These are scheduled things to be delivered */
@@ -334,10 +385,166 @@ struct iax_sched {
 	struct iax_sched *next;
 };
 
-static struct iax_sched *schedq = NULL;
-static struct iax_session *sessions = NULL;
-static int callnums = 1;
-static int transfer_id = 1;		/* for attended transfer */
+/* per-source token buckets of the admission rate limit */
+#define IAX_ADMIT_BUCKETS 1024
+
+/* seconds a call token stays valid */
+#define IAX_CALLTOKEN_TTL 10
+
+struct iax_bucket {
+	int family;
+	unsigned char addr[16];
+	/* last refill and balance in millionths of a frame */
+	unsigned long long stamp;
+	unsigned long long tokens;
+};
+
+/* Everything one iax stack owns.  Contexts share nothing, so each one
+ * can be driven by its own thread. */
+struct iax_context {
+	/* UDP Socket (file descriptor) */
+	int netfd;
+	/* AF_INET6 for a dual-stack socket, AF_INET otherwise */
+	int family;
+	/* external networking replacements */
+	iax_sendto_t sendto;
+	iax_recvfrom_t recvfrom;
+	struct iax_sched *schedq;
+	struct iax_session *sessions;
+	int callnums;
+	int transfer_id;		/* for attended transfer */
+	/* arrival time of the datagram currently being processed */
+	unsigned long long rx_stamp;
+	/* configurable jitterbuffer options */
+	long jb_target_extra;
+	/* Video frames bypass jitterbuffer */
+	int video_bypass_jitterbuffer;
+	/* ping interval (seconds) */
+	int ping_time;
+	/* last error message, iax_errstr for the default context */
+	char *errstr;
+	char errbuf[IAX_ERRSTRLEN];
+	/* admission of frames that would open a new session */
+	iax_admit_t admit;
+	void *admit_data;
+	unsigned int admit_rate;
+	unsigned int admit_burst;
+	struct iax_bucket *buckets;
+	struct iax_admission_stats admission;
+	/* how long ACKs wait for a frame of ours to carry them (ms), and how they fared */
+	int ack_delay;
+	struct iax_ack_stats acks;
+	/* HMAC state of the call token key, keyed on the first token handed out */
+	int token_keyed;
+	struct MD5Context token_inner;
+	struct MD5Context token_outer;
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	/* allocated on the first batched read */
+	struct iax_net_batch *batch;
+#endif
+#ifdef __linux__
+	/* IAX_IO_URING_* requested for the next iax_init socket, the ring if it
+	   got one and whether sends wait for the end of iax_context_get_event */
+	int io_uring;
+	struct uring *uring;
+	int in_event;
+#endif
+};
+
+/* used by threads that never selected a context */
+static struct iax_context default_context = {
+	-1, AF_INET, (iax_sendto_t) sendto, (iax_recvfrom_t) recvfrom,
+	NULL, NULL, 1, 1, 0, -1, 0, 10, iax_errstr
+};
+
+#if defined(_MSC_VER)
+#define IAX_THREAD __declspec(thread)
+#else
+#define IAX_THREAD __thread
+#endif
+
+static IAX_THREAD struct iax_context *current_context = NULL;
+
+static struct iax_context *iax_current(void)
+{
+	return current_context ? current_context : &default_context;
+}
+
+#define IAXERROR(ctx) snprintf((ctx)->errstr, IAX_ERRSTRLEN,
+
+struct iax_context *iax_context_new(void)
+{
+	struct iax_context *ctx;
+
+	ctx = (struct iax_context *)iax_malloc(sizeof(struct iax_context));
+	if (ctx) {
+		memcpy(ctx, &default_context, sizeof(struct iax_context));
+		ctx->netfd = -1;
+		ctx->family = AF_INET;
+		ctx->sendto = (iax_sendto_t) sendto;
+		ctx->recvfrom = (iax_recvfrom_t) recvfrom;
+		ctx->schedq = NULL;
+		ctx->sessions = NULL;
+		ctx->errstr = ctx->errbuf;
+		ctx->errbuf[0] = '\0';
+		ctx->admit = NULL;
+		ctx->admit_data = NULL;
+		ctx->admit_rate = 0;
+		ctx->admit_burst = 0;
+		ctx->buckets = NULL;
+		memset(&ctx->admission, 0, sizeof(ctx->admission));
+		ctx->ack_delay = 0;
+		memset(&ctx->acks, 0, sizeof(ctx->acks));
+		ctx->token_keyed = 0;
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+		ctx->batch = NULL;
+#endif
+#ifdef __linux__
+		ctx->io_uring = 0;
+		ctx->uring = NULL;
+		ctx->in_event = 0;
+#endif
+	}
+	return ctx;
+}
+
+struct iax_context *iax_use_context(struct iax_context *ctx)
+{
+	struct iax_context *prev = current_context;
+
+	current_context = ctx;
+	return prev;
+}
+
+int iax_set_io_uring(int flags)
+{
+	return iax_context_set_io_uring(iax_current(), flags);
+}
+
+int iax_context_set_io_uring(struct iax_context *ctx, int flags)
+{
+#ifdef __linux__
+	ctx->io_uring = flags;
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int iax_context_io_uring(struct iax_context *ctx)
+{
+#ifdef __linux__
+	if (ctx->uring)
+		return IAX_IO_URING_RECV | (ctx->io_uring & IAX_IO_URING_SEND) |
+			(uring_sqpoll(ctx->uring) ? IAX_IO_URING_SQPOLL : 0);
+#endif
+	return 0;
+}
+
+const char *iax_context_error(struct iax_context *ctx)
+{
+	return ctx->errstr;
+}
 
 
 void iax_set_private(struct iax_session *s, void *ptr)
@@ -362,12 +569,175 @@ unsigned int iax_session_get_capability(struct iax_session *s)
 }
 
 
-static int inaddrcmp(struct sockaddr_in *sin1, struct sockaddr_in *sin2)
+unsigned long long iax_monotonic_us(void)
+{
+#if defined(WIN32)  ||  defined(_WIN32_WCE)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	/* split the division so the multiplication can't overflow */
+	return (unsigned long long)(count.QuadPart / freq.QuadPart) * 1000000 +
+	       (unsigned long long)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* Peer addresses are stored as a sockaddr_in or a sockaddr_in6 inside a
+ * sockaddr_storage.  v4-mapped addresses from a dual-stack socket are
+ * unmapped on arrival, so every peer has exactly one form and a plain
+ * field compare is enough to match it. */
+static int inaddrcmp(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family)
+		return 1;
+	if (a->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+		const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+
+		/* a link-local address names a different peer on every interface */
+		return (a6->sin6_port != b6->sin6_port) ||
+			(a6->sin6_scope_id != b6->sin6_scope_id) ||
+			memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+	} else {
+		const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+		const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+
+		return (a4->sin_addr.s_addr != b4->sin_addr.s_addr) || (a4->sin_port != b4->sin_port);
+	}
+}
+
+/* copy a received address, turning ::ffff:a.b.c.d back into a.b.c.d */
+static void iax_addr_set(struct sockaddr_storage *ss, const struct sockaddr *sa)
+{
+	memset(ss, 0, sizeof(*ss));
+	if (sa->sa_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+			struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+			sin->sin_family = AF_INET;
+			sin->sin_port = sin6->sin6_port;
+			memcpy(&sin->sin_addr, &sin6->sin6_addr.s6_addr[12], sizeof(sin->sin_addr));
+		} else
+			memcpy(ss, sin6, sizeof(*sin6));
+	} else
+		memcpy(ss, sa, sizeof(struct sockaddr_in));
+}
+
+/* the address to hand to sendto, v4 peers are mapped on dual-stack sockets */
+static const struct sockaddr *iax_wire_addr(struct iax_context *ctx,
+		const struct sockaddr_storage *ss, struct sockaddr_in6 *mapped, socklen_t *len)
+{
+	if (ss->ss_family == AF_INET6) {
+		*len = sizeof(struct sockaddr_in6);
+		return (const struct sockaddr *)ss;
+	}
+	if (ctx->family == AF_INET6) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+
+		memset(mapped, 0, sizeof(*mapped));
+		mapped->sin6_family = AF_INET6;
+		mapped->sin6_port = sin->sin_port;
+		mapped->sin6_addr.s6_addr[10] = 0xff;
+		mapped->sin6_addr.s6_addr[11] = 0xff;
+		memcpy(&mapped->sin6_addr.s6_addr[12], &sin->sin_addr, sizeof(sin->sin_addr));
+		*len = sizeof(struct sockaddr_in6);
+		return (const struct sockaddr *)mapped;
+	}
+	*len = sizeof(struct sockaddr_in);
+	return (const struct sockaddr *)ss;
+}
+
+#ifdef __linux__
+/* submit the sends queued on the ring and report those that failed since */
+static void iax_net_flush(struct iax_context *ctx)
+{
+	int errors;
+	int error;
+
+	uring_flush(ctx->uring);
+	errors = uring_errors(ctx->uring, &error);
+	if (errors) {
+		DEBU(G "%d queued sends failed: %s\n", errors, strerror(error));
+		IAXERROR(ctx) "%d queued sends failed: %s", errors, strerror(error));
+	}
+}
+#endif
+
+/* send a datagram with fn, queued on the ring when it stands in for the socket */
+static int iax_net_send(struct iax_context *ctx, iax_sendto_t fn, const void *buf, int len,
+		const struct sockaddr *to, socklen_t tolen)
+{
+#ifdef __linux__
+	if (ctx->uring && fn == (iax_sendto_t)sendto && !uring_send(ctx->uring, buf, len, to, tolen)) {
+		/* the application expects its own sends on the wire at once */
+		if (!ctx->in_event)
+			iax_net_flush(ctx);
+		return len;
+	}
+#endif
+	return fn(ctx->netfd, (const char *)buf, len, IAX_SOCKOPTS, to, tolen);
+}
+
+/* numeric form of an address for messages */
+static const char *iax_addr_str(const struct sockaddr_storage *ss, char *buf, int len)
+{
+	if (getnameinfo((const struct sockaddr *)ss, ss->ss_family == AF_INET6 ?
+			sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in),
+			buf, len, NULL, 0, NI_NUMERICHOST))
+		strncpy(buf, "?", len);
+	return buf;
+}
+
+/* Split "host", "host:port", "[v6]" or "[v6]:port" in place; a bare v6
+ * literal has more than one colon and never carries a port. */
+static char *iax_split_host(char *host, int *portno)
+{
+	char *p = host;
+
+	if (*host == '[' && (p = strchr(host, ']')) != NULL) {
+		*p++ = '\0';
+		host++;
+		if (*p == ':')
+			*portno = atoi(p + 1);
+		return host;
+	}
+	p = strchr(host, ':');
+	if (p && p == strrchr(host, ':')) {
+		*p = '\0';
+		*portno = atoi(p + 1);
+	}
+	return host;
+}
+
+/* resolve a host name to an address the context's socket can reach */
+static int iax_resolve(struct iax_context *ctx, const char *host, int portno, struct sockaddr_storage *ss)
 {
-	return (sin1->sin_addr.s_addr != sin2->sin_addr.s_addr) || (sin1->sin_port != sin2->sin_port);
+	struct addrinfo hints, *res;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = ctx->family == AF_INET6 ? AF_UNSPEC : AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host, NULL, &hints, &res) || !res)
+		return -1;
+	iax_addr_set(ss, res->ai_addr);
+	freeaddrinfo(res);
+	if (ss->ss_family == AF_INET6)
+		((struct sockaddr_in6 *)ss)->sin6_port = htons((unsigned short)portno);
+	else
+		((struct sockaddr_in *)ss)->sin_port = htons((unsigned short)portno);
+	return 0;
 }
 
-static int iax_sched_add(struct iax_event *event, struct iax_frame *frame, sched_func func, void *arg, int ms)
+static int iax_sched_add(struct iax_context *ctx, struct iax_event *event, struct iax_frame *frame, sched_func func, void *arg, int ms)
 {
 
 	/* Schedule event to be delivered to the client
@@ -380,7 +750,7 @@ static int iax_sched_add(struct iax_event *event, struct iax_frame *frame, sched
 	}
 
 	//fprintf(stderr, "scheduling event %d ms from now\n", ms);
-	sched = (struct iax_sched*)malloc(sizeof(struct iax_sched));
+	sched = (struct iax_sched*)iax_malloc(sizeof(struct iax_sched));
 	if (sched) {
 		memset(sched, 0, sizeof(struct iax_sched));
 		gettimeofday(&sched->when, NULL);
@@ -396,7 +766,7 @@ static int iax_sched_add(struct iax_event *event, struct iax_frame *frame, sched
 		sched->func = func;
 		sched->arg = arg;
 		/* Put it in the list, in order */
-		cur = schedq;
+		cur = ctx->schedq;
 		while(cur && ((cur->when.tv_sec < sched->when.tv_sec) ||
 					 ((cur->when.tv_usec <= sched->when.tv_usec) &&
 					  (cur->when.tv_sec == sched->when.tv_sec)))) {
@@ -407,7 +777,7 @@ static int iax_sched_add(struct iax_event *event, struct iax_frame *frame, sched
 		if (prev) {
 			prev->next = sched;
 		} else {
-			schedq = sched;
+			ctx->schedq = sched;
 		}
 		return 0;
 	} else {
@@ -416,20 +786,20 @@ static int iax_sched_add(struct iax_event *event, struct iax_frame *frame, sched
 	}
 }
 
-static int iax_sched_del(struct iax_event *event, struct iax_frame *frame, sched_func func, void *arg, int all)
+static int iax_sched_del(struct iax_context *ctx, struct iax_event *event, struct iax_frame *frame, sched_func func, void *arg, int all)
 {
 	struct iax_sched *cur, *tmp, *prev = NULL;
 
-	cur = schedq;
+	cur = ctx->schedq;
 	while (cur) {
 		if (cur->event == event && cur->frame == frame && cur->func == func && cur->arg == arg) {
 			if (prev)
 				prev->next = cur->next;
 			else
-				schedq = cur->next;
+				ctx->schedq = cur->next;
 			tmp = cur;
 			cur = cur->next;
-			free(tmp);
+			iax_free(tmp);
 			if (!all)
 				return -1;
 		} else {
@@ -442,9 +812,14 @@ static int iax_sched_del(struct iax_event *event, struct iax_frame *frame, sched
 
 
 int iax_time_to_next_event(void)
+{
+	return iax_context_time_to_next_event(iax_current());
+}
+
+int iax_context_time_to_next_event(struct iax_context *ctx)
 {
 	struct timeval tv;
-	struct iax_sched *cur = schedq;
+	struct iax_sched *cur = ctx->schedq;
 	int ms, min = 999999999;
 
 	/* If there are no pending events, we don't need to timeout */
@@ -463,10 +838,54 @@ int iax_time_to_next_event(void)
 	return min;
 }
 
+long long iax_time_to_next_event_us(void)
+{
+	return iax_context_time_to_next_event_us(iax_current());
+}
+
+long long iax_context_time_to_next_event_us(struct iax_context *ctx)
+{
+	struct timeval tv;
+	struct iax_sched *cur;
+	struct iax_session *session;
+	long long us, min = 0;
+	long next;
+	int found = 0;
+
+	gettimeofday(&tv, NULL);
+	for (cur = ctx->schedq; cur; cur = cur->next) {
+		us = (long long)(cur->when.tv_sec - tv.tv_sec) * 1000000 +
+		     (cur->when.tv_usec - tv.tv_usec);
+		if (!found || us < min)
+			min = us;
+		found = 1;
+	}
+
+	/* iax_get_event releases a jitterbuffer frame once its time has passed */
+	for (session = ctx->sessions; session; session = session->next) {
+		if (!session->jb || !session->jb->frames ||
+		    (next = jb_next(session->jb)) == JB_LONGMAX)
+			continue;
+		us = (long long)(session->rxcore.tv_sec - tv.tv_sec) * 1000000 +
+		     (session->rxcore.tv_usec - tv.tv_usec) + ((long long)next + 1) * 1000;
+		if (!found || us < min)
+			min = us;
+		found = 1;
+	}
+	if (!found)
+		return -1;
+	return min < 0 ? 0 : min;
+}
+
 struct iax_session *iax_session_new(void)
+{
+	return iax_context_session_new(iax_current());
+}
+
+struct iax_session *iax_context_session_new(struct iax_context *ctx)
 {
 	struct iax_session *s;
-	s = (struct iax_session *)malloc(sizeof(struct iax_session));
+	s = (struct iax_session *)iax_malloc(sizeof(struct iax_session));
 	if (s) {
 		jb_conf jbconf;
 
@@ -479,37 +898,38 @@ struct iax_session *iax_session_new(void)
 		s->pingtime = 100;
 		/* XXX Not quite right -- make sure it's not in use, but that won't matter
 		   unless you've had at least 65k calls.  XXX */
-		s->callno = callnums++;
-		if (callnums > 32767)
-			callnums = 1;
+		s->callno = ctx->callnums++;
+		if (ctx->callnums > 32767)
+			ctx->callnums = 1;
 		s->peercallno = 0;
 		s->lastvnak = -1;
 		s->transferpeer = 0; /* for attended transfer */
-		s->next = sessions;
-		s->sendto = iax_sendto;
+		s->next = ctx->sessions;
+		s->ctx = ctx;
+		s->sendto = ctx->sendto;
 		s->pingid = -1;
 
 		s->jb = jb_new();
 		if ( !s->jb )
 		{
-			free(s);
+			iax_free(s);
 			return 0;
 		}
 		jbconf.max_jitterbuf = 0;
 		jbconf.resync_threshold = 1000;
 		jbconf.max_contig_interp = 0;
-		jbconf.target_extra = jb_target_extra;
+		jbconf.target_extra = ctx->jb_target_extra;
 		jb_setconf(s->jb, &jbconf);
 
-		sessions = s;
+		ctx->sessions = s;
 	}
 	return s;
 }
 
-static int iax_session_valid(struct iax_session *session)
+static int iax_session_valid(struct iax_context *ctx, struct iax_session *session)
 {
 	/* Return -1 on a valid iax session pointer, 0 on a failure */
-	struct iax_session *cur = sessions;
+	struct iax_session *cur = ctx->sessions;
 	while(cur) {
 		if (session == cur)
 			return -1;
@@ -522,7 +942,7 @@ int iax_get_netstats(struct iax_session *session, int *rtt, struct iax_netstat *
 {
 	jb_info stats;
 
-	if(!iax_session_valid(session)) return -1;
+	if(!session || !iax_session_valid(session->ctx, session)) return -1;
 
 	*rtt = session->pingtime;
 
@@ -831,50 +1251,52 @@ static int get_sample_cnt(struct iax_event *e)
 
 static int iax_xmit_frame(struct iax_frame *f)
 {
+	struct sockaddr_in6 mapped;
+	const struct sockaddr *to;
+	socklen_t tolen;
 	int res;
 #ifdef DEBUG_SUPPORT
 	struct ast_iax2_full_hdr *h = (struct ast_iax2_full_hdr *)(f->data);
 
 	if (ntohs(h->scallno) & IAX_FLAG_FULL)
 		iax_showframe(f, NULL, 0, f->transfer ?
-				&(f->session->transfer) :
-				&(f->session->peeraddr),
+				(struct sockaddr *)&(f->session->transfer) :
+				(struct sockaddr *)&(f->session->peeraddr),
 				f->datalen - sizeof(struct ast_iax2_full_hdr));
 #endif
 	/* Send the frame raw */
-	res = f->session->sendto(netfd, (const char *) f->data, f->datalen, IAX_SOCKOPTS,
-			f->transfer ? (struct sockaddr *)&(f->session->transfer) :
-			(struct sockaddr *)&(f->session->peeraddr),
-			sizeof(f->session->peeraddr));
+	to = iax_wire_addr(f->session->ctx, f->transfer ? &(f->session->transfer) :
+			&(f->session->peeraddr), &mapped, &tolen);
+	res = iax_net_send(f->session->ctx, f->session->sendto, f->data, f->datalen, to, tolen);
 	return res;
 }
 
 static int iax_reliable_xmit(struct iax_frame *f)
 {
 	struct iax_frame *fc;
-	struct ast_iax2_full_hdr *fh;
-	fh = (struct ast_iax2_full_hdr *) f->data;
-	if (!fh->type) {
+	/* the header may be encrypted already */
+	if (!(f->af.frametype & 0xFF)) {
 		return -2;
 	}
-	fc = (struct iax_frame *)malloc(sizeof(struct iax_frame));
+	fc = (struct iax_frame *)iax_malloc(sizeof(struct iax_frame));
 	if (fc) {
 		/* Make a copy of the frame */
 		memcpy(fc, f, sizeof(struct iax_frame));
 		/* And a copy of the data if applicable */
 		if (!fc->data || !fc->datalen) {
-			IAXERROR "No frame data?");
+			IAXERROR(f->session->ctx) "No frame data?");
 			DEBU(G "No frame data?\n");
 			return -1;
 		} else {
-			fc->data = (char *)malloc(fc->datalen);
+			fc->data = (char *)iax_malloc(fc->datalen);
 			if (!fc->data) {
 				DEBU(G "Out of memory\n");
-				IAXERROR "Out of memory\n");
+				IAXERROR(f->session->ctx) "Out of memory\n");
 				return -1;
 			}
 			memcpy(fc->data, f->data, f->datalen);
-			iax_sched_add(NULL, fc, NULL, NULL, fc->retrytime);
+			fc->sent = iax_monotonic_us();
+			iax_sched_add(fc->session->ctx, NULL, fc, NULL, NULL, fc->retrytime);
 			return iax_xmit_frame(fc);
 		}
 	} else
@@ -883,49 +1305,151 @@ static int iax_reliable_xmit(struct iax_frame *f)
 
 void iax_set_networking(iax_sendto_t st, iax_recvfrom_t rf)
 {
-	iax_sendto = st;
-	iax_recvfrom = rf;
+	iax_context_set_networking(iax_current(), st, rf);
+}
+
+void iax_context_set_networking(struct iax_context *ctx, iax_sendto_t st, iax_recvfrom_t rf)
+{
+	ctx->sendto = st;
+	ctx->recvfrom = rf;
 }
 
 void iax_set_jb_target_extra( long value )
 {
-	/* store in jb_target_extra, a static global */
-	jb_target_extra = value ;
+	iax_context_set_jb_target_extra(iax_current(), value);
+}
+
+void iax_context_set_jb_target_extra(struct iax_context *ctx, long value)
+{
+	/* store in jb_target_extra of the context */
+	ctx->jb_target_extra = value ;
+}
+
+void iax_set_admission(iax_admit_t admit, void *data)
+{
+	iax_context_set_admission(iax_current(), admit, data);
+}
+
+void iax_context_set_admission(struct iax_context *ctx, iax_admit_t admit, void *data)
+{
+	ctx->admit = admit;
+	ctx->admit_data = data;
+}
+
+void iax_set_admission_rate(unsigned int rate, unsigned int burst)
+{
+	iax_context_set_admission_rate(iax_current(), rate, burst);
+}
+
+void iax_context_set_admission_rate(struct iax_context *ctx, unsigned int rate, unsigned int burst)
+{
+	ctx->admit_rate = rate;
+	ctx->admit_burst = burst ? burst : rate;
+}
+
+void iax_get_admission_stats(struct iax_admission_stats *stats)
+{
+	iax_context_get_admission_stats(iax_current(), stats);
+}
+
+void iax_context_get_admission_stats(struct iax_context *ctx, struct iax_admission_stats *stats)
+{
+	*stats = ctx->admission;
+}
+
+void iax_set_ack_delay(int ms)
+{
+	iax_context_set_ack_delay(iax_current(), ms);
+}
+
+void iax_context_set_ack_delay(struct iax_context *ctx, int ms)
+{
+	ctx->ack_delay = ms < 0 ? 0 : ms > MAX_ACK_DELAY ? MAX_ACK_DELAY : ms;
+}
+
+void iax_get_ack_stats(struct iax_ack_stats *stats)
+{
+	iax_context_get_ack_stats(iax_current(), stats);
+}
+
+void iax_context_get_ack_stats(struct iax_context *ctx, struct iax_ack_stats *stats)
+{
+	*stats = ctx->acks;
 }
 
 int iax_shutdown()
 {
-	if (netfd > -1)
+	return iax_context_shutdown(iax_current());
+}
+
+int iax_context_shutdown(struct iax_context *ctx)
+{
+	if (ctx->netfd > -1)
 	{
-		close(netfd);
-		netfd = -1;
+#ifdef __linux__
+		/* the ring still receives on the socket, and may hold sends */
+		if (ctx->uring) {
+			uring_flush(ctx->uring);
+			uring_free(ctx->uring);
+			ctx->uring = NULL;
+		}
+#endif
+		close(ctx->netfd);
+		ctx->netfd = -1;
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+		if (ctx->batch)
+			ctx->batch->count = ctx->batch->next = 0;
+#endif
 		DEBU(G "Stopped.");
 	}
 	return 0;
 }
 
 int iax_init(int preferredportno)
+{
+	return iax_context_init(iax_current(), preferredportno);
+}
+
+int iax_context_init(struct iax_context *ctx, int preferredportno)
 {
 	int portno = preferredportno;
 
-	if (iax_recvfrom == (iax_recvfrom_t)recvfrom)
+	if (ctx->recvfrom == (iax_recvfrom_t)recvfrom)
 	{
-		struct sockaddr_in sin;
+		struct sockaddr_storage ss;
+		struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
 		socklen_t sinlen;
 		int flags;
 		int bufsize = 256 * 1024;
 
-		if (netfd > -1)
+		if (ctx->netfd > -1)
 		{
 			/* Okay, just don't do anything */
 			DEBU(G "Already initialized.");
 			return 0;
 		}
-		netfd = (int)socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-		if (netfd < 0)
+		/* prefer one dual-stack socket, hosts without IPv6 get a plain one */
+		ctx->family = AF_INET6;
+		ctx->netfd = (int)socket(AF_INET6, SOCK_DGRAM, IPPROTO_IP);
+		if (ctx->netfd > -1)
+		{
+			flags = 0;
+			if (setsockopt(ctx->netfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&flags, sizeof(flags)) < 0)
+			{
+				close(ctx->netfd);
+				ctx->netfd = -1;
+			}
+		}
+		if (ctx->netfd < 0)
+		{
+			ctx->family = AF_INET;
+			ctx->netfd = (int)socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+		}
+		if (ctx->netfd < 0)
 		{
 			DEBU(G "Unable to allocate UDP socket\n");
-			IAXERROR "Unable to allocate UDP socket\n");
+			IAXERROR(ctx) "Unable to allocate UDP socket\n");
 			return -1;
 		}
 
@@ -935,10 +1459,18 @@ int iax_init(int preferredportno)
 		if (preferredportno < 0)
 			preferredportno = 0;
 
-		sin.sin_family = AF_INET;
-		sin.sin_addr.s_addr = 0;
-		sin.sin_port = htons((short)preferredportno);
-		if (bind(netfd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+		memset(&ss, 0, sizeof(ss));
+		ss.ss_family = ctx->family;
+		if (ctx->family == AF_INET6) {
+			sin6->sin6_addr = in6addr_any;
+			sin6->sin6_port = htons((short)preferredportno);
+			sinlen = sizeof(*sin6);
+		} else {
+			sin->sin_addr.s_addr = 0;
+			sin->sin_port = htons((short)preferredportno);
+			sinlen = sizeof(*sin);
+		}
+		if (bind(ctx->netfd, (struct sockaddr *) &ss, sinlen) < 0)
 		{
 #if defined(WIN32)  ||  defined(_WIN32_WCE)
 			if (WSAGetLastError() == WSAEADDRINUSE)
@@ -948,77 +1480,88 @@ int iax_init(int preferredportno)
 			{
 				/*the port is already in use, so bind to a free port chosen by the IP stack*/
 				DEBU(G "Unable to bind to preferred port - port is in use. Trying to bind to a free one");
-				sin.sin_port = htons((short)0);
-				if (bind(netfd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+				if (ctx->family == AF_INET6)
+					sin6->sin6_port = 0;
+				else
+					sin->sin_port = 0;
+				if (bind(ctx->netfd, (struct sockaddr *) &ss, sinlen) < 0)
 				{
-					IAXERROR "Unable to bind UDP socket\n");
+					IAXERROR(ctx) "Unable to bind UDP socket\n");
 					return -1;
 				}
 			} else
 			{
-				IAXERROR "Unable to bind UDP socket\n");
+				IAXERROR(ctx) "Unable to bind UDP socket\n");
 				return -1;
 			}
 		}
 
-		sinlen = sizeof(sin);
-		if (getsockname(netfd, (struct sockaddr *) &sin, &sinlen) < 0)
+		sinlen = sizeof(ss);
+		if (getsockname(ctx->netfd, (struct sockaddr *) &ss, &sinlen) < 0)
 		{
-			close(netfd);
-			netfd = -1;
+			close(ctx->netfd);
+			ctx->netfd = -1;
 			DEBU(G "Unable to figure out what I'm bound to.");
-			IAXERROR "Unable to determine bound port number.");
+			IAXERROR(ctx) "Unable to determine bound port number.");
 			return -1;
 		}
 #if defined(WIN32)  ||  defined(_WIN32_WCE)
 		flags = 1;
-		if (ioctlsocket(netfd,FIONBIO,(unsigned long *) &flags))
+		if (ioctlsocket(ctx->netfd,FIONBIO,(unsigned long *) &flags))
 		{
-			closesocket(netfd);
-			netfd = -1;
+			closesocket(ctx->netfd);
+			ctx->netfd = -1;
 			DEBU(G "Unable to set non-blocking mode.");
-			IAXERROR "Unable to set non-blocking mode.");
+			IAXERROR(ctx) "Unable to set non-blocking mode.");
 			return -1;
 		}
 
 #else
-		if ((flags = fcntl(netfd, F_GETFL)) < 0)
+		if ((flags = fcntl(ctx->netfd, F_GETFL)) < 0)
 		{
-			close(netfd);
-			netfd = -1;
+			close(ctx->netfd);
+			ctx->netfd = -1;
 			DEBU(G "Unable to retrieve socket flags.");
-			IAXERROR "Unable to retrieve socket flags.");
+			IAXERROR(ctx) "Unable to retrieve socket flags.");
 			return -1;
 		}
-		if (fcntl(netfd, F_SETFL, flags | O_NONBLOCK) < 0)
+		if (fcntl(ctx->netfd, F_SETFL, flags | O_NONBLOCK) < 0)
 		{
-			close(netfd);
-			netfd = -1;
+			close(ctx->netfd);
+			ctx->netfd = -1;
 			DEBU(G "Unable to set non-blocking mode.");
-			IAXERROR "Unable to set non-blocking mode.");
+			IAXERROR(ctx) "Unable to set non-blocking mode.");
 			return -1;
 		}
 #endif
 		/* Mihai: increase UDP socket buffers to avoid packet loss. */
-		if (setsockopt(netfd, SOL_SOCKET, SO_RCVBUF, (char *)&bufsize,
+		if (setsockopt(ctx->netfd, SOL_SOCKET, SO_RCVBUF, (char *)&bufsize,
 					sizeof(bufsize)) < 0)
 		{
 			DEBU(G "Unable to set buffer size.");
-			IAXERROR "Unable to set buffer size.");
+			IAXERROR(ctx) "Unable to set buffer size.");
 		}
 
-		portno = ntohs(sin.sin_port);
+		portno = ntohs(ctx->family == AF_INET6 ? sin6->sin6_port : sin->sin_port);
+#ifdef __linux__
+		if (ctx->io_uring & IAX_IO_URING_SQPOLL)
+			ctx->io_uring |= IAX_IO_URING_SEND;
+		if (ctx->io_uring && !(ctx->uring = uring_new(ctx->netfd, IAX_MAX_DATAGRAM,
+				(ctx->io_uring & IAX_IO_URING_SEND ? URING_SEND : 0) |
+				(ctx->io_uring & IAX_IO_URING_SQPOLL ? URING_SQPOLL : 0))))
+			DEBU(G "io_uring unavailable, using the socket directly\n");
+#endif
 		DEBU(G "Started on port %d\n", portno);
 	}
 
 	srand((unsigned int)time(0));
-	callnums = rand() % 32767 + 1;
-	transfer_id = rand() % 32767 + 1;
+	ctx->callnums = rand() % 32767 + 1;
+	ctx->transfer_id = rand() % 32767 + 1;
 
 	return portno;
 }
 
-static void destroy_session(struct iax_session *session);
+static void destroy_session(struct iax_context *ctx, struct iax_session *session);
 
 static void convert_reply(char *out, unsigned char *in)
 {
@@ -1047,6 +1590,85 @@ static unsigned char compress_subclass(int subclass)
 	return power | IAX_FLAG_SC_LOG;
 }
 
+static void iax_random_bytes(unsigned char *buf, int len);
+static void send_delayed_ack(struct iax_context *ctx, void *arg);
+
+/* Drop a scheduled ACK, something else acknowledged the frames */
+static void iax_cancel_ack(struct iax_session *session)
+{
+	iax_sched_del(session->ctx, NULL, NULL, send_delayed_ack, (void *)session, 1);
+	session->ack_pending = 0;
+}
+
+/* Key the session with the MD5 of challenge and secret, every later frame is encrypted */
+static void iax_encrypt_key(struct iax_session *session, const char *challenge, const char *secret)
+{
+	struct MD5Context md5;
+	unsigned char digest[16];
+
+	MD5Init(&md5);
+	MD5Update(&md5, (const unsigned char *) challenge, (unsigned int)strlen(challenge));
+	MD5Update(&md5, (const unsigned char *) secret, (unsigned int)strlen(secret));
+	MD5Final(digest, &md5);
+	aes_set_key(&session->key, digest);
+	memset(digest, 0, sizeof(digest));
+	iax_random_bytes(session->semirand, sizeof(session->semirand));
+	session->encrypted = 1;
+}
+
+/* Encrypt a frame in place behind its first clear bytes (the call numbers).  As in
+   chan_iax2.c, 16 to 31 random bytes are put in front, which round the frame up to
+   whole blocks and keep their count in the low nibble of the 16th; the buffer
+   needs room for 31 more bytes. */
+static void iax_encrypt_frame(struct iax_session *session, unsigned char *buf, int *len, int clear)
+{
+	unsigned char *data = buf + clear;
+	int datalen = *len - clear;
+	int padding;
+
+	padding = 16 + ((16 - datalen % 16) & 0x0f);
+	memmove(data + padding, data, datalen);
+	memcpy(data, session->semirand, padding);
+	data[15] = (unsigned char)((data[15] & 0xf0) | (padding & 0x0f));
+	datalen += padding;
+	aes_cbc_encrypt(&session->key, data, datalen);
+	/* the ciphertext is as good a source for the next padding as any */
+	memcpy(session->semirand, data + datalen - sizeof(session->semirand), sizeof(session->semirand));
+	*len = clear + datalen;
+}
+
+/* Decrypt a frame in place and strip the padding, nonzero if it can't be ours as
+   the header (of hdrlen bytes including the clear ones) wouldn't survive */
+static int iax_decrypt_frame(struct iax_session *session, unsigned char *buf, int *len, int clear, int hdrlen)
+{
+	unsigned char *data = buf + clear;
+	int datalen = *len - clear;
+	int padding;
+
+	if (datalen < 16 || datalen % 16)
+		return -1;
+	aes_cbc_decrypt(&session->key, data, datalen);
+	padding = 16 + (data[15] & 0x0f);
+	if (*len - padding < hdrlen)
+		return -1;
+	datalen -= padding;
+	memmove(data, data + padding, datalen);
+	*len = clear + datalen;
+	return 0;
+}
+
+/* Retry after the measured timeout, 2x the ping time before the first ACK */
+static int iax_retry_time(struct iax_session *session)
+{
+	int retrytime = session->rto ? session->rto : session->pingtime * 2;
+
+	if (retrytime < MIN_RETRY_TIME)
+		retrytime = MIN_RETRY_TIME;
+	if (retrytime > MAX_RETRY_TIME)
+		retrytime = MAX_RETRY_TIME;
+	return retrytime;
+}
+
 static int iax_send(struct iax_session *pvt, struct ast_frame *f, unsigned int ts, int seqno, int now, int transfer, int final, int fullframe)
 {
 	/* Queue a packet for delivery on a given private structure.  Use "ts" for
@@ -1066,7 +1688,14 @@ static int iax_send(struct iax_session *pvt, struct ast_frame *f, unsigned int t
 
 	if (!pvt)
 	{
-		IAXERROR "No private structure for packet?\n");
+		IAXERROR(iax_current()) "No private structure for packet?\n");
+		return -1;
+	}
+
+	/* IAX2 encrypts no video meta frames, rather send nothing than in the clear */
+	if (pvt->encrypted && f->frametype == AST_FRAME_VIDEO)
+	{
+		IAXERROR(pvt->ctx) "Can't send video on an encrypted call\n");
 		return -1;
 	}
 
@@ -1123,10 +1752,10 @@ static int iax_send(struct iax_session *pvt, struct ast_frame *f, unsigned int t
 		fr = (struct iax_frame *) buf;
 	} else
 	{
-		fr = iax_frame_new(DIRECTION_OUTGRESS, f->datalen);
+		fr = iax_frame_new(DIRECTION_OUTGRESS, f->datalen + (pvt->encrypted ? 31 : 0));
 		if ( fr == NULL )
 		{
-			IAXERROR "Out of memory\n");
+			IAXERROR(pvt->ctx) "Out of memory\n");
 			return -1;
 		}
 	}
@@ -1137,7 +1766,7 @@ static int iax_send(struct iax_session *pvt, struct ast_frame *f, unsigned int t
 	fr->ts = fts;
 	if (!fr->ts)
 	{
-		IAXERROR "timestamp is 0?\n");
+		IAXERROR(pvt->ctx) "timestamp is 0?\n");
 		if (!now)
 			iax_frame_free(fr);
 		return -1;
@@ -1180,15 +1809,24 @@ static int iax_send(struct iax_session *pvt, struct ast_frame *f, unsigned int t
 		fr->datalen = fr->af.datalen + sizeof(struct ast_iax2_full_hdr);
 		fr->data = fh;
 		fr->retries = maxretries;
-		/* Retry after 2x the ping time has passed */
-		fr->retrytime = pvt->pingtime * 2;
-		if (fr->retrytime < MIN_RETRY_TIME)
-			fr->retrytime = MIN_RETRY_TIME;
-		if (fr->retrytime > MAX_RETRY_TIME)
-			fr->retrytime = MAX_RETRY_TIME;
+		fr->retrytime = iax_retry_time(pvt);
 		/* Acks' don't get retried */
 		if ((f->frametype == AST_FRAME_IAX) && (f->subclass == IAX_COMMAND_ACK))
+		{
 			fr->retries = -1;
+			pvt->ctx->acks.sent++;
+		}
+		/* Any full frame acknowledges all we received, a delayed ACK has become redundant;
+		   it only saved a datagram if something else than an ACK carries the acknowledgement */
+		if (pvt->ack_pending && !transfer && fr->iseqno == pvt->iseqno)
+		{
+			iax_cancel_ack(pvt);
+			if ((f->frametype != AST_FRAME_IAX) || (f->subclass != IAX_COMMAND_ACK))
+				pvt->ctx->acks.suppressed++;
+		}
+		/* Once, retransmissions resend the ciphertext */
+		if (pvt->encrypted)
+			iax_encrypt_frame(pvt, (unsigned char *)fh, &fr->datalen, 4);
 		if (f->frametype == AST_FRAME_VOICE)
 		{
 			pvt->svoiceformat = f->subclass;
@@ -1229,6 +1867,8 @@ static int iax_send(struct iax_session *pvt, struct ast_frame *f, unsigned int t
 			fr->datalen = fr->af.datalen + sizeof(struct ast_iax2_mini_hdr);
 			fr->data = mh;
 			fr->retries = -1;
+			if (pvt->encrypted)
+				iax_encrypt_frame(pvt, (unsigned char *)mh, &fr->datalen, 2);
 			res = iax_xmit_frame(fr);
 		}
 	}
@@ -1301,7 +1941,7 @@ static int send_command_final(struct iax_session *i, char type, int command, uns
 #endif
 	int r;
 	r = __send_command(i, type, command, ts, data, datalen, seqno, 0, 0, 1, 0, 0);
-	if (r >= 0) destroy_session(i);
+	if (r >= 0) destroy_session(i->ctx, i);
 	return r;
 }
 
@@ -1310,6 +1950,113 @@ static int send_command_immediate(struct iax_session *i, char type, int command,
 	return __send_command(i, type, command, ts, data, datalen, seqno, 1, 0, 0, 0, 0);
 }
 
+/* Send an ACK, PONG or LAGRP whose IEs (if any) are in the session's control buffer
+   already.  The header is filled in place of running the frame through iax_send,
+   only the retransmission copy of a PONG or LAGRP is allocated.  Encrypted calls
+   and unspecified timestamps take the generic path. */
+static int send_control(struct iax_session *session, int command, unsigned int ts, int seqno, int ieslen)
+{
+	struct ast_iax2_full_hdr *fh = (struct ast_iax2_full_hdr *)session->control;
+	struct iax_frame fr;
+
+	if (session->encrypted || !ts)
+		return __send_command(session, AST_FRAME_IAX, command, ts, fh->iedata, ieslen, seqno,
+				command == IAX_COMMAND_ACK, 0, 0, 0, 0);
+
+	/* calc_timestamp() takes the offset from the first frame sent */
+	if (!session->offset.tv_sec && !session->offset.tv_usec)
+		gettimeofday(&session->offset, NULL);
+	session->lastsent = ts;
+
+	fr.session = session;
+	fr.callno = session->callno;
+	fr.dcallno = session->peercallno;
+	fr.ts = ts;
+	fr.oseqno = seqno > -1 ? seqno : session->oseqno++;
+	fr.iseqno = session->iseqno;
+	fr.transfer = 0;
+	fr.data = fh;
+	fr.datalen = sizeof(struct ast_iax2_full_hdr) + ieslen;
+
+	/* the compressed subclass of these commands is the command */
+	fh->scallno = htons(fr.callno | IAX_FLAG_FULL);
+	fh->dcallno = htons(fr.dcallno);
+	fh->ts = htonl(ts);
+	fh->oseqno = (unsigned char)fr.oseqno;
+	fh->iseqno = (unsigned char)fr.iseqno;
+	fh->type = AST_FRAME_IAX;
+	fh->csub = (unsigned char)command;
+	session->aseqno = fr.iseqno;
+
+	/* as in __send_command(), only a frame other than an ACK saves the pending one */
+	if (session->ack_pending)
+	{
+		iax_cancel_ack(session);
+		if (command != IAX_COMMAND_ACK)
+			session->ctx->acks.suppressed++;
+	}
+	if (command == IAX_COMMAND_ACK)
+	{
+		session->ctx->acks.sent++;
+		return iax_xmit_frame(&fr);
+	}
+
+	/* iax_reliable_xmit() queues a copy of all of it */
+	fr.event = NULL;
+	fr.retries = maxretries;
+	fr.retrytime = iax_retry_time(session);
+	fr.sent = 0;
+	fr.outoforder = 0;
+	fr.sentyet = 0;
+	fr.final = 0;
+	fr.direction = DIRECTION_OUTGRESS;
+	fr.retrans = -1;
+	fr.next = NULL;
+	fr.prev = NULL;
+	memset(&fr.af, 0, sizeof(fr.af));
+	fr.af.frametype = AST_FRAME_IAX;
+	fr.af.subclass = command;
+	fr.af.datalen = ieslen;
+	return iax_reliable_xmit(&fr);
+}
+
+static int send_ack(struct iax_session *session, unsigned int ts, int seqno)
+{
+	return send_control(session, IAX_COMMAND_ACK, ts, seqno, 0);
+}
+
+static void send_delayed_ack(struct iax_context *ctx, void *arg)
+{
+	struct iax_session *session = (struct iax_session *)arg;
+
+	session->ack_pending = 0;
+	if (session->aseqno != session->iseqno)
+		send_ack(session, session->ack_ts, session->ack_seqno);
+}
+
+/* Acknowledge the frames received so far, at once or after the ACK delay unless
+   a frame of ours carries the acknowledgement first */
+static void iax_ack(struct iax_session *session, unsigned int ts, int seqno, int now)
+{
+	struct iax_context *ctx = session->ctx;
+
+	if (!now && ctx->ack_delay) {
+		session->ack_ts = ts;
+		session->ack_seqno = seqno;
+		if (session->ack_pending) {
+			/* one ACK covers both */
+			ctx->acks.suppressed++;
+			return;
+		}
+		if (iax_sched_add(ctx, NULL, NULL, send_delayed_ack, (void *)session, ctx->ack_delay) == 0) {
+			session->ack_pending = 1;
+			ctx->acks.delayed++;
+			return;
+		}
+	}
+	send_ack(session, ts, seqno);
+}
+
 static int send_command_transfer(struct iax_session *i, char type, int command, unsigned int ts, unsigned char *data, int datalen)
 {
 	return __send_command(i, type, command, ts, data, datalen, 0, 0, 1, 0, 0, 0);
@@ -1323,7 +2070,7 @@ static int send_command_samples(struct iax_session *i, char type, int command, u
 
 int iax_transfer(struct iax_session *session, const char *number)
 {
-	static int res;				//Return Code
+	int res;				//Return Code
 	struct iax_ie_data ied;			//IE Data Structure (Stuff To Send)
 
 	// Clear The Memory Used For IE Buffer
@@ -1335,15 +2082,15 @@ int iax_transfer(struct iax_session *session, const char *number)
 	// Send The Transfer Command - Asterisk Will Handle The Rest!
 	res = send_command(session, AST_FRAME_IAX, IAX_COMMAND_TRANSFER, 0, ied.buf, ied.pos, -1);
 
-	// Return Success
-	return 0;
+	// Return Success Unless It Couldn't Be Sent
+	return res < 0 ? -1 : 0;
 }
 
 static void stop_transfer(struct iax_session *session)
 {
 	struct iax_sched *sch;
 
-	sch = schedq;
+	sch = session->ctx->schedq;
 	while(sch) {
 		if (sch->frame && (sch->frame->session == session))
 					sch->frame->retries = -1;
@@ -1371,6 +2118,7 @@ static void complete_transfer(struct iax_session *session, int peercallno, int x
 	}
 
 	memset(&session->rxcore, 0, sizeof(session->rxcore));
+	memset(&session->rxtrunk, 0, sizeof(session->rxtrunk));
 	memset(&session->offset, 0, sizeof(session->offset));
 
 	/* Reset jitterbuffer */
@@ -1390,6 +2138,10 @@ static void complete_transfer(struct iax_session *session, int peercallno, int x
 	session->lastsent = 0;
 	session->last_ts = 0;
 	session->pingtime = 30;
+	/* A new path, so measure the round trip time anew */
+	session->srtt = 0;
+	session->rttvar = 0;
+	session->rto = 0;
 	/* We have to dump anything we were going to (re)transmit now that we've been
 	   transferred since they're all invalid and for the old host. */
 	stop_transfer(session);
@@ -1408,19 +2160,23 @@ int iax_setup_transfer(struct iax_session *org_session, struct iax_session *new_
 	memset(&ied1, 0, sizeof(ied1));
 
 	/* reversed setup */
-	iax_ie_append_addr(&ied0, IAX_IE_APPARENT_ADDR, &s1->peeraddr);
+	/* the apparent address element only holds an IPv4 address */
+	if (s0->peeraddr.ss_family != AF_INET || s1->peeraddr.ss_family != AF_INET)
+		return -1;
+
+	iax_ie_append_addr(&ied0, IAX_IE_APPARENT_ADDR, (struct sockaddr_in *)&s1->peeraddr);
 	iax_ie_append_short(&ied0, IAX_IE_CALLNO, s1->peercallno);
-	iax_ie_append_int(&ied0, IAX_IE_TRANSFERID, transfer_id);
+	iax_ie_append_int(&ied0, IAX_IE_TRANSFERID, s0->ctx->transfer_id);
 
-	iax_ie_append_addr(&ied1, IAX_IE_APPARENT_ADDR, &s0->peeraddr);
+	iax_ie_append_addr(&ied1, IAX_IE_APPARENT_ADDR, (struct sockaddr_in *)&s0->peeraddr);
 	iax_ie_append_short(&ied1, IAX_IE_CALLNO, s0->peercallno);
-	iax_ie_append_int(&ied1, IAX_IE_TRANSFERID, transfer_id);
+	iax_ie_append_int(&ied1, IAX_IE_TRANSFERID, s0->ctx->transfer_id);
 
 	s0->transfer = s1->peeraddr;
 	s1->transfer = s0->peeraddr;
 
-	s0->transferid = transfer_id;
-	s1->transferid = transfer_id;
+	s0->transferid = s0->ctx->transfer_id;
+	s1->transferid = s0->ctx->transfer_id;
 
 	s0->transfercallno = s0->peercallno;
 	s1->transfercallno = s1->peercallno;
@@ -1431,10 +2187,10 @@ int iax_setup_transfer(struct iax_session *org_session, struct iax_session *new_
 	s0->transferpeer = s1->callno;
 	s1->transferpeer = s0->callno;
 
-	transfer_id++;
+	s0->ctx->transfer_id++;
 
-	if (transfer_id > 32767)
-		transfer_id = 1;
+	if (s0->ctx->transfer_id > 32767)
+		s0->ctx->transfer_id = 1;
 
 	res = send_command(s0, AST_FRAME_IAX, IAX_COMMAND_TXREQ, 0, ied0.buf, ied0.pos, -1);
 	if (res < 0) {
@@ -1466,9 +2222,9 @@ static int iax_finish_transfer(struct iax_session *s, short new_peer)
 
 }
 
-static struct iax_session *iax_find_session2(short callno)
+static struct iax_session *iax_find_session2(struct iax_context *ctx, short callno)
 {
-	struct iax_session *cur = sessions;
+	struct iax_session *cur = ctx->sessions;
 
 	while(cur) {
 		if (callno == cur->callno && callno != 0)  {
@@ -1495,7 +2251,7 @@ static int iax_handle_txready(struct iax_session *s)
 	s->transferring = TRANSFER_REL;
 
 	s0 = s;
-	s1 = iax_find_session2(s0->transferpeer);
+	s1 = iax_find_session2(s0->ctx, s0->transferpeer);
 
 	if (s1 != NULL &&
 	    s1->callno == s0->transferpeer &&
@@ -1518,7 +2274,7 @@ static void iax_handle_txreject(struct iax_session *s)
 	struct iax_session *s0, *s1;
 
 	s0 = s;
-	s1 = iax_find_session2(s0->transferpeer);
+	s1 = iax_find_session2(s0->ctx, s0->transferpeer);
 	if (s1 != NULL &&
 		 s0->transferpeer == s1->callno &&
 		 s1->transferring) {
@@ -1538,25 +2294,29 @@ static void iax_handle_txreject(struct iax_session *s)
 	s->transfer_moh = 0;
 }
 
-static void destroy_session(struct iax_session *session)
+static void destroy_session(struct iax_context *ctx, struct iax_session *session)
 {
 	struct iax_session *cur, *prev=NULL;
 	struct iax_sched *curs, *prevs=NULL, *nexts=NULL;
 	int    loop_cnt=0;
-	curs = schedq;
+	if (session->ack_pending)
+		iax_cancel_ack(session);
+	curs = ctx->schedq;
 	while(curs) {
 		nexts = curs->next;
 		if (curs->frame && curs->frame->session == session) {
-			/* Just mark these frames as if they've been sent */
+			/* Just mark these frames as if they've been sent, and keep
+			   them from destroying the session again once it is freed */
 			curs->frame->retries = -1;
+			curs->frame->final = 0;
 		} else if (curs->event && curs->event->session == session) {
 			if (prevs)
 				prevs->next = nexts;
 			else
-				schedq = nexts;
+				ctx->schedq = nexts;
 			if (curs->event)
 				iax_event_free(curs->event);
-			free(curs);
+			iax_free(curs);
 		} else {
 			prevs = curs;
 		}
@@ -1564,7 +2324,7 @@ static void destroy_session(struct iax_session *session)
 		loop_cnt++;
 	}
 
-	cur = sessions;
+	cur = ctx->sessions;
 	while(cur) {
 		if (cur == session) {
 			jb_frame frame;
@@ -1572,14 +2332,16 @@ static void destroy_session(struct iax_session *session)
 			if (prev)
 				prev->next = session->next;
 			else
-				sessions = session->next;
+				ctx->sessions = session->next;
 
 			while(jb_getall(session->jb,&frame) == JB_OK)
 				iax_event_free((struct iax_event *)frame.data);
 
 			jb_destroy(session->jb);
 
-			free(session);
+			iax_free(session->calltoken_ies);
+			memset(&session->key, 0, sizeof(session->key));
+			iax_free(session);
 			return;
 		}
 		prev = cur;
@@ -1590,14 +2352,14 @@ static void destroy_session(struct iax_session *session)
 static int iax_send_lagrp(struct iax_session *session, unsigned int ts);
 static int iax_send_pong(struct iax_session *session, unsigned int ts);
 
-static struct iax_event *handle_event(struct iax_event *event)
+static struct iax_event *handle_event(struct iax_context *ctx, struct iax_event *event)
 {
 	/* We have a candidate event to be delievered.  Be sure
 	   the session still exists. */
 	if (event)
 	{
 		if ( event->etype == IAX_EVENT_NULL ) return event;
-		if (iax_session_valid(event->session))
+		if (iax_session_valid(ctx, event->session))
 		{
 			/* Lag requests are never actually sent to the client, but
 			   other than that are handled as normal packets */
@@ -1610,7 +2372,7 @@ static struct iax_event *handle_event(struct iax_event *event)
 			case IAX_EVENT_REJECT:
 			case IAX_EVENT_HANGUP:
 				/* Destroy this session -- it's no longer valid */
-				destroy_session(event->session);
+				destroy_session(ctx, event->session);
 				return event;
 			case IAX_EVENT_LAGRQ:
 				event->etype = IAX_EVENT_LAGRP;
@@ -1625,7 +2387,7 @@ static struct iax_event *handle_event(struct iax_event *event)
 			case IAX_EVENT_POKE:
 				event->etype = IAX_EVENT_PONG;
 				iax_send_pong(event->session, event->ts);
-				destroy_session(event->session);
+				destroy_session(ctx, event->session);
 				iax_event_free(event);
 				break;
 			default:
@@ -1709,10 +2471,43 @@ int iax_send_video_trunk(struct iax_session *session, int format,
 
 int iax_video_bypass_jitter(struct iax_session *s, int mode)
 {
-	video_bypass_jitterbuffer = mode;
+	s->ctx->video_bypass_jitterbuffer = mode;
 	return 0;
 }
 
+/* Keep the IEs of a NEW or REGREQ for a resend with a call token, then
+   announce call token support with an empty one */
+static void iax_calltoken_save(struct iax_session *session, int command, struct iax_ie_data *ied)
+{
+	iax_free(session->calltoken_ies);
+	session->calltoken_ies = (unsigned char *)iax_malloc(ied->pos + 1);
+	if (!session->calltoken_ies)
+		return;
+	memcpy(session->calltoken_ies, ied->buf, ied->pos);
+	session->calltoken_ieslen = ied->pos;
+	session->calltoken_cmd = command;
+	iax_ie_append(ied, IAX_IE_CALLTOKEN);
+}
+
+/* The peer kept no state for our first frame, so start over with the token */
+static void iax_calltoken_resend(struct iax_session *session, const char *token)
+{
+	struct iax_ie_data ied;
+
+	memset(&ied, 0, sizeof(ied));
+	memcpy(ied.buf, session->calltoken_ies, session->calltoken_ieslen);
+	ied.pos = session->calltoken_ieslen;
+	iax_ie_append_str(&ied, IAX_IE_CALLTOKEN, token);
+	iax_free(session->calltoken_ies);
+	session->calltoken_ies = NULL;
+	session->peercallno = 0;
+	session->oseqno = 0;
+	session->rseqno = 0;
+	session->iseqno = 0;
+	session->aseqno = 0;
+	send_command(session, AST_FRAME_IAX, session->calltoken_cmd, 0, ied.buf, ied.pos, -1);
+}
+
 int iax_register(struct iax_session *session, const char *server, const char *peer, const char *secret, int refresh)
 {
 	/* Send a registration request */
@@ -1721,15 +2516,10 @@ int iax_register(struct iax_session *session, const char *server, const char *pe
 	int res;
 	int portno = IAX_DEFAULT_PORTNO;
 	struct iax_ie_data ied;
-	struct hostent *hp;
 
 	tmp[255] = '\0';
 	strncpy(tmp, server, sizeof(tmp) - 1);
-	p = strchr(tmp, ':');
-	if (p) {
-		*p = '\0';
-		portno = atoi(p+1);
-	}
+	p = iax_split_host(tmp, &portno);
 
 	memset(&ied, 0, sizeof(ied));
 	if (secret)
@@ -1738,18 +2528,15 @@ int iax_register(struct iax_session *session, const char *server, const char *pe
 		strcpy(session->secret, "");
 
 	/* Connect first */
-	hp = gethostbyname(tmp);
-	if (!hp) {
-		snprintf(iax_errstr, sizeof(iax_errstr), "Invalid hostname: %s", tmp);
+	if (iax_resolve(session->ctx, p, portno, &session->peeraddr)) {
+		IAXERROR(session->ctx) "Invalid hostname: %s", p);
 		return -1;
 	}
-	memcpy(&session->peeraddr.sin_addr, hp->h_addr, sizeof(session->peeraddr.sin_addr));
-	session->peeraddr.sin_port = htons(portno);
-	session->peeraddr.sin_family = AF_INET;
 	strncpy(session->username, peer, sizeof(session->username) - 1);
 	session->refresh = refresh;
 	iax_ie_append_str(&ied, IAX_IE_USERNAME, peer);
 	iax_ie_append_short(&ied, IAX_IE_REFRESH, refresh);
+	iax_calltoken_save(session, IAX_COMMAND_REGREQ, &ied);
 	res = send_command(session, AST_FRAME_IAX, IAX_COMMAND_REGREQ, 0, ied.buf, ied.pos, -1);
 	return res;
 }
@@ -1765,7 +2552,7 @@ int iax_reject(struct iax_session *session, char *reason)
 int iax_hangup(struct iax_session *session, char *byemsg)
 {
 	struct iax_ie_data ied;
-	iax_sched_del(NULL, NULL, send_ping, (void *) session, 1);
+	iax_sched_del(session->ctx, NULL, NULL, send_ping, (void *) session, 1);
 	memset(&ied, 0, sizeof(ied));
 	iax_ie_append_str(&ied, IAX_IE_CAUSE, byemsg ? byemsg : "Normal clearing");
 	return send_command_final(session, AST_FRAME_IAX, IAX_COMMAND_HANGUP, 0, ied.buf, ied.pos, -1);
@@ -1839,28 +2626,51 @@ int iax_send_link_reject(struct iax_session *session)
 	return send_command(session, AST_FRAME_HTML, AST_HTML_LINKREJECT, 0, NULL, 0, -1);
 }
 
+/* The receiver report of a PONG, the values are patched in at the offsets below */
+static const unsigned char pong_ies[] = {
+	IAX_IE_RR_JITTER, 4, 0, 0, 0, 0,
+	IAX_IE_RR_LOSS, 4, 0, 0, 0, 0,
+	IAX_IE_RR_PKTS, 4, 0, 0, 0, 0,
+	IAX_IE_RR_DELAY, 2, 0, 0,
+	IAX_IE_RR_DROPPED, 4, 0, 0, 0, 0,
+	IAX_IE_RR_OOO, 4, 0, 0, 0, 0,
+};
+
+#define PONG_JITTER 2
+#define PONG_LOSS 8
+#define PONG_PKTS 14
+#define PONG_DELAY 20
+#define PONG_DROPPED 24
+#define PONG_OOO 30
+
+static void put_int(unsigned char *buf, unsigned int value)
+{
+	value = htonl(value);
+	memcpy(buf, &value, sizeof(value));
+}
+
 static int iax_send_pong(struct iax_session *session, unsigned int ts)
 {
-        struct iax_ie_data ied;
+	unsigned char *ies = ((struct ast_iax2_full_hdr *)session->control)->iedata;
+	unsigned short delay;
 	jb_info stats;
 
-        memset(&ied, 0, sizeof(ied));
-
 	jb_getinfo(session->jb, &stats);
 
-	iax_ie_append_int(&ied,IAX_IE_RR_JITTER, stats.jitter);
+	memcpy(ies, pong_ies, sizeof(pong_ies));
+	put_int(ies + PONG_JITTER, stats.jitter);
 	/* XXX: should be short-term loss pct.. */
 	if(stats.frames_in == 0) stats.frames_in = 1;
-	iax_ie_append_int(&ied,IAX_IE_RR_LOSS,
+	put_int(ies + PONG_LOSS,
 			((0xff & (stats.losspct/1000)) << 24 |
 			 (stats.frames_lost & 0x00ffffff)));
-	iax_ie_append_int(&ied,IAX_IE_RR_PKTS, stats.frames_in);
-	iax_ie_append_short(&ied,IAX_IE_RR_DELAY,
-			(unsigned short)(stats.current - stats.min));
-	iax_ie_append_int(&ied,IAX_IE_RR_DROPPED, stats.frames_dropped);
-	iax_ie_append_int(&ied,IAX_IE_RR_OOO, stats.frames_ooo);
+	put_int(ies + PONG_PKTS, stats.frames_in);
+	delay = htons((unsigned short)(stats.current - stats.min));
+	memcpy(ies + PONG_DELAY, &delay, sizeof(delay));
+	put_int(ies + PONG_DROPPED, stats.frames_dropped);
+	put_int(ies + PONG_OOO, stats.frames_ooo);
 
-	return send_command(session, AST_FRAME_IAX, IAX_COMMAND_PONG, ts, ied.buf, ied.pos, -1);
+	return send_control(session, IAX_COMMAND_PONG, ts, -1, sizeof(pong_ies));
 }
 
 /* external API; deprecated since we send pings ourselves now (finally) */
@@ -1870,21 +2680,21 @@ int iax_send_ping(struct iax_session *session)
 }
 
 /* scheduled ping sender; sends ping, then reschedules */
-static void send_ping(void *s)
+static void send_ping(struct iax_context *ctx, void *s)
 {
 	struct iax_session *session = (struct iax_session *)s;
 
 	/* important, eh? */
-	if(!iax_session_valid(session)) return;
+	if(!iax_session_valid(ctx, session)) return;
 
 	send_command(session, AST_FRAME_IAX, IAX_COMMAND_PING, 0, NULL, 0, -1);
-	session->pingid = iax_sched_add(NULL,NULL, send_ping, (void *)session, ping_time * 1000);
+	session->pingid = iax_sched_add(ctx, NULL,NULL, send_ping, (void *)session, ctx->ping_time * 1000);
 	return;
 }
 
 static int iax_send_lagrp(struct iax_session *session, unsigned int ts)
 {
-	return send_command(session, AST_FRAME_IAX, IAX_COMMAND_LAGRP, ts, NULL, 0, -1);
+	return send_control(session, IAX_COMMAND_LAGRP, ts, -1, 0);
 }
 
 static int iax_send_txcnt(struct iax_session *session)
@@ -1937,12 +2747,72 @@ int iax_auth_reply(struct iax_session *session, char *password, char *challenge,
 		memset(realreply, 0, sizeof(realreply));
 		convert_reply(realreply, (unsigned char *) reply);
 		iax_ie_append_str(&ied, IAX_IE_MD5_RESULT, realreply);
+		/* the reply is the first encrypted frame */
+		if (session->encmethods & IAX_ENCRYPT_AES128)
+			iax_encrypt_key(session, challenge, password);
 	} else {
 		iax_ie_append_str(&ied, IAX_IE_MD5_RESULT, password);
 	}
 	return send_command(session, AST_FRAME_IAX, IAX_COMMAND_AUTHREP, 0, ied.buf, ied.pos, -1);
 }
 
+void iax_set_encryption(struct iax_session *session, int encmethods)
+{
+	session->encmethods = encmethods;
+}
+
+int iax_session_encrypted(struct iax_session *session)
+{
+	return session->encrypted;
+}
+
+int iax_auth_request(struct iax_session *session, int methods, int encmethods, const char *secret)
+{
+	struct iax_ie_data ied;
+	unsigned int challenge;
+	int res;
+
+	iax_random_bytes((unsigned char *)&challenge, sizeof(challenge));
+	snprintf(session->challenge, sizeof(session->challenge), "%u", challenge);
+	strncpy(session->secret, secret, sizeof(session->secret) - 1);
+	/* the key comes from the MD5 exchange */
+	session->encmethods &= (methods & IAX_AUTH_MD5) ? encmethods & IAX_ENCRYPT_AES128 : 0;
+
+	memset(&ied, 0, sizeof(ied));
+	iax_ie_append_short(&ied, IAX_IE_AUTHMETHODS, methods);
+	iax_ie_append_str(&ied, IAX_IE_CHALLENGE, session->challenge);
+	if (strlen(session->username))
+		iax_ie_append_str(&ied, IAX_IE_USERNAME, session->username);
+	if (session->encmethods)
+		iax_ie_append_short(&ied, IAX_IE_ENCRYPTION, session->encmethods);
+	res = send_command(session, AST_FRAME_IAX, IAX_COMMAND_AUTHREQ, 0, ied.buf, ied.pos, -1);
+
+	/* the request goes out in the clear, everything after it is encrypted */
+	if (res >= 0 && session->encmethods)
+		iax_encrypt_key(session, session->challenge, session->secret);
+	return res;
+}
+
+int iax_auth_verify(struct iax_session *session, struct iax_event *e)
+{
+	struct MD5Context md5;
+	unsigned char digest[16];
+	char expected[33];
+	int x, diff = 0;
+
+	if (!strlen(session->challenge) || !e->ies.md5_result || strlen(e->ies.md5_result) != 32)
+		return 0;
+	MD5Init(&md5);
+	MD5Update(&md5, (const unsigned char *) session->challenge, (unsigned int)strlen(session->challenge));
+	MD5Update(&md5, (const unsigned char *) session->secret, (unsigned int)strlen(session->secret));
+	MD5Final(digest, &md5);
+	convert_reply(expected, digest);
+	/* in constant time, the reply is what an attacker controls */
+	for (x = 0; x < 32; x++)
+		diff |= expected[x] ^ e->ies.md5_result[x];
+	return !diff;
+}
+
 static int iax_regauth_reply(struct iax_session *session, char *password, char *challenge, int methods)
 {
 	char reply[16];
@@ -2053,11 +2923,10 @@ int iax_call(struct iax_session *session, const char *cidnum, const char *cidnam
 	int portno;
 	char *username, *hostname, *secret, *context, *exten, *dnid;
 	struct iax_ie_data ied;
-	struct hostent *hp;
 	/* We start by parsing up the temporary variable which is of the form of:
 	   [user@]peer[:portno][/exten[@context]] */
 	if (!ich) {
-		IAXERROR "Invalid IAX Call Handle\n");
+		IAXERROR(session->ctx) "Invalid IAX Call Handle\n");
 		DEBU(G "Invalid IAX Call Handle\n");
 		return -1;
 	}
@@ -2074,7 +2943,7 @@ int iax_call(struct iax_session *session, const char *cidnum, const char *cidnam
 	}
 
 	session->capability = capabilities;
-	session->pingid = iax_sched_add(NULL,NULL, send_ping, (void *)session, 2 * 1000);
+	session->pingid = iax_sched_add(session->ctx, NULL,NULL, send_ping, (void *)session, 2 * 1000);
 
 	/* XXX We should have a preferred format XXX */
 	iax_ie_append_int(&ied, IAX_IE_FORMAT, formats);
@@ -2108,12 +2977,8 @@ int iax_call(struct iax_session *session, const char *cidnum, const char *cidnam
 	if(secret)
 		strncpy(session->secret, secret, sizeof(session->secret) - 1);
 
-	if (strchr(hostname, ':')) {
-		strtok(hostname, ":");
-		portno = atoi(strtok(NULL, ":"));
-	} else {
-		portno = IAX_DEFAULT_PORTNO;
-	}
+	portno = IAX_DEFAULT_PORTNO;
+	hostname = iax_split_host(hostname, &portno);
 	if (part2) {
 		exten = strtok(part2, "@");
 		dnid = exten;
@@ -2125,6 +2990,8 @@ int iax_call(struct iax_session *session, const char *cidnum, const char *cidnam
 	}
 	if (username)
 		iax_ie_append_str(&ied, IAX_IE_USERNAME, username);
+	if (session->encmethods)
+		iax_ie_append_short(&ied, IAX_IE_ENCRYPTION, session->encmethods);
 	if (exten && strlen(exten))
 		iax_ie_append_str(&ied, IAX_IE_CALLED_NUMBER, exten);
 	if (dnid && strlen(dnid))
@@ -2133,14 +3000,11 @@ int iax_call(struct iax_session *session, const char *cidnum, const char *cidnam
 		iax_ie_append_str(&ied, IAX_IE_CALLED_CONTEXT, context);
 
 	/* Setup host connection */
-	hp = gethostbyname(hostname);
-	if (!hp) {
-		snprintf(iax_errstr, sizeof(iax_errstr), "Invalid hostname: %s", hostname);
+	if (iax_resolve(session->ctx, hostname, portno, &session->peeraddr)) {
+		IAXERROR(session->ctx) "Invalid hostname: %s", hostname);
 		return -1;
 	}
-	memcpy(&session->peeraddr.sin_addr, hp->h_addr, sizeof(session->peeraddr.sin_addr));
-	session->peeraddr.sin_port = htons(portno);
-	session->peeraddr.sin_family = AF_INET;
+	iax_calltoken_save(session, IAX_COMMAND_NEW, &ied);
 	res = send_command(session, AST_FRAME_IAX, IAX_COMMAND_NEW, 0, ied.buf, ied.pos, -1);
 	if (res < 0)
 		return res;
@@ -2167,7 +3031,7 @@ static int calc_rxstamp(struct iax_session *session)
 }
 
 #ifdef notdef_cruft
-static int match(struct sockaddr_in *sin, short callno, short dcallno, struct iax_session *cur)
+static int match(struct sockaddr_storage *sin, short callno, short dcallno, struct iax_session *cur)
 {
 	if ((cur->peeraddr.sin_addr.s_addr == sin->sin_addr.s_addr) &&
 		(cur->peeraddr.sin_port == sin->sin_port)) {
@@ -2195,10 +3059,9 @@ static int match(struct sockaddr_in *sin, short callno, short dcallno, struct ia
    same peercallno (from two different asterisks) exist in more than
    one session.
  */
-static int forward_match(struct sockaddr_in *sin, short callno, short dcallno, struct iax_session *cur)
+static int forward_match(struct sockaddr_storage *sin, short callno, short dcallno, struct iax_session *cur)
 {
-	if ((cur->transfer.sin_addr.s_addr == sin->sin_addr.s_addr) &&
-		(cur->transfer.sin_port == sin->sin_port) && (cur->transferring)) {
+	if (cur->transferring && !inaddrcmp(&cur->transfer, sin)) {
 		/* We're transferring */
 		if (dcallno == cur->callno)
 		{
@@ -2206,8 +3069,7 @@ static int forward_match(struct sockaddr_in *sin, short callno, short dcallno, s
 		}
 	}
 
-	if ((cur->peeraddr.sin_addr.s_addr == sin->sin_addr.s_addr) &&
-		(cur->peeraddr.sin_port == sin->sin_port)) {
+	if (!inaddrcmp(&cur->peeraddr, sin)) {
 		if (dcallno == cur->callno && dcallno != 0)  {
 			/* That's us.  Be sure we keep track of the peer call number */
 			if (cur->peercallno == 0) {
@@ -2228,17 +3090,15 @@ static int forward_match(struct sockaddr_in *sin, short callno, short dcallno, s
 	return 0;
 }
 
-static int reverse_match(struct sockaddr_in *sin, short callno, struct iax_session *cur)
+static int reverse_match(struct sockaddr_storage *sin, short callno, struct iax_session *cur)
 {
-	if ((cur->transfer.sin_addr.s_addr == sin->sin_addr.s_addr) &&
-		(cur->transfer.sin_port == sin->sin_port) && (cur->transferring)) {
+	if (cur->transferring && !inaddrcmp(&cur->transfer, sin)) {
 		/* We're transferring */
 		if (callno == cur->peercallno)  {
 			return 1;
 		}
 	}
-	if ((cur->peeraddr.sin_addr.s_addr == sin->sin_addr.s_addr) &&
-		(cur->peeraddr.sin_port == sin->sin_port)) {
+	if (!inaddrcmp(&cur->peeraddr, sin)) {
 		if (callno == cur->peercallno)  {
 			return 1;
 		}
@@ -2247,12 +3107,28 @@ static int reverse_match(struct sockaddr_in *sin, short callno, struct iax_sessi
 	return 0;
 }
 
-static struct iax_session *iax_find_session(struct sockaddr_in *sin,
+static struct iax_session *iax_peer_session(struct iax_context *ctx,
+		struct sockaddr_storage *sin, short callno)
+{
+	struct iax_session *cur;
+
+	cur = iax_context_session_new(ctx);
+	if (!cur)
+		return NULL;
+	cur->peercallno = callno;
+	cur->peeraddr = *sin;
+	cur->pingid = iax_sched_add(ctx, NULL,NULL, send_ping, (void *)cur, 2 * 1000);
+	DEBU(G "Making new session, peer callno %d, our callno %d\n", callno, cur->callno);
+	return cur;
+}
+
+static struct iax_session *iax_find_session(struct iax_context *ctx,
+		struct sockaddr_storage *sin,
 		short callno,
 		short dcallno,
 		int makenew)
 {
-	struct iax_session *cur = sessions;
+	struct iax_session *cur = ctx->sessions;
 	while(cur) {
 		if (forward_match(sin, callno, dcallno, cur)) {
 			return cur;
@@ -2260,7 +3136,7 @@ static struct iax_session *iax_find_session(struct sockaddr_in *sin,
 		cur = cur->next;
 	}
 
-	cur = sessions;
+	cur = ctx->sessions;
 	while(cur) {
 		if (reverse_match(sin, callno, cur)) {
 			return cur;
@@ -2269,13 +3145,7 @@ static struct iax_session *iax_find_session(struct sockaddr_in *sin,
 	}
 
 	if (makenew && !dcallno) {
-		cur = iax_session_new();
-		cur->peercallno = callno;
-		cur->peeraddr.sin_addr.s_addr = sin->sin_addr.s_addr;
-		cur->peeraddr.sin_port = sin->sin_port;
-		cur->peeraddr.sin_family = AF_INET;
-		cur->pingid = iax_sched_add(NULL,NULL, send_ping, (void *)cur, 2 * 1000);
-		DEBU(G "Making new session, peer callno %d, our callno %d\n", callno, cur->callno);
+		cur = iax_peer_session(ctx, sin, callno);
 	} else {
 		DEBU(G "No session, peer = %d, us = %d\n", callno, dcallno);
 	}
@@ -2364,9 +3234,9 @@ static struct iax_event *schedule_delivery(struct iax_event *e, unsigned int ts,
 
 	/* insert into jitterbuffer */
 	/* TODO: Perhaps we could act immediately if it's not droppable and late */
-	if ( e->etype == IAX_EVENT_VIDEO && video_bypass_jitterbuffer )
+	if ( e->etype == IAX_EVENT_VIDEO && e->session->ctx->video_bypass_jitterbuffer )
 	{
-		iax_sched_add(e, NULL, NULL, NULL, 0);
+		iax_sched_add(e->session->ctx, e, NULL, NULL, NULL, 0);
 		return NULL;
 	} else
 	{
@@ -2426,7 +3296,7 @@ static void iax_handle_vnak(struct iax_session *session, struct ast_iax2_full_hd
 	 * However, it seems that the right thing to do would be to retransmit
 	 * frames with sequence numbers higher OR EQUAL to VNAK's iseqno.
 	 */
-	sch = schedq;
+	sch = session->ctx->schedq;
 	list = NULL;
 	while ( sch != NULL )
 	{
@@ -2447,7 +3317,8 @@ static void iax_handle_vnak(struct iax_session *session, struct ast_iax2_full_hd
 				 * We cannot retransmit immediately, since the frames are ordered by retransmit time
 				 * We need to collect them and orrange them in ascending order of their oseqno
 				 */
-				tmp = (struct iax_sched *)calloc(1, sizeof(struct iax_sched));
+				tmp = (struct iax_sched *)iax_malloc(sizeof(struct iax_sched));
+				memset(tmp, 0, sizeof(struct iax_sched));
 				tmp->frame = sch->frame;
 
 				if ( list == NULL ||
@@ -2483,11 +3354,40 @@ static void iax_handle_vnak(struct iax_session *session, struct ast_iax2_full_hd
 		tmp = list;
 		iax_xmit_frame(tmp->frame);
 		list = list->next;
-		free(tmp);
+		iax_free(tmp);
+	}
+}
+
+/* Feed a round trip time (us) into the estimator and derive the timeout
+   as in RFC 6298 */
+static void iax_rtt_sample(struct iax_session *session, long long rtt)
+{
+	long long err;
+	long long var;
+
+	if (rtt <= 0)
+		rtt = 1;
+	if (!session->srtt) {
+		session->srtt = rtt;
+		session->rttvar = rtt / 2;
+	} else {
+		err = session->srtt - rtt;
+		if (err < 0)
+			err = -err;
+		session->rttvar += (err - session->rttvar) / 4;
+		session->srtt += (rtt - session->srtt) / 8;
 	}
+	var = 4 * session->rttvar;
+	if (var < RTO_GRANULARITY)
+		var = RTO_GRANULARITY;
+	session->rto = (int)((session->srtt + var + 999) / 1000);
+	if (session->rto < MIN_RETRY_TIME)
+		session->rto = MIN_RETRY_TIME;
+	if (session->rto > MAX_RETRY_TIME)
+		session->rto = MAX_RETRY_TIME;
 }
 
-static struct iax_event *iax_header_to_event(struct iax_session *session, struct ast_iax2_full_hdr *fh, int datalen, struct sockaddr_in *sin)
+static struct iax_event *iax_header_to_event(struct iax_session *session, struct ast_iax2_full_hdr *fh, int datalen, struct sockaddr_storage *sin)
 {
 	struct iax_event *e;
 	struct iax_sched *sch;
@@ -2513,7 +3413,7 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 	}
 
 #ifdef DEBUG_SUPPORT
-	iax_showframe(NULL, fh, 1, sin, datalen);
+	iax_showframe(NULL, fh, 1, (struct sockaddr *)sin, datalen);
 #endif
 
 	/* Get things going with it, timestamp wise, if we
@@ -2542,14 +3442,21 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 			{
 				/* Ack the packet with the given timestamp */
 				DEBU(G "Cancelling transmission of packet %d\n", x);
-				sch = schedq;
+				sch = session->ctx->schedq;
 				while(sch)
 				{
 					if ( sch->frame &&
 					     sch->frame->session == session &&
 					     sch->frame->oseqno == x
 					   )
+					{
+						/* Time the newest frame covered, if it went out only once */
+						if (sch->frame->sent && sch->frame->retries >= 0 &&
+						    (unsigned char)(x + 1) == fh->iseqno)
+							iax_rtt_sample(session, (long long)(session->ctx->rx_stamp - sch->frame->sent));
+						sch->frame->sent = 0;
 						sch->frame->retries = -1;
+					}
 					sch = sch->next;
 				}
 			}
@@ -2598,7 +3505,7 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 					DEBU(G "Acking anyway\n");
 					/* XXX Maybe we should handle its ack to us, but then again, it's probably outdated anyway, and if
 						we have anything to send, we'll retransmit and get an ACK back anyway XXX */
-					send_command_immediate(session, AST_FRAME_IAX, IAX_COMMAND_ACK, ts, NULL, 0,fh->iseqno);
+					send_ack(session, ts, fh->iseqno);
 				}
 			} else
 			{
@@ -2619,7 +3526,7 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 			session->iseqno++;
 	}
 
-	e = (struct iax_event *)malloc(sizeof(struct iax_event) + datalen + 1);
+	e = (struct iax_event *)iax_malloc(sizeof(struct iax_event) + datalen + 1);
 
 	if (e) {
 		memset(e, 0, sizeof(struct iax_event) + datalen);
@@ -2628,6 +3535,8 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 		 */
 		e->etype = -1;
 		e->session = session;
+		e->ctx = session->ctx;
+		e->rxstamp = session->ctx->rx_stamp;
 		switch(fh->type) {
 		case AST_FRAME_DTMF:
 			e->etype = IAX_EVENT_DTMF;
@@ -2664,8 +3573,8 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 				e->datalen = datalen;
 			}
 			if (iax_parse_ies(&e->ies, e->data, e->datalen)) {
-				IAXERROR "Unable to parse IE's");
-				free(e);
+				IAXERROR(session->ctx) "Unable to parse IE's");
+				iax_free(e);
 				e = NULL;
 				break;
 			}
@@ -2674,10 +3583,15 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 				/* This is a new, incoming call */
 				/* save the capability for validation */
 				session->capability = e->ies.capability;
+				/* and what an AUTHREQ would need */
+				session->encmethods = e->ies.encmethods;
+				if (e->ies.username)
+					strncpy(session->username, e->ies.username, sizeof(session->username) - 1);
 				if (e->ies.codec_prefs) {
 					strncpy(session->codec_order,
 							e->ies.codec_prefs,
-							sizeof(session->codec_order));
+							sizeof(session->codec_order) - 1);
+					session->codec_order[sizeof(session->codec_order) - 1] = '\0';
 					session->codec_order_len =
 						(int)strlen(session->codec_order);
 				}
@@ -2687,16 +3601,23 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 			case IAX_COMMAND_AUTHREQ:
 				/* This is a request for a call */
 				e->etype = IAX_EVENT_AUTHRQ;
-				if (strlen(session->username) && !strcmp(e->ies.username, session->username) &&
+				/* encrypt only what both sides want */
+				session->encmethods &= e->ies.encmethods;
+				if (strlen(session->username) && e->ies.username && !strcmp(e->ies.username, session->username) &&
 					strlen(session->secret)) {
 						/* Hey, we already know this one */
 						iax_auth_reply(session, session->secret, e->ies.challenge, e->ies.authmethods);
-						free(e);
+						iax_free(e);
 						e = NULL;
 						break;
 				}
 				e = schedule_delivery(e, ts, updatehistory);
 				break;
+			case IAX_COMMAND_AUTHREP:
+				/* see iax_auth_verify */
+				e->etype = IAX_EVENT_AUTHRP;
+				e = schedule_delivery(e, ts, updatehistory);
+				break;
 			case IAX_COMMAND_HANGUP:
 				e->etype = IAX_EVENT_HANGUP;
 				e = schedule_delivery(e, ts, updatehistory);
@@ -2710,12 +3631,19 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 				e = schedule_delivery(e, ts, updatehistory);
 				break;
 			case IAX_COMMAND_ACK:
-				free(e);
+				iax_free(e);
 				e = NULL;
 				break;
 			case IAX_COMMAND_VNAK:
 				iax_handle_vnak(session, fh);
-				free(e);
+				iax_free(e);
+				e = NULL;
+				break;
+			case IAX_COMMAND_CALLTOKEN:
+				/* only once, a peer can't keep us busy with tokens */
+				if (session->calltoken_ies && e->ies.calltokendata)
+					iax_calltoken_resend(session, e->ies.calltokendata);
+				iax_free(e);
 				e = NULL;
 				break;
 			case IAX_COMMAND_LAGRQ:
@@ -2771,7 +3699,7 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 				break;
 			case IAX_COMMAND_REGAUTH:
 				iax_regauth_reply(session, session->secret, e->ies.challenge, e->ies.authmethods);
-				free(e);
+				iax_free(e);
 				e = NULL;
 				break;
 			case IAX_COMMAND_REGREJ:
@@ -2794,14 +3722,15 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 					/* so a full voice frame is sent on the
 					   next voice output */
 					session->svoiceformat = -1;
-					session->transfer = *e->ies.apparent_addr;
-					session->transfer.sin_family = AF_INET;
+					memset(&session->transfer, 0, sizeof(session->transfer));
+					memcpy(&session->transfer, e->ies.apparent_addr, sizeof(struct sockaddr_in));
+					session->transfer.ss_family = AF_INET;
 					session->transfercallno = e->ies.callno;
 					session->transferring = TRANSFER_BEGIN;
 					session->transferid = e->ies.transferid;
 					iax_send_txcnt(session);
 				}
-				free(e);
+				iax_free(e);
 				e = NULL;
 				break;
 			case IAX_COMMAND_DPREP:
@@ -2814,7 +3743,7 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 					session->transfer = *sin;
 					iax_send_txaccept(session);
 				}
-				free(e);
+				iax_free(e);
 				e = NULL;
 				break;
 			case IAX_COMMAND_TXACC:
@@ -2823,12 +3752,12 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 					session->transferring = TRANSFER_READY;
 					iax_send_txready(session);
 				}
-				free(e);
+				iax_free(e);
 				e = NULL;
 				break;
 			case IAX_COMMAND_TXREL:
 				/* Release the transfer */
-				send_command_immediate(session, AST_FRAME_IAX, IAX_COMMAND_ACK, ts, NULL, 0, fh->iseqno);
+				send_ack(session, ts, fh->iseqno);
 				if (session->transferring) {
 					complete_transfer(session, e->ies.callno, 1, 0);
 				}
@@ -2853,18 +3782,18 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 				break;
 
 			case IAX_COMMAND_TXREADY:
-				send_command_immediate(session, AST_FRAME_IAX, IAX_COMMAND_ACK, ts, NULL, 0, fh->iseqno);
+				send_ack(session, ts, fh->iseqno);
 				if (iax_handle_txready(session)) {
 					e->etype = IAX_EVENT_TXREADY;
 				}
 				else {
-					free(e);
+					iax_free(e);
 					e = NULL;
 				}
 				break;
 			default:
 				DEBU(G "Don't know what to do with IAX command %d\n", subclass);
-				free(e);
+				iax_free(e);
 				e = NULL;
 			}
 			break;
@@ -2885,7 +3814,7 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 				break;
 			default:
 				DEBU(G "Don't know what to do with AST control %d\n", subclass);
-				free(e);
+				iax_free(e);
 				return NULL;
 			}
 			break;
@@ -2944,22 +3873,23 @@ static struct iax_event *iax_header_to_event(struct iax_session *session, struct
 				break;
 			default:
 				DEBU(G "Don't know how to handle HTML type %d frames\n", fh->csub);
-				free(e);
+				iax_free(e);
 				return NULL;
 			}
 			break;
 		default:
 			DEBU(G "Don't know what to do with frame type %d\n", fh->type);
-			free(e);
+			iax_free(e);
 			return NULL;
 		}
 	} else
 		DEBU(G "Out of memory\n");
 
-	/* Already ack'd iax frames */
-	if (session->aseqno != session->iseqno) {
-		send_command_immediate(session, AST_FRAME_IAX, IAX_COMMAND_ACK, ts, NULL, 0, fh->iseqno);
-	}
+	/* Already ack'd iax frames; the end of a call right away, the session
+	   may be gone before a delayed ACK would be due */
+	if (session->aseqno != session->iseqno)
+		iax_ack(session, ts, fh->iseqno, fh->type == AST_FRAME_IAX &&
+			(subclass == IAX_COMMAND_HANGUP || subclass == IAX_COMMAND_REJECT));
 	return e;
 }
 
@@ -2976,7 +3906,7 @@ static struct iax_event *iax_videoheader_to_event(struct iax_session *session,
 		return 0;
 	}
 
-	e = (struct iax_event *)malloc(sizeof(struct iax_event) + datalen);
+	e = (struct iax_event *)iax_malloc(sizeof(struct iax_event) + datalen);
 
 	if ( !e )
 	{
@@ -2986,6 +3916,9 @@ static struct iax_event *iax_videoheader_to_event(struct iax_session *session,
 
 	e->etype = IAX_EVENT_VIDEO;
 	e->session = session;
+	e->ctx = session->ctx;
+	e->rxstamp = session->ctx->rx_stamp;
+	e->jbstamp = 0;
 	e->subclass = session->videoformat | (ntohs(vh->ts) & 0x8000 ? 1 : 0);
 	e->datalen = datalen;
 	memcpy(e->data, vh->data, e->datalen);
@@ -2994,8 +3927,8 @@ static struct iax_event *iax_videoheader_to_event(struct iax_session *session,
 	return schedule_delivery(e, e->ts, 1);
 }
 
-static struct iax_event *iax_miniheader_to_event(struct iax_session *session,
-		struct ast_iax2_mini_hdr *mh, int datalen)
+static struct iax_event *iax_voice_to_event(struct iax_session *session,
+		unsigned char *data, int datalen, unsigned int ts)
 {
 	struct iax_event * e;
 
@@ -3005,7 +3938,7 @@ static struct iax_event *iax_miniheader_to_event(struct iax_session *session,
 		return 0;
 	}
 
-	e = (struct iax_event *)malloc(sizeof(struct iax_event) + datalen);
+	e = (struct iax_event *)iax_malloc(sizeof(struct iax_event) + datalen);
 
 	if ( !e )
 	{
@@ -3015,65 +3948,528 @@ static struct iax_event *iax_miniheader_to_event(struct iax_session *session,
 
 	e->etype = IAX_EVENT_VOICE;
 	e->session = session;
+	e->ctx = session->ctx;
+	e->rxstamp = session->ctx->rx_stamp;
+	e->jbstamp = 0;
 	e->subclass = session->voiceformat;
 	e->datalen = datalen;
-	memcpy(e->data, mh->data, datalen);
-	e->ts = (session->last_ts & 0xFFFF0000) | ntohs(mh->ts);
+	memcpy(e->data, data, datalen);
+	e->ts = ts;
 
 	return schedule_delivery(e, e->ts, 1);
 }
 
+static struct iax_event *iax_miniheader_to_event(struct iax_session *session,
+		struct ast_iax2_mini_hdr *mh, int datalen)
+{
+	return iax_voice_to_event(session, mh->data, datalen,
+			(session->last_ts & 0xFFFF0000) | ntohs(mh->ts));
+}
+
+/* Map a trunk timestamp onto the session's timeline.  The peer counts
+   trunk time from when it started trunking, so remember when that was
+   from our side and add the offset to the session's delivery base. */
+static unsigned int iax_trunk_ts(struct iax_session *session, unsigned int ts)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	if (!session->rxcore.tv_sec && !session->rxcore.tv_usec)
+		session->rxcore = tv;
+	if (!session->rxtrunk.tv_sec && !session->rxtrunk.tv_usec) {
+		session->rxtrunk.tv_sec = tv.tv_sec - ts / 1000;
+		session->rxtrunk.tv_usec = tv.tv_usec - (ts % 1000) * 1000;
+		if (session->rxtrunk.tv_usec < 0) {
+			session->rxtrunk.tv_usec += 1000000;
+			session->rxtrunk.tv_sec--;
+		}
+	}
+	return ts + (session->rxtrunk.tv_sec - session->rxcore.tv_sec) * 1000 +
+		(session->rxtrunk.tv_usec - session->rxcore.tv_usec) / 1000;
+}
+
+/* Split a trunk frame into its calls' voice and hand every piece to the
+   session's jitterbuffer.  The entries are read in place, so nothing but
+   the voice events themselves is allocated. */
+static void iax_trunk_to_events(struct iax_context *ctx, struct sockaddr_storage *sin,
+		struct ast_iax2_meta_hdr *meta, int len)
+{
+	struct ast_iax2_meta_trunk_hdr *mth = (struct ast_iax2_meta_trunk_hdr *)meta->data;
+	struct iax_session *session;
+	unsigned char *ptr = mth->data;
+	unsigned char *end = (unsigned char *)meta + len;
+	unsigned int ts = ntohl(mth->ts);
+	unsigned short callno;
+	int datalen;
+
+	if (meta->cmddata & IAX_META_TRUNK_MINI) {
+		/* every call carries its own mini frame timestamp */
+		while (ptr + sizeof(struct ast_iax2_meta_trunk_mini) <= end) {
+			struct ast_iax2_meta_trunk_mini *mtm = (struct ast_iax2_meta_trunk_mini *)ptr;
+
+			datalen = ntohs(mtm->len);
+			ptr += sizeof(struct ast_iax2_meta_trunk_mini);
+			if (ptr + datalen > end)
+				break;
+			callno = ntohs(mtm->mini.callno);
+			session = iax_find_session(ctx, sin, callno, 0, 0);
+			if (session)
+				iax_voice_to_event(session, mtm->mini.data, datalen,
+						(session->last_ts & 0xFFFF0000) | ntohs(mtm->mini.ts));
+			ptr += datalen;
+		}
+	} else {
+		/* all calls share the trunk timestamp */
+		while (ptr + sizeof(struct ast_iax2_meta_trunk_entry) <= end) {
+			struct ast_iax2_meta_trunk_entry *mte = (struct ast_iax2_meta_trunk_entry *)ptr;
+
+			datalen = ntohs(mte->len);
+			ptr += sizeof(struct ast_iax2_meta_trunk_entry);
+			if (ptr + datalen > end)
+				break;
+			callno = ntohs(mte->callno);
+			session = iax_find_session(ctx, sin, callno, 0, 0);
+			if (session)
+				iax_voice_to_event(session, ptr, datalen, iax_trunk_ts(session, ts));
+			ptr += datalen;
+		}
+	}
+	if (ptr != end)
+		DEBU(G "Trunk frame ends in a partial entry\n");
+}
+
 void iax_destroy(struct iax_session *session)
 {
-	destroy_session(session);
+	destroy_session(session->ctx, session);
+}
+
+static struct iax_event *iax_net_wrap(struct iax_context *ctx, struct iax_event *event)
+{
+	if ( event == NULL )
+	{
+		// We have received a frame. The corresponding event is queued
+		// We need to motify the entire stack of calling functions so they
+		// don't go to sleep thinking there are no more frames to process
+		// TODO: this is buttugly from a design point of view. Basically we
+		// change libiax2 behavior to accomodate iaxclient.
+		// There must be a way to do it better.
+		event = (struct iax_event *)iax_malloc(sizeof(struct iax_event));
+		if ( event != NULL ) {
+			event->etype = IAX_EVENT_NULL;
+			event->session = NULL;
+			event->ctx = ctx;
+		}
+	}
+	return event;
+}
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+static struct iax_event *iax_net_read_batch(struct iax_context *ctx)
+{
+	struct iax_net_batch *b = ctx->batch;
+	int i;
+	int res;
+
+	if (!b) {
+		b = (struct iax_net_batch *)iax_malloc(sizeof(struct iax_net_batch));
+		if (!b) {
+			DEBU(G "Out of memory\n");
+			IAXERROR(ctx) "Out of memory\n");
+			return NULL;
+		}
+		b->count = b->next = 0;
+		ctx->batch = b;
+	}
+	while (b->next >= b->count) {
+		for (i = 0; i < IAX_NET_BATCH; i++) {
+			b->iov[i].iov_base = b->buf[i];
+			b->iov[i].iov_len = IAX_NET_SLOT;
+			memset(&b->msg[i], 0, sizeof(b->msg[i]));
+			b->msg[i].msg_hdr.msg_name = &b->sin[i];
+			b->msg[i].msg_hdr.msg_namelen = sizeof(b->sin[i]);
+			b->msg[i].msg_hdr.msg_iov = &b->iov[i];
+			b->msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		res = recvmmsg(ctx->netfd, b->msg, IAX_NET_BATCH, MSG_DONTWAIT, NULL);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				DEBU(G "Error on read: %s\n", strerror(errno));
+				IAXERROR(ctx) "Read error on network socket: %s", strerror(errno));
+			}
+			return NULL;
+		}
+		if (res == 0)
+			return NULL;
+		b->count = res;
+		b->next = 0;
+	}
+
+	i = b->next++;
+	/* longer than any IAX frame, it can't be ours */
+	if (b->msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+		DEBU(G "Dropping a datagram of more than %d bytes\n", IAX_NET_SLOT);
+		return NULL;
+	}
+	return iax_net_wrap(ctx, iax_context_net_process(ctx, b->buf[i], (int)b->msg[i].msg_len, (struct sockaddr *)&b->sin[i]));
+}
+#endif
+
+#ifdef __linux__
+static struct iax_event *iax_net_read_uring(struct iax_context *ctx)
+{
+	struct uring_datagram dgram;
+	struct iax_event *event;
+
+	if (!uring_recv(ctx->uring, &dgram))
+		return NULL;
+	event = iax_context_net_process(ctx, dgram.data, dgram.len, dgram.from);
+	/* the frame was copied wherever it is still needed */
+	uring_done(ctx->uring);
+	return iax_net_wrap(ctx, event);
 }
+#endif
 
-static struct iax_event *iax_net_read(void)
+static struct iax_event *iax_net_read(struct iax_context *ctx)
 {
 	unsigned char buf[65536];
 	int res;
-	struct sockaddr_in sin;
+	struct sockaddr_storage sin;
 	socklen_t sinlen;
-	struct iax_event *event;
 
+#ifdef __linux__
+	if (ctx->uring)
+		return iax_net_read_uring(ctx);
+#endif
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	if (ctx->recvfrom == (iax_recvfrom_t)recvfrom)
+		return iax_net_read_batch(ctx);
+#endif
 	sinlen = sizeof(sin);
-	res = iax_recvfrom(netfd, (char *)buf, sizeof(buf), 0, (struct sockaddr *) &sin, &sinlen);
+	res = ctx->recvfrom(ctx->netfd, (char *)buf, sizeof(buf), 0, (struct sockaddr *) &sin, &sinlen);
 	if (res < 0) {
 #if defined(_WIN32_WCE)
 		if (WSAGetLastError() != WSAEWOULDBLOCK) {
 			DEBU(G "Error on read: %d\n", WSAGetLastError());
-			IAXERROR "Read error on network socket: ???");
+			IAXERROR(ctx) "Read error on network socket: ???");
 		}
 #elif defined(WIN32)  ||  defined(_WIN32_WCE)
 		if (WSAGetLastError() != WSAEWOULDBLOCK) {
 			DEBU(G "Error on read: %d\n", WSAGetLastError());
-			IAXERROR "Read error on network socket: %s", strerror(errno));
+			IAXERROR(ctx) "Read error on network socket: %s", strerror(errno));
 		}
 #else
 		if (errno != EAGAIN) {
 			DEBU(G "Error on read: %s\n", strerror(errno));
-			IAXERROR "Read error on network socket: %s", strerror(errno));
+			IAXERROR(ctx) "Read error on network socket: %s", strerror(errno));
 		}
 #endif
 		return NULL;
 	}
-	event = iax_net_process(buf, res, &sin);
-	if ( event == NULL )
-	{
-		// We have received a frame. The corresponding event is queued
-		// We need to motify the entire stack of calling functions so they
-		// don't go to sleep thinking there are no more frames to process
-		// TODO: this is buttugly from a design point of view. Basically we
-		// change libiax2 behavior to accomodate iaxclient.
-		// There must be a way to do it better.
-		event = (struct iax_event *)malloc(sizeof(struct iax_event));
-		if ( event != NULL ) event->etype = IAX_EVENT_NULL;
+	return iax_net_wrap(ctx, iax_context_net_process(ctx, buf, res, (struct sockaddr *)&sin));
+}
+
+/* Take a frame from the source's bucket, 0 if it is empty.  Sources share
+   a fixed table, one that loses its slot comes back with a full bucket. */
+static int iax_admit_rate(struct iax_context *ctx, struct sockaddr_storage *sin)
+{
+	unsigned char key[16];
+	unsigned int hash = 2166136261u;
+	unsigned long long full;
+	struct iax_bucket *b;
+	int x;
+
+	if (!ctx->buckets) {
+		ctx->buckets = (struct iax_bucket *)iax_malloc(IAX_ADMIT_BUCKETS * sizeof(struct iax_bucket));
+		if (!ctx->buckets)
+			return 1;
+		memset(ctx->buckets, 0, IAX_ADMIT_BUCKETS * sizeof(struct iax_bucket));
+	}
+	memset(key, 0, sizeof(key));
+	if (sin->ss_family == AF_INET6)
+		memcpy(key, &((struct sockaddr_in6 *)sin)->sin6_addr, 16);
+	else
+		memcpy(key, &((struct sockaddr_in *)sin)->sin_addr, 4);
+	for (x = 0; x < 16; x++)
+		hash = (hash ^ key[x]) * 16777619u;
+	b = &ctx->buckets[hash % IAX_ADMIT_BUCKETS];
+
+	full = (unsigned long long)ctx->admit_burst * 1000000;
+	if (b->family != sin->ss_family || memcmp(b->addr, key, sizeof(key))) {
+		b->family = sin->ss_family;
+		memcpy(b->addr, key, sizeof(key));
+		b->tokens = full;
+	} else {
+		b->tokens += (ctx->rx_stamp - b->stamp) * ctx->admit_rate;
+		if (b->tokens > full)
+			b->tokens = full;
+	}
+	b->stamp = ctx->rx_stamp;
+	if (b->tokens < 1000000)
+		return 0;
+	b->tokens -= 1000000;
+	return 1;
+}
+
+/* Answer a frame without a session, mirroring its call numbers and sequence */
+static void iax_send_stateless(struct iax_context *ctx, struct sockaddr_storage *sin,
+		struct ast_iax2_full_hdr *fh, int command, struct iax_ie_data *ied)
+{
+	unsigned char buf[sizeof(struct ast_iax2_full_hdr) + 256];
+	struct ast_iax2_full_hdr *rh = (struct ast_iax2_full_hdr *)buf;
+	struct sockaddr_in6 mapped;
+	const struct sockaddr *to;
+	socklen_t tolen;
+	int datalen = ied ? ied->pos : 0;
+
+	if (datalen > 256)
+		return;
+	rh->scallno = htons(IAX_FLAG_FULL);
+	rh->dcallno = htons(ntohs(fh->scallno) & ~IAX_FLAG_FULL);
+	rh->ts = fh->ts;
+	rh->oseqno = fh->iseqno;
+	rh->iseqno = fh->oseqno + 1;
+	rh->type = AST_FRAME_IAX;
+	rh->csub = compress_subclass(command);
+	if (datalen)
+		memcpy(rh->iedata, ied->buf, datalen);
+	to = iax_wire_addr(ctx, sin, &mapped, &tolen);
+	iax_net_send(ctx, ctx->sendto, buf, sizeof(struct ast_iax2_full_hdr) + datalen, to, tolen);
+}
+
+/* Unpredictable bytes for keys, a clock mix if the system has no source */
+static void iax_random_bytes(unsigned char *buf, int len)
+{
+	struct MD5Context md5;
+	unsigned long long now;
+	unsigned char digest[16];
+	int x, n;
+#if defined(WIN32) || defined(_WIN32_WCE)
+	HCRYPTPROV prov;
+	BOOL ok;
+
+	if (CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT)) {
+		ok = CryptGenRandom(prov, len, buf);
+		CryptReleaseContext(prov, 0);
+		if (ok)
+			return;
+	}
+#else
+	int fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd > -1) {
+		n = (int)read(fd, buf, len);
+		close(fd);
+		if (n == len)
+			return;
+	}
+#endif
+	for (x = 0; x < len; x += 16) {
+		now = iax_monotonic_us();
+		n = rand();
+		MD5Init(&md5);
+		MD5Update(&md5, (unsigned char *)&now, sizeof(now));
+		MD5Update(&md5, (unsigned char *)&n, sizeof(n));
+		MD5Update(&md5, (unsigned char *)&x, sizeof(x));
+		MD5Update(&md5, (unsigned char *)&buf, sizeof(buf));
+		MD5Final(digest, &md5);
+		memcpy(buf + x, digest, len - x < 16 ? len - x : 16);
+	}
+}
+
+/* Key the call tokens with a fresh secret, the HMAC pads are absorbed once */
+static void iax_calltoken_key(struct iax_context *ctx)
+{
+	unsigned char key[16], pad[64];
+	int x;
+
+	iax_random_bytes(key, sizeof(key));
+	memset(pad, 0x36, sizeof(pad));
+	for (x = 0; x < (int)sizeof(key); x++)
+		pad[x] ^= key[x];
+	MD5Init(&ctx->token_inner);
+	MD5Update(&ctx->token_inner, pad, sizeof(pad));
+	memset(pad, 0x5c, sizeof(pad));
+	for (x = 0; x < (int)sizeof(key); x++)
+		pad[x] ^= key[x];
+	MD5Init(&ctx->token_outer);
+	MD5Update(&ctx->token_outer, pad, sizeof(pad));
+	memset(key, 0, sizeof(key));
+	ctx->token_keyed = 1;
+}
+
+/* HMAC-MD5 over the source address and the issue time, as 32 hex digits */
+static void iax_calltoken_mac(struct iax_context *ctx, struct sockaddr_storage *sin, unsigned int t, char *hex)
+{
+	struct MD5Context md5;
+	unsigned char msg[23], digest[16];
+	int x;
+
+	memset(msg, 0, sizeof(msg));
+	if (sin->ss_family == AF_INET6) {
+		msg[0] = 6;
+		memcpy(msg + 1, &((struct sockaddr_in6 *)sin)->sin6_addr, 16);
+		memcpy(msg + 17, &((struct sockaddr_in6 *)sin)->sin6_port, 2);
+	} else {
+		msg[0] = 4;
+		memcpy(msg + 1, &((struct sockaddr_in *)sin)->sin_addr, 4);
+		memcpy(msg + 17, &((struct sockaddr_in *)sin)->sin_port, 2);
+	}
+	msg[19] = (unsigned char)(t >> 24);
+	msg[20] = (unsigned char)(t >> 16);
+	msg[21] = (unsigned char)(t >> 8);
+	msg[22] = (unsigned char)t;
+
+	md5 = ctx->token_inner;
+	MD5Update(&md5, msg, sizeof(msg));
+	MD5Final(digest, &md5);
+	md5 = ctx->token_outer;
+	MD5Update(&md5, digest, sizeof(digest));
+	MD5Final(digest, &md5);
+	for (x = 0; x < 16; x++) {
+		hex[2 * x] = "0123456789abcdef"[digest[x] >> 4];
+		hex[2 * x + 1] = "0123456789abcdef"[digest[x] & 0xf];
+	}
+	hex[32] = '\0';
+}
+
+/* Issue a token of the form "<seconds>?<mac>" for the source */
+static char *iax_calltoken_make(struct iax_context *ctx, struct sockaddr_storage *sin, char *buf, int len)
+{
+	char hex[33];
+	unsigned int t;
+
+	if (!ctx->token_keyed)
+		iax_calltoken_key(ctx);
+	t = (unsigned int)(ctx->rx_stamp / 1000000);
+	iax_calltoken_mac(ctx, sin, t, hex);
+	snprintf(buf, len, "%u?%s", t, hex);
+	return buf;
+}
+
+/* Check a token we issued to this very source not longer than the TTL ago */
+static int iax_calltoken_valid(struct iax_context *ctx, struct sockaddr_storage *sin, const unsigned char *token, int len)
+{
+	char buf[64], hex[33];
+	unsigned int t, now;
+	char *mac;
+	int x, diff = 0;
+
+	if (!ctx->token_keyed || len >= (int)sizeof(buf))
+		return 0;
+	memcpy(buf, token, len);
+	buf[len] = '\0';
+	t = (unsigned int)strtoul(buf, &mac, 10);
+	if (mac == buf || *mac != '?' || strlen(mac + 1) != 32)
+		return 0;
+	now = (unsigned int)(ctx->rx_stamp / 1000000);
+	if (now - t > IAX_CALLTOKEN_TTL)
+		return 0;
+	iax_calltoken_mac(ctx, sin, t, hex);
+	for (x = 0; x < 32; x++)
+		diff |= hex[x] ^ mac[1 + x];
+	return !diff;
+}
+
+/* Find an IE without touching the frame, NULL if it is missing */
+static unsigned char *iax_ie_find(unsigned char *data, int datalen, int ie, int *len)
+{
+	while (datalen >= 2 && data[1] <= datalen - 2) {
+		if (data[0] == ie) {
+			*len = data[1];
+			return data + 2;
+		}
+		datalen -= data[1] + 2;
+		data += data[1] + 2;
+	}
+	*len = 0;
+	return NULL;
+}
+
+/* Decide on a full frame that would open a new session, before anything
+   is allocated for it.  Returns 1 if the session may be created. */
+static int iax_admit(struct iax_context *ctx, struct sockaddr_storage *sin, struct ast_iax2_full_hdr *fh, int datalen)
+{
+	struct iax_ie_data ied;
+	const char *cause = NULL;
+	unsigned char *token = NULL;
+	char buf[64];
+	int tokenlen = 0;
+	int proven = 0;
+	int subclass = -1;
+	int res;
+
+	if (fh->type == AST_FRAME_IAX)
+		subclass = uncompress_subclass(fh->csub);
+	/* answers (like the ACK of a stateless REJECT) never open a session */
+	if (subclass == IAX_COMMAND_ACK || subclass == IAX_COMMAND_INVAL) {
+		ctx->admission.dropped++;
+		return 0;
+	}
+	/* a valid call token proves the source, so it also skips the rate limit */
+	if (subclass == IAX_COMMAND_NEW || subclass == IAX_COMMAND_REGREQ)
+		token = iax_ie_find(fh->iedata, datalen, IAX_IE_CALLTOKEN, &tokenlen);
+	if (tokenlen) {
+		if (!iax_calltoken_valid(ctx, sin, token, tokenlen)) {
+			ctx->admission.invalid++;
+			return 0;
+		}
+		proven = 1;
+	}
+	if (!proven && ctx->admit_rate && !iax_admit_rate(ctx, sin)) {
+		ctx->admission.limited++;
+		return 0;
+	}
+	res = ctx->admit ? ctx->admit(ctx, (struct sockaddr *)sin, subclass, &cause, ctx->admit_data) : IAX_ADMIT_ACCEPT;
+	/* a POKE only wants its PONG, there is no need to keep anything */
+	if (subclass == IAX_COMMAND_POKE && (res == IAX_ADMIT_ACCEPT || res == IAX_ADMIT_TOKEN)) {
+		ctx->admission.poked++;
+		iax_send_stateless(ctx, sin, fh, IAX_COMMAND_PONG, NULL);
+		return 0;
+	}
+	if (res == IAX_ADMIT_TOKEN) {
+		if (proven) {
+			res = IAX_ADMIT_ACCEPT;
+		} else if (subclass != IAX_COMMAND_NEW && subclass != IAX_COMMAND_REGREQ) {
+			/* only a NEW or REGREQ can prove its source, anything else needs a session first */
+			res = IAX_ADMIT_REJECT;
+		} else if (token) {
+			/* the peer supports call tokens, hand one out and forget about it */
+			ctx->admission.challenged++;
+			memset(&ied, 0, sizeof(ied));
+			iax_ie_append_str(&ied, IAX_IE_CALLTOKEN, iax_calltoken_make(ctx, sin, buf, sizeof(buf)));
+			iax_send_stateless(ctx, sin, fh, IAX_COMMAND_CALLTOKEN, &ied);
+			return 0;
+		} else {
+			res = IAX_ADMIT_REJECT;
+			cause = "Call token required";
+		}
+	}
+	switch (res) {
+	case IAX_ADMIT_ACCEPT:
+		ctx->admission.accepted++;
+		return 1;
+	case IAX_ADMIT_REJECT:
+		ctx->admission.rejected++;
+		if (subclass == IAX_COMMAND_NEW || subclass == IAX_COMMAND_REGREQ) {
+			memset(&ied, 0, sizeof(ied));
+			iax_ie_append_str(&ied, IAX_IE_CAUSE, cause ? cause : subclass == IAX_COMMAND_NEW ?
+					"Call rejected" : "Registration rejected");
+			iax_send_stateless(ctx, sin, fh, subclass == IAX_COMMAND_NEW ?
+					IAX_COMMAND_REJECT : IAX_COMMAND_REGREJ, &ied);
+		} else
+			iax_send_stateless(ctx, sin, fh, IAX_COMMAND_INVAL, NULL);
+		return 0;
+	default:
+		ctx->admission.dropped++;
+		return 0;
 	}
-	return event;
 }
 
-static struct iax_session *iax_txcnt_session(struct ast_iax2_full_hdr *fh, int datalen,
-				struct sockaddr_in *sin, short callno, short dcallno)
+static struct iax_session *iax_txcnt_session(struct iax_context *ctx, struct ast_iax2_full_hdr *fh, int datalen,
+				struct sockaddr_storage *sin, short callno, short dcallno)
 {
 	int subclass = uncompress_subclass(fh->csub);
 	unsigned char buf[ 65536 ]; /* allocated on stack with same size as iax_net_read() */
@@ -3091,7 +4487,7 @@ static struct iax_session *iax_txcnt_session(struct ast_iax2_full_hdr *fh, int d
 	if (!ies.transferid) {
 		return NULL;	/* TXCNT without proper IAX_IE_TRANSFERID */
 	}
-	for( cur=sessions; cur; cur=cur->next ) {
+	for( cur=ctx->sessions; cur; cur=cur->next ) {
 		if ((cur->transferring) && (cur->transferid == (int) ies.transferid) &&
 		   	(cur->callno == dcallno) && (cur->transfercallno == callno)) {
 			/* We're transferring ---
@@ -3099,58 +4495,100 @@ static struct iax_session *iax_txcnt_session(struct ast_iax2_full_hdr *fh, int d
 			 *  remote peer behind symmetric NAT, verify
 			 *  transferid instead
 			 */
-			cur->transfer.sin_addr.s_addr = sin->sin_addr.s_addr; /* setup for further handling */
-			cur->transfer.sin_port = sin->sin_port;
+			cur->transfer = *sin; /* setup for further handling */
 			break;
 		}
 	}
 	return cur;
 }
 
-struct iax_event *iax_net_process(unsigned char *buf, int len, struct sockaddr_in *sin)
+struct iax_event *iax_net_process(unsigned char *buf, int len, struct sockaddr *from)
+{
+	return iax_context_net_process(iax_current(), buf, len, from);
+}
+
+struct iax_event *iax_context_net_process(struct iax_context *ctx, unsigned char *buf, int len, struct sockaddr *from)
 {
+	struct sockaddr_storage addr, *sin = &addr;
+	char host[64];
+
 	struct ast_iax2_full_hdr *fh = (struct ast_iax2_full_hdr *)buf;
 	struct ast_iax2_mini_hdr *mh = (struct ast_iax2_mini_hdr *)buf;
 	struct ast_iax2_video_hdr *vh = (struct ast_iax2_video_hdr *)buf;
 	struct iax_session *session;
 
+	/* stamp the arrival, voice events carry it through the jitterbuffer */
+	ctx->rx_stamp = iax_monotonic_us();
+	iax_addr_set(&addr, from);
+
 	if (ntohs(fh->scallno) & IAX_FLAG_FULL) {
 		/* Full size header */
 		if (len < sizeof(struct ast_iax2_full_hdr)) {
-			DEBU(G "Short header received from %s\n", inet_ntoa(sin->sin_addr));
-			IAXERROR "Short header received from %s\n", inet_ntoa(sin->sin_addr));
+			DEBU(G "Short header received from %s\n", iax_addr_str(sin, host, sizeof(host)));
+			IAXERROR(ctx) "Short header received from %s\n", iax_addr_str(sin, host, sizeof(host)));
 			return NULL;
 		}
 		/* We have a full header, process appropriately */
-		session = iax_find_session(sin,
+		session = iax_find_session(ctx, sin,
 				ntohs(fh->scallno) & ~IAX_FLAG_FULL,
-				ntohs(fh->dcallno) & ~IAX_FLAG_RETRANS, 1);
+				ntohs(fh->dcallno) & ~IAX_FLAG_RETRANS, 0);
+		if (!session && !(ntohs(fh->dcallno) & ~IAX_FLAG_RETRANS)) {
+			/* only admitted peers get a session */
+			if (!iax_admit(ctx, sin, fh, len - sizeof(struct ast_iax2_full_hdr)))
+				return NULL;
+			session = iax_peer_session(ctx, sin, ntohs(fh->scallno) & ~IAX_FLAG_FULL);
+		}
 		if (!session)
-			session = iax_txcnt_session(fh,
+			session = iax_txcnt_session(ctx, fh,
 					len - sizeof(struct ast_iax2_full_hdr),
 					sin, ntohs(fh->scallno) & ~IAX_FLAG_FULL,
 					ntohs(fh->dcallno) & ~IAX_FLAG_RETRANS);
+		if (session && session->encrypted &&
+		    iax_decrypt_frame(session, buf, &len, 4, sizeof(struct ast_iax2_full_hdr))) {
+			DEBU(G "Undecryptable frame from %s\n", iax_addr_str(sin, host, sizeof(host)));
+			return NULL;
+		}
 		if (session)
 			return iax_header_to_event(session, fh, len - sizeof(struct ast_iax2_full_hdr), sin);
 		DEBU(G "No session?\n");
 		return NULL;
 	} else {
 		if (len < sizeof(struct ast_iax2_mini_hdr)) {
-			DEBU(G "Short header received from %s\n", inet_ntoa(sin->sin_addr));
-			IAXERROR "Short header received from %s\n", inet_ntoa(sin->sin_addr));
+			DEBU(G "Short header received from %s\n", iax_addr_str(sin, host, sizeof(host)));
+			IAXERROR(ctx) "Short header received from %s\n", iax_addr_str(sin, host, sizeof(host)));
 			return NULL;
 		}
 		/* Miniature, voice frame */
 		if ((vh->zeros == 0) && (ntohs(vh->callno) & 0x8000))
 		{
-			session = iax_find_session(sin, ntohs(vh->callno) & ~0x8000, 0, 0);
+			session = iax_find_session(ctx, sin, ntohs(vh->callno) & ~0x8000, 0, 0);
 
+			/* never encrypted, so not to be trusted on an encrypted call */
+			if (session && session->encrypted)
+				return NULL;
 			if (session)
 				return iax_videoheader_to_event(session, vh,
 						len - sizeof(struct ast_iax2_video_hdr));
+		} else if (vh->zeros == 0) {
+			/* meta frame, only trunks carry anything for us */
+			struct ast_iax2_meta_hdr *meta = (struct ast_iax2_meta_hdr *)buf;
+
+			if (len < sizeof(struct ast_iax2_meta_hdr) + sizeof(struct ast_iax2_meta_trunk_hdr)) {
+				DEBU(G "Short trunk header received from %s\n", iax_addr_str(sin, host, sizeof(host)));
+				IAXERROR(ctx) "Short trunk header received from %s\n", iax_addr_str(sin, host, sizeof(host)));
+				return NULL;
+			}
+			if (meta->metacmd == IAX_META_TRUNK)
+				iax_trunk_to_events(ctx, sin, meta, len);
+			return NULL;
 		} else {
 			/* audio frame */
-			session = iax_find_session(sin, ntohs(fh->scallno), 0, 0);
+			session = iax_find_session(ctx, sin, ntohs(fh->scallno), 0, 0);
+			if (session && session->encrypted &&
+			    iax_decrypt_frame(session, buf, &len, 2, sizeof(struct ast_iax2_mini_hdr))) {
+				DEBU(G "Undecryptable frame from %s\n", iax_addr_str(sin, host, sizeof(host)));
+				return NULL;
+			}
 			if (session)
 				return iax_miniheader_to_event(session, mh,
 						len - sizeof(struct ast_iax2_mini_hdr));
@@ -3160,10 +4598,10 @@ struct iax_event *iax_net_process(unsigned char *buf, int len, struct sockaddr_i
 	}
 }
 
-static struct iax_sched *iax_get_sched(struct timeval tv)
+static struct iax_sched *iax_get_sched(struct iax_context *ctx, struct timeval tv)
 {
 	struct iax_sched *cur, *prev=NULL;
-	cur = schedq;
+	cur = ctx->schedq;
 	/* Check the event schedule first. */
 	while(cur) {
 		if ((tv.tv_sec > cur->when.tv_sec) ||
@@ -3173,7 +4611,7 @@ static struct iax_sched *iax_get_sched(struct timeval tv)
 				if (prev) {
 					prev->next = cur->next;
 				} else {
-					schedq = cur->next;
+					ctx->schedq = cur->next;
 				}
 				return cur;
 		}
@@ -3183,6 +4621,11 @@ static struct iax_sched *iax_get_sched(struct timeval tv)
 }
 
 struct iax_event *iax_get_event(int blocking)
+{
+	return iax_context_get_event(iax_current(), blocking);
+}
+
+static struct iax_event *get_event(struct iax_context *ctx, int blocking)
 {
 	struct iax_event *event;
 	struct iax_frame *frame;
@@ -3192,17 +4635,17 @@ struct iax_event *iax_get_event(int blocking)
 
 	gettimeofday(&tv, NULL);
 
-	while((cur = iax_get_sched(tv)))
+	while((cur = iax_get_sched(ctx, tv)))
 	{
 		event = cur->event;
 		frame = cur->frame;
 		if (event)
 		{
 			/* See if this is an event we need to handle */
-			event = handle_event(event);
+			event = handle_event(ctx, event);
 			if (event)
 			{
-				free(cur);
+				iax_free(cur);
 				return event;
 			}
 		} else if(frame)
@@ -3213,10 +4656,10 @@ struct iax_event *iax_get_event(int blocking)
 				/* It's been acked.  No need to send it.   Destroy the old
 				   frame. If final, destroy the session. */
 				if (frame->final)
-					destroy_session(frame->session);
+					destroy_session(ctx, frame->session);
 				if (frame->data)
-					free(frame->data);
-				free(frame);
+					iax_free(frame->data);
+				iax_free(frame);
 			} else if (frame->retries == 0)
 			{
 				if (frame->transfer)
@@ -3224,9 +4667,9 @@ struct iax_event *iax_get_event(int blocking)
 					/* Send a transfer reject since we weren't able to connect */
 					iax_send_txrej(frame->session);
 					if (frame->data)
-						free(frame->data);
-					free(frame);
-					free(cur);
+						iax_free(frame->data);
+					iax_free(frame);
+					iax_free(cur);
 					break;
 				} else
 				{
@@ -3234,22 +4677,23 @@ struct iax_event *iax_get_event(int blocking)
 					   final frame, destroy the session, otherwise, pass up timeout */
 					if (frame->final)
 					{
-						destroy_session(frame->session);
+						destroy_session(ctx, frame->session);
 						if (frame->data)
-							free(frame->data);
-						free(frame);
+							iax_free(frame->data);
+						iax_free(frame);
 					} else
 					{
-						event = (struct iax_event *)malloc(sizeof(struct iax_event));
+						event = (struct iax_event *)iax_malloc(sizeof(struct iax_event));
 						if (event)
 						{
 							event->etype = IAX_EVENT_TIMEOUT;
 							event->session = frame->session;
+							event->ctx = ctx;
 							if (frame->data)
-								free(frame->data);
-							free(frame);
-							free(cur);
-							return handle_event(event);
+								iax_free(frame->data);
+							iax_free(frame);
+							iax_free(cur);
+							return handle_event(ctx, event);
 						}
 					}
 				}
@@ -3258,13 +4702,18 @@ struct iax_event *iax_get_event(int blocking)
 				struct ast_iax2_full_hdr *fh;
 				/* Decrement remaining retries */
 				frame->retries--;
-				/* Multiply next retry time by 4, not above MAX_RETRY_TIME though */
-				frame->retrytime *= 4;
+				/* The ACK could be for either transmission, so it is no sample (Karn) */
+				frame->sent = 0;
+				/* Double the next retry time, not above MAX_RETRY_TIME though */
+				frame->retrytime *= 2;
 				/* Keep under 1000 ms if this is a transfer packet */
 				if (!frame->transfer)
 				{
 					if (frame->retrytime > MAX_RETRY_TIME)
 						frame->retrytime = MAX_RETRY_TIME;
+					/* Keep the backed off timer for new frames until a fresh sample */
+					if (frame->session->rto < frame->retrytime)
+						frame->session->rto = frame->retrytime;
 				} else if (frame->retrytime > 1000)
 					frame->retrytime = 1000;
 				fh = (struct ast_iax2_full_hdr *)(frame->data);
@@ -3272,17 +4721,17 @@ struct iax_event *iax_get_event(int blocking)
 				iax_xmit_frame(frame);
 				/* Schedule another retransmission */
 				DEBU(G "Scheduling retransmission %d\n", frame->retries);
-				iax_sched_add(NULL, frame, NULL, NULL, frame->retrytime);
+				iax_sched_add(ctx, NULL, frame, NULL, NULL, frame->retrytime);
 			}
 		} else if (cur->func)
 		{
-		    cur->func(cur->arg);
+		    cur->func(ctx, cur->arg);
 		}
-		free(cur);
+		iax_free(cur);
 	}
 
 	/* get jitterbuffer-scheduled events */
-	for ( session = sessions; session; session = session->next )
+	for ( session = ctx->sessions; session; session = session->next )
 	{
 		int ret;
 		long now;
@@ -3301,7 +4750,8 @@ struct iax_event *iax_get_event(int blocking)
 		switch(ret) {
 		case JB_OK:
 			event = (struct iax_event *)frame.data;
-			event = handle_event(event);
+			event->jbstamp = iax_monotonic_us();
+			event = handle_event(ctx, event);
 			if (event) {
 				return event;
 			}
@@ -3309,15 +4759,18 @@ struct iax_event *iax_get_event(int blocking)
 		case JB_INTERP:
 			/* create an interpolation frame */
 			//fprintf(stderr, "Making Interpolation frame\n");
-			event = (struct iax_event *)malloc(sizeof(struct iax_event));
+			event = (struct iax_event *)iax_malloc(sizeof(struct iax_event));
 			if (event) {
 				event->etype    = IAX_EVENT_VOICE;
 				event->subclass = session->voiceformat;
 				/* XXX: ??? applications probably ignore this anyway */
 				event->ts       = now;
 				event->session  = session;
+				event->ctx      = ctx;
 				event->datalen  = 0;
-				event = handle_event(event);
+				event->rxstamp  = 0;
+				event->jbstamp  = iax_monotonic_us();
+				event = handle_event(ctx, event);
 				if(event)
 					return event;
 			}
@@ -3336,44 +4789,109 @@ struct iax_event *iax_get_event(int blocking)
 	}
 
 	/* Now look for networking events */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	/* datagrams left over from the last batch are already here */
+	if (ctx->batch && ctx->batch->next < ctx->batch->count)
+		blocking = 0;
+#endif
+#ifdef __linux__
+	if (ctx->uring && uring_pending(ctx->uring))
+		blocking = 0;
+#endif
 	if (blocking) {
 		/* Block until there is data if desired */
 		fd_set fds;
-		int nextEventTime;
+		long long nextEventTime;
+		int fd = iax_context_get_fd(ctx);
 
 		FD_ZERO(&fds);
-		FD_SET(netfd, &fds);
+		FD_SET(fd, &fds);
 
-		nextEventTime = iax_time_to_next_event();
+#ifdef __linux__
+		/* nothing may stay queued while waiting */
+		if (ctx->uring)
+			iax_net_flush(ctx);
+#endif
+		nextEventTime = iax_context_time_to_next_event_us(ctx);
 
-		if(nextEventTime < 0) select(netfd + 1, &fds, NULL, NULL, NULL);
+		if(nextEventTime < 0) select(fd + 1, &fds, NULL, NULL, NULL);
 		else
 		{
 			struct timeval nextEvent;
 
-			nextEvent.tv_sec = nextEventTime / 1000;
-			nextEvent.tv_usec = (nextEventTime % 1000) * 1000;
+			nextEvent.tv_sec = (long)(nextEventTime / 1000000);
+			nextEvent.tv_usec = (long)(nextEventTime % 1000000);
 
-			select(netfd + 1, &fds, NULL, NULL, &nextEvent);
+			select(fd + 1, &fds, NULL, NULL, &nextEvent);
 		}
 
 	}
-	event = iax_net_read();
+	event = iax_net_read(ctx);
 
-	return handle_event(event);
+	return handle_event(ctx, event);
+}
+
+struct iax_event *iax_context_get_event(struct iax_context *ctx, int blocking)
+{
+#ifdef __linux__
+	struct iax_event *event;
+
+	/* the responses to a run of datagrams go out together once the ring is drained */
+	ctx->in_event = 1;
+	event = get_event(ctx, blocking);
+	ctx->in_event = 0;
+	if (ctx->uring && !uring_pending(ctx->uring))
+		iax_net_flush(ctx);
+	return event;
+#else
+	return get_event(ctx, blocking);
+#endif
 }
 
 struct sockaddr_in iax_get_peer_addr(struct iax_session *session)
+{
+	struct sockaddr_in sin;
+
+	/* IPv6 peers have no such address */
+	memset(&sin, 0, sizeof(sin));
+	if (session->peeraddr.ss_family == AF_INET)
+		memcpy(&sin, &session->peeraddr, sizeof(sin));
+	return sin;
+}
+
+struct sockaddr_storage iax_get_peer_sockaddr(struct iax_session *session)
 {
 	return session->peeraddr;
 }
 
 void iax_session_destroy(struct iax_session **session)
 {
-	destroy_session(*session);
+	destroy_session((*session)->ctx, *session);
 	*session = NULL;
 }
 
+void iax_session_reset(struct iax_session *session)
+{
+	struct iax_sched *cur;
+
+	/* Retransmissions of the old transaction would only confuse the peer */
+	for (cur = session->ctx->schedq; cur; cur = cur->next) {
+		if (cur->frame && cur->frame->session == session) {
+			cur->frame->retries = -1;
+			cur->frame->final = 0;
+		}
+	}
+	if (session->ack_pending)
+		iax_cancel_ack(session);
+	iax_free(session->calltoken_ies);
+	session->calltoken_ies = NULL;
+	session->peercallno = 0;
+	session->oseqno = 0;
+	session->rseqno = 0;
+	session->iseqno = 0;
+	session->aseqno = 0;
+}
+
 void iax_event_free(struct iax_event *event)
 {
 	/* We gave the user a chance to play with the session now we need to
@@ -3385,19 +4903,56 @@ void iax_event_free(struct iax_event *event)
 	case IAX_EVENT_HANGUP:
 		/* Destroy this session -- it's no longer valid */
 		if (event->session) { /* maybe the user did it already */
-			destroy_session(event->session);
+			destroy_session(event->ctx, event->session);
 		}
 		break;
 	}
-	free(event);
+	iax_free(event);
 }
 
 int iax_get_fd(void)
+{
+	return iax_context_get_fd(iax_current());
+}
+
+int iax_context_get_fd(struct iax_context *ctx)
 {
 	/* Return our network file descriptor. The client can select on this
 	 * (probably with other things, or can add it to a network add sort
 	 * of gtk_input_add for example */
-	return netfd;
+#ifdef __linux__
+	/* with io_uring, datagrams show up as completions on the ring */
+	if (ctx->uring)
+		return uring_fd(ctx->uring);
+#endif
+	return ctx->netfd;
+}
+
+void iax_context_free(struct iax_context *ctx)
+{
+	struct iax_sched *cur;
+
+	if (!ctx || ctx == &default_context)
+		return;
+	iax_context_shutdown(ctx);
+	while (ctx->sessions)
+		destroy_session(ctx, ctx->sessions);
+	while ((cur = ctx->schedq)) {
+		ctx->schedq = cur->next;
+		if (cur->frame) {
+			iax_free(cur->frame->data);
+			iax_free(cur->frame);
+		}
+		iax_free(cur->event);
+		iax_free(cur);
+	}
+	if (current_context == ctx)
+		current_context = NULL;
+	iax_free(ctx->buckets);
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	iax_free(ctx->batch);
+#endif
+	iax_free(ctx);
 }
 
 int iax_quelch_moh(struct iax_session *session, int MOH)
@@ -12,13 +12,15 @@
  */
 
 #if defined(WIN32)  ||  defined(_WIN32_WCE)
-#include <winsock.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #define snprintf _snprintf
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #endif
 
 #ifndef _MSC_VER
@@ -32,6 +34,7 @@
 #include "frame.h"
 #include "iax2.h"
 #include "iax2-parser.h"
+#include "jitterbuf.h"
 
 static int frames = 0;
 static int iframes = 0;
@@ -66,6 +69,8 @@ static void internalerror(const char *str)
 
 static void (*outputf)(const char *str) = internaloutput;
 static void (*errorf)(const char *str) = internalerror;
+static void *(*allocf)(size_t size) = malloc;
+static void (*releasef)(void *ptr) = free;
 
 static void dump_addr(char *output, int maxlen, void *value, int len)
 {
@@ -190,6 +195,7 @@ static struct iax2_ie {
 	{ IAX_IE_CALLINGTON, "CALLING TYPEOFNUM", dump_byte },
 	{ IAX_IE_CALLINGTNS, "CALLING TRANSITNET", dump_short },
 	{ IAX_IE_SAMPLINGRATE, "SAMPLINGRATE", dump_samprate },
+	{ IAX_IE_ENCRYPTION, "ENCRYPTION", dump_short },
 	{ IAX_IE_CODEC_PREFS, "CODEC_PREFS", dump_string },
 	{ IAX_IE_RR_JITTER, "RR_JITTER", dump_int },
 	{ IAX_IE_RR_LOSS, "RR_LOSS", dump_int },
@@ -197,6 +203,7 @@ static struct iax2_ie {
 	{ IAX_IE_RR_DELAY, "RR_DELAY", dump_short },
 	{ IAX_IE_RR_DROPPED, "RR_DROPPED", dump_int },
 	{ IAX_IE_RR_OOO, "RR_OOO", dump_int },
+	{ IAX_IE_CALLTOKEN, "CALLTOKEN", dump_string },
 };
 
 const char *iax_ie2str(int ie)
@@ -286,7 +293,7 @@ static void dump_ies(unsigned char *iedata, int len)
 	outputf("\n");
 }
 
-void iax_showframe(struct iax_frame *f, struct ast_iax2_full_hdr *fhi, int rx, struct sockaddr_in *sin, int datalen)
+void iax_showframe(struct iax_frame *f, struct ast_iax2_full_hdr *fhi, int rx, struct sockaddr *sa, int datalen)
 {
 	const char *frames[] = {
 		"(0?)",
@@ -336,7 +343,10 @@ void iax_showframe(struct iax_frame *f, struct ast_iax2_full_hdr *fhi, int rx, s
 		"TRANSFER",
 		"PROVISION",
 		"FWDOWNLD",
-		"FWDATA"
+		"FWDATA",
+		"TXMEDIA",
+		"RTKEY",
+		"CALLTOKEN"
 	};
 	const char *cmds[] = {
 		"(0?)",
@@ -354,6 +364,7 @@ void iax_showframe(struct iax_frame *f, struct ast_iax2_full_hdr *fhi, int rx, s
 	const char *clas;
 	const char *subclass;
 	char tmp[256];
+	char host[64], port[8];
 
 	if (f) {
 		fh = (struct ast_iax2_full_hdr *)f->data;
@@ -401,11 +412,16 @@ snprintf(tmp, (int)sizeof(tmp),
 	(rx ? "Rx" : "Tx"),
 	retries, fh->oseqno, fh->iseqno, clas, subclass);
 	outputf(tmp);
+	if (getnameinfo(sa, sa->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in),
+			host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV)) {
+		strcpy(host, "?");
+		strcpy(port, "?");
+	}
 snprintf(tmp, (int)sizeof(tmp), 
-"   Timestamp: %05lums  SCall: %5.5d  DCall: %5.5d [%s:%d]\n",
+"   Timestamp: %05lums  SCall: %5.5d  DCall: %5.5d [%s]:%s\n",
 	(unsigned long)ntohl(fh->ts),
 	ntohs(fh->scallno) & ~IAX_FLAG_FULL, ntohs(fh->dcallno) & ~IAX_FLAG_RETRANS,
-		inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+		host, port);
 	outputf(tmp);
 	if (fh->type == AST_FRAME_IAX)
 		dump_ies(fh->iedata, datalen);
@@ -470,6 +486,23 @@ void iax_set_error(void (*func)(const char *))
 	errorf = func;
 }
 
+void iax_set_allocator(void *(*alloc)(size_t), void (*release)(void *))
+{
+	allocf = alloc;
+	releasef = release;
+	jb_setallocator(alloc, release);
+}
+
+void *iax_malloc(size_t size)
+{
+	return allocf(size);
+}
+
+void iax_free(void *ptr)
+{
+	releasef(ptr);
+}
+
 int iax_parse_ies(struct iax_ies *ies, unsigned char *data, int datalen)
 {
 	/* Parse data into information elements */
@@ -749,6 +782,18 @@ int iax_parse_ies(struct iax_ies *ies, unsigned char *data, int datalen)
 				ies->rr_ooo = ntohl(get_uint32(data + 2));
 			}
 			break;
+		case IAX_IE_ENCRYPTION:
+			if (len != (int)sizeof(unsigned short)) {
+				snprintf(tmp, (int)sizeof(tmp), "Expecting encryption to be %d bytes long but was %d\n", (int)sizeof(unsigned short), len);
+				errorf(tmp);
+			} else
+				ies->encmethods = ntohs(get_uint16(data + 2));
+			break;
+		case IAX_IE_CALLTOKEN:
+			ies->calltoken = 1;
+			if (len)
+				ies->calltokendata = (char *) data + 2;
+			break;
 		default:
 			snprintf(tmp, (int)sizeof(tmp), "Ignoring unknown information element '%s' (%d) of length %d\n", iax_ie2str(ie), ie, len);
 			outputf(tmp);
@@ -784,7 +829,7 @@ void iax_frame_wrap(struct iax_frame *fr, struct ast_frame *f)
 struct iax_frame *iax_frame_new(int direction, int datalen)
 {
 	struct iax_frame *fr;
-	fr = (struct iax_frame *)malloc((int)sizeof(struct iax_frame) + datalen);
+	fr = (struct iax_frame *)iax_malloc((int)sizeof(struct iax_frame) + datalen);
 	if (fr) {
 		fr->direction = direction;
 		fr->retrans = -1;
@@ -809,7 +854,7 @@ void iax_frame_free(struct iax_frame *fr)
 		return;
 	}
 	fr->direction = 0;
-	free(fr);
+	iax_free(fr);
 	frames--;
 }
 
@@ -39,6 +39,7 @@ struct iax_ies {
 	char *rsa_result;
 	struct sockaddr_in *apparent_addr;
 	unsigned short refresh;
+	unsigned short encmethods;
 	unsigned short dpstatus;
 	unsigned short callno;
 	char *cause;
@@ -64,6 +65,8 @@ struct iax_ies {
 	unsigned short rr_delay;
 	unsigned int rr_dropped;
 	unsigned int rr_ooo;
+	int calltoken;
+	char *calltokendata;
 };
 
 #define DIRECTION_INGRESS 1
@@ -87,6 +90,8 @@ struct iax_frame {
 	unsigned int ts;
 	/* How long to wait before retrying */
 	int retrytime;
+	/* Monotonic time (us) of the only transmission, 0 once retransmitted */
+	unsigned long long sent;
 	/* Are we received out of order?  */
 	int outoforder;
 	/* Have we been sent at all yet? */
@@ -121,7 +126,15 @@ struct iax_ie_data {
 extern void iax_set_output(void (*output)(const char *data));
 /* Choose a different function for errors */
 extern void iax_set_error(void (*output)(const char *data));
-extern void iax_showframe(struct iax_frame *f, struct ast_iax2_full_hdr *fhi, int rx, struct sockaddr_in *sin, int datalen);
+/* Choose different functions to allocate events, frames, jitterbuffers, sessions
+   and everything else the library keeps (the io_uring buffers aside).  Set them
+   before iax_init and leave them; release is called from whichever thread frees
+   an event and must take anything alloc returned */
+extern void iax_set_allocator(void *(*alloc)(size_t size), void (*release)(void *ptr));
+/* Allocate and release through the chosen functions */
+extern void *iax_malloc(size_t size);
+extern void iax_free(void *ptr);
+extern void iax_showframe(struct iax_frame *f, struct ast_iax2_full_hdr *fhi, int rx, struct sockaddr *sa, int datalen);
 
 extern const char *iax_ie2str(int ie);
 
@@ -67,6 +67,9 @@
 #define IAX_COMMAND_PROVISION	35	/* Provision device */
 #define IAX_COMMAND_FWDOWNL    36      /* Download firmware */
 #define IAX_COMMAND_FWDATA     37      /* Firmware Data */
+#define IAX_COMMAND_TXMEDIA    38      /* Transfer media only */
+#define IAX_COMMAND_RTKEY      39      /* Rotate key */
+#define IAX_COMMAND_CALLTOKEN  40      /* Call token, proves the source address */
 
 #define IAX_DEFAULT_REG_EXPIRE  60	/* By default require re-registration once per minute */
 
@@ -127,6 +130,9 @@
 #define IAX_IE_RR_DELAY                         49              /* Max playout delay for received frames (in ms) u16 */
 #define IAX_IE_RR_DROPPED                       50              /* Dropped frames (presumably by jitterbuf) u32 */
 #define IAX_IE_RR_OOO                           51              /* Frames received Out of Order u32 */
+#define IAX_IE_VARIABLE                         52              /* Remote variable */
+#define IAX_IE_OSPTOKEN                         53              /* OSP token */
+#define IAX_IE_CALLTOKEN                        54              /* Call token, empty to announce support */
 
 
 
@@ -134,9 +140,14 @@
 #define IAX_AUTH_MD5				(1 << 1)
 #define IAX_AUTH_RSA				(1 << 2)
 
+#define IAX_ENCRYPT_AES128			(1 << 0)
+
 #define IAX_META_TRUNK				1		/* Trunk meta-message */
 #define IAX_META_VIDEO				2		/* Video frame */
 
+#define IAX_META_TRUNK_SUPERMINI	0		/* This trunk frame contains classic supermini frames */
+#define IAX_META_TRUNK_MINI			1		/* This trunk frame contains trunked mini frames */
+
 #define IAX_RATE_8KHZ                          (1 << 0) /* 8khz sampling (default if absent) */
 #define IAX_RATE_11KHZ                         (1 << 1) /* 11.025khz sampling */
 #define IAX_RATE_16KHZ                         (1 << 2) /* 16khz sampling */
@@ -202,6 +213,12 @@ struct ast_iax2_meta_trunk_entry {
 	unsigned short len;				/* Length of data for this callno */
 } __PACKED;
 
+/* When trunk timestamps are used, we use this format instead */
+struct ast_iax2_meta_trunk_mini {
+	unsigned short len;
+	struct ast_iax2_mini_hdr mini;		/* this is an actual miniframe */
+} __PACKED;
+
 #define IAX_FIRMWARE_MAGIC 0x69617879
 
 struct ast_iax2_firmware_header {
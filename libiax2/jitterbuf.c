@@ -21,7 +21,6 @@
 #include "jitterbuf.h"
 
 /* define these here, just for ancient compiler systems */
-#define JB_LONGMAX 2147483647L
 #define JB_LONGMIN (-JB_LONGMAX - 1L)
 
 /* MS VC can't do __VA_ARGS__ */
@@ -51,6 +50,8 @@
 #endif
 
 static jb_output_function_t warnf, errf, dbgf;
+static jb_alloc_function_t allocf = malloc;
+static jb_free_function_t freef = free;
 
 void jb_setoutput(jb_output_function_t err, jb_output_function_t warn, jb_output_function_t dbg)
 {
@@ -59,6 +60,12 @@ void jb_setoutput(jb_output_function_t err, jb_output_function_t warn, jb_output
 	dbgf = dbg;
 }
 
+void jb_setallocator(jb_alloc_function_t alloc, jb_free_function_t release)
+{
+	allocf = alloc;
+	freef = release;
+}
+
 static void increment_losspct(jitterbuf *jb)
 {
 	jb->info.losspct = (100000 + 499 * jb->info.losspct)/500;
@@ -85,7 +92,7 @@ jitterbuf * jb_new()
 {
 	jitterbuf *jb;
 
-	if (!(jb = (jitterbuf *)malloc(sizeof(*jb))))
+	if (!(jb = (jitterbuf *)allocf(sizeof(*jb))))
 		return NULL;
 
 	jb->info.conf.target_extra = JB_TARGET_EXTRA;
@@ -105,12 +112,12 @@ void jb_destroy(jitterbuf *jb)
 	frame = jb->free;
 	while (frame != NULL) {
 		jb_frame *next = frame->next;
-		free(frame);
+		freef(frame);
 		frame = next;
 	}
 
 	/* free ourselves! */
-	free(jb);
+	freef(jb);
 }
 
 
@@ -332,7 +339,7 @@ static int queue_put(jitterbuf *jb, void *data, const enum jb_frame_type type, l
 
 	if ((frame = jb->free)) {
 		jb->free = frame->next;
-	} else if (!(frame = (jb_frame *)malloc(sizeof(*frame)))) {
+	} else if (!(frame = (jb_frame *)allocf(sizeof(*frame)))) {
 		jb_err("cannot allocate frame\n");
 		return 0;
 	}
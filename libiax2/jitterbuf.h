@@ -34,6 +34,8 @@ extern "C" {
 #define JB_TARGET_EXTRA 40
 	/* ms between growing and shrinking; may not be honored if jitterbuffer runs out of space */
 #define JB_ADJUST_DELAY 40
+	/* returned by jb_next() when nothing is scheduled */
+#define JB_LONGMAX 2147483647L
 
 enum jb_return_code {
 	/* return codes */
@@ -154,6 +156,11 @@ enum jb_return_code jb_setconf(jitterbuf *jb, jb_conf *conf);
 typedef			void (*jb_output_function_t)(const char *fmt, ...);
 extern void jb_setoutput(jb_output_function_t err, jb_output_function_t warn, jb_output_function_t dbg);
 
+/* allocate jitterbuffers and their frames with something else than malloc and free */
+typedef			void *(*jb_alloc_function_t)(size_t size);
+typedef			void (*jb_free_function_t)(void *ptr);
+extern void jb_setallocator(jb_alloc_function_t alloc, jb_free_function_t release);
+
 #ifdef __cplusplus
 }
 #endif
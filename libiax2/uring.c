@@ -0,0 +1,496 @@
+/*
+ * io_uring networking for libiax2.
+ *
+ * A single multishot recvmsg stays armed on the socket and takes its buffers
+ * from a ring registered with the kernel, so no system call is made while
+ * datagrams keep arriving.  Sends are copied into a slot and queued; the
+ * owner submits all that piled up with one uring_flush, or a submission
+ * thread (if asked for and granted) picks them up.  Their completions come
+ * back on the ring, failed ones are counted for uring_errors.  Everything
+ * else runs on the thread that owns the libiax2 context.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU Lesser (Library) General Public License
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* receive buffers, each takes a datagram of the size given to uring_new */
+#define RECV_BUFFERS 32
+#define RECV_GROUP 0
+#define RECV_HEADER (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage))
+
+/* queued sends of up to the same size, larger ones go out directly */
+#define SEND_SLOTS 32
+
+#define SQ_ENTRIES 128
+#define CQ_ENTRIES 1024
+/* milliseconds the submission thread keeps polling before it sleeps */
+#define SQ_IDLE 50
+
+/* user data of the receive request, sends carry their slot + 1 */
+#define RECV_TAG 0
+
+struct send_slot {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage to;
+	unsigned char buf[];
+};
+
+struct uring {
+	int fd;
+	int sock;
+	int sqpoll;
+
+	/* the longest datagram and the size of a receive buffer and a send slot */
+	int maxlen;
+	size_t recv_size;
+	size_t slot_size;
+
+	/* submission ring, its array maps every entry to the sqe of the same index */
+	void *sq_map;
+	size_t sq_map_len;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_flags;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	/* completion ring */
+	void *cq_map;
+	size_t cq_map_len;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* the receive request, its buffers and the one handed out (-1 if none) */
+	struct msghdr recv_msg;
+	int armed;
+	struct io_uring_buf_ring *br;
+	unsigned short br_tail;
+	unsigned char *bufs;
+	int current;
+
+	/* send slots (NULL if sends aren't queued), the stack of free ones and
+	   the failed sends not yet reported */
+	unsigned char *slots;
+	int free_slots[SEND_SLOTS];
+	int nfree;
+	int errors;
+	int error;
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+	return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *r)
+{
+	unsigned tail = *r->sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+		return NULL;
+	sqe = &r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+/* without a submission thread, tell the kernel about everything queued */
+static void flush(struct uring *r)
+{
+	unsigned queued = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+	if (!r->sqpoll && queued)
+		sys_enter(r->fd, queued, 0, 0);
+}
+
+/* publish the sqe taken last, without a submission thread it waits for a flush unless now is set */
+static void submit(struct uring *r, int now)
+{
+	__atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+	if (!r->sqpoll) {
+		if (now)
+			flush(r);
+		return;
+	}
+	/* the thread may have gone to sleep before it saw the new tail */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)
+		sys_enter(r->fd, 0, 0, IORING_ENTER_SQ_WAKEUP);
+}
+
+static void arm_recv(struct uring *r)
+{
+	struct io_uring_sqe *sqe = get_sqe(r);
+
+	/* the ring is full of sends, try again on the next receive */
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = r->sock;
+	sqe->addr = (unsigned long)&r->recv_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_GROUP;
+	sqe->user_data = RECV_TAG;
+	submit(r, 1);
+	r->armed = 1;
+}
+
+static void recycle(struct uring *r, int bid)
+{
+	struct io_uring_buf *buf = &r->br->bufs[r->br_tail & (RECV_BUFFERS - 1)];
+
+	buf->addr = (unsigned long)(r->bufs + (size_t)bid * r->recv_size);
+	buf->len = (unsigned)r->recv_size;
+	buf->bid = (unsigned short)bid;
+	__atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+/* free the slot of a completed send and count it if it failed */
+static void complete_send(struct uring *r, unsigned long long tag, int res)
+{
+	r->free_slots[r->nfree++] = (int)(tag - 1);
+	if (res < 0) {
+		r->errors++;
+		r->error = -res;
+	}
+}
+
+/* take the completed sends up to the next receive completion */
+static void reap_sends(struct uring *r)
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = &r->cqes[head & *r->cq_mask];
+		if (cqe->user_data == RECV_TAG)
+			break;
+		complete_send(r, cqe->user_data, cqe->res);
+		__atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+	}
+}
+
+void uring_free(struct uring *r)
+{
+	/* closing the ring cancels the receive and drops the buffer registration */
+	if (r->fd >= 0)
+		close(r->fd);
+	if (r->sq_map && r->sq_map != MAP_FAILED)
+		munmap(r->sq_map, r->sq_map_len);
+	if (r->cq_map && r->cq_map != MAP_FAILED)
+		munmap(r->cq_map, r->cq_map_len);
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_len);
+	if (r->br && r->br != MAP_FAILED)
+		munmap(r->br, RECV_BUFFERS * sizeof(struct io_uring_buf));
+	free(r->bufs);
+	free(r->slots);
+	free(r);
+}
+
+struct uring *uring_new(int sock, int maxlen, int flags)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct uring *r;
+	unsigned char *sq;
+	unsigned char *cq;
+	unsigned i;
+
+	r = (struct uring *)calloc(1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->sock = sock;
+	r->current = -1;
+	r->maxlen = maxlen;
+	r->recv_size = RECV_HEADER + maxlen;
+	r->slot_size = (sizeof(struct send_slot) + maxlen + 15) & ~(size_t)15;
+
+	/* a submission thread if asked for (unprivileged since Linux 5.11) */
+	r->fd = -1;
+	if ((flags & URING_SEND) && (flags & URING_SQPOLL)) {
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_SQPOLL | IORING_SETUP_CQSIZE;
+		p.sq_thread_idle = SQ_IDLE;
+		p.cq_entries = CQ_ENTRIES;
+		r->fd = sys_setup(SQ_ENTRIES, &p);
+		r->sqpoll = r->fd >= 0;
+	}
+	if (r->fd < 0) {
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = CQ_ENTRIES;
+		r->fd = sys_setup(SQ_ENTRIES, &p);
+	}
+	if (r->fd < 0 || !(p.features & IORING_FEAT_NODROP))
+		goto fail;
+
+	/* map both rings and the sqes */
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq_map == MAP_FAILED || r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED)
+		goto fail;
+	sq = (unsigned char *)r->sq_map;
+	cq = (unsigned char *)r->cq_map;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+	r->sq_entries = p.sq_entries;
+	for (i = 0; i < p.sq_entries; i++)
+		((unsigned *)(sq + p.sq_off.array))[i] = i;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/* register the buffer ring (page aligned) and fill it */
+	r->br = (struct io_uring_buf_ring *)mmap(NULL, RECV_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	r->bufs = (unsigned char *)malloc(RECV_BUFFERS * r->recv_size);
+	if (flags & URING_SEND)
+		r->slots = (unsigned char *)malloc(SEND_SLOTS * r->slot_size);
+	if (r->br == MAP_FAILED || !r->bufs || ((flags & URING_SEND) && !r->slots))
+		goto fail;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)r->br;
+	reg.ring_entries = RECV_BUFFERS;
+	reg.bgid = RECV_GROUP;
+	if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+	for (i = 0; i < RECV_BUFFERS; i++)
+		recycle(r, (int)i);
+	for (i = 0; r->slots && i < SEND_SLOTS; i++)
+		r->free_slots[r->nfree++] = (int)i;
+
+	/* only the sender's address is of interest */
+	r->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+	arm_recv(r);
+	return r;
+
+fail:
+	uring_free(r);
+	return NULL;
+}
+
+int uring_fd(struct uring *r)
+{
+	return r->fd;
+}
+
+int uring_sqpoll(struct uring *r)
+{
+	return r->sqpoll;
+}
+
+int uring_pending(struct uring *r)
+{
+	return *r->cq_head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) ||
+		(__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW);
+}
+
+void uring_done(struct uring *r)
+{
+	if (r->current >= 0) {
+		recycle(r, r->current);
+		r->current = -1;
+	}
+}
+
+int uring_recv(struct uring *r, struct uring_datagram *dgram)
+{
+	struct io_uring_recvmsg_out *out;
+	struct io_uring_cqe *cqe;
+	unsigned char *buf;
+	unsigned head;
+	unsigned flags;
+	unsigned long long tag;
+	int res;
+
+	uring_done(r);
+	for (;;) {
+		head = *r->cq_head;
+		if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			/* completions that found the ring full wait in the kernel */
+			if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW) {
+				sys_enter(r->fd, 0, 0, IORING_ENTER_GETEVENTS);
+				if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+					continue;
+			}
+			/* the receive ends when it ran out of buffers, they are all back by now */
+			if (!r->armed)
+				arm_recv(r);
+			flush(r);
+			return 0;
+		}
+		cqe = &r->cqes[head & *r->cq_mask];
+		tag = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if (tag != RECV_TAG) {
+			complete_send(r, tag, res);
+			continue;
+		}
+		if (!(flags & IORING_CQE_F_MORE))
+			r->armed = 0;
+		if (!(flags & IORING_CQE_F_BUFFER))
+			continue;
+		r->current = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+		buf = r->bufs + (size_t)r->current * r->recv_size;
+		out = (struct io_uring_recvmsg_out *)buf;
+		/* longer than any IAX frame, it can't be ours */
+		if (res < 0 || (out->flags & MSG_TRUNC)) {
+			uring_done(r);
+			continue;
+		}
+		dgram->from = (struct sockaddr *)(buf + sizeof(*out));
+		dgram->fromlen = out->namelen < r->recv_msg.msg_namelen ? out->namelen : r->recv_msg.msg_namelen;
+		dgram->data = buf + sizeof(*out) + r->recv_msg.msg_namelen + r->recv_msg.msg_controllen;
+		dgram->len = (int)out->payloadlen;
+		return 1;
+	}
+}
+
+int uring_send(struct uring *r, const void *buf, int len, const struct sockaddr *to, socklen_t tolen)
+{
+	struct io_uring_sqe *sqe;
+	struct send_slot *s;
+	int slot;
+
+	if (!r->slots || len > r->maxlen || tolen > sizeof(s->to))
+		return -1;
+	/* whatever piled up has to go before there is room again */
+	if (!r->nfree || *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+		flush(r);
+		reap_sends(r);
+	}
+	if (!r->nfree || !(sqe = get_sqe(r)))
+		return -1;
+	slot = r->free_slots[--r->nfree];
+	s = (struct send_slot *)(r->slots + (size_t)slot * r->slot_size);
+	memcpy(s->buf, buf, len);
+	memcpy(&s->to, to, tolen);
+	s->iov.iov_base = s->buf;
+	s->iov.iov_len = len;
+	memset(&s->msg, 0, sizeof(s->msg));
+	s->msg.msg_name = &s->to;
+	s->msg.msg_namelen = tolen;
+	s->msg.msg_iov = &s->iov;
+	s->msg.msg_iovlen = 1;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = r->sock;
+	sqe->addr = (unsigned long)&s->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = slot + 1;
+	submit(r, 0);
+	return 0;
+}
+
+void uring_flush(struct uring *r)
+{
+	flush(r);
+	reap_sends(r);
+}
+
+int uring_errors(struct uring *r, int *error)
+{
+	int errors = r->errors;
+
+	*error = r->error;
+	r->errors = 0;
+	return errors;
+}
+
+#else
+
+/* built without io_uring headers, the socket is always used directly */
+
+struct uring *uring_new(int sock, int maxlen, int flags)
+{
+	return NULL;
+}
+
+void uring_free(struct uring *r)
+{
+}
+
+int uring_fd(struct uring *r)
+{
+	return -1;
+}
+
+int uring_sqpoll(struct uring *r)
+{
+	return 0;
+}
+
+int uring_pending(struct uring *r)
+{
+	return 0;
+}
+
+int uring_recv(struct uring *r, struct uring_datagram *dgram)
+{
+	return 0;
+}
+
+void uring_done(struct uring *r)
+{
+}
+
+int uring_send(struct uring *r, const void *buf, int len, const struct sockaddr *to, socklen_t tolen)
+{
+	return -1;
+}
+
+void uring_flush(struct uring *r)
+{
+}
+
+int uring_errors(struct uring *r, int *error)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * io_uring networking for libiax2 on Linux: multishot recvmsg into a
+ * registered buffer ring and sends queued on the ring, submitted in
+ * batches or by a kernel submission thread
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <sys/socket.h>
+
+struct uring;
+
+/* a received datagram, valid until uring_done */
+struct uring_datagram {
+	unsigned char *data;
+	int len;
+	struct sockaddr *from;
+	socklen_t fromlen;
+};
+
+/* uring_new flags: queue sends on the ring as well, and have a kernel thread
+   submit them (if the kernel grants it) */
+#define URING_SEND	(1 << 0)
+#define URING_SQPOLL	(1 << 1)
+
+/* set up a ring receiving from the datagram socket fd, datagrams longer than
+   maxlen bytes are dropped (and sends that long aren't queued); NULL if the
+   kernel (or the headers the library was built with) can't */
+struct uring *uring_new(int fd, int maxlen, int flags);
+void uring_free(struct uring *ring);
+
+/* the descriptor to wait on, it becomes readable with received datagrams */
+int uring_fd(struct uring *ring);
+
+/* nonzero if a kernel thread submits the sends */
+int uring_sqpoll(struct uring *ring);
+
+/* nonzero if completions are waiting, so waiting on the descriptor would be wrong */
+int uring_pending(struct uring *ring);
+
+/* fetch the next datagram, 0 if there is none; hand it back with uring_done */
+int uring_recv(struct uring *ring, struct uring_datagram *dgram);
+void uring_done(struct uring *ring);
+
+/* queue a datagram, -1 if it has to be sent directly (sends not queued, too
+   large or no free slot); without a submission thread it waits for uring_flush */
+int uring_send(struct uring *ring, const void *buf, int len, const struct sockaddr *to, socklen_t tolen);
+
+/* submit the queued sends with a single system call */
+void uring_flush(struct uring *ring);
+
+/* queued sends that failed since the last call, the error of the last one in *error */
+int uring_errors(struct uring *ring, int *error);
+
+#endif /* !URING_H */
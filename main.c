@@ -18,8 +18,14 @@
 #include "common.h"
 #include "host.h"
 #include "settings.h"
+#include "metrics.h"
 #include "service.h"
 #include "wave.h"
+#include "latency.h"
+#include "recorder.h"
+#include "handoff.h"
+#include "realtime.h"
+#include "registrar.h"
 
 /* correct the byte order */
 static LPVOID ReverseByteOrder(LPVOID buffer, INT length)
@@ -32,10 +38,243 @@ static LPVOID ReverseByteOrder(LPVOID buffer, INT length)
 	return buffer;
 }
 
-/* free the event data from done wave headers */
-static VOID CALLBACK HeaderDone(LPVOID userData)
+/* playout thread events */
+#define PLAYOUT_EVENT_EXIT     0
+#define PLAYOUT_EVENT_HANDOFF  1
+#define PLAYOUT_EVENT_WAVEFORM 2
+#define PLAYOUT_EVENT_MAX      3
+
+/* the audio side of the service, in threaded mode it belongs to the playout
+   thread, which only calls iax_event_free on voice and comfort noise events
+   (a plain free) and never touches any other libiax2 state */
+typedef struct tagPLAYOUT
+{
+	LPSETTINGS Settings;
+	LPWAVE Wave;
+	LPLATENCY Latency;
+	LPRECORDER Recorder;
+	LPMETRICS Metrics;
+	LPHANDOFF Handoff;
+	LPREGISTRAR Registrar;
+	HANDLE Thread;
+	WSAEVENT Shutdown;
+	WSAEVENT Events[PLAYOUT_EVENT_MAX];
+	DWORD DroppedFrames;
+	struct iax_admission_stats Admission;
+	struct iax_ack_stats Acks;
+} PLAYOUT, *LPPLAYOUT;
+
+/* what the admission hook decides on */
+typedef struct tagADMISSION
+{
+	LPSETTINGS Settings;
+	struct iax_session **Session;
+} ADMISSION, *LPADMISSION;
+
+/* record the latency of played voice frames and free the event data from done wave headers */
+static VOID CALLBACK HeaderDone(LPVOID context, LPVOID userData, ULONGLONG submitted, ULONGLONG completed)
+{
+	struct iax_event *evt = (struct iax_event *)userData;
+
+	if (completed != 0 && evt->etype == IAX_EVENT_VOICE)
+		RecordFrameLatency((LPLATENCY)context, evt->rxstamp, evt->jbstamp, submitted, completed);
+	iax_event_free(evt);
+}
+
+/* hand the current metrics to the metrics writer (if any), the file is written on its thread */
+static VOID WriteMetrics(LPPLAYOUT playout, LPCSTR reason)
+{
+	LPMETRICS metrics = playout->Metrics;
+
+	if (metrics == NULL)
+		return;
+	BeginMetrics(metrics, reason);
+	DumpWave(playout->Wave, metrics);
+	DumpLatency(playout->Latency, metrics);
+	if (playout->Recorder != NULL)
+		DumpRecorder(playout->Recorder, metrics);
+	if (playout->Handoff != NULL)
+		PrintMetrics(metrics, "handoff: dropped=%lu\n", playout->DroppedFrames);
+	if (playout->Registrar != NULL)
+		DumpRegistrar(playout->Registrar, metrics);
+	PrintMetrics(metrics, "admission: accepted=%lu rejected=%lu limited=%lu dropped=%lu challenged=%lu invalid=%lu poked=%lu\n", playout->Admission.accepted, playout->Admission.rejected, playout->Admission.limited, playout->Admission.dropped, playout->Admission.challenged, playout->Admission.invalid, playout->Admission.poked);
+	PrintMetrics(metrics, "acks: sent=%lu delayed=%lu suppressed=%lu\n", playout->Acks.sent, playout->Acks.delayed, playout->Acks.suppressed);
+	EndMetrics(metrics);
+}
+
+/* perform a playout action, voice and comfort noise events are always consumed */
+static DWORD HandlePlayout(LPPLAYOUT playout, INT kind, struct iax_event *evt)
+{
+	DWORD error = ERROR_SUCCESS;
+
+	switch (kind)
+	{
+		/* start the playback (and recording) of an answered call */
+		case HANDOFF_START:
+			ResetLatency(playout->Latency);
+			if (playout->Recorder != NULL && playout->Settings->RingTone == NULL)
+				StartRecording(playout->Recorder);
+			if (!StartWave(playout->Wave))
+				error = GetLastWaveError();
+			break;
+
+		/* stop any audio playback and dump the call's metrics */
+		case HANDOFF_STOP:
+			if (!StopWave(playout->Wave))
+				error = GetLastWaveError();
+			if (playout->Recorder != NULL && playout->Settings->RingTone == NULL)
+				StopRecording(playout->Recorder);
+			WriteMetrics(playout, "hangup");
+			break;
+
+		/* archive the decoded audio and enque the wave form header, which owns the event unless refused */
+		case HANDOFF_VOICE:
+			if (playout->Recorder != NULL)
+				RecordBlock(playout->Recorder, evt->data, evt->datalen);
+			if (!EnqueueWaveHeader(playout->Wave, evt->data, evt->datalen, evt))
+			{
+				error = GetLastWaveError();
+				iax_event_free(evt);
+			}
+			break;
+
+		/* fill silence suppressed periods with comfort noise */
+		case HANDOFF_CNG:
+			if (!StartComfortNoise(playout->Wave, (BYTE)evt->subclass))
+				error = GetLastWaveError();
+			iax_event_free(evt);
+			break;
+
+		/* dump the metrics on request */
+		case HANDOFF_METRICS:
+			WriteMetrics(playout, "request");
+			break;
+	}
+	return error;
+}
+
+/* the playout thread, owns the wave output once started */
+static DWORD WINAPI PlayoutThread(LPVOID parameter)
+{
+	LPPLAYOUT playout = (LPPLAYOUT)parameter;
+	HANDOFFITEM item;
+	HANDLE task = NULL;
+	DWORD error = ERROR_SUCCESS;
+
+	/* raise the priority if requested */
+	if (playout->Settings->Realtime)
+		task = EnterRealtime();
+
+	while (error == ERROR_SUCCESS)
+	{
+		switch (WSAWaitForMultipleEvents(PLAYOUT_EVENT_MAX, playout->Events, FALSE, WSA_INFINITE, FALSE))
+		{
+			/* leave when the service stops */
+			case WSA_WAIT_EVENT_0 + PLAYOUT_EVENT_EXIT:
+				if (playout->Settings->Realtime)
+					LeaveRealtime(task);
+				return ERROR_SUCCESS;
+
+			/* reset the event before draining, so that no item gets missed */
+			case WSA_WAIT_EVENT_0 + PLAYOUT_EVENT_HANDOFF:
+				if (!WSAResetEvent(playout->Events[PLAYOUT_EVENT_HANDOFF]))
+				{
+					error = WSAGetLastError();
+					break;
+				}
+				while (error == ERROR_SUCCESS && PopHandoff(playout->Handoff, &item))
+				{
+					if (item.Event != NULL)
+						RecordLatency(playout->Latency, LATENCY_HANDOFF, iax_monotonic_us() - item.Pushed);
+					error = HandlePlayout(playout, item.Kind, item.Event);
+				}
+				break;
+
+			/* cleanup all done headers */
+			case WSA_WAIT_EVENT_0 + PLAYOUT_EVENT_WAVEFORM:
+				if (!HandleDoneWaveHeaders(playout->Wave))
+					error = GetLastWaveError();
+				break;
+
+			/* all other values should be treated as an error */
+			case WSA_WAIT_FAILED:
+				error = WSAGetLastError();
+				break;
+			default:
+				error = ERROR_INVALID_HANDLE;
+				break;
+		}
+	}
+
+	/* take the service down with us */
+	if (playout->Settings->Realtime)
+		LeaveRealtime(task);
+	WSASetEvent(playout->Shutdown);
+	return error;
+}
+
+/* hand an action to the playout side, voice and comfort noise events are always consumed */
+static DWORD DeliverPlayout(LPPLAYOUT playout, INT kind, struct iax_event *evt)
+{
+	/* without a playout thread perform it right away */
+	if (playout->Handoff == NULL)
+		return HandlePlayout(playout, kind, evt);
+
+	/* drop frames if the playout thread lags behind, but wait with control actions */
+	while (!PushHandoff(playout->Handoff, kind, evt))
+	{
+		if (evt != NULL)
+		{
+			playout->DroppedFrames++;
+			iax_event_free(evt);
+			break;
+		}
+		if (WaitForSingleObject(playout->Thread, 1) != WAIT_TIMEOUT)
+			break;
+	}
+	return ERROR_SUCCESS;
+}
+
+/* screen frames that would open a new session before libiax2 allocates anything for them */
+static int AdmitSession(struct iax_context *ctx, const struct sockaddr *from, int subclass, const char **cause, void *data)
+{
+	LPADMISSION admission = (LPADMISSION)data;
+	DWORD host;
+
+	/* let's see if the host is restricted */
+	switch (host = LookupHost(admission->Settings->Hosts, from))
+	{
+		case HOST_FORBIDDEN:
+			*cause = "IP address forbidden.";
+			return IAX_ADMIT_REJECT;
+		case HOST_NOT_ALLOWED:
+			*cause = "IP not allowed.";
+			return IAX_ADMIT_REJECT;
+	}
+
+	/* reject new calls if we're already in another session */
+	if (subclass == IAX_COMMAND_NEW && *admission->Session != NULL)
+	{
+		*cause = "Already in session.";
+		return IAX_ADMIT_REJECT;
+	}
+
+	/* let libiax2 check or hand out a call token if the host has to prove its address */
+	return host == HOST_TOKEN ? IAX_ADMIT_TOKEN : IAX_ADMIT_ACCEPT;
+}
+
+/* accept a call in the format it gets played in and announce or answer it */
+static VOID AnswerCall(LPSETTINGS settings, struct iax_session *session)
 {
-	iax_event_free((struct iax_event *)userData);
+	UINT format;
+
+	format = AST_FORMAT_SLINEAR;
+	if (settings->RingTone != NULL)
+		iax_pref_codec_get(session, &format, 1);
+	iax_accept(session, format);
+	iax_ring_announce(session);
+	if (settings->RingTone == NULL)
+		iax_answer(session);
 }
 
 /* the service main routine, started by the scheduler */
@@ -46,34 +285,27 @@ static VOID WINAPI ServiceMain(DWORD argc, LPTSTR argv[])
 	LPSETTINGS settings = NULL;
 	INT wsaStartup = ~0;
 	INT iaxPort = -1;
-	LPWAVE wave = NULL;
+	PLAYOUT playout;
+	HANDOFFITEM item;
+	DWORD error;
+	INT i;
+	BOOL realtime = FALSE;
+	HANDLE task = NULL;
+	ULONGLONG due;
+	ULONGLONG now;
 	struct iax_session *session = NULL;
-	struct iax_session *registeredSession = NULL;
-	UINT format;
-	DWORD nextRegistration;
-	INT waitTimeForEvent;
-	INT waitTimeForRegister;
+	BOOL authenticating = FALSE;
+	LONGLONG waitTimeForEvent;
+	LONGLONG waitTimeForRegister;
 	WSADATA wsaData;
 	WSAEVENT netEvent;
-	ULONG address;
+	ADMISSION admission;
 	struct iax_event *evt;
 
-#define REG_START \
-{ \
-	if (settings->Register) \
-	{ \
-		CHECK((registeredSession = iax_session_new()) != NULL, ERROR_OUTOFMEMORY); \
-		REG_REFRESH; \
-	} \
-}
-#define REG_REFRESH \
-{ \
-		iax_register(registeredSession, settings->Host, settings->UserName, settings->Secret, IAX_DEFAULT_REG_EXPIRE); \
-		nextRegistration = GetTickCount() + IAX_DEFAULT_REG_EXPIRE*1000; \
-}
 #define CHECK(condition, error) { if (!(condition)) { exitCode = (error); goto LEAVE; } }
 
 	/* initialize the service */
+	ZERO(&playout);
 	if ((service = InitializeService()) == NULL)
 		return;
 	BeginServiceStatus(service, SERVICE_RUNNING, 1000);
@@ -87,37 +319,85 @@ static VOID WINAPI ServiceMain(DWORD argc, LPTSTR argv[])
 	CHECK(wsaData.wVersion >= MAKEWORD(2, 0), WSAVERNOTSUPPORTED);
 	ProgressServiceStatus(service);
 
+	/* make room for locked memory, give libiax2 its locked pool and raise the timer resolution in real-time mode */
+	if (settings->Realtime)
+		CHECK(realtime = PrepareRealtime(), GetLastError());
+
 	/* initialize iax */
 	CHECK((iaxPort = iax_init(settings->Port)) == settings->Port, WSAGetLastError() == ERROR_SUCCESS ? ERROR_OPEN_FAILED : WSAGetLastError());
-	REG_START;
+	admission.Settings = settings;
+	admission.Session = &session;
+	iax_set_admission(&AdmitSession, &admission);
+	iax_set_admission_rate(settings->NewRate, settings->NewBurst);
+	iax_set_ack_delay(settings->AckDelay);
+
+	/* start resolving the registrars in the background, the first requests follow shortly */
+	if (settings->Registrars > 0)
+		CHECK((playout.Registrar = CreateRegistrar(settings, GetServiceEvent(service, SERVICE_EVENT_RESOLVER), GetTickCount64())) != NULL, GetLastError());
 	ProgressServiceStatus(service);
 
 	/* associate the socket with an event */
-	CHECK(WSAEventSelect(iax_get_fd(), (netEvent = GetServiceEvent(service, SERVICE_EVENT_NETWORK)), FD_READ) == 0, WSAGetLastError());
+	netEvent = GetServiceEvent(service, SERVICE_EVENT_NETWORK);
+	CHECK(WatchServiceNetwork(service, iax_get_fd()), WSAGetLastError());
 	ProgressServiceStatus(service);
 
-	/* initialize the wave output */
-	CHECK((wave = InitializeWave(settings, GetServiceEvent(service, SERVICE_EVENT_WAVEFORM), &HeaderDone)) != NULL, GetLastWaveError());
+	/* create the playout thread's events if needed */
+	playout.Settings = settings;
+	if (settings->Threaded)
+	{
+		for (i = 0; i < PLAYOUT_EVENT_MAX; i++)
+			CHECK((playout.Events[i] = WSACreateEvent()) != WSA_INVALID_EVENT, WSAGetLastError());
+	}
+
+	/* initialize the latency histograms and the wave output */
+	playout.Latency = CreateLatency();
+	CHECK((playout.Wave = InitializeWave(settings, settings->Threaded ? playout.Events[PLAYOUT_EVENT_WAVEFORM] : GetServiceEvent(service, SERVICE_EVENT_WAVEFORM), &HeaderDone, playout.Latency)) != NULL, GetLastWaveError());
 	ProgressServiceStatus(service);
 
+	/* start the recorder's writer thread if calls should be archived */
+	if (settings->RecordDirectory != NULL)
+		CHECK((playout.Recorder = CreateRecorder(settings)) != NULL, GetLastError());
+	ProgressServiceStatus(service);
+
+	/* the metrics file is written by a thread of its own as well */
+	if (settings->MetricsFile != NULL)
+		CHECK((playout.Metrics = CreateMetrics(settings)) != NULL, GetLastError());
+	ProgressServiceStatus(service);
+
+	/* hand the audio side over to its own thread if requested */
+	if (settings->Threaded)
+	{
+		playout.Handoff = CreateHandoff(settings, playout.Events[PLAYOUT_EVENT_HANDOFF]);
+		playout.Shutdown = GetServiceEvent(service, SERVICE_EVENT_SHUTDOWN);
+		CHECK((playout.Thread = CreateThread(NULL, 0, &PlayoutThread, &playout, 0, NULL)) != NULL, GetLastError());
+	}
+	ProgressServiceStatus(service);
+
+	/* raise the service thread's priority if requested */
+	if (realtime)
+		task = EnterRealtime();
+
 	/* report the service start */
 	EndServiceStatus(service);
 
 	/* wait for the following things:
 	   - shutdown event
 	   - network event
-	   - wave event
+	   - wave event (unless the playout thread handles it)
+	   - metrics request
+	   - finished registrar lookup
 	   - the next scheduled event */
 	for (;;)
 	{
-		waitTimeForEvent = iax_time_to_next_event();
-		if (registeredSession != NULL)
+		waitTimeForEvent = iax_time_to_next_event_us();
+		if (playout.Registrar != NULL && (waitTimeForRegister = GetRegistrarTimeout(playout.Registrar, GetTickCount64())) >= 0)
 		{
-			waitTimeForRegister = (INT)(nextRegistration - GetTickCount());
-			if (waitTimeForEvent == (INT)INFINITE || waitTimeForRegister < waitTimeForEvent)
+			waitTimeForRegister *= 1000;
+			if (waitTimeForEvent < 0 || waitTimeForRegister < waitTimeForEvent)
 				waitTimeForEvent = waitTimeForRegister;
 		}
-		switch (WaitForServiceEvents(service, (DWORD)waitTimeForEvent))
+		due = waitTimeForEvent >= 0 ? iax_monotonic_us() + (ULONGLONG)waitTimeForEvent : 0;
+		switch (WaitForServiceEvents(service, waitTimeForEvent))
 		{
 			/* on a wait fail set the error code and leave */
 			case WSA_WAIT_FAILED:
@@ -135,13 +415,30 @@ static VOID WINAPI ServiceMain(DWORD argc, LPTSTR argv[])
 
 			/* on a waveform event cleanup all done headers */
 			case WSA_WAIT_EVENT_0 + SERVICE_EVENT_WAVEFORM:
-				CHECK(HandleDoneWaveHeaders(wave), GetLastWaveError());
+				CHECK(HandleDoneWaveHeaders(playout.Wave), GetLastWaveError());
+				break;
+
+			/* on a metrics request reset the event and dump the metrics */
+			case WSA_WAIT_EVENT_0 + SERVICE_EVENT_METRICS:
+				CHECK(WSAResetEvent(GetServiceEvent(service, SERVICE_EVENT_METRICS)), WSAGetLastError());
+				iax_get_admission_stats(&playout.Admission);
+				iax_get_ack_stats(&playout.Acks);
+				CHECK((error = DeliverPlayout(&playout, HANDOFF_METRICS, NULL)) == ERROR_SUCCESS, error);
 				break;
 
-			/* on timeout just update the hint for the loop and possible the registration */
+			/* on a finished lookup reset the event and register again where a registrar moved */
+			case WSA_WAIT_EVENT_0 + SERVICE_EVENT_RESOLVER:
+				CHECK(WSAResetEvent(GetServiceEvent(service, SERVICE_EVENT_RESOLVER)), WSAGetLastError());
+				if (playout.Registrar != NULL)
+					ResolveRegistrar(playout.Registrar, GetTickCount64());
+				break;
+
+			/* on timeout record how late we woke up and send the due registration requests */
 			case WSA_WAIT_TIMEOUT:
-				if (registeredSession != NULL && (INT)(GetTickCount() - nextRegistration) > 0)
-					REG_REFRESH;
+				if (due != 0 && (now = iax_monotonic_us()) >= due)
+					RecordLatency(playout.Latency, LATENCY_WAKEUP, now - due);
+				if (playout.Registrar != NULL)
+					ServiceRegistrar(playout.Registrar, GetTickCount64());
 				break;
 
 			/* all other values should be treated as an error */
@@ -169,33 +466,45 @@ static VOID WINAPI ServiceMain(DWORD argc, LPTSTR argv[])
 						break;
 					}
 
-					/* determine host */
-					address = iax_get_peer_addr(evt->session).sin_addr.S_un.S_addr;
-
-					/* let's see if it is explicitly restricted */
-					if (settings->ForbiddenHosts != NULL && ContainsHost(address, settings->ForbiddenHosts))
+					/* with a call secret the caller has to authenticate first and encrypt the call */
+					if (settings->CallSecret[0] != '\0')
 					{
-						iax_reject(evt->session, "IP address forbidden.");
+						if (!(evt->ies.encmethods & IAX_ENCRYPT_AES128))
+							iax_reject(evt->session, "Encryption required.");
+						else if (iax_auth_request(evt->session, IAX_AUTH_MD5, IAX_ENCRYPT_AES128, settings->CallSecret) >= 0)
+						{
+							session = evt->session;
+							authenticating = TRUE;
+						}
 						break;
 					}
 
-					/* test the allowed hosts if at least one matches */
-					if (settings->AllowedHosts != NULL && !ContainsHost(address, settings->AllowedHosts))
+					/* all checks successful, begin the call */
+					session = evt->session;
+					AnswerCall(settings, session);
+					CHECK((error = DeliverPlayout(&playout, HANDOFF_START, NULL)) == ERROR_SUCCESS, error);
+					break;
+
+				/* begin an authenticating call if the caller knows the secret */
+				case IAX_EVENT_AUTHRP:
+					if (evt->session != session || !authenticating)
+						break;
+					authenticating = FALSE;
+					if (!iax_auth_verify(session, evt))
 					{
-						iax_reject(evt->session, "IP not allowed.");
+						iax_reject(session, "Authentication failed.");
+						session = NULL;
 						break;
 					}
+					AnswerCall(settings, session);
+					CHECK((error = DeliverPlayout(&playout, HANDOFF_START, NULL)) == ERROR_SUCCESS, error);
+					break;
 
-					/* all checks successful, begin the call */
-					session = evt->session;
-					format = AST_FORMAT_SLINEAR;
-					if (settings->RingTone != NULL)
-						iax_pref_codec_get(evt->session, &format, 1);
-					iax_accept(evt->session, format);
-					iax_ring_announce(evt->session);
-					if (settings->RingTone == NULL)
-						iax_answer(evt->session);
-					CHECK(StartWave(wave), GetLastWaveError());
+				/* handle registration replies */
+				case IAX_EVENT_REGACK:
+				case IAX_EVENT_REGREJ:
+					if (playout.Registrar != NULL)
+						HandleRegistrarEvent(playout.Registrar, evt, GetTickCount64());
 					break;
 
 				/* handle rejects, hangups and timeouts */
@@ -203,28 +512,43 @@ static VOID WINAPI ServiceMain(DWORD argc, LPTSTR argv[])
 				case IAX_EVENT_HANGUP:
 				case IAX_EVENT_TIMEOUT:
 
-					/* stop any audio playback and leave the session */
+					/* stop any audio playback, dump the call's metrics and leave the session (a call that never got past authentication has neither) */
 					if (evt->session == session)
 					{
-						CHECK(StopWave(wave), GetLastWaveError());
+						if (!authenticating)
+						{
+							iax_get_admission_stats(&playout.Admission);
+							iax_get_ack_stats(&playout.Acks);
+							CHECK((error = DeliverPlayout(&playout, HANDOFF_STOP, NULL)) == ERROR_SUCCESS, error);
+						}
 						session = NULL;
+						authenticating = FALSE;
 					}
 
-					/* recreate the register session if necessary */
-					if (evt->session == registeredSession)
-					{
-						iax_session_destroy(&registeredSession);
-						REG_START;
-					}
+					/* otherwise it might be a registration session that needs to start over */
+					else if (playout.Registrar != NULL)
+						HandleRegistrarEvent(playout.Registrar, evt, GetTickCount64());
 					break;
 
 				/* handle incoming voice buffers */
 				case IAX_EVENT_VOICE:
 
-					/* enque the wave form header */
-					if (evt->session == session && settings->RingTone == NULL)
+					/* pass the decoded audio on, the event is consumed in any case */
+					if (evt->session == session && !authenticating && settings->RingTone == NULL)
 					{
-						CHECK(EnqueueWaveHeader(wave, ReverseByteOrder(evt->data, evt->datalen), evt->datalen, evt), GetLastWaveError());
+						ReverseByteOrder(evt->data, evt->datalen);
+						if ((exitCode = DeliverPlayout(&playout, HANDOFF_VOICE, evt)) != ERROR_SUCCESS)
+							goto LEAVE;
+						continue;
+					}
+					break;
+
+				/* fill silence suppressed periods with comfort noise */
+				case IAX_EVENT_CNG:
+					if (evt->session == session && !authenticating && settings->RingTone == NULL)
+					{
+						if ((exitCode = DeliverPlayout(&playout, HANDOFF_CNG, evt)) != ERROR_SUCCESS)
+							goto LEAVE;
 						continue;
 					}
 					break;
@@ -236,24 +560,60 @@ static VOID WINAPI ServiceMain(DWORD argc, LPTSTR argv[])
 	}
 
 #undef CHECK
-#undef REG_REFRESH
-#undef REG_START
 
 LEAVE:
 
 	/* report the pending end of the service */
 	BeginServiceStatus(service, SERVICE_STOPPED, 1000);
 
-	/* hangup a possibly active call and destroy the registered session */
+	/* hangup a possibly active call */
 	if (session != NULL)
 		iax_hangup(session, "Gotta go, sorry!");
-	if (registeredSession != NULL)
-		iax_session_destroy(&registeredSession);
 	ProgressServiceStatus(service);
 
-	/* close audio device */
-	if (wave != NULL)
-		FreeWave(wave);
+	/* stop the playout thread, take over its exit code and free the frames it didn't get to */
+	if (playout.Thread != NULL)
+	{
+		WSASetEvent(playout.Events[PLAYOUT_EVENT_EXIT]);
+		WaitForSingleObject(playout.Thread, INFINITE);
+		if (exitCode == ERROR_SUCCESS)
+			GetExitCodeThread(playout.Thread, &exitCode);
+		CloseHandle(playout.Thread);
+	}
+	if (playout.Handoff != NULL)
+	{
+		while (PopHandoff(playout.Handoff, &item))
+		{
+			if (item.Event != NULL)
+				iax_event_free(item.Event);
+		}
+		FreeHandoff(playout.Handoff);
+	}
+	ProgressServiceStatus(service);
+
+	/* return to normal scheduling */
+	if (realtime)
+	{
+		LeaveRealtime(task);
+		FinishRealtime();
+	}
+
+	/* close audio device, release the histograms, finish the recordings and drop the registrations */
+	if (playout.Wave != NULL)
+		FreeWave(playout.Wave);
+	if (playout.Latency != NULL)
+		FreeLatency(playout.Latency);
+	if (playout.Recorder != NULL)
+		FreeRecorder(playout.Recorder);
+	if (playout.Metrics != NULL)
+		FreeMetrics(playout.Metrics);
+	if (playout.Registrar != NULL)
+		FreeRegistrar(playout.Registrar);
+	for (i = 0; i < PLAYOUT_EVENT_MAX; i++)
+	{
+		if (playout.Events[i] != NULL)
+			WSACloseEvent(playout.Events[i]);
+	}
 	ProgressServiceStatus(service);
 
 	/* shutdown iax */
@@ -0,0 +1,183 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <tchar.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "realtime.h"
+
+/* dumps are formatted into one of a few fixed buffers by whoever owns the
+   playout, the writer thread appends them to the metrics file */
+#define DUMPS      4
+#define DUMP_BYTES 8192
+
+struct tagMETRICS
+{
+	LPSETTINGS Settings;
+	HANDLE Thread;
+	HANDLE Wakeup;
+	volatile BOOL Exit;
+
+	/* ring indices, the head is only written by the dumping thread, the tail only by the writer */
+	volatile LONG Head;
+	volatile LONG Tail;
+
+	/* whether a dump is in progress and has run out of space, and the dumps dropped or cut short so far */
+	BOOL Dumping;
+	BOOL Full;
+	DWORD Dropped;
+	DWORD Truncated;
+	DWORD Length[DUMPS];
+	CHAR Text[DUMPS][DUMP_BYTES];
+};
+
+/* append all dumps the playout has published to the metrics file */
+static VOID DrainMetrics(LPMETRICS metrics)
+{
+	FILE *file = NULL;
+	LONG tail = metrics->Tail;
+
+	while (tail != metrics->Head)
+	{
+		/* make sure the dump is read after the head */
+		MemoryBarrier();
+		if (file == NULL)
+			file = _tfopen(metrics->Settings->MetricsFile, _T("a"));
+		if (file != NULL)
+			fwrite(metrics->Text[tail], 1, metrics->Length[tail], file);
+
+		/* hand the buffer back */
+		tail = (tail + 1) % DUMPS;
+		MemoryBarrier();
+		metrics->Tail = tail;
+	}
+	if (file != NULL)
+		fclose(file);
+}
+
+/* the writer thread, does all the file i/o */
+static DWORD WINAPI WriterThread(LPVOID parameter)
+{
+	LPMETRICS metrics = (LPMETRICS)parameter;
+	BOOL exit;
+
+	do
+	{
+		WaitForSingleObject(metrics->Wakeup, INFINITE);
+		exit = metrics->Exit;
+		DrainMetrics(metrics);
+	}
+	while (!exit);
+	return 0;
+}
+
+/* create a metrics writer and its thread for the metrics file (NULL on error, see GetLastError) */
+LPMETRICS CreateMetrics(LPSETTINGS settings)
+{
+	LPMETRICS metrics;
+	DWORD error;
+
+	ALLOC(metrics);
+	metrics->Settings = settings;
+	LockRealtimeMemory(settings, metrics, sizeof(*metrics));
+	if
+	(
+		(metrics->Wakeup = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL ||
+		(metrics->Thread = CreateThread(NULL, 0, &WriterThread, metrics, 0, NULL)) == NULL
+	)
+	{
+		error = GetLastError();
+		FreeMetrics(metrics);
+		SetLastError(error);
+		return NULL;
+	}
+	return metrics;
+}
+
+/* start a dump with a time stamp and the reason, never blocks and drops the dump if the writer lags behind */
+VOID BeginMetrics(LPMETRICS metrics, LPCSTR reason)
+{
+	SYSTEMTIME now;
+	LONG head = metrics->Head;
+
+	if ((head + 1) % DUMPS == metrics->Tail)
+	{
+		metrics->Dropped++;
+		metrics->Dumping = FALSE;
+		return;
+	}
+	metrics->Dumping = TRUE;
+	metrics->Full = FALSE;
+	metrics->Length[head] = 0;
+	GetLocalTime(&now);
+	PrintMetrics(metrics, "%04u-%02u-%02u %02u:%02u:%02u.%03u %s\n", now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond, now.wMilliseconds, reason);
+}
+
+/* append a formatted line (or part of it) to the dump in progress */
+VOID PrintMetrics(LPMETRICS metrics, LPCSTR format, ...)
+{
+	LONG head = metrics->Head;
+	DWORD length = metrics->Length[head];
+	va_list args;
+	int written;
+
+	if (!metrics->Dumping || metrics->Full)
+		return;
+	va_start(args, format);
+	written = _vsnprintf(metrics->Text[head] + length, DUMP_BYTES - length, format, args);
+	va_end(args);
+
+	/* keep what fits, the dump still ends with a line break */
+	if (written < 0 || (DWORD)written >= DUMP_BYTES - length)
+	{
+		metrics->Truncated++;
+		metrics->Text[head][DUMP_BYTES - 1] = '\n';
+		metrics->Length[head] = DUMP_BYTES;
+		metrics->Full = TRUE;
+		return;
+	}
+	metrics->Length[head] = length + (DWORD)written;
+}
+
+/* hand the dump in progress to the writer */
+VOID EndMetrics(LPMETRICS metrics)
+{
+	if (!metrics->Dumping)
+		return;
+	PrintMetrics(metrics, "metrics: dropped=%lu truncated=%lu\n\n", metrics->Dropped, metrics->Truncated);
+	metrics->Dumping = FALSE;
+	MemoryBarrier();
+	metrics->Head = (metrics->Head + 1) % DUMPS;
+	SetEvent(metrics->Wakeup);
+}
+
+/* write all pending dumps and release the writer */
+VOID FreeMetrics(LPMETRICS metrics)
+{
+	if (metrics->Thread != NULL)
+	{
+		metrics->Exit = TRUE;
+		SetEvent(metrics->Wakeup);
+		WaitForSingleObject(metrics->Thread, INFINITE);
+		CloseHandle(metrics->Thread);
+	}
+	if (metrics->Wakeup != NULL)
+		CloseHandle(metrics->Wakeup);
+	FREE(metrics);
+}
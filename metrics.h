@@ -0,0 +1,34 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+/* transparent metrics writer structure */
+typedef struct tagMETRICS METRICS, *LPMETRICS;
+
+/* create a metrics writer and its thread for the metrics file (NULL on error, see GetLastError) */
+extern LPMETRICS CreateMetrics(LPSETTINGS);
+
+/* start a dump with a time stamp and the reason, never blocks and drops the dump if the writer lags behind */
+extern VOID BeginMetrics(LPMETRICS, LPCSTR);
+
+/* append a formatted line (or part of it) to the dump in progress */
+extern VOID PrintMetrics(LPMETRICS, LPCSTR, ...);
+
+/* hand the dump in progress to the writer */
+extern VOID EndMetrics(LPMETRICS);
+
+/* write all pending dumps and release the writer */
+extern VOID FreeMetrics(LPMETRICS);
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <windows.h>
+#include <math.h>
+#include "common.h"
+#include "noise.h"
+
+/* rms of the filtered generator output (uniform 16 bit samples averaged in pairs) */
+#define FILTERED_RMS 13377.0
+
+struct tagNOISE
+{
+	DWORD State;
+	LONG Last;
+	LONG Gain;
+};
+
+/* create a noise generator with the given seed */
+LPNOISE CreateNoise(DWORD seed)
+{
+	LPNOISE noise;
+
+	/* the shift register must never be all zero */
+	ALLOC(noise);
+	noise->State = seed != 0 ? seed : 0x9E3779B9;
+	return noise;
+}
+
+/* set the noise level in -dBov (as signalled in comfort noise frames) */
+VOID SetNoiseLevel(LPNOISE noise, BYTE level)
+{
+	/* only the lower seven bits carry the level, the gain is in 16.16 fixed point */
+	noise->Gain = (LONG)(32767.0 * pow(10.0, -(level & 0x7F) / 20.0) / FILTERED_RMS * 65536.0);
+}
+
+/* fill a buffer with the given number of slin samples */
+VOID GenerateNoise(LPNOISE noise, SHORT *buffer, DWORD count)
+{
+	DWORD state = noise->State;
+	LONG last = noise->Last;
+	LONG next;
+	LONG sample;
+
+	while (count-- > 0)
+	{
+		/* step the xorshift register and take its upper half as white noise */
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		next = (SHORT)(state >> 16);
+
+		/* average with the previous value to take the edge off, then scale and clip */
+		sample = (LONG)(((LONGLONG)(next + last) * noise->Gain) >> 17);
+		last = next;
+		*(buffer++) = (SHORT)(sample > 32767 ? 32767 : sample < -32768 ? -32768 : sample);
+	}
+	noise->State = state;
+	noise->Last = last;
+}
+
+/* release the noise generator */
+VOID FreeNoise(LPNOISE noise)
+{
+	FREE(noise);
+}
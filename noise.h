@@ -0,0 +1,31 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _NOISE_H
+#define _NOISE_H
+
+/* transparent noise generator structure */
+typedef struct tagNOISE NOISE, *LPNOISE;
+
+/* create a noise generator with the given seed */
+extern LPNOISE CreateNoise(DWORD);
+
+/* set the noise level in -dBov (as signalled in comfort noise frames) */
+extern VOID SetNoiseLevel(LPNOISE, BYTE);
+
+/* fill a buffer with the given number of slin samples */
+extern VOID GenerateNoise(LPNOISE, SHORT *, DWORD);
+
+/* release the noise generator */
+extern VOID FreeNoise(LPNOISE);
+
+#endif
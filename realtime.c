@@ -0,0 +1,252 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#else
+#include <mmsystem.h>
+#include <avrt.h>
+#endif
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "realtime.h"
+
+/* the prefaulted stack */
+#define STACK_PREFAULT (64 * 1024)
+
+#ifdef __linux__
+
+/* fifo priority of real-time threads (below the kernel's interrupt threads)
+   and the nice value if the process may not use the fifo class */
+#define FIFO_PRIORITY 20
+#define NICE_PRIORITY -10
+
+/* lock all present and future memory, libiax2's allocations included */
+BOOL PrepareRealtime()
+{
+	/* errno tells why */
+	return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+}
+
+/* lock a buffer into memory (faulting it in) if the settings demand it */
+VOID LockRealtimeMemory(LPSETTINGS settings, LPVOID buffer, SIZE_T size)
+{
+	/* failing to lock only costs page faults, so it's not an error */
+	if (settings->Realtime && buffer != NULL && size > 0)
+		mlock(buffer, size);
+}
+
+/* move the calling thread into the fifo class (or raise its nice value if
+   not permitted), returns the handle for LeaveRealtime */
+HANDLE EnterRealtime()
+{
+	volatile BYTE stack[STACK_PREFAULT];
+	struct sched_param param;
+	DWORD i;
+
+	/* fault in the stack the thread is going to use */
+	for (i = 0; i < STACK_PREFAULT; i += 4096)
+		stack[i] = 0;
+
+	/* prefer the fifo class, which needs CAP_SYS_NICE or RLIMIT_RTPRIO */
+	param.sched_priority = FIFO_PRIORITY;
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0)
+		return (HANDLE)(DWORD_PTR)TRUE;
+	setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), NICE_PRIORITY);
+	return NULL;
+}
+
+/* return the calling thread to normal scheduling */
+VOID LeaveRealtime(HANDLE task)
+{
+	struct sched_param param;
+
+	if (task != NULL)
+	{
+		param.sched_priority = 0;
+		pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+	}
+	else
+		setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 0);
+}
+
+/* unlock the memory */
+VOID FinishRealtime()
+{
+	munlockall();
+}
+
+#else
+
+/* additional working set for locked buffers and the timer period */
+#define WORKING_SET  (16 * 1024 * 1024)
+#define TIMER_PERIOD 1
+
+/* block sizes and counts of the locked pool libiax2 allocates from: scheduler
+   entries and jitterbuffer frames, frames, voice events, sessions and large
+   events, jitterbuffers */
+#define POOL_CLASSES 5
+static CONST SIZE_T PoolBlockSize[POOL_CLASSES] = { 128, 512, 1024, 4096, 8192 };
+static CONST DWORD PoolBlockCount[POOL_CLASSES] = { 1024, 512, 512, 64, 16 };
+
+/* free blocks of each class and the range they are carved from */
+static struct
+{
+	SLIST_HEADER Free;
+	LPBYTE Base;
+	LPBYTE Limit;
+} Pool[POOL_CLASSES];
+
+/* take a block from the smallest class that has one, from the heap (locked in place) once they're all taken */
+static LPVOID PoolAlloc(size_t size)
+{
+	PSLIST_ENTRY block;
+	LPVOID buffer;
+	DWORD i;
+
+	for (i = 0; i < POOL_CLASSES; i++)
+	{
+		if (size <= PoolBlockSize[i] && (block = InterlockedPopEntrySList(&Pool[i].Free)) != NULL)
+			return block;
+	}
+	if ((buffer = HeapAlloc(GetProcessHeap(), 0, size)) != NULL)
+		VirtualLock(buffer, size);
+	return buffer;
+}
+
+/* return a block to its class or to the heap, from any thread */
+static VOID PoolFree(LPVOID buffer)
+{
+	DWORD i;
+
+	if (buffer == NULL)
+		return;
+	for (i = 0; i < POOL_CLASSES; i++)
+	{
+		if ((LPBYTE)buffer >= Pool[i].Base && (LPBYTE)buffer < Pool[i].Limit)
+		{
+			InterlockedPushEntrySList(&Pool[i].Free, (PSLIST_ENTRY)buffer);
+			return;
+		}
+	}
+	HeapFree(GetProcessHeap(), 0, buffer);
+}
+
+/* carve the locked pool and have libiax2 allocate from it, it stays for the
+   rest of the process since the library may hold on to blocks until exit */
+static BOOL CreatePool()
+{
+	SIZE_T total = 0;
+	LPBYTE memory;
+	LPBYTE block;
+	DWORD i;
+
+	for (i = 0; i < POOL_CLASSES; i++)
+		total += PoolBlockSize[i] * PoolBlockCount[i];
+	if ((memory = VirtualAlloc(NULL, total, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE)) == NULL)
+		return FALSE;
+	if (!VirtualLock(memory, total))
+	{
+		VirtualFree(memory, 0, MEM_RELEASE);
+		return FALSE;
+	}
+	for (i = 0; i < POOL_CLASSES; i++)
+	{
+		InitializeSListHead(&Pool[i].Free);
+		Pool[i].Base = memory;
+		Pool[i].Limit = memory + PoolBlockSize[i] * PoolBlockCount[i];
+		for (block = Pool[i].Base; block < Pool[i].Limit; block += PoolBlockSize[i])
+			InterlockedPushEntrySList(&Pool[i].Free, (PSLIST_ENTRY)block);
+		memory = Pool[i].Limit;
+	}
+	iax_set_allocator(&PoolAlloc, &PoolFree);
+	return TRUE;
+}
+
+/* grow the working set for locked buffers, move libiax2 onto the locked
+   pool and raise the timer resolution */
+BOOL PrepareRealtime()
+{
+	SIZE_T minimum;
+	SIZE_T maximum;
+
+	if
+	(
+		!GetProcessWorkingSetSize(GetCurrentProcess(), &minimum, &maximum) ||
+		!SetProcessWorkingSetSize(GetCurrentProcess(), minimum + WORKING_SET, maximum + WORKING_SET) ||
+		!CreatePool()
+	)
+		return FALSE;
+	if (timeBeginPeriod(TIMER_PERIOD) != TIMERR_NOERROR)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* lock a buffer into memory (faulting it in) if the settings demand it */
+VOID LockRealtimeMemory(LPSETTINGS settings, LPVOID buffer, SIZE_T size)
+{
+	/* failing to lock only costs page faults, so it's not an error */
+	if (settings->Realtime && buffer != NULL && size > 0)
+		VirtualLock(buffer, size);
+}
+
+/* move the calling thread into the pro audio class (or to time critical
+   priority if unavailable), returns the handle for LeaveRealtime */
+HANDLE EnterRealtime()
+{
+	volatile BYTE stack[STACK_PREFAULT];
+	DWORD taskIndex = 0;
+	HANDLE task;
+	DWORD i;
+
+	/* fault in the stack the thread is going to use */
+	for (i = 0; i < STACK_PREFAULT; i += 4096)
+		stack[i] = 0;
+
+	/* prefer the multimedia class scheduler */
+	if ((task = AvSetMmThreadCharacteristics(TEXT("Pro Audio"), &taskIndex)) != NULL)
+	{
+		AvSetMmThreadPriority(task, AVRT_PRIORITY_HIGH);
+		return task;
+	}
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+	return NULL;
+}
+
+/* return the calling thread to normal scheduling */
+VOID LeaveRealtime(HANDLE task)
+{
+	if (task != NULL)
+		AvRevertMmThreadCharacteristics(task);
+	else
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+}
+
+/* restore the timer resolution */
+VOID FinishRealtime()
+{
+	timeEndPeriod(TIMER_PERIOD);
+}
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _REALTIME_H
+#define _REALTIME_H
+
+/* grow the working set for locked buffers, move libiax2 onto a locked pool and
+   raise the timer resolution (lock all memory on Linux), call it before iax_init */
+extern BOOL PrepareRealtime();
+
+/* lock a buffer into memory (faulting it in) if the settings demand it */
+extern VOID LockRealtimeMemory(LPSETTINGS, LPVOID, SIZE_T);
+
+/* move the calling thread into the pro audio class (the fifo class on Linux) or
+   to time critical priority if unavailable, returns the handle for LeaveRealtime */
+extern HANDLE EnterRealtime();
+
+/* return the calling thread to normal scheduling */
+extern VOID LeaveRealtime(HANDLE);
+
+/* restore the timer resolution (unlock the memory on Linux) */
+extern VOID FinishRealtime();
+
+#endif
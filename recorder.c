@@ -0,0 +1,342 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <tchar.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "realtime.h"
+
+/* the ring holds a slot per voice frame of up to 40ms (about 10s of 20ms frames),
+   the last 8 are kept for starting and stopping files, the writer wakes up every
+   32 slots or 100ms and writes in 64kB pieces to files grown by 1MB */
+#define SLOTS         512
+#define CONTROL_SLOTS 8
+#define SLOT_BYTES    640
+#define WAKEUP_SLOTS  32
+#define WAKEUP_MS     100
+#define WRITE_BYTES   65536
+#define PREALLOCATE   1048576
+#define HEADER_BYTES  44
+
+/* kinds of ring slots */
+#define SLOT_DATA  0
+#define SLOT_START 1
+#define SLOT_STOP  2
+
+/* a single ring entry */
+typedef struct tagSLOT
+{
+	DWORD Kind;
+	DWORD Size;
+	BYTE Data[SLOT_BYTES];
+} SLOT, *LPSLOT;
+
+struct tagRECORDER
+{
+	LPSETTINGS Settings;
+	HANDLE Thread;
+	HANDLE Wakeup;
+	volatile BOOL Exit;
+
+	/* ring indices, the head is only written by the service loop, the tail only by the writer */
+	volatile LONG Head;
+	volatile LONG Tail;
+
+	/* service loop statistics */
+	DWORD HighWater;
+	DWORD DroppedBlocks;
+	DWORD DroppedControls;
+
+	/* writer state and statistics */
+	HANDLE File;
+	DWORD DataBytes;
+	DWORD AllocatedBytes;
+	DWORD BufferedBytes;
+	DWORD Files;
+	DWORD Errors;
+	BYTE Buffer[WRITE_BYTES];
+	SLOT Slots[SLOTS];
+};
+
+/* move the file pointer */
+static BOOL SeekRecording(LPRECORDER recorder, DWORD offset)
+{
+	return SetFilePointer(recorder->File, (LONG)offset, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER;
+}
+
+/* write a slin riff header with the current data size */
+static BOOL WriteRecordingHeader(LPRECORDER recorder)
+{
+	WAVEFORMATEX slinFormat = {WAVE_FORMAT_PCM, 1, 8000, 16000, 2, 16, 0};
+	BYTE header[HEADER_BYTES];
+	LPBYTE offset = header;
+	DWORD size;
+	DWORD written;
+
+#define PUT(what, size) { memcpy(offset, (what), (size)); offset += (size); }
+	PUT("RIFF", 4);
+	size = HEADER_BYTES - 8 + recorder->DataBytes;
+	PUT(&size, 4);
+	PUT("WAVEfmt ", 8);
+	size = sizeof(PCMWAVEFORMAT);
+	PUT(&size, 4);
+	PUT(&slinFormat, sizeof(PCMWAVEFORMAT));
+	PUT("data", 4);
+	PUT(&recorder->DataBytes, 4);
+#undef PUT
+	return SeekRecording(recorder, 0) && WriteFile(recorder->File, header, HEADER_BYTES, &written, NULL) && written == HEADER_BYTES;
+}
+
+/* write the buffered data, growing the file ahead of it */
+static VOID FlushRecording(LPRECORDER recorder)
+{
+	DWORD written;
+
+	if (recorder->File == INVALID_HANDLE_VALUE || recorder->BufferedBytes == 0)
+	{
+		recorder->BufferedBytes = 0;
+		return;
+	}
+	if (HEADER_BYTES + recorder->DataBytes + recorder->BufferedBytes > recorder->AllocatedBytes)
+	{
+		recorder->AllocatedBytes += PREALLOCATE;
+		if (!SeekRecording(recorder, recorder->AllocatedBytes) || !SetEndOfFile(recorder->File) || !SeekRecording(recorder, HEADER_BYTES + recorder->DataBytes))
+			recorder->Errors++;
+	}
+	if (WriteFile(recorder->File, recorder->Buffer, recorder->BufferedBytes, &written, NULL))
+		recorder->DataBytes += written;
+	else
+		recorder->Errors++;
+	recorder->BufferedBytes = 0;
+}
+
+/* patch the header, cut off the preallocated space and close the file */
+static VOID CloseRecording(LPRECORDER recorder)
+{
+	if (recorder->File == INVALID_HANDLE_VALUE)
+		return;
+	FlushRecording(recorder);
+	if (!WriteRecordingHeader(recorder) || !SeekRecording(recorder, HEADER_BYTES + recorder->DataBytes) || !SetEndOfFile(recorder->File))
+		recorder->Errors++;
+	CloseHandle(recorder->File);
+	recorder->File = INVALID_HANDLE_VALUE;
+}
+
+/* create a new file named after the call's start time */
+static VOID OpenRecording(LPRECORDER recorder, CONST SYSTEMTIME *time)
+{
+	TCHAR fileName[MAX_PATH];
+
+	CloseRecording(recorder);
+	_sntprintf(fileName, MAX_PATH, _T("%s\\%04u%02u%02u-%02u%02u%02u%03u.wav"), recorder->Settings->RecordDirectory, time->wYear, time->wMonth, time->wDay, time->wHour, time->wMinute, time->wSecond, time->wMilliseconds);
+	fileName[MAX_PATH - 1] = _T('\0');
+	recorder->DataBytes = 0;
+	recorder->AllocatedBytes = 0;
+	if
+	(
+		(recorder->File = CreateFile(fileName, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL)) == INVALID_HANDLE_VALUE ||
+		!WriteRecordingHeader(recorder)
+	)
+	{
+		recorder->Errors++;
+		if (recorder->File != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(recorder->File);
+			recorder->File = INVALID_HANDLE_VALUE;
+		}
+		return;
+	}
+	recorder->Files++;
+}
+
+/* process all slots the service loop has published */
+static VOID DrainRecorder(LPRECORDER recorder)
+{
+	LPSLOT slot;
+	LONG tail = recorder->Tail;
+
+	while (tail != recorder->Head)
+	{
+		/* make sure the slot content is read after the head */
+		MemoryBarrier();
+		slot = &recorder->Slots[tail];
+		switch (slot->Kind)
+		{
+			case SLOT_DATA:
+				if (recorder->BufferedBytes + slot->Size > WRITE_BYTES)
+					FlushRecording(recorder);
+				memcpy(recorder->Buffer + recorder->BufferedBytes, slot->Data, slot->Size);
+				recorder->BufferedBytes += slot->Size;
+				break;
+			case SLOT_START:
+				OpenRecording(recorder, (CONST SYSTEMTIME *)slot->Data);
+				break;
+			case SLOT_STOP:
+				CloseRecording(recorder);
+				break;
+		}
+
+		/* hand the slot back */
+		tail = (tail + 1) % SLOTS;
+		MemoryBarrier();
+		recorder->Tail = tail;
+	}
+}
+
+/* the writer thread, does all the file i/o */
+static DWORD WINAPI WriterThread(LPVOID parameter)
+{
+	LPRECORDER recorder = (LPRECORDER)parameter;
+	BOOL exit;
+
+	do
+	{
+		WaitForSingleObject(recorder->Wakeup, WAKEUP_MS);
+		exit = recorder->Exit;
+		DrainRecorder(recorder);
+	}
+	while (!exit);
+	CloseRecording(recorder);
+	return 0;
+}
+
+/* publish a slot to the writer */
+static VOID PushSlot(LPRECORDER recorder, DWORD kind, LPCVOID data, DWORD size)
+{
+	LONG head = recorder->Head;
+	LONG next = (head + 1) % SLOTS;
+	DWORD used;
+
+	/* never wait for the writer with audio, drop the block instead */
+	if (kind == SLOT_DATA)
+	{
+		if ((DWORD)((next - recorder->Tail + SLOTS) % SLOTS) > SLOTS - 1 - CONTROL_SLOTS)
+		{
+			recorder->DroppedBlocks++;
+			return;
+		}
+	}
+
+	/* a lost start or stop would archive a call in the wrong file or not at all, so
+	   wait if even the reserve is used up, unless the writer is gone */
+	else
+	{
+		while (next == recorder->Tail)
+		{
+			SetEvent(recorder->Wakeup);
+			if (WaitForSingleObject(recorder->Thread, 1) != WAIT_TIMEOUT)
+			{
+				recorder->DroppedControls++;
+				return;
+			}
+		}
+	}
+
+	/* fill the slot and make it visible after its content */
+	recorder->Slots[head].Kind = kind;
+	recorder->Slots[head].Size = size;
+	if (size > 0)
+		memcpy(recorder->Slots[head].Data, data, size);
+	MemoryBarrier();
+	recorder->Head = next;
+
+	/* update the high-water mark and wake the writer for control slots or a full batch */
+	used = (DWORD)((next - recorder->Tail + SLOTS) % SLOTS);
+	if (used > recorder->HighWater)
+		recorder->HighWater = used;
+	if (kind != SLOT_DATA || used % WAKEUP_SLOTS == 0)
+		SetEvent(recorder->Wakeup);
+}
+
+/* create a recorder and its writer thread (NULL on error, see GetLastError) */
+LPRECORDER CreateRecorder(LPSETTINGS settings)
+{
+	LPRECORDER recorder;
+	DWORD error;
+
+	ALLOC(recorder);
+	recorder->Settings = settings;
+	recorder->File = INVALID_HANDLE_VALUE;
+	LockRealtimeMemory(settings, recorder, sizeof(*recorder));
+	if
+	(
+		(recorder->Wakeup = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL ||
+		(recorder->Thread = CreateThread(NULL, 0, &WriterThread, recorder, 0, NULL)) == NULL
+	)
+	{
+		error = GetLastError();
+		FreeRecorder(recorder);
+		SetLastError(error);
+		return NULL;
+	}
+	return recorder;
+}
+
+/* begin a new recording file */
+VOID StartRecording(LPRECORDER recorder)
+{
+	SYSTEMTIME now;
+
+	recorder->HighWater = 0;
+	recorder->DroppedBlocks = 0;
+	recorder->DroppedControls = 0;
+	GetLocalTime(&now);
+	PushSlot(recorder, SLOT_START, &now, sizeof(now));
+}
+
+/* queue a block of slin audio, never blocks and drops the block if the writer lags behind */
+VOID RecordBlock(LPRECORDER recorder, LPCVOID buffer, DWORD size)
+{
+	DWORD part;
+
+	while (size > 0)
+	{
+		part = size < SLOT_BYTES ? size : SLOT_BYTES;
+		PushSlot(recorder, SLOT_DATA, buffer, part);
+		buffer = (CONST BYTE *)buffer + part;
+		size -= part;
+	}
+}
+
+/* finish the current recording file */
+VOID StopRecording(LPRECORDER recorder)
+{
+	PushSlot(recorder, SLOT_STOP, NULL, 0);
+}
+
+/* write the recorder statistics */
+VOID DumpRecorder(LPRECORDER recorder, LPMETRICS metrics)
+{
+	PrintMetrics(metrics, "recorder: highwater=%lu/%u dropped=%lu controls_dropped=%lu files=%lu errors=%lu\n", recorder->HighWater, SLOTS - 1, recorder->DroppedBlocks, recorder->DroppedControls, recorder->Files, recorder->Errors);
+}
+
+/* finish all pending writes and release the recorder */
+VOID FreeRecorder(LPRECORDER recorder)
+{
+	if (recorder->Thread != NULL)
+	{
+		recorder->Exit = TRUE;
+		SetEvent(recorder->Wakeup);
+		WaitForSingleObject(recorder->Thread, INFINITE);
+		CloseHandle(recorder->Thread);
+	}
+	if (recorder->Wakeup != NULL)
+		CloseHandle(recorder->Wakeup);
+	FREE(recorder);
+}
@@ -0,0 +1,37 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+/* transparent recorder structure */
+typedef struct tagRECORDER RECORDER, *LPRECORDER;
+
+/* create a recorder and its writer thread (NULL on error, see GetLastError) */
+extern LPRECORDER CreateRecorder(LPSETTINGS);
+
+/* begin a new recording file */
+extern VOID StartRecording(LPRECORDER);
+
+/* queue a block of slin audio, never blocks and drops the block if the writer lags behind */
+extern VOID RecordBlock(LPRECORDER, LPCVOID, DWORD);
+
+/* finish the current recording file */
+extern VOID StopRecording(LPRECORDER);
+
+/* write the recorder statistics */
+extern VOID DumpRecorder(LPRECORDER, LPMETRICS);
+
+/* finish all pending writes and release the recorder */
+extern VOID FreeRecorder(LPRECORDER);
+
+#endif
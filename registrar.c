@@ -0,0 +1,247 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tchar.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "resolver.h"
+#include "regstate.h"
+#include "registrar.h"
+
+/* names of the registration states, for the metrics */
+static LPCSTR StateNames[] = { "idle", "requested", "registered", "refreshing", "backoff" };
+
+/* the state of a single registrar */
+typedef struct tagREGISTRATION
+{
+	/* the account and the resolver of its host */
+	LPCSTR Host;
+	LPCSTR UserName;
+	LPCSTR Secret;
+	LPRESOLVER Resolver;
+
+	/* the session, kept across requests, and the address of the last one */
+	struct iax_session *Session;
+	CHAR Address[MAXSTRLEN];
+
+	/* the state machine, which also keeps the schedule */
+	REGSTATE Machine;
+
+	/* statistics */
+	DWORD Requests;
+	DWORD Acks;
+	DWORD Rejected;
+	DWORD LastLatency;
+	ULONGLONG TotalLatency;
+} REGISTRATION, *LPREGISTRATION;
+
+struct tagREGISTRAR
+{
+	/* guards the registrations against metrics dumps from the playout thread */
+	CRITICAL_SECTION Lock;
+	UINT Count;
+	REGISTRATION Registrations[MAX_REGISTRARS];
+};
+
+/* send a request to the last known address as a new transaction on the existing session */
+static BOOL Send(LPREGISTRATION registration, ULONGLONG now)
+{
+	RefreshResolver(registration->Resolver, FALSE);
+	if (!GetResolvedAddress(registration->Resolver, registration->Address, MAXSTRLEN))
+		return FALSE;
+	if (registration->Session != NULL)
+		iax_session_reset(registration->Session);
+	else if ((registration->Session = iax_session_new()) == NULL)
+		return FALSE;
+	if (iax_register(registration->Session, registration->Address, registration->UserName, registration->Secret, IAX_DEFAULT_REG_EXPIRE) < 0)
+		return FALSE;
+	registration->Requests++;
+	registration->Machine.Sent = now;
+	return TRUE;
+}
+
+/* feed an input to the state machine and send what it asks for, a request that can't be sent counts as failed */
+static VOID Dispatch(LPREGISTRATION registration, INT input, DWORD granted, ULONGLONG now)
+{
+	if (StepRegState(&registration->Machine, input, granted, now) && !Send(registration, now))
+		StepRegState(&registration->Machine, INPUT_FAILED, 0, now);
+}
+
+/* create a registration for each registrar in the settings, their lookups signal
+   the event, all times are GetTickCount64 milliseconds (NULL on error, see GetLastError) */
+LPREGISTRAR CreateRegistrar(LPSETTINGS settings, WSAEVENT resolved, ULONGLONG now)
+{
+	LPREGISTRAR registrar;
+	LPREGISTRATION registration;
+	LARGE_INTEGER counter;
+	DWORD error;
+	UINT i;
+
+	ALLOC(registrar);
+	InitializeCriticalSection(&registrar->Lock);
+	for (i = 0; i < settings->Registrars; i++)
+	{
+		registration = &registrar->Registrations[i];
+		registration->Host = settings->Host[i];
+		registration->UserName = settings->UserName[i];
+		registration->Secret = settings->Secret[i];
+
+		/* seed the jitter with something that differs even between identical machines */
+		QueryPerformanceCounter(&counter);
+		InitRegState(&registration->Machine, (GetTickCount() ^ GetCurrentProcessId() ^ counter.u.LowPart ^ (i << 24)) | 1, now);
+		if ((registration->Resolver = CreateResolver(registration->Host, resolved)) == NULL)
+		{
+			error = GetLastError();
+			FreeRegistrar(registrar);
+			SetLastError(error);
+			return NULL;
+		}
+		registrar->Count++;
+	}
+	return registrar;
+}
+
+/* milliseconds until the next request is due, negative if none is scheduled */
+LONGLONG GetRegistrarTimeout(LPREGISTRAR registrar, ULONGLONG now)
+{
+	LONGLONG timeout = -1;
+	LONGLONG wait;
+	UINT i;
+
+	for (i = 0; i < registrar->Count; i++)
+	{
+		wait = registrar->Registrations[i].Machine.Due <= now ? 0 : (LONGLONG)(registrar->Registrations[i].Machine.Due - now);
+		if (timeout < 0 || wait < timeout)
+			timeout = wait;
+	}
+	return timeout;
+}
+
+/* send all requests that are due */
+VOID ServiceRegistrar(LPREGISTRAR registrar, ULONGLONG now)
+{
+	UINT i;
+
+	EnterCriticalSection(&registrar->Lock);
+	for (i = 0; i < registrar->Count; i++)
+	{
+		if (registrar->Registrations[i].Machine.Due <= now)
+			Dispatch(&registrar->Registrations[i], INPUT_DUE, 0, now);
+	}
+	LeaveCriticalSection(&registrar->Lock);
+}
+
+/* register again soon wherever a finished lookup moved the registrar */
+VOID ResolveRegistrar(LPREGISTRAR registrar, ULONGLONG now)
+{
+	LPREGISTRATION registration;
+	CHAR address[MAXSTRLEN];
+	UINT i;
+
+	EnterCriticalSection(&registrar->Lock);
+	for (i = 0; i < registrar->Count; i++)
+	{
+		registration = &registrar->Registrations[i];
+		if (GetResolvedAddress(registration->Resolver, address, MAXSTRLEN) && strcmp(address, registration->Address) != 0)
+			Dispatch(registration, INPUT_MOVED, 0, now);
+	}
+	LeaveCriticalSection(&registrar->Lock);
+}
+
+/* handle an event of a registration session, FALSE if the session is none of ours */
+BOOL HandleRegistrarEvent(LPREGISTRAR registrar, struct iax_event *evt, ULONGLONG now)
+{
+	LPREGISTRATION registration;
+	UINT i;
+
+	for (i = 0; i < registrar->Count && registrar->Registrations[i].Session != evt->session; i++);
+	if (i == registrar->Count || evt->session == NULL)
+		return FALSE;
+	registration = &registrar->Registrations[i];
+
+	EnterCriticalSection(&registrar->Lock);
+	switch (evt->etype)
+	{
+		/* remember how long the registrar took and refresh in time for the expiry it granted */
+		case IAX_EVENT_REGACK:
+			registration->Acks++;
+			if (registration->Machine.Sent != 0)
+			{
+				registration->LastLatency = (DWORD)(now - registration->Machine.Sent);
+				registration->TotalLatency += registration->LastLatency;
+			}
+			Dispatch(registration, INPUT_ACK, evt->ies.refresh != 0 ? evt->ies.refresh : IAX_DEFAULT_REG_EXPIRE, now);
+			break;
+
+		/* the session stays for the next attempt */
+		case IAX_EVENT_REGREJ:
+			registration->Rejected++;
+			Dispatch(registration, INPUT_FAILED, 0, now);
+			break;
+
+		/* libiax2 already destroyed the session, the next attempt needs a new one */
+		case IAX_EVENT_REJECT:
+		case IAX_EVENT_HANGUP:
+			registration->Rejected++;
+			registration->Session = NULL;
+			Dispatch(registration, INPUT_FAILED, 0, now);
+			break;
+
+		/* keep the session, but look the registrar up again meanwhile */
+		case IAX_EVENT_TIMEOUT:
+			registration->Machine.Timeouts++;
+			RefreshResolver(registration->Resolver, TRUE);
+			Dispatch(registration, INPUT_FAILED, 0, now);
+			break;
+	}
+	LeaveCriticalSection(&registrar->Lock);
+	return TRUE;
+}
+
+/* write the state, latency and resolver statistics of every registration */
+VOID DumpRegistrar(LPREGISTRAR registrar, LPMETRICS metrics)
+{
+	LPREGISTRATION registration;
+	ULONGLONG now = GetTickCount64();
+	UINT i;
+
+	EnterCriticalSection(&registrar->Lock);
+	for (i = 0; i < registrar->Count; i++)
+	{
+		registration = &registrar->Registrations[i];
+		PrintMetrics(metrics, "registrar: host=%s user=%s state=%s expires=%lus failures=%u requests=%lu acks=%lu rejects=%lu timeouts=%u latency=%lums mean=%lums\n", registration->Host, registration->UserName, StateNames[registration->Machine.State], registration->Machine.Expires > now ? (DWORD)((registration->Machine.Expires - now) / 1000) : 0, registration->Machine.Failures, registration->Requests, registration->Acks, registration->Rejected, registration->Machine.Timeouts, registration->LastLatency, registration->Acks > 0 ? (DWORD)(registration->TotalLatency / registration->Acks) : 0);
+		DumpResolver(registration->Resolver, metrics);
+	}
+	LeaveCriticalSection(&registrar->Lock);
+}
+
+/* destroy all registration sessions and release the registrar */
+VOID FreeRegistrar(LPREGISTRAR registrar)
+{
+	UINT i;
+
+	for (i = 0; i < registrar->Count; i++)
+	{
+		if (registrar->Registrations[i].Session != NULL)
+			iax_session_destroy(&registrar->Registrations[i].Session);
+		FreeResolver(registrar->Registrations[i].Resolver);
+	}
+	DeleteCriticalSection(&registrar->Lock);
+	FREE(registrar);
+}
@@ -0,0 +1,41 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _REGISTRAR_H
+#define _REGISTRAR_H
+
+/* transparent structure of all registrations */
+typedef struct tagREGISTRAR REGISTRAR, *LPREGISTRAR;
+
+/* create a registration for each registrar in the settings, their lookups signal
+   the event, all times are GetTickCount64 milliseconds (NULL on error, see GetLastError) */
+extern LPREGISTRAR CreateRegistrar(LPSETTINGS, WSAEVENT, ULONGLONG);
+
+/* milliseconds until the next request is due, negative if none is scheduled */
+extern LONGLONG GetRegistrarTimeout(LPREGISTRAR, ULONGLONG);
+
+/* send all requests that are due */
+extern VOID ServiceRegistrar(LPREGISTRAR, ULONGLONG);
+
+/* register again soon wherever a finished lookup moved the registrar */
+extern VOID ResolveRegistrar(LPREGISTRAR, ULONGLONG);
+
+/* handle an event of a registration session, FALSE if the session is none of ours */
+extern BOOL HandleRegistrarEvent(LPREGISTRAR, struct iax_event *, ULONGLONG);
+
+/* write the state, latency and resolver statistics of every registration */
+extern VOID DumpRegistrar(LPREGISTRAR, LPMETRICS);
+
+/* destroy all registration sessions and release the registrar */
+extern VOID FreeRegistrar(LPREGISTRAR);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include "regstate.h"
+
+/* a random number below the range from the registration's own xorshift generator */
+static unsigned int Random(LPREGSTATE state, unsigned int range)
+{
+	unsigned int x = state->Seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	state->Seed = x;
+	return range == 0 ? 0 : x % range;
+}
+
+/* start idle with the first request due within START_JITTER, the seed must not be zero */
+void InitRegState(LPREGSTATE state, unsigned int seed, unsigned long long now)
+{
+	state->State = REGISTRATION_IDLE;
+	state->Expires = 0;
+	state->Sent = 0;
+	state->Failures = 0;
+	state->Timeouts = 0;
+	state->Seed = seed;
+	state->Due = now + Random(state, START_JITTER);
+}
+
+/* advance the state machine, nonzero if a request has to go out now; nothing but the
+   arguments and the state itself is involved, so it runs in any time base */
+int StepRegState(LPREGSTATE state, int input, unsigned int granted, unsigned long long now)
+{
+	unsigned int delay;
+
+	switch (input)
+	{
+		/* time to (re)register, unless the pending request never got an answer */
+		case INPUT_DUE:
+			if (state->State == REGISTRATION_REQUESTED || state->State == REGISTRATION_REFRESHING)
+			{
+				state->Timeouts++;
+				return StepRegState(state, INPUT_FAILED, 0, now);
+			}
+			state->State = state->State == REGISTRATION_REGISTERED ? REGISTRATION_REFRESHING : REGISTRATION_REQUESTED;
+			state->Due = now + REQUEST_TIMEOUT * 1000;
+			return 1;
+
+		/* ask a moved registrar soon (jittered like the first request) unless a request is under way */
+		case INPUT_MOVED:
+			if (state->State != REGISTRATION_REQUESTED && state->State != REGISTRATION_REFRESHING && state->Due > now + START_JITTER)
+				state->Due = now + Random(state, START_JITTER);
+			return 0;
+
+		/* refresh well before the granted expiry, at a random point so that pagers spread out */
+		case INPUT_ACK:
+			if (granted < MIN_EXPIRY)
+				granted = MIN_EXPIRY;
+			state->State = REGISTRATION_REGISTERED;
+			state->Failures = 0;
+			state->Sent = 0;
+			state->Expires = now + (unsigned long long)granted * 1000;
+			state->Due = now + (unsigned long long)granted * 10 * (REFRESH_MIN + Random(state, REFRESH_MAX - REFRESH_MIN + 1));
+			return 0;
+
+		/* back off exponentially, cut by up to half at random so that failed pagers don't return together */
+		case INPUT_FAILED:
+			delay = BACKOFF_MIN << (state->Failures < 6 ? state->Failures : 6);
+			if (delay > BACKOFF_MAX)
+				delay = BACKOFF_MAX;
+			state->State = REGISTRATION_BACKOFF;
+			state->Failures++;
+			state->Sent = 0;
+			state->Due = now + delay * 1000 - Random(state, delay * 500);
+			return 0;
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _REGSTATE_H
+#define _REGSTATE_H
+
+/* the first requests go out within START_JITTER milliseconds, registrations are
+   refreshed after REFRESH_MIN to REFRESH_MAX percent of the granted expiry (which
+   counts as at least MIN_EXPIRY seconds), failures back off from BACKOFF_MIN
+   seconds, doubling up to BACKOFF_MAX seconds, each cut by up to half, and a
+   request without any answer fails after REQUEST_TIMEOUT seconds */
+#define START_JITTER    1000
+#define REFRESH_MIN     65
+#define REFRESH_MAX     85
+#define MIN_EXPIRY      10
+#define BACKOFF_MIN     5
+#define BACKOFF_MAX     300
+#define REQUEST_TIMEOUT 60
+
+/* registration states */
+#define REGISTRATION_IDLE       0
+#define REGISTRATION_REQUESTED  1
+#define REGISTRATION_REGISTERED 2
+#define REGISTRATION_REFRESHING 3
+#define REGISTRATION_BACKOFF    4
+
+/* state machine inputs */
+#define INPUT_DUE    0
+#define INPUT_MOVED  1
+#define INPUT_ACK    2
+#define INPUT_FAILED 3
+
+/* the schedule of a single registration, free of any Windows or network type so that
+   it can be driven by a fake clock; all times are milliseconds in the caller's time base */
+typedef struct tagREGSTATE
+{
+	/* current state, when the next input is due, when the registration expires,
+	   when the pending request was sent, the failures in a row, the requests that
+	   never got an answer and the jitter source */
+	int State;
+	unsigned long long Due;
+	unsigned long long Expires;
+	unsigned long long Sent;
+	unsigned int Failures;
+	unsigned int Timeouts;
+	unsigned int Seed;
+} REGSTATE, *LPREGSTATE;
+
+/* start idle with the first request due within START_JITTER, the seed must not be zero */
+extern void InitRegState(LPREGSTATE, unsigned int, unsigned long long);
+
+/* advance the state machine by an input (with the granted expiry in seconds for
+   INPUT_ACK), nonzero if a request has to go out now */
+extern int StepRegState(LPREGSTATE, int, unsigned int, unsigned long long);
+
+#endif
@@ -0,0 +1,402 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <windns.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <tchar.h>
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "resolver.h"
+
+/* record ttls are kept within MIN_TTL and MAX_TTL, failed lookups are retried
+   after RETRY_TTL and names only the system resolver knows are kept for
+   DEFAULT_TTL (all in seconds) */
+#define MIN_TTL     10
+#define MAX_TTL     86400
+#define RETRY_TTL   30
+#define DEFAULT_TTL 300
+
+/* owner of the iax service records (RFC 2782) */
+#define SERVICE_PREFIX "_iax._udp."
+
+struct tagRESOLVER
+{
+	/* the configured name and port (0 if none was given) */
+	CHAR Name[MAXSTRLEN];
+	USHORT Port;
+
+	/* the lookup thread, its wakeup event, the event signaled after each lookup and
+	   the number of owners (the service and the thread), the last one frees the resolver */
+	HANDLE Thread;
+	HANDLE Wakeup;
+	WSAEVENT Done;
+	volatile LONG References;
+
+	/* everything below is guarded by the lock */
+	CRITICAL_SECTION Lock;
+	BOOL Exit;
+	BOOL Pending;
+
+	/* last known good address, whether it came from a service record and when it expires */
+	CHAR Address[MAXSTRLEN];
+	BOOL Service;
+	ULONGLONG Expires;
+
+	/* statistics */
+	DWORD Lookups;
+	DWORD Failures;
+	DWORD Changes;
+	DWORD LastDuration;
+};
+
+/* split "host", "host:port", "[v6]" or "[v6]:port", a bare v6 literal never carries a port */
+static BOOL SplitName(LPRESOLVER resolver, LPCSTR host)
+{
+	LPCSTR end;
+	LPCSTR colon;
+	size_t length;
+
+	if (*host == '[')
+	{
+		if ((end = strchr(++host, ']')) == NULL || (end[1] != '\0' && end[1] != ':'))
+			return FALSE;
+		colon = end[1] == ':' ? end + 1 : NULL;
+	}
+	else
+	{
+		colon = strchr(host, ':');
+		if (colon != NULL && colon != strrchr(host, ':'))
+			colon = NULL;
+		end = colon != NULL ? colon : host + strlen(host);
+	}
+	length = (size_t)(end - host);
+	if (length == 0 || length >= MAXSTRLEN)
+		return FALSE;
+	memcpy(resolver->Name, host, length);
+	resolver->Name[length] = '\0';
+	return colon == NULL || (resolver->Port = (USHORT)atoi(colon + 1)) != 0;
+}
+
+/* print an address the way iax_register expects it */
+static BOOL FormatAddress(CONST SOCKADDR_STORAGE *address, USHORT port, LPSTR buffer, DWORD size)
+{
+	CHAR numeric[INET6_ADDRSTRLEN];
+
+	if (getnameinfo((CONST SOCKADDR *)address, address->ss_family == AF_INET6 ? sizeof(SOCKADDR_IN6) : sizeof(SOCKADDR_IN), numeric, sizeof(numeric), NULL, 0, NI_NUMERICHOST) != 0)
+		return FALSE;
+	_snprintf(buffer, size, address->ss_family == AF_INET6 ? "[%s]:%u" : "%s:%u", numeric, port);
+	buffer[size - 1] = '\0';
+	return TRUE;
+}
+
+/* take the address of an a or aaaa record and lower the ttl to the record's */
+static BOOL CopyRecordAddress(PDNS_RECORDA record, WORD type, SOCKADDR_STORAGE *address, LPDWORD ttl)
+{
+	if (record->wType != type)
+		return FALSE;
+	ZERO(address);
+	if (type == DNS_TYPE_A)
+	{
+		((SOCKADDR_IN *)address)->sin_family = AF_INET;
+		((SOCKADDR_IN *)address)->sin_addr.s_addr = record->Data.A.IpAddress;
+	}
+	else
+	{
+		((SOCKADDR_IN6 *)address)->sin6_family = AF_INET6;
+		memcpy(&((SOCKADDR_IN6 *)address)->sin6_addr, &record->Data.AAAA.Ip6Address, sizeof(IN6_ADDR));
+	}
+	if (record->dwTtl < *ttl)
+		*ttl = record->dwTtl;
+	return TRUE;
+}
+
+/* find the first address of the given type within a section, optionally for a certain name only */
+static BOOL FindAddress(PDNS_RECORDA records, DWORD section, LPCSTR name, WORD type, SOCKADDR_STORAGE *address, LPDWORD ttl)
+{
+	for (; records != NULL; records = records->pNext)
+	{
+		if (records->Flags.S.Section == section && (name == NULL || DnsNameCompare_A(records->pName, name)) && CopyRecordAddress(records, type, address, ttl))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* look up an a or aaaa record of the name, cnames are followed by the dns client */
+static BOOL QueryAddress(LPCSTR name, WORD type, SOCKADDR_STORAGE *address, LPDWORD ttl)
+{
+	PDNS_RECORDA records = NULL;
+	BOOL found;
+
+	if (DnsQuery_A(name, type, DNS_QUERY_STANDARD, NULL, (PDNS_RECORD *)&records, NULL) != ERROR_SUCCESS)
+		return FALSE;
+	found = FindAddress(records, DNSREC_ANSWER, NULL, type, address, ttl);
+	DnsRecordListFree(records, DnsFreeRecordList);
+	return found;
+}
+
+/* look up the iax service records of the name and resolve the target picked by priority and weight (RFC 2782) */
+static BOOL QueryService(LPCSTR name, SOCKADDR_STORAGE *address, USHORT *port, LPDWORD ttl)
+{
+	CHAR service[sizeof(SERVICE_PREFIX) + MAXSTRLEN];
+	PDNS_RECORDA records = NULL;
+	PDNS_RECORDA record;
+	PDNS_RECORDA chosen = NULL;
+	LPCSTR target;
+	DWORD total = 0;
+	BOOL found = FALSE;
+
+	strcpy(service, SERVICE_PREFIX);
+	strcat(service, name);
+	if (DnsQuery_A(service, DNS_TYPE_SRV, DNS_QUERY_STANDARD, NULL, (PDNS_RECORD *)&records, NULL) != ERROR_SUCCESS)
+		return FALSE;
+
+	/* find the lowest priority first */
+	for (record = records; record != NULL; record = record->pNext)
+	{
+		if (record->Flags.S.Section == DNSREC_ANSWER && record->wType == DNS_TYPE_SRV && (chosen == NULL || record->Data.SRV.wPriority < chosen->Data.SRV.wPriority))
+			chosen = record;
+	}
+
+	/* then pick one of its records at random in proportion to the weights (zero weights get a slim chance) */
+	if (chosen != NULL)
+	{
+		for (record = records; record != NULL; record = record->pNext)
+		{
+			if (record->Flags.S.Section == DNSREC_ANSWER && record->wType == DNS_TYPE_SRV && record->Data.SRV.wPriority == chosen->Data.SRV.wPriority)
+			{
+				total += record->Data.SRV.wWeight + 1;
+				if ((((DWORD)rand() << 15) ^ (DWORD)rand()) % total <= record->Data.SRV.wWeight)
+					chosen = record;
+			}
+		}
+	}
+
+	/* a target of "." means the service is not offered under that name */
+	if (chosen != NULL && (target = chosen->Data.SRV.pNameTarget) != NULL && target[0] != '\0' && strcmp(target, ".") != 0)
+	{
+		*port = chosen->Data.SRV.wPort;
+		if (chosen->dwTtl < *ttl)
+			*ttl = chosen->dwTtl;
+
+		/* prefer the addresses the server sent along */
+		found =
+			FindAddress(records, DNSREC_ADDITIONAL, target, DNS_TYPE_A, address, ttl) ||
+			FindAddress(records, DNSREC_ADDITIONAL, target, DNS_TYPE_AAAA, address, ttl) ||
+			QueryAddress(target, DNS_TYPE_A, address, ttl) ||
+			QueryAddress(target, DNS_TYPE_AAAA, address, ttl);
+	}
+	DnsRecordListFree(records, DnsFreeRecordList);
+	return found;
+}
+
+/* resolve the name, ports given explicitly skip the service lookup */
+static BOOL Lookup(LPRESOLVER resolver, LPSTR buffer, DWORD size, LPBOOL service, LPDWORD ttl)
+{
+	SOCKADDR_STORAGE address;
+	USHORT port = resolver->Port != 0 ? resolver->Port : IAX_DEFAULT_PORTNO;
+	struct addrinfo hints;
+	struct addrinfo *result;
+
+	*ttl = MAX_TTL;
+	*service = resolver->Port == 0 && QueryService(resolver->Name, &address, &port, ttl);
+	if (!*service && !QueryAddress(resolver->Name, DNS_TYPE_A, &address, ttl) && !QueryAddress(resolver->Name, DNS_TYPE_AAAA, &address, ttl))
+	{
+		/* let the system resolve names that are not in the dns (like netbios names) */
+		ZERO(&hints);
+		hints.ai_socktype = SOCK_DGRAM;
+		if (getaddrinfo(resolver->Name, NULL, &hints, &result) != 0)
+			return FALSE;
+		ZERO(&address);
+		memcpy(&address, result->ai_addr, min(result->ai_addrlen, sizeof(address)));
+		freeaddrinfo(result);
+		*ttl = DEFAULT_TTL;
+	}
+	if (*ttl < MIN_TTL)
+		*ttl = MIN_TTL;
+	return FormatAddress(&address, port, buffer, size);
+}
+
+/* drop a reference, the last one frees the resolver */
+static VOID ReleaseResolver(LPRESOLVER resolver)
+{
+	if (InterlockedDecrement(&resolver->References) != 0)
+		return;
+	if (resolver->Wakeup != NULL)
+		CloseHandle(resolver->Wakeup);
+	DeleteCriticalSection(&resolver->Lock);
+	FREE(resolver);
+}
+
+/* the lookup thread, the only one that may block on the network */
+static DWORD WINAPI LookupThread(LPVOID parameter)
+{
+	LPRESOLVER resolver = (LPRESOLVER)parameter;
+	CHAR address[MAXSTRLEN];
+	ULONGLONG started;
+	BOOL service;
+	BOOL success;
+	BOOL exit;
+	DWORD ttl;
+
+	/* every pager should spread differently over equally weighted servers */
+	srand(GetTickCount() ^ GetCurrentThreadId());
+	do
+	{
+		WaitForSingleObject(resolver->Wakeup, INFINITE);
+		EnterCriticalSection(&resolver->Lock);
+		exit = resolver->Exit;
+		LeaveCriticalSection(&resolver->Lock);
+		if (exit)
+			break;
+
+		/* resolve without the lock, so that the service loop never waits for the network */
+		started = GetTickCount64();
+		success = Lookup(resolver, address, sizeof(address), &service, &ttl);
+
+		/* on failure keep the last known good address and try again later */
+		EnterCriticalSection(&resolver->Lock);
+		resolver->Lookups++;
+		resolver->LastDuration = (DWORD)(GetTickCount64() - started);
+		if (success)
+		{
+			if (strcmp(resolver->Address, address) != 0)
+			{
+				if (resolver->Address[0] != '\0')
+					resolver->Changes++;
+				strcpy(resolver->Address, address);
+			}
+			resolver->Service = service;
+		}
+		else
+		{
+			resolver->Failures++;
+			ttl = RETRY_TTL;
+		}
+		resolver->Expires = GetTickCount64() + (ULONGLONG)ttl * 1000;
+		resolver->Pending = FALSE;
+		if (!(exit = resolver->Exit))
+			WSASetEvent(resolver->Done);
+		LeaveCriticalSection(&resolver->Lock);
+	}
+	while (!exit);
+	ReleaseResolver(resolver);
+	return 0;
+}
+
+/* create a resolver for a "host[:port]" or "[v6][:port]" string and its lookup
+   thread, which signals the event after each lookup (NULL on error, see GetLastError) */
+LPRESOLVER CreateResolver(LPCSTR host, WSAEVENT done)
+{
+	LPRESOLVER resolver;
+	SOCKADDR_STORAGE address;
+	struct addrinfo hints;
+	struct addrinfo *result;
+	DWORD error;
+
+	ALLOC(resolver);
+	InitializeCriticalSection(&resolver->Lock);
+	resolver->Done = done;
+	resolver->References = 1;
+	if (!SplitName(resolver, host))
+	{
+		ReleaseResolver(resolver);
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return NULL;
+	}
+
+	/* literal addresses need no lookup and never expire */
+	ZERO(&hints);
+	hints.ai_flags = AI_NUMERICHOST;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(resolver->Name, NULL, &hints, &result) == 0)
+	{
+		ZERO(&address);
+		memcpy(&address, result->ai_addr, min(result->ai_addrlen, sizeof(address)));
+		freeaddrinfo(result);
+		FormatAddress(&address, resolver->Port != 0 ? resolver->Port : IAX_DEFAULT_PORTNO, resolver->Address, MAXSTRLEN);
+		resolver->Expires = ~(ULONGLONG)0;
+		return resolver;
+	}
+
+	/* otherwise start the thread with the first lookup already pending */
+	resolver->Pending = TRUE;
+	resolver->References = 2;
+	if
+	(
+		(resolver->Wakeup = CreateEvent(NULL, FALSE, TRUE, NULL)) == NULL ||
+		(resolver->Thread = CreateThread(NULL, 0, &LookupThread, resolver, 0, NULL)) == NULL
+	)
+	{
+		error = GetLastError();
+		resolver->References = 1;
+		ReleaseResolver(resolver);
+		SetLastError(error);
+		return NULL;
+	}
+	return resolver;
+}
+
+/* start a background lookup if the cached address expired (or in any case if forced) */
+VOID RefreshResolver(LPRESOLVER resolver, BOOL force)
+{
+	EnterCriticalSection(&resolver->Lock);
+	if (resolver->Thread != NULL && !resolver->Pending && (force || GetTickCount64() >= resolver->Expires))
+	{
+		resolver->Pending = TRUE;
+		SetEvent(resolver->Wakeup);
+	}
+	LeaveCriticalSection(&resolver->Lock);
+}
+
+/* copy the last known good address as "address:port", FALSE if there is none yet */
+BOOL GetResolvedAddress(LPRESOLVER resolver, LPSTR buffer, DWORD size)
+{
+	BOOL known;
+
+	EnterCriticalSection(&resolver->Lock);
+	if ((known = resolver->Address[0] != '\0'))
+	{
+		strncpy(buffer, resolver->Address, size);
+		buffer[size - 1] = '\0';
+	}
+	LeaveCriticalSection(&resolver->Lock);
+	return known;
+}
+
+/* write the resolver statistics */
+VOID DumpResolver(LPRESOLVER resolver, LPMETRICS metrics)
+{
+	EnterCriticalSection(&resolver->Lock);
+	PrintMetrics(metrics, "resolver: name=%s address=%s srv=%s pending=%s lookups=%lu failures=%lu changes=%lu last=%lums\n", resolver->Name, resolver->Address[0] != '\0' ? resolver->Address : "-", resolver->Service ? "yes" : "no", resolver->Pending ? "yes" : "no", resolver->Lookups, resolver->Failures, resolver->Changes, resolver->LastDuration);
+	LeaveCriticalSection(&resolver->Lock);
+}
+
+/* release the resolver, a pending lookup is abandoned rather than waited for */
+VOID FreeResolver(LPRESOLVER resolver)
+{
+	EnterCriticalSection(&resolver->Lock);
+	resolver->Exit = TRUE;
+	LeaveCriticalSection(&resolver->Lock);
+	if (resolver->Thread != NULL)
+	{
+		SetEvent(resolver->Wakeup);
+		CloseHandle(resolver->Thread);
+	}
+	ReleaseResolver(resolver);
+}
@@ -0,0 +1,35 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+
+/* transparent resolver structure */
+typedef struct tagRESOLVER RESOLVER, *LPRESOLVER;
+
+/* create a resolver for a "host[:port]" or "[v6][:port]" string and its lookup
+   thread, which signals the event after each lookup (NULL on error, see GetLastError) */
+extern LPRESOLVER CreateResolver(LPCSTR, WSAEVENT);
+
+/* start a background lookup if the cached address expired (or in any case if forced) */
+extern VOID RefreshResolver(LPRESOLVER, BOOL);
+
+/* copy the last known good address as "address:port", FALSE if there is none yet */
+extern BOOL GetResolvedAddress(LPRESOLVER, LPSTR, DWORD);
+
+/* write the resolver statistics */
+extern VOID DumpResolver(LPRESOLVER, LPMETRICS);
+
+/* release the resolver, a pending lookup is abandoned rather than waited for */
+extern VOID FreeResolver(LPRESOLVER);
+
+#endif
@@ -14,26 +14,152 @@
 #include <windows.h>
 #include <stdio.h>
 #include <tchar.h>
+#ifdef __linux__
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
 #include "common.h"
 #include "service.h"
 
+#ifdef __linux__
+/* descriptor behind an event and the epoll data of the signalfd */
+#define DESCRIPTOR(event) ((INT)(DWORD_PTR)(event))
+#define SERVICE_SIGNALS   SERVICE_EVENT_MAX
+#endif
+
 /* variables associated with a service */
 struct tagSERVICE
 {
+#ifdef __linux__
+	/* the status, there is no SCM to report it to */
+	SERVICE_STATUS Status;
+	DWORD TargetState;
+
+	/* the epoll set over the events and the watched network descriptor, and
+	   the signalfd delivering SIGTERM, SIGINT (stop) and SIGUSR1 (metrics) */
+	INT Poll;
+	INT Signals;
+
+	/* eventfds for shutdown/stop, network data, waveform completion, a metrics
+	   request and a finished lookup, followed by the timerfd for sub-millisecond timeouts */
+	WSAEVENT Events[SERVICE_EVENT_MAX];
+#else
 	/* the handle and status of the service */
 	SERVICE_STATUS_HANDLE Handle;
 	SERVICE_STATUS Status;
 	DWORD TargetState;
 
-	/* events indicating shutdown/stop, network data and waveform completion */
+	/* events indicating shutdown/stop, network data, waveform completion, a metrics request and a finished lookup */
 	WSAEVENT ShutdownEvent;
 	WSAEVENT NetworkEvent;
 	WSAEVENT WaveformEvent;
+	WSAEVENT MetricsEvent;
+	WSAEVENT ResolverEvent;
+
+	/* timer for sub-millisecond timeouts, always the last event */
+	HANDLE Timer;
 
 	/* array of all events */
 	WSAEVENT Events[SERVICE_EVENT_MAX];
+#endif
 };
 
+#ifdef __linux__
+
+/* add a descriptor to the epoll set, reported as the given event */
+static BOOL WatchDescriptor(LPSERVICE service, INT fd, DWORD event)
+{
+	struct epoll_event watch;
+
+	ZERO(&watch);
+	watch.events = EPOLLIN;
+	watch.data.u32 = event;
+	return epoll_ctl(service->Poll, EPOLL_CTL_ADD, fd, &watch) == 0;
+}
+
+/* there is no SCM to report the status to */
+static BOOL ReportServiceStatus(LPSERVICE service)
+{
+	return TRUE;
+}
+
+/* wait for any service event within the given microseconds (negative waits forever),
+   returns WSA_WAIT_TIMEOUT once the time has passed */
+DWORD WaitForServiceEvents(LPSERVICE service, LONGLONG timeout)
+{
+	struct epoll_event ready[SERVICE_EVENT_MAX + 2];
+	struct signalfd_siginfo info;
+	struct itimerspec due;
+	eventfd_t expirations;
+	DWORD first = SERVICE_EVENT_MAX;
+	DWORD event;
+	INT count;
+	INT i;
+
+	/* arm the timer (relative, in nanoseconds) unless just polling or waiting forever */
+	ZERO(&due);
+	if (timeout > 0)
+	{
+		due.it_value.tv_sec = timeout / 1000000;
+		due.it_value.tv_nsec = (timeout % 1000000) * 1000;
+		if (timerfd_settime(DESCRIPTOR(service->Events[SERVICE_EVENT_TIMER]), 0, &due, NULL) != 0)
+			return WSA_WAIT_FAILED;
+	}
+	while ((count = epoll_wait(service->Poll, ready, sizeof(ready) / sizeof(ready[0]), timeout == 0 ? 0 : -1)) < 0 && errno == EINTR);
+	if (count < 0)
+		return WSA_WAIT_FAILED;
+
+	/* the lowest ready event wins as with WSAWaitForMultipleEvents, signals set
+	   their events first just like the handler does on Windows */
+	for (i = 0; i < count; i++)
+	{
+		event = ready[i].data.u32;
+		if (event == SERVICE_SIGNALS)
+		{
+			while (read(service->Signals, &info, sizeof(info)) == sizeof(info))
+			{
+				event = info.ssi_signo == SIGUSR1 ? SERVICE_EVENT_METRICS : SERVICE_EVENT_SHUTDOWN;
+				eventfd_write(DESCRIPTOR(service->Events[event]), 1);
+				if (event < first)
+					first = event;
+			}
+		}
+		else if (event < first)
+			first = event;
+	}
+
+	/* report the timer like a timeout and disarm it otherwise (which drops a pending expiry) */
+	if (first == SERVICE_EVENT_TIMER)
+		eventfd_read(DESCRIPTOR(service->Events[SERVICE_EVENT_TIMER]), &expirations);
+	if (first >= SERVICE_EVENT_TIMER)
+		return WSA_WAIT_TIMEOUT;
+	if (timeout > 0)
+	{
+		ZERO(&due);
+		timerfd_settime(DESCRIPTOR(service->Events[SERVICE_EVENT_TIMER]), 0, &due, NULL);
+	}
+	return WSA_WAIT_EVENT_0 + first;
+}
+
+/* report data on the network descriptor (the io_uring one if libiax2 receives through it) as the network event */
+BOOL WatchServiceNetwork(LPSERVICE service, INT fd)
+{
+	if (!WatchDescriptor(service, fd, SERVICE_EVENT_NETWORK))
+	{
+		SetLastError(errno);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+#else
+
 /* serive handler routine */
 static DWORD WINAPI Handler(DWORD control, DWORD eventType, LPVOID eventData, LPVOID context)
 {
@@ -47,6 +173,10 @@ static DWORD WINAPI Handler(DWORD control, DWORD eventType, LPVOID eventData, LP
 		case SERVICE_CONTROL_STOP:
 			return WSASetEvent(service->ShutdownEvent) ? NO_ERROR : GetLastError();
 
+		/* signal a metrics dump to the service main loop */
+		case SERVICE_CONTROL_METRICS:
+			return WSASetEvent(service->MetricsEvent) ? NO_ERROR : GetLastError();
+
 		/* report the current status */
 		case SERVICE_CONTROL_INTERROGATE:
 			return SetServiceStatus(service->Handle, &service->Status) ? NO_ERROR : GetLastError();
@@ -57,12 +187,46 @@ static DWORD WINAPI Handler(DWORD control, DWORD eventType, LPVOID eventData, LP
 	}
 }
 
-/* wait for any service event within the given time */
-DWORD WaitForServiceEvents(LPSERVICE service, DWORD timeout)
+/* wait for any service event within the given microseconds (negative waits forever),
+   returns WSA_WAIT_TIMEOUT once the time has passed */
+DWORD WaitForServiceEvents(LPSERVICE service, LONGLONG timeout)
+{
+	LARGE_INTEGER dueTime;
+	DWORD result;
+
+	/* just poll if the time is already up */
+	if (timeout == 0)
+		return WSAWaitForMultipleEvents(SERVICE_EVENT_TIMER, service->Events, FALSE, 0, FALSE);
+
+	/* wait forever without the timer, otherwise arm it (relative, in 100ns units) */
+	if (timeout < 0)
+		return WSAWaitForMultipleEvents(SERVICE_EVENT_TIMER, service->Events, FALSE, WSA_INFINITE, FALSE);
+	dueTime.QuadPart = -timeout * 10;
+	if (!SetWaitableTimer(service->Timer, &dueTime, 0, NULL, NULL, FALSE))
+		return WSA_WAIT_FAILED;
+	result = WSAWaitForMultipleEvents(SERVICE_EVENT_MAX, service->Events, FALSE, WSA_INFINITE, FALSE);
+
+	/* report the timer like a timeout and disarm it otherwise */
+	if (result == WSA_WAIT_EVENT_0 + SERVICE_EVENT_TIMER)
+		return WSA_WAIT_TIMEOUT;
+	CancelWaitableTimer(service->Timer);
+	return result;
+}
+
+/* report data on the network socket as the network event */
+BOOL WatchServiceNetwork(LPSERVICE service, INT fd)
 {
-	return WSAWaitForMultipleEvents(SERVICE_EVENT_MAX, service->Events, FALSE, timeout, FALSE);
+	return WSAEventSelect((SOCKET)fd, service->NetworkEvent, FD_READ) == 0;
+}
+
+/* tell the SCM about the current status */
+static BOOL ReportServiceStatus(LPSERVICE service)
+{
+	return SetServiceStatus(service->Handle, &service->Status);
 }
 
+#endif
+
 /* return the given event */
 WSAEVENT GetServiceEvent(LPSERVICE service, INT event)
 {
@@ -90,7 +254,7 @@ BOOL BeginServiceStatus(LPSERVICE service, DWORD state, DWORD waitHint)
 	service->Status.dwCheckPoint = 0;
 	service->Status.dwWaitHint = waitHint;
 	service->TargetState = state;
-	return SetServiceStatus(service->Handle, &service->Status);
+	return ReportServiceStatus(service);
 }
 
 /* inform the SCM that the service is one step closer to the next state */
@@ -102,7 +266,7 @@ BOOL ProgressServiceStatus(LPSERVICE service)
 		return FALSE;
 	}
 	service->Status.dwCheckPoint++;
-	return SetServiceStatus(service->Handle, &service->Status);
+	return ReportServiceStatus(service);
 }
 
 /* signal that all pending tasks have been completed to reach the next state */
@@ -117,9 +281,74 @@ BOOL EndServiceStatus(LPSERVICE service)
 	service->Status.dwCheckPoint = 0;
 	service->Status.dwWaitHint = 0;
 	service->TargetState = 0;
-	return SetServiceStatus(service->Handle, &service->Status);
+	return ReportServiceStatus(service);
+}
+
+#ifdef __linux__
+
+/* create a new service structure, blocks the stop and metrics signals (call it before creating any threads) */
+LPSERVICE InitializeService()
+{
+#define CHECK(condition) { if (!(condition)) goto ON_ERROR; }
+
+	LPSERVICE service;
+	sigset_t signals;
+	INT created = 0;
+	INT fd;
+
+	/* allocate the structure and the epoll set */
+	ALLOC(service);
+	service->Signals = -1;
+	CHECK((service->Poll = epoll_create1(EPOLL_CLOEXEC)) >= 0);
+
+	/* create all events, the timer last */
+	for (; created < SERVICE_EVENT_TIMER; created++)
+	{
+		CHECK((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
+		service->Events[created] = (WSAEVENT)(DWORD_PTR)fd;
+		CHECK(WatchDescriptor(service, fd, created));
+	}
+	CHECK((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) >= 0);
+	service->Events[created++] = (WSAEVENT)(DWORD_PTR)fd;
+	CHECK(WatchDescriptor(service, fd, SERVICE_EVENT_TIMER));
+
+	/* take the stop and metrics requests through a signalfd, every later thread inherits the mask */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGUSR1);
+	CHECK(pthread_sigmask(SIG_BLOCK, &signals, NULL) == 0);
+	CHECK((service->Signals = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) >= 0);
+	CHECK(WatchDescriptor(service, service->Signals, SERVICE_SIGNALS));
+	return service;
+
+ON_ERROR:
+	/* on error release the created descriptors and the structure */
+	while (created > 0)
+		close(DESCRIPTOR(service->Events[--created]));
+	if (service->Signals >= 0) close(service->Signals);
+	if (service->Poll >= 0) close(service->Poll);
+	FREE(service);
+	return NULL;
+
+#undef CHECK
 }
 
+/* release all service resources */
+VOID FreeService(LPSERVICE service, DWORD exitCode)
+{
+	INT i;
+
+	/* close all descriptors */
+	for (i = 0; i < SERVICE_EVENT_MAX; i++)
+		close(DESCRIPTOR(service->Events[i]));
+	close(service->Signals);
+	close(service->Poll);
+	FREE(service);
+}
+
+#else
+
 /* create a new service structure */
 LPSERVICE InitializeService()
 {
@@ -132,11 +361,21 @@ LPSERVICE InitializeService()
 	service->ShutdownEvent = WSA_INVALID_EVENT;
 	service->NetworkEvent = WSA_INVALID_EVENT;
 	service->WaveformEvent = WSA_INVALID_EVENT;
+	service->MetricsEvent = WSA_INVALID_EVENT;
+	service->ResolverEvent = WSA_INVALID_EVENT;
+	service->Timer = NULL;
 
 	/* create all events */
 	CHECK((service->Events[SERVICE_EVENT_SHUTDOWN] = service->ShutdownEvent = WSACreateEvent()) != WSA_INVALID_EVENT);
 	CHECK((service->Events[SERVICE_EVENT_NETWORK] = service->NetworkEvent = WSACreateEvent()) != WSA_INVALID_EVENT);
 	CHECK((service->Events[SERVICE_EVENT_WAVEFORM] = service->WaveformEvent = WSACreateEvent()) != WSA_INVALID_EVENT);
+	CHECK((service->Events[SERVICE_EVENT_METRICS] = service->MetricsEvent = WSACreateEvent()) != WSA_INVALID_EVENT);
+	CHECK((service->Events[SERVICE_EVENT_RESOLVER] = service->ResolverEvent = WSACreateEvent()) != WSA_INVALID_EVENT);
+
+	/* prefer a high resolution timer (falls back on older systems) */
+	if ((service->Timer = CreateWaitableTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS)) == NULL)
+		service->Timer = CreateWaitableTimer(NULL, FALSE, NULL);
+	CHECK((service->Events[SERVICE_EVENT_TIMER] = service->Timer) != NULL);
 
 	/* register the service control handler */
 	CHECK((service->Handle = RegisterServiceCtrlHandlerEx(_T(SERVICE_NAME), &Handler, service)) != 0);
@@ -151,6 +390,9 @@ ON_ERROR:
 	if (service->ShutdownEvent != WSA_INVALID_EVENT) WSACloseEvent(service->ShutdownEvent);
 	if (service->NetworkEvent != WSA_INVALID_EVENT) WSACloseEvent(service->NetworkEvent);
 	if (service->WaveformEvent != WSA_INVALID_EVENT) WSACloseEvent(service->WaveformEvent);
+	if (service->MetricsEvent != WSA_INVALID_EVENT) WSACloseEvent(service->MetricsEvent);
+	if (service->ResolverEvent != WSA_INVALID_EVENT) WSACloseEvent(service->ResolverEvent);
+	if (service->Timer != NULL) CloseHandle(service->Timer);
 	FREE(service);
 	return NULL;
 
@@ -164,7 +406,12 @@ VOID FreeService(LPSERVICE service, DWORD exitCode)
 	WSACloseEvent(service->ShutdownEvent);
 	WSACloseEvent(service->NetworkEvent);
 	WSACloseEvent(service->WaveformEvent);
+	WSACloseEvent(service->MetricsEvent);
+	WSACloseEvent(service->ResolverEvent);
+	CloseHandle(service->Timer);
 	service->Status.dwWin32ExitCode = exitCode;
 	SetServiceStatus(service->Handle, &service->Status);
 	FREE(service);
 }
+
+#endif
@@ -17,13 +17,23 @@
 #define SERVICE_EVENT_SHUTDOWN 0
 #define SERVICE_EVENT_NETWORK  1
 #define SERVICE_EVENT_WAVEFORM 2
-#define SERVICE_EVENT_MAX      3
+#define SERVICE_EVENT_METRICS  3
+#define SERVICE_EVENT_RESOLVER 4
+#define SERVICE_EVENT_TIMER    5
+#define SERVICE_EVENT_MAX      6
+
+/* user control code requesting a metrics dump */
+#define SERVICE_CONTROL_METRICS 128
 
 /* transparent service structure */
 typedef struct tagSERVICE SERVICE, *LPSERVICE;
 
-/* wait for any service event within the given time */
-extern DWORD WaitForServiceEvents(LPSERVICE, DWORD);
+/* wait for any service event within the given microseconds (negative waits forever),
+   returns WSA_WAIT_TIMEOUT once the time has passed */
+extern DWORD WaitForServiceEvents(LPSERVICE, LONGLONG);
+
+/* report data on the network descriptor (iax_get_fd) as the network event */
+extern BOOL WatchServiceNetwork(LPSERVICE, INT);
 
 /* return the given event */
 extern WSAEVENT GetServiceEvent(LPSERVICE, INT);
@@ -22,21 +22,40 @@
 LPSETTINGS ParseSettings(DWORD argc, LPTSTR argv[])
 {
 #define CHECK(condition) { if (!(condition)) goto ON_ERROR; }
-#define CHECKREGSTR(str) { CHECK(argv[i][0]!=_T('\0')); tcstombs((str),argv[i],MAXSTRLEN); (str)[MAXSTRLEN-1]='\0'; settings->Register = TRUE; }
+#define CHECKREGSTR(str, count) { CHECK(argv[i][0]!=_T('\0') && (count)<MAX_REGISTRARS); tcstombs((str)[count],argv[i],MAXSTRLEN); (str)[count][MAXSTRLEN-1]='\0'; (count)++; }
 
 	TCHAR lastFlag = _T('\0');
 	LPSETTINGS settings;
+	UINT userNames = 0;
+	UINT secrets = 0;
 	DWORD i;
 
 	/* create and initialize the structure */
 	ALLOC(settings);
 	settings->WaveOutDevID = WAVE_MAPPER;
 	settings->Volume = -1;
+	settings->AgcTarget = 0;
+	settings->LimiterCeiling = 0;
+	settings->Output = OUTPUT_DEVICE;
+	settings->OutputFile = NULL;
+	settings->MaxDelay = 0;
 	settings->AllowedHosts = NULL;
 	settings->ForbiddenHosts = NULL;
+	settings->TokenHosts = NULL;
+	settings->Hosts = NULL;
+	settings->Registrars = 0;
+	settings->CallSecret[0] = '\0';
 	settings->Port = IAX_DEFAULT_PORTNO;
+	settings->NewRate = 0;
+	settings->NewBurst = 0;
+	settings->AckDelay = 20;
+	settings->RecordDirectory = NULL;
+	settings->MetricsFile = NULL;
+	settings->Chime = NULL;
 	settings->RingTone = NULL;
 	settings->PlayLoop = FALSE;
+	settings->Threaded = FALSE;
+	settings->Realtime = FALSE;
 
 	/* parse the given arguments */
 	for (i = 1; i < argc; i++)
@@ -56,6 +75,16 @@ LPSETTINGS ParseSettings(DWORD argc, LPTSTR argv[])
 					settings->PlayLoop = TRUE;
 					break;
 
+				/* threaded playout flag */
+				case _T('t'):
+					settings->Threaded = TRUE;
+					break;
+
+				/* real-time flag */
+				case _T('e'):
+					settings->Realtime = TRUE;
+					break;
+
 				/* store the flag for the next iteration */
 				default:
 					lastFlag = argv[i][1];
@@ -79,14 +108,45 @@ LPSETTINGS ParseSettings(DWORD argc, LPTSTR argv[])
 					CHECK(_stscanf(argv[i], _T("%d"), &settings->Volume) == 1 && 0 <= settings->Volume && settings->Volume <= 0xFFFF);
 					break;
 
-				/* allowed address */
+				/* agc target level */
+				case _T('g'):
+					CHECK(_stscanf(argv[i], _T("%d"), &settings->AgcTarget) == 1 && 0 <= settings->AgcTarget && settings->AgcTarget <= 96);
+					break;
+
+				/* limiter ceiling */
+				case _T('k'):
+					CHECK(_stscanf(argv[i], _T("%d"), &settings->LimiterCeiling) == 1 && 0 <= settings->LimiterCeiling && settings->LimiterCeiling <= 96);
+					break;
+
+				/* audio output */
+				case _T('o'):
+					CHECK(argv[i][0] != _T('\0'));
+					if (_tcsicmp(argv[i], _T("device")) == 0)
+						settings->Output = OUTPUT_DEVICE;
+					else if (_tcsicmp(argv[i], _T("null")) == 0)
+						settings->Output = OUTPUT_NULL;
+					else if (_tcsicmp(argv[i], _T("discard")) == 0)
+						settings->Output = OUTPUT_DISCARD;
+					else
+					{
+						settings->Output = OUTPUT_FILE;
+						settings->OutputFile = argv[i];
+					}
+					break;
+
+				/* maximum playout delay */
+				case _T('d'):
+					CHECK(_stscanf(argv[i], _T("%lu"), &settings->MaxDelay) == 1);
+					break;
+
+				/* allowed address or file of addresses */
 				case _T('a'):
-					CHECK(AppendHost(argv[i], &settings->AllowedHosts));
+					CHECK(argv[i][0] == _T('@') ? AppendHostFile(argv[i] + 1, &settings->AllowedHosts) : AppendHost(argv[i], &settings->AllowedHosts));
 					break;
 
-				/* forbidden address */
+				/* forbidden address or file of addresses */
 				case _T('f'):
-					CHECK(AppendHost(argv[i], &settings->ForbiddenHosts));
+					CHECK(argv[i][0] == _T('@') ? AppendHostFile(argv[i] + 1, &settings->ForbiddenHosts) : AppendHost(argv[i], &settings->ForbiddenHosts));
 					break;
 
 				/* iax port number */
@@ -94,6 +154,36 @@ LPSETTINGS ParseSettings(DWORD argc, LPTSTR argv[])
 					CHECK(_stscanf(argv[i], _T("%hu"), &settings->Port) == 1);
 					break;
 
+				/* address or file of addresses that must do a call token exchange */
+				case _T('x'):
+					CHECK(argv[i][0] == _T('@') ? AppendHostFile(argv[i] + 1, &settings->TokenHosts) : AppendHost(argv[i], &settings->TokenHosts));
+					break;
+
+				/* new session rate and optional burst size */
+				case _T('n'):
+					CHECK(_stscanf(argv[i], _T("%u/%u"), &settings->NewRate, &settings->NewBurst) >= 1);
+					break;
+
+				/* ack delay */
+				case _T('q'):
+					CHECK(_stscanf(argv[i], _T("%d"), &settings->AckDelay) == 1 && 0 <= settings->AckDelay && settings->AckDelay <= 50);
+					break;
+
+				/* recording directory */
+				case _T('w'):
+					CHECK((settings->RecordDirectory = argv[i])[0] != _T('\0'));
+					break;
+
+				/* metrics file name */
+				case _T('m'):
+					CHECK((settings->MetricsFile = argv[i])[0] != _T('\0'));
+					break;
+
+				/* chime file name */
+				case _T('i'):
+					CHECK((settings->Chime = argv[i])[0] != _T('\0'));
+					break;
+
 				/* ring tone file name */
 				case _T('r'):
 					CHECK((settings->RingTone = argv[i])[0] != _T('\0'));
@@ -101,17 +191,24 @@ LPSETTINGS ParseSettings(DWORD argc, LPTSTR argv[])
 
 				/* account host */
 				case _T('h'):
-					CHECKREGSTR(settings->Host);
+					CHECKREGSTR(settings->Host, settings->Registrars);
 					break;
 
 				/* account user name */
 				case _T('u'):
-					CHECKREGSTR(settings->UserName);
+					CHECKREGSTR(settings->UserName, userNames);
 					break;
 
 				/* account secret */
 				case _T('s'):
-					CHECKREGSTR(settings->Secret);
+					CHECKREGSTR(settings->Secret, secrets);
+					break;
+
+				/* call secret */
+				case _T('y'):
+					CHECK(argv[i][0] != _T('\0'));
+					tcstombs(settings->CallSecret, argv[i], MAXSTRLEN);
+					settings->CallSecret[MAXSTRLEN - 1] = '\0';
 					break;
 
 				/* illegal flag */
@@ -129,11 +226,23 @@ LPSETTINGS ParseSettings(DWORD argc, LPTSTR argv[])
 	(
 		lastFlag == _T('\0') &&
 		(settings->RingTone != NULL || !settings->PlayLoop) &&
-		settings->Register == (settings->Host[0] != '\0') &&
-		settings->Register == (settings->UserName[0] != '\0') &&
-		settings->Register == (settings->Secret[0] != '\0')
+		(settings->Registrars > 0) == (userNames > 0) && userNames <= settings->Registrars &&
+		(settings->Registrars > 0) == (secrets > 0) && secrets <= settings->Registrars
 	)
+	{
+		/* the n-th user name and password belong to the n-th host, the last ones given also to all further hosts */
+		for (i = userNames; i < settings->Registrars; i++)
+			strcpy(settings->UserName[i], settings->UserName[userNames - 1]);
+		for (i = secrets; i < settings->Registrars; i++)
+			strcpy(settings->Secret[i], settings->Secret[secrets - 1]);
+
+		/* compile the host lists, they are no longer needed afterwards */
+		settings->Hosts = CompileHosts(settings->AllowedHosts, settings->ForbiddenHosts, settings->TokenHosts);
+		RemoveAllHosts(&settings->AllowedHosts);
+		RemoveAllHosts(&settings->ForbiddenHosts);
+		RemoveAllHosts(&settings->TokenHosts);
 		return settings;
+	}
 
 ON_ERROR:
 	/* free the memory and return NULL */
@@ -149,5 +258,7 @@ VOID FreeSettings(LPSETTINGS settings)
 {
 	RemoveAllHosts(&settings->AllowedHosts);
 	RemoveAllHosts(&settings->ForbiddenHosts);
+	RemoveAllHosts(&settings->TokenHosts);
+	FreeHostTable(settings->Hosts);
 	FREE(settings);
 }
@@ -13,6 +13,15 @@
 #ifndef _SETTINGS_H
 #define _SETTINGS_H
 
+/* kinds of audio output */
+#define OUTPUT_DEVICE  0
+#define OUTPUT_NULL    1
+#define OUTPUT_DISCARD 2
+#define OUTPUT_FILE    3
+
+/* maximum number of registrars */
+#define MAX_REGISTRARS 8
+
 /* all service parameters */
 typedef struct tagSETTINGS
 {
@@ -20,19 +29,55 @@ typedef struct tagSETTINGS
 	UINT WaveOutDevID;
 	INT Volume;
 
-	/* first allowed and forbidden host */
+	/* agc target level (0 for no agc) and limiter ceiling in dB below full scale */
+	INT AgcTarget;
+	INT LimiterCeiling;
+
+	/* the kind of audio output and the wave file name if written to disk */
+	INT Output;
+	LPTSTR OutputFile;
+
+	/* maximum playout delay in milliseconds (0 for unbounded) */
+	DWORD MaxDelay;
+
+	/* first allowed, forbidden and call token host (only kept until compiled) and their lookup table */
 	LPHOST AllowedHosts;
 	LPHOST ForbiddenHosts;
+	LPHOST TokenHosts;
+	LPHOSTTABLE Hosts;
+
+	/* registrar hosts with their user names and passwords */
+	UINT Registrars;
+	CHAR Host[MAX_REGISTRARS][MAXSTRLEN];
+	CHAR UserName[MAX_REGISTRARS][MAXSTRLEN];
+	CHAR Secret[MAX_REGISTRARS][MAXSTRLEN];
 
-	/* host, user name and password */
-	BOOL Register;
-	CHAR Host[MAXSTRLEN];
-	CHAR UserName[MAXSTRLEN];
-	CHAR Secret[MAXSTRLEN];
+	/* password callers authenticate with, their calls are encrypted (empty for none) */
+	CHAR CallSecret[MAXSTRLEN];
 
 	/* preferred iax-client port */
 	USHORT Port;
 
+	/* new sessions allowed per second and source and the burst size (0 for no limit) */
+	UINT NewRate;
+	UINT NewBurst;
+
+	/* milliseconds an ACK may wait for a frame to carry it (0 to acknowledge at once) */
+	INT AckDelay;
+
+	/* directory every call gets recorded to */
+	LPTSTR RecordDirectory;
+
+	/* file the metrics get appended to */
+	LPTSTR MetricsFile;
+
+	/* file name of the chime played before live audio */
+	LPTSTR Chime;
+
+	/* run the playout on its own thread and with real-time priority and locked memory */
+	BOOL Threaded;
+	BOOL Realtime;
+
 	/* file name of the ring tone and loop flag */
 	LPTSTR RingTone;
 	BOOL PlayLoop;
@@ -0,0 +1,780 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#include <winsock2.h>
+#include <windows.h>
+#include <stdio.h>
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#endif
+#include "libiax2/iax-client.h"
+#include "common.h"
+#include "host.h"
+#include "settings.h"
+#include "metrics.h"
+#include "wave.h"
+#include "sink.h"
+
+/* interval of the null output clock in milliseconds */
+#define SINK_NULL_TICK 10
+
+/* operations every output backend implements */
+typedef struct tagSINKPROCS
+{
+	DWORD (*Open)(LPSINK, LPWAVEFORMATEX);
+	DWORD (*Close)(LPSINK);
+	DWORD (*Prepare)(LPSINK, LPWAVEHDR);
+	DWORD (*Unprepare)(LPSINK, LPWAVEHDR);
+	DWORD (*Write)(LPSINK, LPWAVEHDR);
+	DWORD (*Poll)(LPSINK);
+	DWORD (*Reset)(LPSINK);
+	DWORD (*GetVolume)(LPSINK, LPDWORD);
+	DWORD (*SetVolume)(LPSINK, DWORD);
+} SINKPROCS;
+
+#ifndef __linux__
+/* an asynchronous file write request */
+typedef struct tagSINKWRITE
+{
+	OVERLAPPED Overlapped;
+	LPSINK Sink;
+	LPWAVEHDR Header;
+} SINKWRITE, *LPSINKWRITE;
+#endif
+
+struct tagSINK
+{
+	/* the backend, settings and the event signalling done headers */
+	CONST SINKPROCS *Procs;
+	LPSETTINGS Settings;
+	WSAEVENT Event;
+	DWORD BytesPerSec;
+
+	/* null output clock and the queued headers in output order */
+	BOOL Throttled;
+	LPWAVEHDR Queue[WAVE_BUFFERS];
+	USHORT FirstQueued;
+	USHORT QueueLength;
+
+	/* wave file header, the data bytes behind it and the first write error */
+	LPBYTE RiffHeader;
+	DWORD RiffHeaderSize;
+	ULONGLONG DataBytes;
+	volatile LONG WriteError;
+
+#ifdef __linux__
+	/* the sink thread and what it shares with the owner: the deadlines of the
+	   queued headers in monotonic nanoseconds and the exit request */
+	pthread_t Thread;
+	pthread_mutex_t Lock;
+	pthread_cond_t Wakeup;
+	BOOL Started;
+	BOOL Exit;
+	ULONGLONG ClockStart;
+	ULONGLONG ClockBytes;
+	ULONGLONG Deadline[WAVE_BUFFERS];
+
+	/* wave file and the data bytes the thread has written to it */
+	INT File;
+	ULONGLONG WrittenBytes;
+#else
+	/* waveform audio device */
+	HWAVEOUT Device;
+
+	/* null output timer, its clock and the deadlines of the queued headers */
+	HANDLE Timer;
+	DWORD ClockStart;
+	ULONGLONG ClockBytes;
+	DWORD Due[WAVE_BUFFERS];
+	volatile LONG Pending;
+
+	/* wave file, its header write and the writes still in flight (plus one while
+	   nobody waits for them), the event signals when the last one completed */
+	HANDLE File;
+	SINKWRITE RiffHeaderWrite;
+	volatile LONG Outstanding;
+	HANDLE Drained;
+#endif
+};
+
+/* mark a header as played */
+static VOID MarkHeaderDone(LPWAVEHDR header)
+{
+	header->dwFlags = (header->dwFlags & ~WHDR_INQUEUE) | WHDR_DONE;
+}
+
+/* headers of software backends only need the flags to be maintained */
+static DWORD PrepareSoftwareHeader(LPSINK sink, LPWAVEHDR header)
+{
+	header->dwFlags |= WHDR_PREPARED;
+	return MMSYSERR_NOERROR;
+}
+
+static DWORD UnprepareSoftwareHeader(LPSINK sink, LPWAVEHDR header)
+{
+	if (header->dwFlags & WHDR_INQUEUE)
+		return MMSYSERR_INVALPARAM;
+	header->dwFlags &= ~WHDR_PREPARED;
+	return MMSYSERR_NOERROR;
+}
+
+/* software backends have no volume control */
+static DWORD GetSoftwareVolume(LPSINK sink, LPDWORD volume)
+{
+	return MMSYSERR_NOTSUPPORTED;
+}
+
+static DWORD SetSoftwareVolume(LPSINK sink, DWORD volume)
+{
+	return MMSYSERR_NOTSUPPORTED;
+}
+
+/* build the wave file header, only non-PCM formats carry extra format bytes */
+static VOID BuildRiffHeader(LPSINK sink, LPWAVEFORMATEX format)
+{
+	DWORD formatSize;
+	LPBYTE offset;
+
+	formatSize = format->wFormatTag == WAVE_FORMAT_PCM ? sizeof(PCMWAVEFORMAT) : sizeof(WAVEFORMATEX) + format->cbSize;
+	sink->RiffHeaderSize = 12 + 8 + formatSize + 8;
+	sink->RiffHeader = HeapAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS | HEAP_ZERO_MEMORY, sink->RiffHeaderSize);
+	offset = sink->RiffHeader;
+#define PUT(what, size) { memcpy(offset, (what), (size)); offset += (size); }
+	PUT("RIFF", 4);
+	offset += 4;
+	PUT("WAVEfmt ", 8);
+	PUT(&formatSize, 4);
+	PUT(format, formatSize);
+	PUT("data", 4);
+#undef PUT
+}
+
+/* patch the chunk sizes of the wave file header */
+static VOID PatchRiffHeader(LPSINK sink)
+{
+	*(LPDWORD)(sink->RiffHeader + 4) = (DWORD)(sink->RiffHeaderSize - 8 + sink->DataBytes);
+	*(LPDWORD)(sink->RiffHeader + sink->RiffHeaderSize - 4) = (DWORD)sink->DataBytes;
+}
+
+#ifndef __linux__
+
+/* nothing to poll if the backend signals completion by itself */
+static DWORD PollNothing(LPSINK sink)
+{
+	return MMSYSERR_NOERROR;
+}
+
+
+/* waveform audio device backend */
+
+static DWORD OpenDevice(LPSINK sink, LPWAVEFORMATEX format)
+{
+	return waveOutOpen(&sink->Device, sink->Settings->WaveOutDevID, format, (DWORD_PTR)sink->Event, 0, CALLBACK_EVENT);
+}
+
+static DWORD CloseDevice(LPSINK sink)
+{
+	return waveOutClose(sink->Device);
+}
+
+static DWORD PrepareDeviceHeader(LPSINK sink, LPWAVEHDR header)
+{
+	return waveOutPrepareHeader(sink->Device, header, sizeof(WAVEHDR));
+}
+
+static DWORD UnprepareDeviceHeader(LPSINK sink, LPWAVEHDR header)
+{
+	return waveOutUnprepareHeader(sink->Device, header, sizeof(WAVEHDR));
+}
+
+static DWORD WriteDevice(LPSINK sink, LPWAVEHDR header)
+{
+	return waveOutWrite(sink->Device, header, sizeof(WAVEHDR));
+}
+
+static DWORD ResetDevice(LPSINK sink)
+{
+	return waveOutReset(sink->Device);
+}
+
+static DWORD GetDeviceVolume(LPSINK sink, LPDWORD volume)
+{
+	return waveOutGetVolume(sink->Device, volume);
+}
+
+static DWORD SetDeviceVolume(LPSINK sink, DWORD volume)
+{
+	return waveOutSetVolume(sink->Device, volume);
+}
+
+static CONST SINKPROCS DeviceProcs =
+{
+	&OpenDevice, &CloseDevice, &PrepareDeviceHeader, &UnprepareDeviceHeader, &WriteDevice,
+	&PollNothing, &ResetDevice, &GetDeviceVolume, &SetDeviceVolume
+};
+
+
+/* null backend, consumes the data either in real-time or immediately */
+
+static VOID CALLBACK NullClockTick(PVOID context, BOOLEAN fired)
+{
+	LPSINK sink = (LPSINK)context;
+
+	/* wake up the service loop as long as there are headers to retire */
+	if (sink->Pending > 0)
+		WSASetEvent(sink->Event);
+}
+
+static DWORD OpenNull(LPSINK sink, LPWAVEFORMATEX format)
+{
+	sink->Throttled = sink->Settings->Output == OUTPUT_NULL;
+	if (sink->Throttled && !CreateTimerQueueTimer(&sink->Timer, NULL, &NullClockTick, sink, SINK_NULL_TICK, SINK_NULL_TICK, WT_EXECUTEINTIMERTHREAD))
+		return GetLastError();
+	return MMSYSERR_NOERROR;
+}
+
+static DWORD CloseNull(LPSINK sink)
+{
+	/* wait for a running tick to finish */
+	if (sink->Timer != NULL && !DeleteTimerQueueTimer(NULL, sink->Timer, INVALID_HANDLE_VALUE))
+		return GetLastError();
+	return MMSYSERR_NOERROR;
+}
+
+static DWORD WriteNull(LPSINK sink, LPWAVEHDR header)
+{
+	USHORT index;
+
+	header->dwFlags = (header->dwFlags & ~WHDR_DONE) | WHDR_INQUEUE;
+
+	/* either retire the header right away or schedule it on the output clock */
+	if (!sink->Throttled)
+	{
+		MarkHeaderDone(header);
+		return WSASetEvent(sink->Event) ? MMSYSERR_NOERROR : WSAGetLastError();
+	}
+	if (sink->QueueLength == WAVE_BUFFERS)
+		return MMSYSERR_NOMEM;
+	if (sink->QueueLength == 0)
+	{
+		/* the clock restarts after an underrun, just like a real device */
+		sink->ClockStart = GetTickCount();
+		sink->ClockBytes = 0;
+	}
+	sink->ClockBytes += header->dwBufferLength;
+	index = (sink->FirstQueued + sink->QueueLength++) % WAVE_BUFFERS;
+	sink->Queue[index] = header;
+	sink->Due[index] = sink->ClockStart + (DWORD)(sink->ClockBytes * 1000 / sink->BytesPerSec);
+	InterlockedIncrement(&sink->Pending);
+	return MMSYSERR_NOERROR;
+}
+
+static DWORD PollNull(LPSINK sink)
+{
+	DWORD now = GetTickCount();
+
+	while (sink->QueueLength > 0 && (INT)(now - sink->Due[sink->FirstQueued]) >= 0)
+	{
+		MarkHeaderDone(sink->Queue[sink->FirstQueued]);
+		sink->FirstQueued = (sink->FirstQueued + 1) % WAVE_BUFFERS;
+		sink->QueueLength--;
+		InterlockedDecrement(&sink->Pending);
+	}
+	return MMSYSERR_NOERROR;
+}
+
+static DWORD ResetNull(LPSINK sink)
+{
+	while (sink->QueueLength > 0)
+	{
+		MarkHeaderDone(sink->Queue[sink->FirstQueued]);
+		sink->FirstQueued = (sink->FirstQueued + 1) % WAVE_BUFFERS;
+		sink->QueueLength--;
+	}
+	InterlockedExchange(&sink->Pending, 0);
+	return MMSYSERR_NOERROR;
+}
+
+static CONST SINKPROCS NullProcs =
+{
+	&OpenNull, &CloseNull, &PrepareSoftwareHeader, &UnprepareSoftwareHeader, &WriteNull,
+	&PollNull, &ResetNull, &GetSoftwareVolume, &SetSoftwareVolume
+};
+
+
+/* wave file backend, writes asynchronously and signals like a device */
+
+static VOID CALLBACK FileWriteDone(DWORD error, DWORD written, LPOVERLAPPED overlapped)
+{
+	LPSINKWRITE write = (LPSINKWRITE)overlapped;
+	LPSINK sink = write->Sink;
+
+	/* remember the first failure, it gets reported by the next poll */
+	if (error != ERROR_SUCCESS)
+		InterlockedCompareExchange(&sink->WriteError, (LONG)error, ERROR_SUCCESS);
+
+	/* retire the header and wake up the service loop */
+	if (write->Header != NULL)
+	{
+		MarkHeaderDone(write->Header);
+		WSASetEvent(sink->Event);
+	}
+
+	/* the sink may be freed as soon as nothing is outstanding */
+	if (InterlockedDecrement(&sink->Outstanding) == 0)
+		SetEvent(sink->Drained);
+}
+
+static DWORD IssueFileWrite(LPSINK sink, LPSINKWRITE write, ULONGLONG offset, LPCVOID buffer, DWORD size)
+{
+	DWORD error;
+
+	ZERO(&write->Overlapped);
+	write->Overlapped.Offset = (DWORD)offset;
+	write->Overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	InterlockedIncrement(&sink->Outstanding);
+	if (!WriteFile(sink->File, buffer, size, NULL, &write->Overlapped) && (error = GetLastError()) != ERROR_IO_PENDING)
+	{
+		InterlockedDecrement(&sink->Outstanding);
+		return error;
+	}
+	return ERROR_SUCCESS;
+}
+
+/* only done when closing, the audio path never waits for the disk */
+static VOID WaitForFileWrites(LPSINK sink)
+{
+	/* drop our own count, the last completion signals the event */
+	if (InterlockedDecrement(&sink->Outstanding) != 0)
+		WaitForSingleObject(sink->Drained, INFINITE);
+	InterlockedIncrement(&sink->Outstanding);
+}
+
+static DWORD WriteRiffHeader(LPSINK sink)
+{
+	/* patch the chunk sizes and rewrite the header */
+	PatchRiffHeader(sink);
+	return IssueFileWrite(sink, &sink->RiffHeaderWrite, 0, sink->RiffHeader, sink->RiffHeaderSize);
+}
+
+static DWORD OpenWaveFile(LPSINK sink, LPWAVEFORMATEX format)
+{
+	/* create the file and route its completions to the thread pool */
+	sink->Outstanding = 1;
+	if
+	(
+		(sink->Drained = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL ||
+		(sink->File = CreateFile(sink->Settings->OutputFile, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL)) == INVALID_HANDLE_VALUE ||
+		!BindIoCompletionCallback(sink->File, &FileWriteDone, 0)
+	)
+		return GetLastError();
+
+	BuildRiffHeader(sink, format);
+	sink->RiffHeaderWrite.Sink = sink;
+
+	/* the sizes are patched once the file gets closed, failures show up on the next poll */
+	return WriteRiffHeader(sink);
+}
+
+static DWORD CloseWaveFile(LPSINK sink)
+{
+	DWORD error = ERROR_SUCCESS;
+
+	if (sink->File != INVALID_HANDLE_VALUE)
+	{
+		/* the header may only change once the data behind it is written */
+		WaitForFileWrites(sink);
+		if (sink->RiffHeader != NULL && (error = WriteRiffHeader(sink)) == ERROR_SUCCESS)
+		{
+			WaitForFileWrites(sink);
+			error = sink->WriteError;
+		}
+		CloseHandle(sink->File);
+	}
+	if (sink->Drained != NULL)
+		CloseHandle(sink->Drained);
+	if (sink->RiffHeader != NULL)
+		FREE(sink->RiffHeader);
+	return error;
+}
+
+static DWORD PrepareWaveFileHeader(LPSINK sink, LPWAVEHDR header)
+{
+	LPSINKWRITE write;
+
+	/* every header carries its own write request */
+	ALLOC(write);
+	write->Sink = sink;
+	write->Header = header;
+	header->reserved = (DWORD_PTR)write;
+	return PrepareSoftwareHeader(sink, header);
+}
+
+static DWORD UnprepareWaveFileHeader(LPSINK sink, LPWAVEHDR header)
+{
+	DWORD error;
+
+	if ((error = UnprepareSoftwareHeader(sink, header)) != MMSYSERR_NOERROR)
+		return error;
+	FREE((LPSINKWRITE)header->reserved);
+	header->reserved = 0;
+	return MMSYSERR_NOERROR;
+}
+
+static DWORD WriteWaveFile(LPSINK sink, LPWAVEHDR header)
+{
+	DWORD error;
+
+	header->dwFlags = (header->dwFlags & ~WHDR_DONE) | WHDR_INQUEUE;
+
+	/* empty headers (interpolated frames) don't need to touch the disk */
+	if (header->dwBufferLength == 0)
+	{
+		MarkHeaderDone(header);
+		return WSASetEvent(sink->Event) ? MMSYSERR_NOERROR : WSAGetLastError();
+	}
+
+	/* append the data at the end of the file */
+	if ((error = IssueFileWrite(sink, (LPSINKWRITE)header->reserved, sink->RiffHeaderSize + sink->DataBytes, header->lpData, header->dwBufferLength)) != ERROR_SUCCESS)
+	{
+		header->dwFlags &= ~WHDR_INQUEUE;
+		return error;
+	}
+	sink->DataBytes += header->dwBufferLength;
+	return MMSYSERR_NOERROR;
+}
+
+static DWORD PollWaveFile(LPSINK sink)
+{
+	return sink->WriteError;
+}
+
+static DWORD ResetWaveFile(LPSINK sink)
+{
+	/* written data can't be taken back, the headers get done as their writes complete */
+	return MMSYSERR_NOERROR;
+}
+
+static CONST SINKPROCS WaveFileProcs =
+{
+	&OpenWaveFile, &CloseWaveFile, &PrepareWaveFileHeader, &UnprepareWaveFileHeader, &WriteWaveFile,
+	&PollWaveFile, &ResetWaveFile, &GetSoftwareVolume, &SetSoftwareVolume
+};
+
+#else
+
+/* POSIX backend for running headless on Linux, the event is an eventfd: a thread
+   retires the queued headers in real-time (null), at once (discard) or once they
+   are appended to the wave file, and signals the done ones through the eventfd */
+
+static ULONGLONG MonotonicNs()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (ULONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static VOID SignalPosix(LPSINK sink)
+{
+	eventfd_write((INT)(DWORD_PTR)sink->Event, 1);
+}
+
+/* write all of a buffer, the first failure is kept for the next poll */
+static VOID WritePosixFile(LPSINK sink, ULONGLONG offset, LPCVOID buffer, DWORD size)
+{
+	ssize_t written;
+
+	while (size > 0)
+	{
+		if ((written = pwrite(sink->File, buffer, size, (off_t)offset)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			__sync_bool_compare_and_swap(&sink->WriteError, ERROR_SUCCESS, errno);
+			return;
+		}
+		buffer = (CONST BYTE *)buffer + written;
+		offset += (ULONGLONG)written;
+		size -= (DWORD)written;
+	}
+}
+
+/* the sink thread, waits for the next deadline or header and does all the file i/o */
+static LPVOID PosixThread(LPVOID parameter)
+{
+	LPSINK sink = (LPSINK)parameter;
+	LPWAVEHDR header;
+	ULONGLONG deadline;
+	struct timespec until;
+
+	pthread_mutex_lock(&sink->Lock);
+	for (;;)
+	{
+		/* the null output stops at once, the file is written up to the last header */
+		if (sink->QueueLength == 0 || (sink->Exit && sink->File < 0))
+		{
+			if (sink->Exit)
+				break;
+			pthread_cond_wait(&sink->Wakeup, &sink->Lock);
+			continue;
+		}
+		deadline = sink->Deadline[sink->FirstQueued];
+		if (sink->Throttled && MonotonicNs() < deadline)
+		{
+			until.tv_sec = (time_t)(deadline / 1000000000);
+			until.tv_nsec = (long)(deadline % 1000000000);
+			pthread_cond_timedwait(&sink->Wakeup, &sink->Lock, &until);
+			continue;
+		}
+		header = sink->Queue[sink->FirstQueued];
+		sink->FirstQueued = (sink->FirstQueued + 1) % WAVE_BUFFERS;
+		sink->QueueLength--;
+
+		/* the owner doesn't touch a queued header, the lock isn't needed for writing it */
+		if (sink->File >= 0 && header->dwBufferLength > 0)
+		{
+			pthread_mutex_unlock(&sink->Lock);
+			WritePosixFile(sink, sink->RiffHeaderSize + sink->WrittenBytes, header->lpData, header->dwBufferLength);
+			sink->WrittenBytes += header->dwBufferLength;
+			pthread_mutex_lock(&sink->Lock);
+		}
+		MarkHeaderDone(header);
+		SignalPosix(sink);
+	}
+	pthread_mutex_unlock(&sink->Lock);
+	return NULL;
+}
+
+static DWORD OpenPosix(LPSINK sink, LPWAVEFORMATEX format)
+{
+	pthread_condattr_t attributes;
+	INT error;
+
+	/* the deadlines are monotonic, like the clock of a device */
+	sink->Throttled = sink->Settings->Output == OUTPUT_NULL;
+	sink->File = -1;
+	pthread_mutex_init(&sink->Lock, NULL);
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&sink->Wakeup, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	/* the sizes in the header are patched once the file gets closed */
+	if (sink->Settings->Output == OUTPUT_FILE)
+	{
+		if ((sink->File = open(sink->Settings->OutputFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+			return errno;
+		BuildRiffHeader(sink, format);
+		WritePosixFile(sink, 0, sink->RiffHeader, sink->RiffHeaderSize);
+	}
+	if ((error = pthread_create(&sink->Thread, NULL, &PosixThread, sink)) != 0)
+		return error;
+	sink->Started = TRUE;
+	return MMSYSERR_NOERROR;
+}
+
+static DWORD ClosePosix(LPSINK sink)
+{
+	DWORD error;
+
+	/* the thread writes what is queued for the file before it exits */
+	if (sink->Started)
+	{
+		pthread_mutex_lock(&sink->Lock);
+		sink->Exit = TRUE;
+		pthread_cond_signal(&sink->Wakeup);
+		pthread_mutex_unlock(&sink->Lock);
+		pthread_join(sink->Thread, NULL);
+	}
+	if (sink->File >= 0)
+	{
+		PatchRiffHeader(sink);
+		WritePosixFile(sink, 0, sink->RiffHeader, sink->RiffHeaderSize);
+		if (close(sink->File) != 0)
+			__sync_bool_compare_and_swap(&sink->WriteError, ERROR_SUCCESS, errno);
+	}
+	if (sink->RiffHeader != NULL)
+		FREE(sink->RiffHeader);
+	error = sink->WriteError;
+	pthread_cond_destroy(&sink->Wakeup);
+	pthread_mutex_destroy(&sink->Lock);
+	return error;
+}
+
+static DWORD WritePosix(LPSINK sink, LPWAVEHDR header)
+{
+	USHORT index;
+
+	header->dwFlags = (header->dwFlags & ~WHDR_DONE) | WHDR_INQUEUE;
+	pthread_mutex_lock(&sink->Lock);
+	if (sink->QueueLength == WAVE_BUFFERS)
+	{
+		pthread_mutex_unlock(&sink->Lock);
+		header->dwFlags &= ~WHDR_INQUEUE;
+		return MMSYSERR_NOMEM;
+	}
+	if (sink->QueueLength == 0)
+	{
+		/* the clock restarts after an underrun, just like a real device */
+		sink->ClockStart = MonotonicNs();
+		sink->ClockBytes = 0;
+	}
+	sink->ClockBytes += header->dwBufferLength;
+	index = (sink->FirstQueued + sink->QueueLength++) % WAVE_BUFFERS;
+	sink->Queue[index] = header;
+	sink->Deadline[index] = sink->ClockStart + sink->ClockBytes * 1000000000 / sink->BytesPerSec;
+	sink->DataBytes += header->dwBufferLength;
+	if (sink->QueueLength == 1)
+		pthread_cond_signal(&sink->Wakeup);
+	pthread_mutex_unlock(&sink->Lock);
+	return MMSYSERR_NOERROR;
+}
+
+static DWORD PollPosix(LPSINK sink)
+{
+	return sink->WriteError;
+}
+
+static DWORD ResetPosix(LPSINK sink)
+{
+	/* written data can't be taken back, the file headers get done as they are written */
+	if (sink->File >= 0)
+		return MMSYSERR_NOERROR;
+	pthread_mutex_lock(&sink->Lock);
+	while (sink->QueueLength > 0)
+	{
+		MarkHeaderDone(sink->Queue[sink->FirstQueued]);
+		sink->FirstQueued = (sink->FirstQueued + 1) % WAVE_BUFFERS;
+		sink->QueueLength--;
+	}
+	pthread_mutex_unlock(&sink->Lock);
+	SignalPosix(sink);
+	return MMSYSERR_NOERROR;
+}
+
+static CONST SINKPROCS PosixProcs =
+{
+	&OpenPosix, &ClosePosix, &PrepareSoftwareHeader, &UnprepareSoftwareHeader, &WritePosix,
+	&PollPosix, &ResetPosix, &GetSoftwareVolume, &SetSoftwareVolume
+};
+
+#endif
+
+
+/* open the output configured in the settings, done headers signal the event */
+DWORD OpenSink(LPSETTINGS settings, LPWAVEFORMATEX format, WSAEVENT event, LPSINK *result)
+{
+	LPSINK sink;
+	DWORD error;
+
+	/* create and initialize the sink structure */
+	ALLOC(sink);
+	sink->Settings = settings;
+	sink->Event = event;
+	sink->BytesPerSec = format->nAvgBytesPerSec > 0 ? format->nAvgBytesPerSec : 1;
+#ifdef __linux__
+	/* there is no audio device to play to */
+	if (settings->Output == OUTPUT_DEVICE)
+	{
+		FREE(sink);
+		return MMSYSERR_NODRIVER;
+	}
+	sink->Procs = &PosixProcs;
+#else
+	sink->File = INVALID_HANDLE_VALUE;
+	switch (settings->Output)
+	{
+		case OUTPUT_NULL:
+		case OUTPUT_DISCARD:
+			sink->Procs = &NullProcs;
+			break;
+		case OUTPUT_FILE:
+			sink->Procs = &WaveFileProcs;
+			break;
+		default:
+			sink->Procs = &DeviceProcs;
+			break;
+	}
+#endif
+
+	/* open the backend */
+	if ((error = sink->Procs->Open(sink, format)) != MMSYSERR_NOERROR)
+	{
+#ifdef __linux__
+		sink->Procs->Close(sink);
+#else
+		if (sink->Procs != &DeviceProcs)
+			sink->Procs->Close(sink);
+#endif
+		FREE(sink);
+		return error;
+	}
+	*result = sink;
+	return MMSYSERR_NOERROR;
+}
+
+/* wait for all pending headers and release the sink */
+DWORD CloseSink(LPSINK sink)
+{
+	DWORD error;
+
+	error = sink->Procs->Close(sink);
+	FREE(sink);
+	return error;
+}
+
+/* prepare a header before it gets written */
+DWORD PrepareSinkHeader(LPSINK sink, LPWAVEHDR header)
+{
+	return sink->Procs->Prepare(sink, header);
+}
+
+/* release a done header */
+DWORD UnprepareSinkHeader(LPSINK sink, LPWAVEHDR header)
+{
+	return sink->Procs->Unprepare(sink, header);
+}
+
+/* queue a prepared header for output */
+DWORD WriteSink(LPSINK sink, LPWAVEHDR header)
+{
+	return sink->Procs->Write(sink, header);
+}
+
+/* mark all headers whose output time has passed as done */
+DWORD PollSink(LPSINK sink)
+{
+	return sink->Procs->Poll(sink);
+}
+
+/* abort the output and mark all pending headers as done */
+DWORD ResetSink(LPSINK sink)
+{
+	return sink->Procs->Reset(sink);
+}
+
+/* query and change the output volume */
+DWORD GetSinkVolume(LPSINK sink, LPDWORD volume)
+{
+	return sink->Procs->GetVolume(sink, volume);
+}
+
+DWORD SetSinkVolume(LPSINK sink, DWORD volume)
+{
+	return sink->Procs->SetVolume(sink, volume);
+}
@@ -0,0 +1,44 @@
+/*
+ * IAX-Pager -- Turns your Windows Machine into a Phone-Speaker
+ *
+ * Copyright (C) 2008-2013, Manuel Meitinger
+ *
+ * Manuel Meitinger <m.meitinger@aufbauwerk.com>
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+#ifndef _SINK_H
+#define _SINK_H
+
+/* transparent sink structure */
+typedef struct tagSINK SINK, *LPSINK;
+
+/* open the output configured in the settings, done headers signal the event */
+extern DWORD OpenSink(LPSETTINGS, LPWAVEFORMATEX, WSAEVENT, LPSINK *);
+
+/* wait for all pending headers and release the sink */
+extern DWORD CloseSink(LPSINK);
+
+/* prepare a header before it gets written */
+extern DWORD PrepareSinkHeader(LPSINK, LPWAVEHDR);
+
+/* release a done header */
+extern DWORD UnprepareSinkHeader(LPSINK, LPWAVEHDR);
+
+/* queue a prepared header for output */
+extern DWORD WriteSink(LPSINK, LPWAVEHDR);
+
+/* mark all headers whose output time has passed as done */
+extern DWORD PollSink(LPSINK);
+
+/* abort the output and mark all pending headers as done */
+extern DWORD ResetSink(LPSINK);
+
+/* query and change the output volume */
+extern DWORD GetSinkVolume(LPSINK, LPDWORD);
+extern DWORD SetSinkVolume(LPSINK, DWORD);
+
+#endif
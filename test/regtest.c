@@ -0,0 +1,237 @@
+/*
+ * Registration state machine in virtual time.
+ *
+ * The state machine is fed INPUT_DUE, INPUT_ACK, INPUT_FAILED and
+ * INPUT_MOVED from a fake clock and fixed seeds, so every run takes the
+ * same course.  Checked are the refresh point within the granted expiry,
+ * the backoff and its jitter, a request without answer counting as a
+ * failure and a moved registrar not preempting a request under way.
+ *
+ * usage: regtest
+ */
+#include <stdio.h>
+
+#include "regstate.h"
+
+static int failures;
+
+#define CHECK(cond, what) do { if (!(cond)) { printf("%s:%d: %s\n", __FILE__, __LINE__, what); failures++; } } while (0)
+
+/* seeds a large number of pagers would draw from */
+#define SEEDS 1000
+
+static unsigned int seed_of(int i)
+{
+	return 2463534242u ^ (unsigned int)i * 2654435761u ^ 1;
+}
+
+/* a fresh registration whose first request is out */
+static void requested(LPREGSTATE state, unsigned int seed, unsigned long long *now)
+{
+	InitRegState(state, seed, *now);
+	*now = state->Due;
+	CHECK(StepRegState(state, INPUT_DUE, 0, *now), "first due sends no request");
+	CHECK(state->State == REGISTRATION_REQUESTED, "first request isn't pending");
+}
+
+static void test_start(void)
+{
+	REGSTATE state;
+	int i;
+
+	for (i = 0; i < SEEDS; i++) {
+		InitRegState(&state, seed_of(i), 5000);
+		CHECK(state.State == REGISTRATION_IDLE, "not idle at start");
+		CHECK(state.Due >= 5000 && state.Due < 5000 + START_JITTER, "first request outside the start jitter");
+	}
+}
+
+/* refreshes fall within REFRESH_MIN to REFRESH_MAX percent of the granted expiry, at least MIN_EXPIRY */
+static void test_refresh(void)
+{
+	static const unsigned int granted[] = { 0, 1, 9, 10, 11, 60, 300, 3600, 86400 };
+	unsigned long long now;
+	unsigned long long low;
+	unsigned long long high;
+	unsigned long long lowest;
+	unsigned long long highest;
+	unsigned int expiry;
+	REGSTATE state;
+	size_t g;
+	int i;
+
+	for (g = 0; g < sizeof(granted) / sizeof(granted[0]); g++) {
+		expiry = granted[g] < MIN_EXPIRY ? MIN_EXPIRY : granted[g];
+		low = (unsigned long long)expiry * 1000 * REFRESH_MIN / 100;
+		high = (unsigned long long)expiry * 1000 * REFRESH_MAX / 100;
+		lowest = ~0ULL;
+		highest = 0;
+		for (i = 0; i < SEEDS; i++) {
+			now = 1000;
+			requested(&state, seed_of(i), &now);
+			now += 40;
+			CHECK(!StepRegState(&state, INPUT_ACK, granted[g], now), "an ack sends a request");
+			CHECK(state.State == REGISTRATION_REGISTERED, "not registered after the ack");
+			CHECK(state.Expires == now + (unsigned long long)expiry * 1000, "expiry isn't the granted one");
+			CHECK(state.Due - now >= low && state.Due - now <= high, "refresh outside the expiry window");
+			if (state.Due - now < lowest)
+				lowest = state.Due - now;
+			if (state.Due - now > highest)
+				highest = state.Due - now;
+
+			/* the refresh goes out on the same schedule */
+			now = state.Due;
+			CHECK(StepRegState(&state, INPUT_DUE, 0, now), "refresh sends no request");
+			CHECK(state.State == REGISTRATION_REFRESHING, "refresh isn't pending");
+		}
+		/* the jitter covers the whole window, which is what spreads the pagers out */
+		CHECK(lowest <= low + (high - low) / 10 && highest >= high - (high - low) / 10, "refreshes don't spread over the window");
+	}
+}
+
+/* failures back off from BACKOFF_MIN doubling up to BACKOFF_MAX, cut by up to half */
+static void test_backoff(void)
+{
+	unsigned long long now;
+	unsigned long long wait;
+	unsigned int nominal;
+	unsigned int shortest[12];
+	REGSTATE state;
+	int f;
+	int i;
+
+	for (f = 0; f < 12; f++)
+		shortest[f] = ~0u;
+	for (i = 0; i < SEEDS; i++) {
+		now = 0;
+		requested(&state, seed_of(i), &now);
+		nominal = BACKOFF_MIN;
+		for (f = 0; f < 12; f++) {
+			CHECK(!StepRegState(&state, INPUT_FAILED, 0, now), "a failure sends a request");
+			CHECK(state.State == REGISTRATION_BACKOFF, "not backing off after a failure");
+			CHECK(state.Failures == (unsigned int)f + 1, "failures aren't counted");
+			wait = state.Due - now;
+			CHECK(wait > nominal * 500ULL && wait <= nominal * 1000ULL, "backoff jitter out of bounds");
+			if (wait < shortest[f])
+				shortest[f] = (unsigned int)wait;
+
+			/* retry once the backoff is over, which fails again */
+			now = state.Due;
+			CHECK(StepRegState(&state, INPUT_DUE, 0, now), "retry sends no request");
+			CHECK(state.State == REGISTRATION_REQUESTED, "retry isn't pending");
+			nominal = nominal * 2 > BACKOFF_MAX ? BACKOFF_MAX : nominal * 2;
+		}
+
+		/* an ack starts over */
+		CHECK(!StepRegState(&state, INPUT_ACK, 60, now), "an ack sends a request");
+		CHECK(state.Failures == 0, "an ack doesn't reset the failures");
+		CHECK(!StepRegState(&state, INPUT_FAILED, 0, now), "a failure sends a request");
+		CHECK(state.Due - now <= BACKOFF_MIN * 1000ULL, "backoff doesn't start over after an ack");
+	}
+	/* the cut reaches down to about half of the nominal delay */
+	nominal = BACKOFF_MIN;
+	for (f = 0; f < 12; f++) {
+		CHECK(shortest[f] < nominal * 550, "backoff isn't cut by up to half");
+		nominal = nominal * 2 > BACKOFF_MAX ? BACKOFF_MAX : nominal * 2;
+	}
+}
+
+/* a request that gets no answer within REQUEST_TIMEOUT fails like a rejected one */
+static void test_timeout(void)
+{
+	unsigned long long now = 0;
+	REGSTATE state;
+
+	requested(&state, seed_of(0), &now);
+	CHECK(state.Due == now + REQUEST_TIMEOUT * 1000ULL, "request timeout isn't scheduled");
+	now = state.Due;
+	CHECK(!StepRegState(&state, INPUT_DUE, 0, now), "a timed out request is sent again at once");
+	CHECK(state.State == REGISTRATION_BACKOFF, "timeout doesn't back off");
+	CHECK(state.Failures == 1 && state.Timeouts == 1, "timeout isn't counted as a failure");
+	CHECK(state.Due > now + BACKOFF_MIN * 500ULL && state.Due <= now + BACKOFF_MIN * 1000ULL, "timeout backoff out of bounds");
+
+	/* a refresh without answer is no different */
+	now = state.Due;
+	CHECK(StepRegState(&state, INPUT_DUE, 0, now), "retry sends no request");
+	CHECK(!StepRegState(&state, INPUT_ACK, 60, now), "an ack sends a request");
+	now = state.Due;
+	CHECK(StepRegState(&state, INPUT_DUE, 0, now), "refresh sends no request");
+	now = state.Due;
+	CHECK(state.State == REGISTRATION_REFRESHING, "refresh isn't pending");
+	CHECK(!StepRegState(&state, INPUT_DUE, 0, now), "a timed out refresh is sent again at once");
+	CHECK(state.State == REGISTRATION_BACKOFF && state.Failures == 1 && state.Timeouts == 2, "refresh timeout isn't a failure");
+}
+
+/* a moved registrar is asked soon, but never instead of a request under way */
+static void test_moved(void)
+{
+	unsigned long long now = 0;
+	unsigned long long due;
+	REGSTATE state;
+	int i;
+
+	for (i = 0; i < SEEDS; i++) {
+		now = 0;
+		requested(&state, seed_of(i), &now);
+		due = state.Due;
+		now += 100;
+		CHECK(!StepRegState(&state, INPUT_MOVED, 0, now), "a move sends a request");
+		CHECK(state.State == REGISTRATION_REQUESTED && state.Due == due, "a move preempts a pending request");
+
+		/* registered: the refresh moves up to within the start jitter */
+		CHECK(!StepRegState(&state, INPUT_ACK, 3600, now), "an ack sends a request");
+		now += 1000;
+		CHECK(!StepRegState(&state, INPUT_MOVED, 0, now), "a move sends a request");
+		CHECK(state.State == REGISTRATION_REGISTERED && state.Due < now + START_JITTER, "a move doesn't bring the refresh forward");
+
+		/* refreshing: again no preemption */
+		now = state.Due;
+		CHECK(StepRegState(&state, INPUT_DUE, 0, now), "refresh sends no request");
+		due = state.Due;
+		CHECK(!StepRegState(&state, INPUT_MOVED, 0, now + 10), "a move sends a request");
+		CHECK(state.State == REGISTRATION_REFRESHING && state.Due == due, "a move preempts a pending refresh");
+
+		/* backing off: the retry moves up, a retry that is due soon anyway stays */
+		CHECK(!StepRegState(&state, INPUT_FAILED, 0, now), "a failure sends a request");
+		CHECK(!StepRegState(&state, INPUT_MOVED, 0, now), "a move sends a request");
+		CHECK(state.State == REGISTRATION_BACKOFF && state.Due < now + START_JITTER, "a move doesn't bring the retry forward");
+		due = state.Due;
+		CHECK(!StepRegState(&state, INPUT_MOVED, 0, now), "a move sends a request");
+		CHECK(state.Due == due, "a move postpones a retry that is due soon");
+	}
+}
+
+/* the same seed takes the same course */
+static void test_deterministic(void)
+{
+	static const int inputs[] = { INPUT_DUE, INPUT_FAILED, INPUT_DUE, INPUT_ACK, INPUT_MOVED, INPUT_DUE, INPUT_DUE, INPUT_DUE, INPUT_ACK };
+	unsigned long long now[2] = { 0, 0 };
+	REGSTATE state[2];
+	size_t i;
+	int r;
+
+	for (r = 0; r < 2; r++) {
+		InitRegState(&state[r], seed_of(7), now[r]);
+		for (i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+			now[r] = inputs[i] == INPUT_DUE ? state[r].Due : now[r] + 20;
+			StepRegState(&state[r], inputs[i], 120, now[r]);
+		}
+	}
+	CHECK(now[0] == now[1] && state[0].Due == state[1].Due && state[0].Seed == state[1].Seed, "same seed, different course");
+}
+
+int main(void)
+{
+	test_start();
+	test_refresh();
+	test_backoff();
+	test_timeout();
+	test_moved();
+	test_deterministic();
+	if (failures) {
+		printf("regtest: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("regtest: all checks passed\n");
+	return 0;
+}
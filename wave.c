@@ -13,11 +13,17 @@
 #include <winsock2.h>
 #include <windows.h>
 #include <stdio.h>
+#include <tchar.h>
 #include "libiax2/iax-client.h"
 #include "common.h"
 #include "host.h"
 #include "settings.h"
+#include "metrics.h"
 #include "wave.h"
+#include "sink.h"
+#include "noise.h"
+#include "gain.h"
+#include "realtime.h"
 
 __declspec(thread) DWORD lastError = ERROR_SUCCESS;
 
@@ -26,7 +32,8 @@ struct tagWAVE
 	LPSETTINGS Settings;
 	WSAEVENT Event;
 	LPHEADERDONEPROC Callback;
-	HWAVEOUT Device;
+	LPVOID Context;
+	LPSINK Sink;
 	HANDLE File;
 	HANDLE Mapping;
 	LPVOID Data;
@@ -39,10 +46,158 @@ struct tagWAVE
 	USHORT NextAvailableHeader;
 	BOOL HasLastVolume;
 	DWORD LastVolume;
+	DWORD BytesPerSec;
+	DWORD MaxQueuedBytes;
+	DWORD QueuedBytes;
+	DWORD SubmittedBytes;
+	USHORT PendingHeaders;
+	DWORD MaxQueuedBytesSeen;
+	DWORD CatchUps;
+	DWORD DiscardedBytes;
+	DWORD SilentDiscards;
+	LPGAIN Gain;
+	LPNOISE Noise;
+	SHORT *Chime;
+	DWORD ChimeSamples;
+	USHORT ChimeInFlight;
+	BOOL CatchingUp;
+	DWORD CaughtUpBytes;
+	BOOL ComfortNoise;
+	USHORT NoiseInFlight;
+	USHORT NextNoiseBlock;
+	DWORD NoiseBytes;
+	SHORT NoiseBlocks[WAVE_NOISE_BLOCKS][WAVE_NOISE_SAMPLES];
 	WAVEHDR Headers[WAVE_BUFFERS];
+	ULONGLONG Submitted[WAVE_BUFFERS];
+	BOOL Silent[WAVE_BUFFERS];
 };
 
-/* enqueue wave data for playback */
+/* peak amplitude below which a live block counts as silence */
+#define SILENCE_LEVEL 256
+
+/* the chime is split into this many headers and live audio is played faster
+   after it until no more than 60ms are queued */
+#define CHIME_BLOCKS      10
+#define CATCHUP_TARGET_MS 60
+
+/* the longest slin frame a peer may send (Asterisk's framing limit), a delay
+   limit below it would drop every block */
+#define MAX_FRAME_MS 70
+
+/* check whether a block of slin samples is (nearly) silent */
+static BOOL IsSilence(LPVOID buffer, DWORD size)
+{
+	SHORT *sample = (SHORT *)buffer;
+	DWORD count = size / sizeof(SHORT);
+
+	while (count-- > 0)
+	{
+		if (*sample > SILENCE_LEVEL || *sample < -SILENCE_LEVEL)
+			return FALSE;
+		sample++;
+	}
+	return TRUE;
+}
+
+/* return the index of the oldest header that is held back */
+static USHORT FirstPendingHeader(LPWAVE wave)
+{
+	return (wave->NextAvailableHeader + WAVE_BUFFERS - wave->PendingHeaders) % WAVE_BUFFERS;
+}
+
+/* send a header to the output */
+static BOOL SubmitWaveHeader(LPWAVE wave, USHORT index)
+{
+	/* prepare the header */
+	lastError = PrepareSinkHeader(wave->Sink, &wave->Headers[index]);
+	if (lastError != MMSYSERR_NOERROR)
+		return FALSE;
+
+	/* send the header to the device */
+	lastError = WriteSink(wave->Sink, &wave->Headers[index]);
+	if (lastError != MMSYSERR_NOERROR)
+	{
+		UnprepareSinkHeader(wave->Sink, &wave->Headers[index]);
+		return FALSE;
+	}
+
+	/* remember when it was submitted and how much the output holds */
+	wave->Submitted[index] = iax_monotonic_us();
+	wave->SubmittedBytes += wave->Headers[index].dwBufferLength;
+	return TRUE;
+}
+
+/* submit held back headers until the output holds half the maximum delay */
+static BOOL SubmitPendingWaveHeaders(LPWAVE wave)
+{
+	while (wave->PendingHeaders > 0 && wave->SubmittedBytes < wave->MaxQueuedBytes / 2)
+	{
+		if (!SubmitWaveHeader(wave, FirstPendingHeader(wave)))
+			return FALSE;
+		wave->PendingHeaders--;
+	}
+	return TRUE;
+}
+
+/* remove a held back header from the ring and hand it back unplayed */
+static VOID DiscardPendingWaveHeader(LPWAVE wave, USHORT index)
+{
+	LPVOID userData = (LPVOID)wave->Headers[index].dwUser;
+	USHORT younger = (wave->NextAvailableHeader + WAVE_BUFFERS - index - 1) % WAVE_BUFFERS;
+	USHORT next;
+
+	/* close the gap by moving all younger pending headers one slot down */
+	wave->QueuedBytes -= wave->Headers[index].dwBufferLength;
+	while (younger-- > 0)
+	{
+		next = (index + 1) % WAVE_BUFFERS;
+		wave->Headers[index] = wave->Headers[next];
+		wave->Silent[index] = wave->Silent[next];
+		index = next;
+	}
+	wave->NextAvailableHeader = (wave->NextAvailableHeader + WAVE_BUFFERS - 1) % WAVE_BUFFERS;
+	wave->NoAvailableHeaders = FALSE;
+	wave->PendingHeaders--;
+
+	/* the data was never played */
+	if (wave->Callback != NULL)
+		wave->Callback(wave->Context, userData, 0, 0);
+}
+
+/* drop held back audio until the queue fits the maximum delay, silence first */
+static VOID EnforceMaxDelay(LPWAVE wave)
+{
+	BOOL caughtUp = FALSE;
+	USHORT index;
+	USHORT victim;
+	USHORT i;
+
+	/* audio buffered behind the chime is made up by the catch-up instead */
+	while (wave->QueuedBytes > wave->MaxQueuedBytes && wave->PendingHeaders > 0 && wave->ChimeInFlight == 0)
+	{
+		/* look for the oldest silent block, otherwise take the oldest one */
+		victim = index = FirstPendingHeader(wave);
+		for (i = 0; i < wave->PendingHeaders; i++, index = (index + 1) % WAVE_BUFFERS)
+		{
+			if (wave->Silent[index])
+			{
+				victim = index;
+				break;
+			}
+		}
+
+		/* update the statistics and drop the block */
+		if (wave->Silent[victim])
+			wave->SilentDiscards++;
+		wave->DiscardedBytes += wave->Headers[victim].dwBufferLength;
+		DiscardPendingWaveHeader(wave, victim);
+		caughtUp = TRUE;
+	}
+	if (caughtUp)
+		wave->CatchUps++;
+}
+
+/* enqueue wave data for playback, live data is held back if the delay is limited */
 static BOOL InternalEnqueueWaveHeader(LPWAVE wave, LPVOID buffer, DWORD size, LPVOID userData)
 {
 	/* ensure that there is a header available */
@@ -58,20 +213,22 @@ static BOOL InternalEnqueueWaveHeader(LPWAVE wave, LPVOID buffer, DWORD size, LP
 	wave->Headers[wave->NextAvailableHeader].dwBufferLength = size;
 	wave->Headers[wave->NextAvailableHeader].dwUser = (DWORD_PTR)userData;
 
-	/* prepare the header */
-	lastError = waveOutPrepareHeader(wave->Device, &wave->Headers[wave->NextAvailableHeader], sizeof(WAVEHDR));
-	if (lastError != MMSYSERR_NOERROR)
-		return FALSE;
-
-	/* send the header to the device */
-	lastError = waveOutWrite(wave->Device, &wave->Headers[wave->NextAvailableHeader], sizeof(WAVEHDR));
-	if (lastError != MMSYSERR_NOERROR)
+	/* either send the header to the output or keep it pending (comfort noise is never held back) */
+	if (wave->Data != NULL || wave->MaxQueuedBytes == 0 || userData == NULL)
 	{
-		waveOutUnprepareHeader(wave->Device, &wave->Headers[wave->NextAvailableHeader], sizeof(WAVEHDR));
-		return FALSE;
+		if (!SubmitWaveHeader(wave, wave->NextAvailableHeader))
+			return FALSE;
+	}
+	else
+	{
+		wave->Silent[wave->NextAvailableHeader] = IsSilence(buffer, size);
+		wave->PendingHeaders++;
 	}
 
-	/* increment the prepared counter */
+	/* account the queued data and increment the prepared counter */
+	wave->QueuedBytes += size;
+	if (wave->QueuedBytes > wave->MaxQueuedBytesSeen)
+		wave->MaxQueuedBytesSeen = wave->QueuedBytes;
 	wave->NextAvailableHeader = (wave->NextAvailableHeader + 1) % WAVE_BUFFERS;
 	wave->NoAvailableHeaders = wave->NextAvailableHeader == wave->FirstPreparedHeader;
 	return TRUE;
@@ -81,22 +238,109 @@ static BOOL InternalEnqueueWaveHeader(LPWAVE wave, LPVOID buffer, DWORD size, LP
 static BOOL InternalHandleDoneWaveHeaders(LPWAVE wave)
 {
 	LPVOID userData;
+	SHORT *data;
+	ULONGLONG submitted;
+	ULONGLONG completed = iax_monotonic_us();
 
-	while ((wave->NoAvailableHeaders || wave->FirstPreparedHeader != wave->NextAvailableHeader) && (wave->Headers[wave->FirstPreparedHeader].dwFlags & WHDR_DONE) == WHDR_DONE)
+	/* held back headers are never done, so only look at the submitted ones */
+	while (((wave->NoAvailableHeaders && wave->PendingHeaders == 0) || wave->FirstPreparedHeader != FirstPendingHeader(wave)) && (wave->Headers[wave->FirstPreparedHeader].dwFlags & WHDR_DONE) == WHDR_DONE)
 	{
 		/* unprepare the header data */
-		lastError = waveOutUnprepareHeader(wave->Device, &wave->Headers[wave->FirstPreparedHeader], sizeof(WAVEHDR));
+		lastError = UnprepareSinkHeader(wave->Sink, &wave->Headers[wave->FirstPreparedHeader]);
 		if (lastError != MMSYSERR_NOERROR)
 			return FALSE;
 
 		/* store the old user data and advance the prepared header */
 		userData = (LPVOID)wave->Headers[wave->FirstPreparedHeader].dwUser;
+		data = (SHORT *)wave->Headers[wave->FirstPreparedHeader].lpData;
+		submitted = wave->Submitted[wave->FirstPreparedHeader];
+		wave->QueuedBytes -= wave->Headers[wave->FirstPreparedHeader].dwBufferLength;
+		wave->SubmittedBytes -= wave->Headers[wave->FirstPreparedHeader].dwBufferLength;
 		wave->NoAvailableHeaders = FALSE;
 		wave->FirstPreparedHeader = (wave->FirstPreparedHeader + 1) % WAVE_BUFFERS;
 
-		/* invoke the callback if we're not playing a ring tone */
-		if (wave->Data == NULL && wave->Callback != NULL)
-			wave->Callback(userData);
+		/* invoke the callback if we're not playing a ring tone, comfort noise or the chime */
+		if (wave->Data == NULL && userData == NULL)
+		{
+			if (wave->Chime != NULL && data >= wave->Chime && data < wave->Chime + wave->ChimeSamples)
+				wave->ChimeInFlight--;
+			else
+				wave->NoiseInFlight--;
+		}
+		else if (wave->Data == NULL && wave->Callback != NULL)
+			wave->Callback(wave->Context, userData, submitted, completed);
+	}
+	return TRUE;
+}
+
+/* shorten a voice block by splicing out a pitch-like period with a crossfade, return the new size */
+static DWORD CompressVoice(SHORT *samples, DWORD size)
+{
+	DWORD count = size / sizeof(SHORT);
+	DWORD start = count / 8;
+	DWORD overlap = count / 8;
+	DWORD period;
+	DWORD bestPeriod = 0;
+	LONGLONG correlation;
+	LONGLONG bestCorrelation = 0;
+	DWORD i;
+
+	/* blocks too short to splice are left alone */
+	if (overlap < 8)
+		return size;
+
+	/* find the period between 1/8 and 1/3 of the block that matches best */
+	for (period = count / 8; period <= count / 3; period++)
+	{
+		correlation = 0;
+		for (i = 0; i < overlap; i++)
+			correlation += (LONG)samples[start + i] * samples[start + period + i];
+		if (bestPeriod == 0 || correlation > bestCorrelation)
+		{
+			bestPeriod = period;
+			bestCorrelation = correlation;
+		}
+	}
+
+	/* crossfade into the signal one period later and move the rest down */
+	for (i = 0; i < overlap; i++)
+		samples[start + i] = (SHORT)(((LONG)samples[start + i] * (LONG)(overlap - i) + (LONG)samples[start + bestPeriod + i] * (LONG)i) / (LONG)overlap);
+	memmove(samples + start + overlap, samples + start + bestPeriod + overlap, (count - start - bestPeriod - overlap) * sizeof(SHORT));
+	return (count - bestPeriod) * sizeof(SHORT);
+}
+
+/* queue the chime ahead of any live audio */
+static BOOL PlayChime(LPWAVE wave)
+{
+	DWORD blockSamples = (wave->ChimeSamples + CHIME_BLOCKS - 1) / CHIME_BLOCKS;
+	DWORD offset;
+
+	for (offset = 0; offset < wave->ChimeSamples && !wave->NoAvailableHeaders; offset += blockSamples)
+	{
+		if (!InternalEnqueueWaveHeader(wave, wave->Chime + offset, (offset + blockSamples > wave->ChimeSamples ? wave->ChimeSamples - offset : blockSamples) * sizeof(SHORT), NULL))
+			return FALSE;
+		wave->ChimeInFlight++;
+	}
+	wave->CatchingUp = TRUE;
+	return TRUE;
+}
+
+/* keep the output clock running with comfort noise while the caller is silent */
+static BOOL PlayComfortNoise(LPWAVE wave)
+{
+	SHORT *block;
+
+	/* only fill up to the noise lead and never overtake held back voice */
+	while (wave->ComfortNoise && wave->PendingHeaders == 0 && wave->NoiseInFlight < WAVE_NOISE_BLOCKS && !wave->NoAvailableHeaders)
+	{
+		block = wave->NoiseBlocks[wave->NextNoiseBlock];
+		GenerateNoise(wave->Noise, block, WAVE_NOISE_SAMPLES);
+		ApplyVolume(wave->Gain, block, WAVE_NOISE_SAMPLES);
+		if (!InternalEnqueueWaveHeader(wave, block, sizeof(wave->NoiseBlocks[0]), NULL))
+			return FALSE;
+		wave->NextNoiseBlock = (wave->NextNoiseBlock + 1) % WAVE_NOISE_BLOCKS;
+		wave->NoiseInFlight++;
+		wave->NoiseBytes += sizeof(wave->NoiseBlocks[0]);
 	}
 	return TRUE;
 }
@@ -132,90 +376,214 @@ static BOOL PlayData(LPWAVE wave)
 	return TRUE;
 }
 
-/* initialize the wave audio device */
-LPWAVE InitializeWave(LPSETTINGS settings, WSAEVENT event, LPHEADERDONEPROC callback)
+/* open a file and map it to memory */
+static BOOL MapWaveFile(LPTSTR fileName, HANDLE *file, HANDLE *mapping, LPVOID *data, LPDWORD fileSize)
+{
+	DWORD high;
+
+	if
+	(
+		(*file = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE ||
+		(*fileSize = GetFileSize(*file, &high)) == INVALID_FILE_SIZE ||
+		(*mapping = CreateFileMapping(*file, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL ||
+		(*data = MapViewOfFile(*mapping, FILE_MAP_READ, 0, 0, 0)) == NULL
+	)
+	{
+		lastError = GetLastError();
+		return FALSE;
+	}
+
+	/* large files are not supported */
+	if (high > 0)
+	{
+		lastError = ERROR_INVALID_DATA;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* find the format and the data chunk of a mapped wave file */
+static BOOL ParseWaveFile(LPVOID data, DWORD fileSize, LPWAVEFORMATEX *format, LPDWORD startOffset, LPDWORD endOffset)
 {
 	CONST FOURCC riffID = mmioFOURCC('R','I','F','F');
 	CONST FOURCC waveID = mmioFOURCC('W','A','V','E');
+	FOURCC chunk;
+	DWORD chunkSize;
+	DWORD offset = 0;
+
+	/* check the file format and find the format and data offset */
+#define OFFSET ((LPBYTE)data+offset)
+#define CHECK(what) if ((offset+sizeof(what))>fileSize || memcmp(OFFSET,&what,sizeof(what))!=0) goto ON_ERROR; offset += sizeof(what)
+#define READ(what) if ((offset+sizeof(what))>fileSize) goto ON_ERROR; memcpy(&what,OFFSET,sizeof(what)); offset += sizeof(what)
+	*format = NULL;
+	CHECK(riffID);
+	READ(chunkSize);
+	if ((chunkSize + 8) > fileSize)
+		goto ON_ERROR;
+	fileSize = chunkSize + 8;
+	CHECK(waveID);
+	while (offset < fileSize)
+	{
+		READ(chunk);
+		READ(chunkSize);
+		switch (chunk)
+		{
+			case mmioFOURCC('f','m','t',' '):
+				if (chunkSize < sizeof(WAVEFORMAT))
+					goto ON_ERROR;
+				*format = (LPWAVEFORMATEX)OFFSET;
+				break;
+			case mmioFOURCC('d','a','t','a'):
+				*startOffset = offset;
+				*endOffset = offset + chunkSize;
+				break;
+		}
+		offset += chunkSize;
+	}
+	if (offset > fileSize || *format == NULL || (*format)->nBlockAlign == 0)
+		goto ON_ERROR;
+	return TRUE;
+#undef READ
+#undef CHECK
+#undef OFFSET
+
+ON_ERROR:
+	lastError = ERROR_INVALID_DATA;
+	return FALSE;
+}
+
+/* load the chime and convert it to slin */
+static BOOL LoadChime(LPWAVE wave)
+{
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+	LPVOID data = NULL;
+	DWORD fileSize;
+	LPWAVEFORMATEX format;
+	DWORD startOffset;
+	DWORD endOffset;
+	LPBYTE frame;
+	DWORD frames;
+	DWORD i;
+	DWORD index;
+	ULONGLONG position;
+	WORD channel;
+	LONG sample[2];
+	BOOL result = FALSE;
+
+	/* map the file and accept 8 or 16 bit pcm with any rate and channel count */
+	if (!MapWaveFile(wave->Settings->Chime, &file, &mapping, &data, &fileSize) || !ParseWaveFile(data, fileSize, &format, &startOffset, &endOffset))
+		goto LEAVE;
+	if (format->wFormatTag != WAVE_FORMAT_PCM || (format->wBitsPerSample != 8 && format->wBitsPerSample != 16) || format->nChannels == 0 || format->nSamplesPerSec == 0 || format->nBlockAlign != format->nChannels * format->wBitsPerSample / 8)
+	{
+		lastError = ERROR_INVALID_DATA;
+		goto LEAVE;
+	}
+
+	/* allocate the converted chime */
+	frames = (endOffset - startOffset) / format->nBlockAlign;
+	wave->ChimeSamples = (DWORD)((ULONGLONG)frames * 8000 / format->nSamplesPerSec);
+	if (frames == 0 || wave->ChimeSamples == 0)
+	{
+		lastError = ERROR_INVALID_DATA;
+		goto LEAVE;
+	}
+	wave->Chime = HeapAlloc(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, wave->ChimeSamples * sizeof(SHORT));
+
+	/* mix down to mono and resample to 8kHz by linear interpolation (position is 16.16 fixed point) */
+	for (i = 0; i < wave->ChimeSamples; i++)
+	{
+		position = ((ULONGLONG)i * format->nSamplesPerSec << 16) / 8000;
+		index = (DWORD)(position >> 16);
+		frame = (LPBYTE)data + startOffset + index * format->nBlockAlign;
+		sample[0] = sample[1] = 0;
+		for (channel = 0; channel < format->nChannels; channel++)
+		{
+			if (format->wBitsPerSample == 8)
+			{
+				sample[0] += ((LONG)frame[channel] - 128) << 8;
+				if (index + 1 < frames)
+					sample[1] += ((LONG)frame[format->nBlockAlign + channel] - 128) << 8;
+			}
+			else
+			{
+				sample[0] += ((SHORT *)frame)[channel];
+				if (index + 1 < frames)
+					sample[1] += ((SHORT *)(frame + format->nBlockAlign))[channel];
+			}
+		}
+		if (index + 1 >= frames)
+			sample[1] = sample[0];
+		wave->Chime[i] = (SHORT)((sample[0] + (LONG)(((LONGLONG)(sample[1] - sample[0]) * (position & 0xFFFF)) >> 16)) / format->nChannels);
+	}
+	result = TRUE;
+
+LEAVE:
+	if (data != NULL)
+		UnmapViewOfFile(data);
+	if (mapping != NULL)
+		CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	return result;
+}
+
+/* initialize the wave audio device */
+LPWAVE InitializeWave(LPSETTINGS settings, WSAEVENT event, LPHEADERDONEPROC callback, LPVOID context)
+{
 	WAVEFORMATEX slinFormat = {WAVE_FORMAT_PCM, 1, 8000, 16000, 2, 16, 0};
 	LPWAVE wave;
 	DWORD fileSize;
-	FOURCC chunk;
-	DWORD chunkSize;
+	DWORD maxDelay;
+	TCHAR message[100];
 	LPWAVEFORMATEX format;
-	DWORD offset;
 
 	/* create and initialize the wave structure */
 	ALLOC(wave);
 	wave->Settings = settings;
 	wave->Event = event;
 	wave->Callback = callback;
+	wave->Context = context;
 	wave->File = INVALID_HANDLE_VALUE;
+	wave->Gain = CreateGain(settings);
+	wave->Noise = CreateNoise(GetTickCount());
 
 	/* either lookup the wave format in the ring tone file or use slin */
 	if (wave->Settings->RingTone != NULL)
 	{
-		/* open and map the file to memory */
-		if
-		(
-			(wave->File = CreateFile(wave->Settings->RingTone, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE ||
-			(fileSize = GetFileSize(wave->File, &offset)) == INVALID_FILE_SIZE ||
-			(wave->Mapping = CreateFileMapping(wave->File, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL ||
-			(wave->Data = MapViewOfFile(wave->Mapping, FILE_MAP_READ, 0, 0, 0)) == NULL
-		)
-		{
-			lastError = GetLastError();
-			goto ON_ERROR;
-		}
-
-		/* check the file format and find the format and data offset */
-#define OFFSET ((LPBYTE)wave->Data+offset)
-#define CHECK(what) if ((offset+sizeof(what))>fileSize || memcmp(OFFSET,&what,sizeof(what))!=0) goto ON_ERROR; offset += sizeof(what)
-#define READ(what) if ((offset+sizeof(what))>fileSize) goto ON_ERROR; memcpy(&what,OFFSET,sizeof(what)); offset += sizeof(what)
-		lastError = ERROR_INVALID_DATA;
-		if (offset > 0)
-			/* large files are not supported */
+		/* map the file, find the format and data and determine the block size */
+		if (!MapWaveFile(wave->Settings->RingTone, &wave->File, &wave->Mapping, &wave->Data, &fileSize) || !ParseWaveFile(wave->Data, fileSize, &format, &wave->StartOffset, &wave->EndOffset))
 			goto ON_ERROR;
-		CHECK(riffID);
-		READ(chunkSize);
-		if ((chunkSize + 8) > fileSize)
+		wave->BlockSize = (DWORD)(WAVE_SECS_PER_BUFFER * format->nAvgBytesPerSec);
+		wave->BlockSize -= wave->BlockSize % format->nBlockAlign;
+		if (wave->BlockSize == 0)
+			wave->BlockSize = format->nBlockAlign;
+		LockRealtimeMemory(settings, wave->Data, fileSize);
+	}
+	else
+	{
+		/* the chime is only played ahead of live audio */
+		if (wave->Settings->Chime != NULL && !LoadChime(wave))
 			goto ON_ERROR;
-		fileSize = chunkSize + 8;
-		CHECK(waveID);
-		while (offset < fileSize)
+		LockRealtimeMemory(settings, wave->Chime, wave->ChimeSamples * sizeof(SHORT));
+		format = &slinFormat;
+		maxDelay = wave->Settings->MaxDelay;
+		if (maxDelay > 0 && maxDelay < MAX_FRAME_MS)
 		{
-			READ(chunk);
-			READ(chunkSize);
-			switch (chunk)
-			{
-				case mmioFOURCC('f','m','t',' '):
-					if (chunkSize < sizeof(WAVEFORMAT))
-						goto ON_ERROR;
-					format = (LPWAVEFORMATEX)OFFSET;
-					wave->BlockSize = (DWORD)(WAVE_SECS_PER_BUFFER * format->nAvgBytesPerSec);
-					wave->BlockSize -= wave->BlockSize % format->nBlockAlign;
-					if (wave->BlockSize == 0)
-						wave->BlockSize = format->nBlockAlign;
-					break;
-				case mmioFOURCC('d','a','t','a'):
-					wave->StartOffset = offset;
-					wave->EndOffset = offset + chunkSize;
-					break;
-			}
-			offset += chunkSize;
+			_sntprintf(message, sizeof(message) / sizeof(TCHAR), _T("maximum delay of %lums is below a frame, raised to %ums\n"), maxDelay, MAX_FRAME_MS);
+			message[sizeof(message) / sizeof(TCHAR) - 1] = _T('\0');
+			OutputDebugString(message);
+			maxDelay = MAX_FRAME_MS;
 		}
-		if (offset > fileSize)
-			goto ON_ERROR;
-		lastError = ERROR_SUCCESS;
-#undef READ
-#undef CHECK
-#undef OFFSET
+		wave->MaxQueuedBytes = (DWORD)((ULONGLONG)maxDelay * format->nAvgBytesPerSec / 1000);
 	}
-	else
-		format = &slinFormat;
+	wave->BytesPerSec = format->nAvgBytesPerSec;
+
+	/* keep the headers and the noise blocks in memory */
+	LockRealtimeMemory(settings, wave, sizeof(*wave));
 
-	/* open the wave device and return the handle */
-	if ((lastError = waveOutOpen(&wave->Device, wave->Settings->WaveOutDevID, format, (DWORD_PTR)wave->Event, 0, CALLBACK_EVENT)) != MMSYSERR_NOERROR)
+	/* open the output and return the structure */
+	if ((lastError = OpenSink(wave->Settings, format, wave->Event, &wave->Sink)) != MMSYSERR_NOERROR)
 		goto ON_ERROR;
 	return wave;
 
@@ -228,10 +596,10 @@ ON_ERROR:
 /* stop and release the wave audio device */
 VOID FreeWave(LPWAVE wave)
 {
-	if (wave->Device != NULL)
+	if (wave->Sink != NULL)
 	{
 		StopWave(wave);
-		waveOutClose(wave->Device);
+		CloseSink(wave->Sink);
 	}
 	if (wave->Data != NULL)
 		UnmapViewOfFile(wave->Data);
@@ -239,6 +607,12 @@ VOID FreeWave(LPWAVE wave)
 		CloseHandle(wave->Mapping);
 	if (wave->File != INVALID_HANDLE_VALUE)
 		CloseHandle(wave->File);
+	if (wave->Noise != NULL)
+		FreeNoise(wave->Noise);
+	if (wave->Gain != NULL)
+		FreeGain(wave->Gain);
+	if (wave->Chime != NULL)
+		HeapFree(GetProcessHeap(), HEAP_GENERATE_EXCEPTIONS, wave->Chime);
 	FREE(wave);
 }
 
@@ -251,16 +625,25 @@ DWORD GetLastWaveError()
 /* start audio playback */
 BOOL StartWave(LPWAVE wave)
 {
-	/* set the volume */
-	if (wave->Settings->Volume > -1 && !wave->HasLastVolume)
+	/* live audio gets its volume in software, ring tones use the output volume */
+	ResetGain(wave->Gain);
+	if (wave->Data != NULL && wave->Settings->Volume > -1 && !wave->HasLastVolume)
 	{
-		if (waveOutGetVolume(wave->Device, &wave->LastVolume) == MMSYSERR_NOERROR)
-			wave->HasLastVolume = waveOutSetVolume(wave->Device, MAKELONG((WORD)wave->Settings->Volume,(WORD)wave->Settings->Volume)) == MMSYSERR_NOERROR;
+		if (GetSinkVolume(wave->Sink, &wave->LastVolume) == MMSYSERR_NOERROR)
+			wave->HasLastVolume = SetSinkVolume(wave->Sink, MAKELONG((WORD)wave->Settings->Volume,(WORD)wave->Settings->Volume)) == MMSYSERR_NOERROR;
 	}
 
-	/* just exit if no ring tone is loaded */
+	/* reset the delay statistics of the last call */
+	wave->MaxQueuedBytesSeen = wave->QueuedBytes;
+	wave->CatchUps = 0;
+	wave->DiscardedBytes = 0;
+	wave->SilentDiscards = 0;
+	wave->NoiseBytes = 0;
+	wave->CaughtUpBytes = 0;
+
+	/* play the chime (if any) if no ring tone is loaded */
 	if (wave->Data == NULL)
-		return TRUE;
+		return wave->Chime == NULL || PlayChime(wave);
 
 	/* start the ring tone playback */
 	wave->NextBlockOffset = wave->StartOffset;
@@ -271,11 +654,15 @@ BOOL StartWave(LPWAVE wave)
 BOOL StopWave(LPWAVE wave)
 {
 	/* reset the volume */
-	if (wave->Settings->Volume > -1 && wave->HasLastVolume)
-		wave->HasLastVolume = waveOutSetVolume(wave->Device, wave->LastVolume) != MMSYSERR_NOERROR;
-
-	/* stop any pending playback */
-	lastError = waveOutReset(wave->Device);
+	if (wave->HasLastVolume)
+		wave->HasLastVolume = SetSinkVolume(wave->Sink, wave->LastVolume) != MMSYSERR_NOERROR;
+
+	/* end comfort noise and catch-up, drop the held back audio and stop any pending playback */
+	wave->ComfortNoise = FALSE;
+	wave->CatchingUp = FALSE;
+	while (wave->PendingHeaders > 0)
+		DiscardPendingWaveHeader(wave, FirstPendingHeader(wave));
+	lastError = ResetSink(wave->Sink);
 	if (lastError != MMSYSERR_NOERROR)
 		return FALSE;
 
@@ -295,15 +682,25 @@ BOOL HandleDoneWaveHeaders(LPWAVE wave)
 		return FALSE;
 	}
 
-	/* free done headers */
-	if (!InternalHandleDoneWaveHeaders(wave))
+	/* let the output retire due headers and free done headers */
+	if ((lastError = PollSink(wave->Sink)) != MMSYSERR_NOERROR || !InternalHandleDoneWaveHeaders(wave))
 		return FALSE;
 
-	/* either return or continue ring tone playback */
-	return (wave->Data == NULL || wave->NextBlockOffset == 0) ? TRUE : PlayData(wave);
+	/* refill the output with held back audio or comfort noise, or continue ring tone playback */
+	if (wave->Data == NULL)
+		return SubmitPendingWaveHeaders(wave) && PlayComfortNoise(wave);
+	return wave->NextBlockOffset == 0 ? TRUE : PlayData(wave);
+}
+
+/* return the queue size at which the catch-up after the chime ends */
+static DWORD CatchUpTarget(LPWAVE wave)
+{
+	DWORD target = CATCHUP_TARGET_MS * wave->BytesPerSec / 1000;
+
+	return wave->MaxQueuedBytes > 0 && wave->MaxQueuedBytes / 2 < target ? wave->MaxQueuedBytes / 2 : target;
 }
 
-/* enqueue another block of audio for playback */
+/* enqueue another block of audio for playback, FALSE if it was refused and the user data is still the caller's */
 BOOL EnqueueWaveHeader(LPWAVE wave, LPVOID buffer, DWORD size, LPVOID userData)
 {
 	/* when we play a ring tone no other wave headers are allowed */
@@ -313,14 +710,78 @@ BOOL EnqueueWaveHeader(LPWAVE wave, LPVOID buffer, DWORD size, LPVOID userData)
 		return FALSE;
 	}
 
+	/* the caller is talking again */
+	wave->ComfortNoise = FALSE;
+
+	/* skip pauses and shorten voice until the delay caused by the chime is made up */
+	if (wave->CatchingUp)
+	{
+		if (wave->QueuedBytes <= CatchUpTarget(wave))
+			wave->CatchingUp = FALSE;
+		else if (IsSilence(buffer, size))
+		{
+			wave->CaughtUpBytes += size;
+			if (wave->Callback != NULL)
+				wave->Callback(wave->Context, userData, 0, 0);
+			return TRUE;
+		}
+		else
+		{
+			wave->CaughtUpBytes += size;
+			size = CompressVoice((SHORT *)buffer, size);
+			wave->CaughtUpBytes -= size;
+		}
+	}
+
+	/* make room by dropping the oldest held back audio */
+	if (wave->NoAvailableHeaders && wave->PendingHeaders > 0)
+	{
+		wave->DiscardedBytes += wave->Headers[FirstPendingHeader(wave)].dwBufferLength;
+		wave->CatchUps++;
+		DiscardPendingWaveHeader(wave, FirstPendingHeader(wave));
+	}
+
 	/* if we don't have any free buffers we have to skip this header and just invoke the callback */
 	if (wave->NoAvailableHeaders)
 	{
 		if (wave->Callback != NULL)
-			wave->Callback(userData);
+			wave->Callback(wave->Context, userData, 0, 0);
 		return TRUE;
 	}
 
-	/* actually enqueue the buffer */
-	return InternalEnqueueWaveHeader(wave, buffer, size, userData);
+	/* apply the gain stage, actually enqueue the buffer and keep the delay bounded */
+	ProcessGain(wave->Gain, (SHORT *)buffer, size / sizeof(SHORT));
+	if (!InternalEnqueueWaveHeader(wave, buffer, size, userData))
+		return FALSE;
+	EnforceMaxDelay(wave);
+
+	/* the ring owns the block now, if the output can't take it let the done headers handler retry and report */
+	if (!SubmitPendingWaveHeaders(wave) && !WSASetEvent(wave->Event))
+		lastError = WSAGetLastError();
+	return TRUE;
+}
+
+/* play comfort noise at the given level in -dBov until the next voice data */
+BOOL StartComfortNoise(LPWAVE wave, BYTE level)
+{
+	/* ring tones don't need any filling */
+	if (wave->Data != NULL)
+	{
+		lastError = E_UNEXPECTED;
+		return FALSE;
+	}
+
+	/* set the level and fill the output */
+	SetNoiseLevel(wave->Noise, level);
+	wave->ComfortNoise = TRUE;
+	return PlayComfortNoise(wave);
+}
+
+/* write the playout queue statistics */
+VOID DumpWave(LPWAVE wave, LPMETRICS metrics)
+{
+#define MS(bytes) (DWORD)((ULONGLONG)(bytes) * 1000 / wave->BytesPerSec)
+	PrintMetrics(metrics, "queue: now=%lums max=%lums limit=%lums catchups=%lu discarded=%lums silent=%lu noise=%lums chime=%lums caughtup=%lums\n", MS(wave->QueuedBytes), MS(wave->MaxQueuedBytesSeen), MS(wave->MaxQueuedBytes), wave->CatchUps, MS(wave->DiscardedBytes), wave->SilentDiscards, MS(wave->NoiseBytes), MS(wave->ChimeSamples * sizeof(SHORT)), MS(wave->CaughtUpBytes));
+#undef MS
+	DumpGain(wave->Gain, metrics);
 }
@@ -17,14 +17,19 @@
 #define WAVE_BUFFERS 100
 #define WAVE_SECS_PER_BUFFER 0.015
 
+/* comfort noise is written ahead in this many blocks of 15ms slin */
+#define WAVE_NOISE_BLOCKS 3
+#define WAVE_NOISE_SAMPLES 120
+
 /* transparent wave structure */
 typedef struct tagWAVE WAVE, *LPWAVE;
 
-/* callback for done header data */
-typedef VOID (CALLBACK *LPHEADERDONEPROC)(LPVOID);
+/* callback for done header data, gets the context, the header data and the
+   monotonic submission and completion time (both zero if never played) */
+typedef VOID (CALLBACK *LPHEADERDONEPROC)(LPVOID, LPVOID, ULONGLONG, ULONGLONG);
 
 /* initialize the wave audio device */
-extern LPWAVE InitializeWave(LPSETTINGS, WSAEVENT, LPHEADERDONEPROC);
+extern LPWAVE InitializeWave(LPSETTINGS, WSAEVENT, LPHEADERDONEPROC, LPVOID);
 
 /* stop and release the wave audio device */
 extern VOID FreeWave(LPWAVE);
@@ -41,7 +46,13 @@ extern BOOL StopWave(LPWAVE);
 /* reset the audio event, free the done headers and possible continue the ring tone playback */
 extern BOOL HandleDoneWaveHeaders(LPWAVE);
 
-/* enqueue another block of audio for playback */
+/* enqueue another block of audio for playback, FALSE if it was refused and the user data is still the caller's */
 extern BOOL EnqueueWaveHeader(LPWAVE, LPVOID, DWORD, LPVOID);
 
+/* play comfort noise at the given level in -dBov until the next voice data */
+extern BOOL StartComfortNoise(LPWAVE, BYTE);
+
+/* write the playout queue statistics */
+extern VOID DumpWave(LPWAVE, LPMETRICS);
+
 #endif